@@ -0,0 +1,82 @@
+#!/usr/bin/env python3
+"""Looping worker for `cgi_pool` that runs Python CGI scripts in-process.
+
+    cgi_handler .py /usr/bin/python3;
+    cgi_pool .py cgi-bin/cgi_worker.py min=1 max=8 idle=60s requests=1000;
+
+Reads "WSCGI <env_bytes> <body_bytes>\\n" frames on stdin (environment as
+NAME=VALUE\\0 entries, then the request body), runs SCRIPT_FILENAME as
+__main__ and answers "WSCGI <output_bytes> <exit_status>\\n<output>".
+"""
+import io
+import os
+import runpy
+import sys
+import traceback
+
+START_DIR = os.getcwd()
+
+
+def read_exact(stream, n):
+    data = stream.read(n)
+    if data is None or len(data) != n:
+        raise EOFError
+    return data
+
+
+def run_script(env, body):
+    os.chdir(START_DIR)
+    script = os.path.abspath(env.get("SCRIPT_FILENAME", ""))
+    os.environ.clear()
+    os.environ.update(env)
+    os.chdir(os.path.dirname(script))
+
+    output = io.BytesIO()
+    saved = sys.stdin, sys.stdout, sys.argv
+    sys.stdin = io.TextIOWrapper(io.BytesIO(body), encoding="utf-8")
+    sys.stdout = io.TextIOWrapper(output, encoding="utf-8", write_through=True)
+    sys.argv = [script]
+    status = 0
+    try:
+        runpy.run_path(script, run_name="__main__")
+    except SystemExit as e:
+        if e.code is None:
+            status = 0
+        elif isinstance(e.code, int):
+            status = e.code
+        else:
+            status = 1
+    except Exception:
+        traceback.print_exc()
+        status = 1
+    finally:
+        sys.stdout.flush()
+        result = output.getvalue()
+        sys.stdin, sys.stdout, sys.argv = saved
+    return status, result
+
+
+def main():
+    requests = sys.stdin.buffer
+    responses = sys.stdout.buffer
+    while True:
+        header = requests.readline()
+        if not header:
+            return
+        magic, env_len, body_len = header.split()
+        if magic != b"WSCGI":
+            sys.exit("cgi_worker: bad frame")
+        env_block = read_exact(requests, int(env_len))
+        body = read_exact(requests, int(body_len))
+        env = {}
+        for item in env_block.split(b"\0"):
+            if item:
+                name, _, value = item.partition(b"=")
+                env[name.decode("latin-1")] = value.decode("latin-1")
+        status, output = run_script(env, body)
+        responses.write(b"WSCGI %d %d\n" % (len(output), status) + output)
+        responses.flush()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,120 @@
+#!/usr/bin/env python3
+"""Minimal FastCGI responder for testing fastcgi_pass.
+
+    python3 cgi-bin/fcgi_server.py unix:/tmp/webserv-fcgi.sock
+    python3 cgi-bin/fcgi_server.py 127.0.0.1:9000
+
+Answers every request with its CGI variables and how many requests the
+backend connection has served, which shows whether connections are reused.
+"""
+import os
+import socket
+import struct
+import sys
+import threading
+
+BEGIN_REQUEST, END_REQUEST, PARAMS, STDIN, STDOUT = 1, 3, 4, 5, 6
+KEEP_CONN = 1
+
+
+def read_exact(conn, n):
+    data = b""
+    while len(data) < n:
+        chunk = conn.recv(n - len(data))
+        if not chunk:
+            return None
+        data += chunk
+    return data
+
+
+def read_record(conn):
+    header = read_exact(conn, 8)
+    if header is None:
+        return None
+    _, rtype, req_id, clen, plen, _ = struct.unpack("!BBHHBB", header)
+    content = read_exact(conn, clen + plen)
+    if content is None:
+        return None
+    return rtype, req_id, content[:clen]
+
+
+def decode_length(data, pos):
+    if data[pos] < 128:
+        return data[pos], pos + 1
+    return struct.unpack("!I", data[pos:pos + 4])[0] & 0x7FFFFFFF, pos + 4
+
+
+def decode_params(data):
+    params = {}
+    pos = 0
+    while pos < len(data):
+        name_len, pos = decode_length(data, pos)
+        value_len, pos = decode_length(data, pos)
+        name = data[pos:pos + name_len].decode("latin-1")
+        pos += name_len
+        params[name] = data[pos:pos + value_len].decode("latin-1")
+        pos += value_len
+    return params
+
+
+def write_record(conn, rtype, req_id, content):
+    for i in range(0, max(len(content), 1), 65535):
+        piece = content[i:i + 65535]
+        conn.sendall(struct.pack("!BBHHBB", 1, rtype, req_id, len(piece), 0, 0)
+                     + piece)
+
+
+def respond(params, body, served):
+    text = "".join("%s=%s\n" % kv for kv in sorted(params.items()))
+    text += "BODY_LENGTH=%d\nCONNECTION_REQUESTS=%d\n" % (len(body), served)
+    return ("Content-Type: text/plain\r\n\r\n" + text).encode("latin-1")
+
+
+def serve(conn):
+    served = 0
+    with conn:
+        while True:
+            params_data, body, keep_conn = b"", b"", False
+            while True:
+                record = read_record(conn)
+                if record is None:
+                    return
+                rtype, req_id, content = record
+                if rtype == BEGIN_REQUEST:
+                    keep_conn = bool(content[2] & KEEP_CONN)
+                elif rtype == PARAMS:
+                    params_data += content
+                elif rtype == STDIN:
+                    if not content:
+                        break
+                    body += content
+            served += 1
+            output = respond(decode_params(params_data), body, served)
+            write_record(conn, STDOUT, req_id, output)
+            write_record(conn, STDOUT, req_id, b"")
+            write_record(conn, END_REQUEST, req_id, struct.pack("!IB3x", 0, 0))
+            if not keep_conn:
+                return
+
+
+def main():
+    address = sys.argv[1] if len(sys.argv) > 1 else "127.0.0.1:9000"
+    if address.startswith("unix:"):
+        path = address[5:]
+        if os.path.exists(path):
+            os.unlink(path)
+        listener = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        listener.bind(path)
+    else:
+        host, port = address.rsplit(":", 1)
+        listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        listener.bind((host, int(port)))
+    listener.listen(128)
+    while True:
+        conn, _ = listener.accept()
+        threading.Thread(target=serve, args=(conn,), daemon=True).start()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,207 @@
+#include "Autoindex.hpp"
+
+#include <gtest/gtest.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <string>
+
+namespace {
+const char* kRoot = "autoindex_test.d";
+
+class AutoindexTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    Autoindex::clear_cache();
+    Autoindex::set_cache_limits(128, 64 * 1024 * 1024);
+    mkdir(kRoot, 0755);
+  }
+  void TearDown() override {
+    Autoindex::clear_cache();
+    Autoindex::set_cache_limits(128, 64 * 1024 * 1024);
+    std::system("rm -rf autoindex_test.d");
+  }
+
+  std::string make_dir(const std::string& name) {
+    std::string path = std::string(kRoot) + "/" + name;
+    mkdir(path.c_str(), 0755);
+    return path;
+  }
+  void touch(const std::string& path) { std::ofstream ofs(path.c_str()); }
+
+  // Listings built in the same second as the directory's last change are
+  // never trusted, so the tests date their directories in the past.
+  void set_mtime(const std::string& path, time_t ago) {
+    struct timeval times[2];
+    times[0].tv_sec = times[1].tv_sec = std::time(NULL) - ago;
+    times[0].tv_usec = times[1].tv_usec = 0;
+    utimes(path.c_str(), times);
+  }
+
+  // The whole page, read in small pieces
+  std::string list(const std::string& path, const std::string& uri = "/",
+                   bool with_details = false) {
+    BodySource* body = Autoindex::open(path, uri, with_details);
+    if (body == NULL) {
+      return "";
+    }
+    std::string page;
+    while (body->read_some(page, 7) == kBodyMore) {
+    }
+    delete body;
+    return page;
+  }
+};
+
+TEST_F(AutoindexTest, MissingDirectoryFails) {
+  EXPECT_EQ(NULL, Autoindex::open("autoindex_test.d/none", "/", false));
+  EXPECT_EQ(0u, Autoindex::cached_listings());
+}
+
+TEST_F(AutoindexTest, ListsDirectoriesFirstThenByName) {
+  std::string dir = make_dir("sorted");
+  touch(dir + "/b.txt");
+  touch(dir + "/A.txt");
+  touch(dir + "/a");
+  make_dir("sorted/sub");
+  make_dir("sorted/Z");
+
+  std::string page = list(dir);
+  std::size_t z = page.find(">Z/</a>");
+  std::size_t sub = page.find(">sub/</a>");
+  std::size_t upper = page.find(">A.txt</a>");
+  std::size_t a = page.find(">a</a>");
+  std::size_t b = page.find(">b.txt</a>");
+  ASSERT_NE(std::string::npos, b);
+  EXPECT_LT(page.find("../"), z);
+  EXPECT_LT(z, sub);
+  EXPECT_LT(sub, upper);
+  EXPECT_LT(upper, a);
+  EXPECT_LT(a, b);
+  EXPECT_EQ("</pre><hr></body></html>", page.substr(page.size() - 24));
+}
+
+TEST_F(AutoindexTest, EscapesOddNames) {
+  std::string dir = make_dir("odd");
+  touch(dir + "/a&b<c>\"d'.txt");
+  touch(dir + "/sp ace#?%.txt");
+  touch(dir + "/\xc3\xa9t\xc3\xa9");
+  make_dir("odd/x y");
+
+  std::string page = list(dir, "/<odd>&/");
+  EXPECT_NE(std::string::npos,
+            page.find("<title>Index of /&lt;odd&gt;&amp;/</title>"));
+  EXPECT_NE(std::string::npos,
+            page.find("<a href=\"a%26b%3Cc%3E%22d%27.txt\">"
+                      "a&amp;b&lt;c&gt;&quot;d&#39;.txt</a>"));
+  EXPECT_NE(std::string::npos,
+            page.find("<a href=\"sp%20ace%23%3F%25.txt\">sp ace#?%.txt</a>"));
+  EXPECT_NE(std::string::npos,
+            page.find("<a href=\"%C3%A9t%C3%A9\">\xc3\xa9t\xc3\xa9</a>"));
+  EXPECT_NE(std::string::npos, page.find("<a href=\"x%20y/\">x y/</a>"));
+}
+
+TEST_F(AutoindexTest, DetailsShowSizes) {
+  std::string dir = make_dir("details");
+  std::ofstream(dir.c_str() + std::string("/f")) << "12345";
+  make_dir("details/d");
+
+  std::string page = list(dir, "/", true);
+  std::size_t f = page.find(">f</a>");
+  ASSERT_NE(std::string::npos, f);
+  std::string line = page.substr(f, page.find('\n', f) - f);
+  EXPECT_EQ(" 5", line.substr(line.size() - 2));
+  std::size_t d = page.find(">d/</a>");
+  ASSERT_NE(std::string::npos, d);
+  line = page.substr(d, page.find('\n', d) - d);
+  EXPECT_EQ(" -", line.substr(line.size() - 2));
+}
+
+TEST_F(AutoindexTest, ReusesListingUntilDirectoryChanges) {
+  std::string dir = make_dir("changing");
+  touch(dir + "/first");
+  set_mtime(dir, 100);
+  EXPECT_NE(std::string::npos, list(dir).find(">first</a>"));
+  EXPECT_TRUE(Autoindex::is_cached(dir, false));
+
+  // Same mtime: the cached copy is served even though a file was added
+  touch(dir + "/second");
+  set_mtime(dir, 100);
+  EXPECT_EQ(std::string::npos, list(dir).find(">second</a>"));
+
+  set_mtime(dir, 50);
+  EXPECT_NE(std::string::npos, list(dir).find(">second</a>"));
+  EXPECT_EQ(1u, Autoindex::cached_listings());
+}
+
+TEST_F(AutoindexTest, RecentDirectoriesAreNotTrusted) {
+  std::string dir = make_dir("recent");
+  touch(dir + "/first");
+  list(dir);
+  touch(dir + "/second");
+  EXPECT_NE(std::string::npos, list(dir).find(">second</a>"));
+}
+
+TEST_F(AutoindexTest, EvictsLeastRecentlyUsedAtEntryLimit) {
+  Autoindex::set_cache_limits(3, 64 * 1024 * 1024);
+  std::string dirs[4];
+  for (int i = 0; i < 4; ++i) {
+    dirs[i] = make_dir(std::string(1, static_cast<char>('a' + i)));
+    set_mtime(dirs[i], 100);
+  }
+  list(dirs[0]);
+  list(dirs[1]);
+  list(dirs[2]);
+  list(dirs[0]);
+  list(dirs[3]);
+
+  EXPECT_EQ(3u, Autoindex::cached_listings());
+  EXPECT_TRUE(Autoindex::is_cached(dirs[0], false));
+  EXPECT_FALSE(Autoindex::is_cached(dirs[1], false));
+  EXPECT_TRUE(Autoindex::is_cached(dirs[2], false));
+  EXPECT_TRUE(Autoindex::is_cached(dirs[3], false));
+
+  Autoindex::set_cache_limits(1, 64 * 1024 * 1024);
+  EXPECT_EQ(1u, Autoindex::cached_listings());
+  EXPECT_TRUE(Autoindex::is_cached(dirs[3], false));
+}
+
+TEST_F(AutoindexTest, EvictsLeastRecentlyUsedAtByteLimit) {
+  std::string dirs[5];
+  for (int i = 0; i < 5; ++i) {
+    dirs[i] = make_dir(std::string(1, static_cast<char>('a' + i)));
+    touch(dirs[i] + "/file");
+    set_mtime(dirs[i], 100);
+  }
+  list(dirs[0]);
+  std::size_t size = Autoindex::cached_bytes();
+  ASSERT_GT(size, 0u);
+  // Room for four listings
+  Autoindex::set_cache_limits(128, size * 4 + size / 2);
+  list(dirs[1]);
+  list(dirs[2]);
+  list(dirs[3]);
+  list(dirs[0]);
+  EXPECT_EQ(size * 4, Autoindex::cached_bytes());
+
+  list(dirs[4]);
+  EXPECT_EQ(4u, Autoindex::cached_listings());
+  EXPECT_EQ(size * 4, Autoindex::cached_bytes());
+  EXPECT_FALSE(Autoindex::is_cached(dirs[1], false));
+  EXPECT_TRUE(Autoindex::is_cached(dirs[0], false));
+  EXPECT_TRUE(Autoindex::is_cached(dirs[4], false));
+}
+
+TEST_F(AutoindexTest, OversizedListingsAreNotCached) {
+  std::string dir = make_dir("big");
+  touch(dir + "/file");
+  set_mtime(dir, 100);
+  Autoindex::set_cache_limits(128, 8);
+  EXPECT_NE(std::string::npos, list(dir).find(">file</a>"));
+  EXPECT_EQ(0u, Autoindex::cached_listings());
+  EXPECT_EQ(0u, Autoindex::cached_bytes());
+}
+}  // namespace
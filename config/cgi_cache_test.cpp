@@ -0,0 +1,219 @@
+#include "CgiCache.hpp"
+
+#include <gtest/gtest.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <string>
+
+#include "Config.hpp"
+
+namespace {
+const char* kCgiCacheConf =
+    "server {\n"
+    "  listen 8094;\n"
+    "  location /cgi-bin/ {\n"
+    "    cgi_handler .py /usr/bin/python3;\n"
+    "    cgi_cache micro max_size=4k ttl=60s stale=10s;\n"
+    "  }\n"
+    "}\n";
+
+typedef std::map<std::string, std::string> Headers;
+
+Request make_request(const std::string& target) {
+  Request request;
+  request.method = kGet;
+  request.target = target;
+  request.version = kHttp11;
+  request.headers["host"] = "Example.COM:8094";
+  return request;
+}
+
+// Body of body_size bytes, which with its head is a little more on the
+// wire
+Response make_response(std::size_t body_size) {
+  Response response;
+  response.set_status_code(200);
+  response.add_header("Content-Type", "text/plain");
+  response.set_body_and_content_length(std::string(body_size, 'x'));
+  return response;
+}
+
+class CgiCacheTest : public ::testing::Test {
+ protected:
+  Config config;
+  std::string path;
+  CgiCache cache;
+
+  void SetUp() override {
+    path = "cgi_cache_test.conf";
+    std::ofstream ofs(path.c_str());
+    ofs << kCgiCacheConf;
+    ofs.close();
+    config.load_file(path);
+    cache.configure(config);
+  }
+  void TearDown() override { std::remove(path.c_str()); }
+
+  const CgiCacheConfig& cc() {
+    return config.get_config(8094, "").get_matching_location("/cgi-bin/")
+        .cgi_cache;
+  }
+
+  CgiCache::Lookup lookup(const std::string& key) {
+    std::string out;
+    return cache.lookup(cc(), key, out);
+  }
+
+  void store(const std::string& key, const Headers& headers,
+             std::size_t body_size) {
+    cache.store(cc(), key, 200, headers, make_response(body_size));
+  }
+};
+}  // namespace
+
+TEST(CgiCacheFreshnessTest, CacheControl) {
+  int64_t ttl;
+  int64_t stale;
+  Headers headers;
+  ASSERT_TRUE(CgiCache::freshness(5, 0, 200, headers, ttl, stale));
+  EXPECT_EQ(ttl, 5);
+  EXPECT_EQ(stale, 0);
+
+  headers["cache-control"] = "public, Max-Age=30, stale-while-revalidate=7";
+  ASSERT_TRUE(CgiCache::freshness(5, 0, 200, headers, ttl, stale));
+  EXPECT_EQ(ttl, 30);
+  EXPECT_EQ(stale, 7);
+
+  headers["cache-control"] = "s-maxage=90, max-age=30";
+  ASSERT_TRUE(CgiCache::freshness(5, 0, 200, headers, ttl, stale));
+  EXPECT_EQ(ttl, 90);
+
+  const char* refused[] = {"no-store", "private, max-age=60", "no-cache",
+                           "max-age=0"};
+  for (std::size_t i = 0; i < sizeof(refused) / sizeof(refused[0]); ++i) {
+    headers["cache-control"] = refused[i];
+    EXPECT_FALSE(CgiCache::freshness(5, 0, 200, headers, ttl, stale))
+        << refused[i];
+  }
+}
+
+TEST(CgiCacheFreshnessTest, ExpiresCountsFromDate) {
+  int64_t ttl;
+  int64_t stale;
+  Headers headers;
+  // Long past by our clock, but a minute of lifetime by the script's
+  headers["date"] = "Mon, 01 Jan 2024 00:00:00 GMT";
+  headers["expires"] = "Mon, 01 Jan 2024 00:01:00 GMT";
+  ASSERT_TRUE(CgiCache::freshness(5, 0, 200, headers, ttl, stale));
+  EXPECT_EQ(ttl, 60);
+
+  headers["expires"] = "Sun, 31 Dec 2023 23:59:00 GMT";
+  EXPECT_FALSE(CgiCache::freshness(5, 0, 200, headers, ttl, stale));
+
+  // max-age wins over Expires
+  headers["cache-control"] = "max-age=20";
+  ASSERT_TRUE(CgiCache::freshness(5, 0, 200, headers, ttl, stale));
+  EXPECT_EQ(ttl, 20);
+
+  // Without a Date, Expires counts from now
+  headers.clear();
+  headers["expires"] = "Mon, 01 Jan 2024 00:01:00 GMT";
+  EXPECT_FALSE(CgiCache::freshness(5, 0, 200, headers, ttl, stale));
+  headers["expires"] = "garbage";
+  EXPECT_FALSE(CgiCache::freshness(5, 0, 200, headers, ttl, stale));
+}
+
+TEST(CgiCacheFreshnessTest, RefusesCookiesAndOtherStatuses) {
+  int64_t ttl;
+  int64_t stale;
+  Headers headers;
+  EXPECT_FALSE(CgiCache::freshness(5, 0, 404, headers, ttl, stale));
+  EXPECT_TRUE(CgiCache::freshness(5, 0, 301, headers, ttl, stale));
+  headers["vary"] = " * ";
+  EXPECT_FALSE(CgiCache::freshness(5, 0, 200, headers, ttl, stale));
+  headers.clear();
+  headers["set-cookie"] = "id=1";
+  headers["cache-control"] = "max-age=60";
+  EXPECT_FALSE(CgiCache::freshness(5, 0, 200, headers, ttl, stale));
+}
+
+TEST(CgiCacheKeyTest, ExpandsTemplate) {
+  Request request = make_request("/cgi-bin/a.py?x=1");
+  request.headers["accept-language"] = "ja";
+  EXPECT_EQ(CgiCache::build_key(
+                "$request_method$host$request_uri$http_accept_language",
+                request),
+            "GET\nexample.com\n/cgi-bin/a.py?x=1\nja\n");
+  EXPECT_EQ(CgiCache::build_key("v1:$uri|$args|$unknown", request),
+            "v1:/cgi-bin/a.py\n|x=1\n|$unknown\n");
+
+  // $uri$args of /a?bc and of /ab?c are different keys
+  EXPECT_NE(CgiCache::build_key("$uri$args", make_request("/a?bc")),
+            CgiCache::build_key("$uri$args", make_request("/ab?c")));
+}
+
+TEST(CgiCacheKeyTest, OnlyPlainGetsAreCacheable) {
+  Request request = make_request("/cgi-bin/a.py");
+  EXPECT_TRUE(CgiCache::is_cacheable(request));
+  request.headers["content-length"] = "0";
+  EXPECT_TRUE(CgiCache::is_cacheable(request));
+  request.headers["content-length"] = "3";
+  EXPECT_FALSE(CgiCache::is_cacheable(request));
+
+  request = make_request("/cgi-bin/a.py");
+  request.headers["authorization"] = "Bearer x";
+  EXPECT_FALSE(CgiCache::is_cacheable(request));
+  request = make_request("/cgi-bin/a.py");
+  request.method = kPost;
+  EXPECT_FALSE(CgiCache::is_cacheable(request));
+}
+
+TEST_F(CgiCacheTest, StoreRefusesSetCookie) {
+  Headers headers;
+  headers["set-cookie"] = "id=1";
+  EXPECT_EQ(lookup("a"), CgiCache::kFill);
+  cache.store(cc(), "a", 200, headers, make_response(10));
+  // Still no entry, and the fill of "a" is still held
+  EXPECT_EQ(lookup("a"), CgiCache::kMiss);
+}
+
+TEST_F(CgiCacheTest, EvictsLeastRecentlyUsedAtMaxSize) {
+  // Entries of a little over 600 bytes in a 4k zone: six fit
+  Headers headers;
+  const char* keys[] = {"k0", "k1", "k2", "k3", "k4", "k5"};
+  for (std::size_t i = 0; i < 6; ++i) {
+    store(keys[i], headers, 500);
+  }
+  for (std::size_t i = 0; i < 6; ++i) {
+    ASSERT_EQ(lookup(keys[i]), CgiCache::kHit) << keys[i];
+  }
+  // k0 is used again, so k1 is now the oldest
+  EXPECT_EQ(lookup("k0"), CgiCache::kHit);
+  store("k6", headers, 500);
+  EXPECT_EQ(lookup("k1"), CgiCache::kFill);
+  EXPECT_EQ(lookup("k0"), CgiCache::kHit);
+  EXPECT_EQ(lookup("k6"), CgiCache::kHit);
+
+  // Over a quarter of the zone is never kept
+  store("huge", headers, 1200);
+  EXPECT_EQ(lookup("huge"), CgiCache::kFill);
+}
+
+TEST_F(CgiCacheTest, ServesStaleWhileRevalidating) {
+  Headers swr;
+  swr["cache-control"] = "max-age=1, stale-while-revalidate=60";
+  Headers short_swr;
+  short_swr["cache-control"] = "max-age=1, stale-while-revalidate=1";
+  store("long", swr, 10);
+  store("short", short_swr, 10);
+  EXPECT_EQ(lookup("long"), CgiCache::kHit);
+  sleep(2);
+  // The first stale hit refreshes it, the next ones are served meanwhile
+  EXPECT_EQ(lookup("long"), CgiCache::kStale);
+  EXPECT_EQ(lookup("long"), CgiCache::kHit);
+  // Past its window: a miss that runs the script
+  EXPECT_EQ(lookup("short"), CgiCache::kFill);
+}
@@ -0,0 +1,40 @@
+#!/bin/bash
+
+# Streams a slow CGI (cgi-bin/chunked.py writes a chunk every 0.1s) many
+# times at once and checks every body arrives whole. A response cut after
+# its first chunk means the end of the script's output was guessed from an
+# empty pipe. Start the server with cgi-bin/cgi.conf first.
+
+GREEN='\033[0;32m'
+YELLOW='\033[1;33m'
+RED='\033[0;31m'
+NC='\033[0m'
+
+TARGET_URL="http://localhost:8080/cgi-bin/chunked.py"
+EXPECTED="Hello, World! This is chunked response!"
+CONCURRENCY=8
+REQUESTS=40
+
+echo -e "${YELLOW}[CGI stream] ${CONCURRENCY} x ${REQUESTS} requests to ${TARGET_URL}${NC}"
+
+TMP_DIR=$(mktemp -d)
+for c in $(seq 1 $CONCURRENCY); do
+    (
+        for i in $(seq 1 $REQUESTS); do
+            body=$(curl -s --max-time 10 "$TARGET_URL")
+            if [ "$body" != "$EXPECTED" ]; then
+                echo "request $i" >> "$TMP_DIR/bad.$c"
+            fi
+        done
+    ) &
+done
+wait
+
+BAD=$(cat "$TMP_DIR"/bad.* 2>/dev/null | wc -l)
+rm -rf "$TMP_DIR"
+if [ "$BAD" -eq 0 ]; then
+    echo -e "${GREEN}OK: $((CONCURRENCY * REQUESTS)) complete bodies${NC}"
+else
+    echo -e "${RED}Failed: ${BAD} truncated or wrong bodies${NC}"
+    exit 1
+fi
@@ -0,0 +1,76 @@
+#include "Config.hpp"
+
+#include <gtest/gtest.h>
+
+#include <cstdio>
+#include <fstream>
+#include <string>
+
+namespace {
+const char* kVhostConf =
+    "server {\n"
+    "  listen 8090;\n"
+    "  server_name default.test;\n"
+    "}\n"
+    "server {\n"
+    "  listen 127.0.0.1:8090;\n"
+    "  server_name example.com *.wild.com www.trail.* .both.org;\n"
+    "}\n"
+    "server {\n"
+    "  listen 8091;\n"
+    "  server_name example.com;\n"
+    "}\n";
+
+class ConfigVhostTest : public ::testing::Test {
+ protected:
+  Config config;
+  std::string path;
+
+  void SetUp() override {
+    path = "config_vhost_test.conf";
+    std::ofstream ofs(path.c_str());
+    ofs << kVhostConf;
+    ofs.close();
+    config.load_file(path);
+  }
+  void TearDown() override { std::remove(path.c_str()); }
+
+  const std::string& name_of(int port, const std::string& host) {
+    return config.get_config(port, host).server_names[0];
+  }
+};
+}  // namespace
+
+TEST(ConfigNormalizeHost, StripsPortCaseAndTrailingDot) {
+  EXPECT_EQ(Config::normalize_host("Example.COM:8080"), "example.com");
+  EXPECT_EQ(Config::normalize_host("example.com."), "example.com");
+  EXPECT_EQ(Config::normalize_host("[::1]:8080"), "[::1]");
+  EXPECT_EQ(Config::normalize_host(""), "");
+}
+
+TEST_F(ConfigVhostTest, ExactNameWithPort) {
+  EXPECT_EQ(name_of(8090, "example.com:8090"), "example.com");
+  EXPECT_EQ(name_of(8090, "EXAMPLE.com"), "example.com");
+}
+
+TEST_F(ConfigVhostTest, Wildcards) {
+  EXPECT_EQ(name_of(8090, "a.b.wild.com"), "example.com");
+  EXPECT_EQ(name_of(8090, "www.trail.org"), "example.com");
+  EXPECT_EQ(name_of(8090, "both.org"), "example.com");
+  EXPECT_EQ(name_of(8090, "x.both.org"), "example.com");
+  EXPECT_EQ(name_of(8090, "wild.com"), "default.test");
+}
+
+TEST_F(ConfigVhostTest, FallsBackToDefaultServerOfPort) {
+  EXPECT_EQ(name_of(8090, "unknown.test"), "default.test");
+  EXPECT_EQ(name_of(8090, ""), "default.test");
+  EXPECT_EQ(name_of(8091, "unknown.test"), "example.com");
+}
+
+TEST_F(ConfigVhostTest, OneListenerPerAddressAndPort) {
+  std::vector<ListenConfig> listens = config.get_unique_listens();
+  ASSERT_EQ(listens.size(), 2u);
+  EXPECT_EQ(listens[0].address, "0.0.0.0");
+  EXPECT_EQ(listens[0].port, 8090);
+  EXPECT_EQ(listens[1].port, 8091);
+}
@@ -0,0 +1,173 @@
+#include "DiskCache.hpp"
+
+#include <gtest/gtest.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+
+#include "Config.hpp"
+
+namespace {
+const char* kDiskCacheConf =
+    "cache_path pages disk_cache_test.d max_size=1m entries=8;\n"
+    "server {\n"
+    "  listen 8093;\n"
+    "  location /app/ {\n"
+    "    proxy_pass http://127.0.0.1:9001;\n"
+    "    disk_cache pages ttl=1m;\n"
+    "  }\n"
+    "}\n";
+
+const char* kResponse =
+    "HTTP/1.1 200 OK\r\n"
+    "Date: Mon, 01 Jan 2024 00:00:00 GMT\r\n"
+    "Content-Length: 5\r\n"
+    "Content-Type: text/plain\r\n"
+    "\r\n"
+    "hello";
+
+// A backend body handed out in pieces of at most max_bytes
+class StringSource : public BodySource {
+  std::string data_;
+  std::size_t offset_;
+
+ public:
+  explicit StringSource(const std::string& data) : data_(data), offset_(0) {}
+  BodyStatus read_some(std::string& out, std::size_t max_bytes) {
+    std::string piece = data_.substr(offset_, max_bytes);
+    out += piece;
+    offset_ += piece.size();
+    return offset_ == data_.size() ? kBodyDone : kBodyMore;
+  }
+};
+
+class DiskCacheTest : public ::testing::Test {
+ protected:
+  Config config;
+  std::string path;
+
+  void SetUp() override {
+    path = "disk_cache_test.conf";
+    std::ofstream ofs(path.c_str());
+    ofs << kDiskCacheConf;
+    ofs.close();
+    config.load_file(path);
+  }
+  void TearDown() override {
+    std::remove(path.c_str());
+    std::system("rm -rf disk_cache_test.d");
+  }
+
+  const DiskCacheConfig& dc() {
+    return config.get_config(8093, "").get_matching_location("/app/")
+        .disk_cache;
+  }
+
+  // The whole response of a hit, or "" on a miss
+  std::string fetch(DiskCache& cache, const std::string& key) {
+    std::string head;
+    BodySource* body;
+    if (!cache.lookup(dc(), key, head, body)) {
+      return "";
+    }
+    std::string data;
+    while (body->read_some(data, 2) == kBodyMore) {
+    }
+    delete body;
+    return head + data;
+  }
+};
+}  // namespace
+
+TEST_F(DiskCacheTest, StoredResponseIsServedWithItsLength) {
+  DiskCache cache;
+  cache.configure(config);
+  EXPECT_EQ(fetch(cache, "/a"), "");
+  cache.store(dc(), "/a", kResponse);
+  std::string hit = fetch(cache, "/a");
+  EXPECT_NE(hit.find("Content-Length: 5\r\n"), std::string::npos);
+  EXPECT_NE(hit.find("Content-Type: text/plain\r\n"), std::string::npos);
+  EXPECT_EQ(hit.find("2024"), std::string::npos);
+  EXPECT_EQ(hit.substr(hit.size() - 9), "\r\n\r\nhello");
+  EXPECT_EQ(fetch(cache, "/b"), "");
+}
+
+TEST_F(DiskCacheTest, BackendCanRefuseCaching) {
+  DiskCache cache;
+  cache.configure(config);
+  std::string response = kResponse;
+  response.insert(response.find("\r\n\r\n") + 2, "Cache-Control: no-store\r\n");
+  cache.store(dc(), "/a", response);
+  EXPECT_EQ(fetch(cache, "/a"), "");
+
+  // Cut short: the length does not match
+  cache.store(dc(), "/b", std::string(kResponse, std::strlen(kResponse) - 1));
+  EXPECT_EQ(fetch(cache, "/b"), "");
+}
+
+TEST_F(DiskCacheTest, EntriesSurviveRestartAndCrash) {
+  {
+    DiskCache cache;
+    cache.configure(config);
+    cache.store(dc(), "/a", kResponse);
+  }
+  {
+    DiskCache cache;
+    cache.configure(config);
+    EXPECT_NE(fetch(cache, "/a"), "");
+  }
+  // Marked as still open, as after a crash (clean follows the magic and
+  // three counters), so the next start rebuilds the index
+  std::FILE* file = std::fopen("disk_cache_test.d/index", "r+b");
+  ASSERT_TRUE(file != NULL);
+  std::fseek(file, 32, SEEK_SET);
+  std::fputc(0, file);
+  std::fclose(file);
+  DiskCache cache;
+  cache.configure(config);
+  EXPECT_NE(fetch(cache, "/a"), "");
+}
+
+TEST_F(DiskCacheTest, EvictionKeepsIndexBelowEntries) {
+  DiskCache cache;
+  cache.configure(config);
+  for (int i = 0; i < 10; ++i) {
+    cache.store(dc(), "/" + std::to_string(i), kResponse);
+  }
+  EXPECT_EQ(fetch(cache, "/8"), "");
+  cache.evict(cache.next_eviction_sec());
+  cache.store(dc(), "/8", kResponse);
+  EXPECT_NE(fetch(cache, "/8"), "");
+}
+
+TEST_F(DiskCacheTest, TeeKeepsOnlyWholeBodies) {
+  DiskCache cache;
+  cache.configure(config);
+  // Over several pieces of the writer
+  std::string body(200 * 1024, 'b');
+  std::string head =
+      "HTTP/1.1 200 OK\r\nContent-Length: " + std::to_string(body.size()) +
+      "\r\n\r\n";
+  BodySource* tee = cache.tee(dc(), "/whole", head, new StringSource(body));
+  std::string sent;
+  while (tee->read_some(sent, 16 * 1024) == kBodyMore) {
+  }
+  delete tee;
+  EXPECT_EQ(sent, body);
+  std::string hit = fetch(cache, "/whole");
+  ASSERT_GT(hit.size(), body.size());
+  EXPECT_EQ(hit.substr(hit.size() - body.size()), body);
+
+  // The client went away half way
+  tee = cache.tee(dc(), "/cut", head, new StringSource(body));
+  sent.clear();
+  for (int i = 0; i < 8; ++i) {
+    tee->read_some(sent, 16 * 1024);
+  }
+  delete tee;
+  EXPECT_EQ(fetch(cache, "/cut"), "");
+  EXPECT_EQ(std::system("test -z \"$(ls disk_cache_test.d/tmp)\""), 0);
+}
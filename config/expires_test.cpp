@@ -0,0 +1,160 @@
+#include <gtest/gtest.h>
+#include <sys/stat.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <string>
+
+#include "Config.hpp"
+#include "RequestProcessor.hpp"
+#include "config_utils.hpp"
+#include "string_utils.hpp"
+
+namespace {
+const char* kExpiresConf =
+    "server {\n"
+    "  listen 8095;\n"
+    "  root expires_test.d;\n"
+    "  location /hour/ {\n"
+    "    expires 1h;\n"
+    "    expires_match *.[0-9a-f][0-9a-f][0-9a-f][0-9a-f].js max;\n"
+    "    expires_match *.html epoch;\n"
+    "  }\n"
+    "  location /past/ {\n"
+    "    expires -1h;\n"
+    "  }\n"
+    "  location /off/ {\n"
+    "    expires off;\n"
+    "    add_header X-Frame-Options DENY;\n"
+    "  }\n"
+    "  location /own/ {\n"
+    "    expires 7d;\n"
+    "    add_header Cache-Control \"public, max-age=60; x\";\n"
+    "  }\n"
+    "}\n";
+
+class ExpiresTest : public ::testing::Test {
+ protected:
+  Config config;
+  std::string path;
+
+  void SetUp() override {
+    mkdir("expires_test.d", 0755);
+    const char* dirs[] = {"hour", "past", "off", "own"};
+    for (std::size_t i = 0; i < 4; ++i) {
+      std::string dir = std::string("expires_test.d/") + dirs[i];
+      mkdir(dir.c_str(), 0755);
+      std::ofstream((dir + "/a.txt").c_str()) << "a";
+    }
+    std::ofstream("expires_test.d/hour/app.0f3a.js") << "js";
+    std::ofstream("expires_test.d/hour/page.html") << "html";
+    path = "expires_test.conf";
+    std::ofstream ofs(path.c_str());
+    ofs << kExpiresConf;
+    ofs.close();
+    config.load_file(path);
+  }
+  void TearDown() override {
+    std::remove(path.c_str());
+    std::system("rm -rf expires_test.d");
+  }
+
+  // The serialized response to a GET of target
+  std::string get(const std::string& target) {
+    Request request;
+    request.method = kGet;
+    request.target = target;
+    request.version = kHttp11;
+    request.headers["host"] = "localhost";
+    const ServerContext& sc = config.get_config(8095, "localhost");
+    ProcessorResult result =
+        RequestProcessor::process(kParseFinished, request, sc);
+    EXPECT_EQ(result.next_action, ProcessorResult::kFileIo) << target;
+    std::string data = "body";
+    RequestProcessor::complete_file_io(result, 0, data, sc);
+    return result.response.serialize();
+  }
+
+  // The value of the header name in response, "" when it is missing
+  static std::string header(const std::string& response,
+                            const std::string& name) {
+    std::size_t pos = response.find("\r\n" + name + ": ");
+    if (pos == std::string::npos) {
+      return "";
+    }
+    pos += name.size() + 4;
+    return response.substr(pos, response.find("\r\n", pos) - pos);
+  }
+};
+}  // namespace
+
+TEST(ParseDurationTest, UnitsAndSums) {
+  EXPECT_EQ(parse_duration_sec("90"), 90);
+  EXPECT_EQ(parse_duration_sec("30s"), 30);
+  EXPECT_EQ(parse_duration_sec("10m"), 600);
+  EXPECT_EQ(parse_duration_sec("1h30m"), 5400);
+  EXPECT_EQ(parse_duration_sec("2w"), 14 * 24 * 3600);
+  EXPECT_EQ(parse_duration_sec("1M"), 30 * 24 * 3600);
+  EXPECT_EQ(parse_duration_sec("1y"), 365 * 24 * 3600);
+  EXPECT_EQ(parse_duration_sec("-1h"), -3600);
+  EXPECT_EQ(parse_duration_sec("-1d12h"), -36 * 3600);
+}
+
+TEST(ParseDurationDeathTest, RejectsMalformedValues) {
+  EXPECT_EXIT(parse_duration_sec(""), ::testing::ExitedWithCode(1),
+              "Invalid duration");
+  EXPECT_EXIT(parse_duration_sec("-"), ::testing::ExitedWithCode(1),
+              "Invalid duration");
+  EXPECT_EXIT(parse_duration_sec("5x"), ::testing::ExitedWithCode(1),
+              "Invalid duration unit");
+  EXPECT_EXIT(parse_duration_sec("1h30"), ::testing::ExitedWithCode(1),
+              "Missing duration unit");
+  EXPECT_EXIT(parse_duration_sec("h"), ::testing::ExitedWithCode(1),
+              "Invalid duration");
+  EXPECT_EXIT(parse_duration_sec("99999999y"), ::testing::ExitedWithCode(1),
+              "Duration too large");
+}
+
+TEST_F(ExpiresTest, RelativeDurationCountsFromNow) {
+  std::time_t before = std::time(NULL);
+  std::string response = get("/hour/a.txt");
+  std::time_t expires;
+  ASSERT_TRUE(parse_http_date(header(response, "Expires"), expires));
+  EXPECT_GE(expires, before + 3600);
+  EXPECT_LE(expires, std::time(NULL) + 3600);
+  EXPECT_EQ(header(response, "Cache-Control"), "max-age=3600");
+}
+
+TEST_F(ExpiresTest, NegativeDurationIsAlreadyStale) {
+  std::string response = get("/past/a.txt");
+  std::time_t expires;
+  ASSERT_TRUE(parse_http_date(header(response, "Expires"), expires));
+  EXPECT_LT(expires, std::time(NULL));
+  EXPECT_EQ(header(response, "Cache-Control"), "no-cache");
+}
+
+TEST_F(ExpiresTest, MatchOverridesLocationValue) {
+  std::string response = get("/hour/app.0f3a.js");
+  EXPECT_EQ(header(response, "Expires"), "Thu, 31 Dec 2037 23:55:55 GMT");
+  EXPECT_EQ(header(response, "Cache-Control"), "max-age=315360000");
+
+  response = get("/hour/page.html");
+  EXPECT_EQ(header(response, "Expires"), "Thu, 01 Jan 1970 00:00:01 GMT");
+  EXPECT_EQ(header(response, "Cache-Control"), "no-cache");
+}
+
+TEST_F(ExpiresTest, OffSendsNoCacheHeaders) {
+  std::string response = get("/off/a.txt");
+  EXPECT_EQ(header(response, "Expires"), "");
+  EXPECT_EQ(header(response, "Cache-Control"), "");
+  EXPECT_EQ(header(response, "X-Frame-Options"), "DENY");
+}
+
+TEST_F(ExpiresTest, AddHeaderCacheControlReplacesGenerated) {
+  std::string response = get("/own/a.txt");
+  EXPECT_NE(header(response, "Expires"), "");
+  EXPECT_EQ(header(response, "Cache-Control"), "public, max-age=60; x");
+  EXPECT_EQ(response.find("max-age=604800"), std::string::npos);
+}
@@ -0,0 +1,60 @@
+#include "fastcgi_protocol.hpp"
+
+#include <gtest/gtest.h>
+
+#include <string>
+
+TEST(FastCgiProtocol, BeginRequestRecord) {
+  std::string out;
+  fastcgi::append_begin_request(out, 1, true);
+  ASSERT_EQ(out.size(), 16u);
+  fastcgi::RecordHeader header;
+  ASSERT_TRUE(fastcgi::parse_header(out, 0, header));
+  EXPECT_EQ(header.type, fastcgi::kBeginRequest);
+  EXPECT_EQ(header.request_id, 1);
+  EXPECT_EQ(header.content_length, 8u);
+  EXPECT_EQ(out[9], 1);   // responder role
+  EXPECT_EQ(out[10], 1);  // keep connection
+}
+
+TEST(FastCgiProtocol, ParamsUseShortAndLongLengths) {
+  fastcgi::Params params;
+  params.push_back(std::make_pair("A", std::string(200, 'x')));
+  std::string out;
+  fastcgi::append_params(out, 1, params);
+
+  fastcgi::RecordHeader header;
+  ASSERT_TRUE(fastcgi::parse_header(out, 0, header));
+  EXPECT_EQ(header.type, fastcgi::kParams);
+  EXPECT_EQ(header.content_length, 1u + 4u + 1u + 200u);
+  EXPECT_EQ(out[8], 1);
+  EXPECT_EQ(static_cast<unsigned char>(out[9]), 0x80);
+  EXPECT_EQ(static_cast<unsigned char>(out[12]), 200);
+
+  // Closing empty PARAMS record
+  std::size_t next = fastcgi::kHeaderLength + header.content_length +
+                     header.padding_length;
+  ASSERT_TRUE(fastcgi::parse_header(out, next, header));
+  EXPECT_EQ(header.content_length, 0u);
+  EXPECT_EQ(out.size(), next + fastcgi::kHeaderLength);
+}
+
+TEST(FastCgiProtocol, StreamIsSplitIntoMaxSizedRecords) {
+  std::string body(fastcgi::kMaxContentLength + 10, 'b');
+  std::string out;
+  fastcgi::append_stream(out, fastcgi::kStdin, 1, body.data(), body.size());
+
+  fastcgi::RecordHeader header;
+  ASSERT_TRUE(fastcgi::parse_header(out, 0, header));
+  EXPECT_EQ(header.content_length, fastcgi::kMaxContentLength);
+  std::size_t next = fastcgi::kHeaderLength + header.content_length +
+                     header.padding_length;
+  ASSERT_TRUE(fastcgi::parse_header(out, next, header));
+  EXPECT_EQ(header.content_length, 10u);
+  EXPECT_EQ((header.content_length + header.padding_length) % 8, 0u);
+}
+
+TEST(FastCgiProtocol, ParseHeaderNeedsEightBytes) {
+  fastcgi::RecordHeader header;
+  EXPECT_FALSE(fastcgi::parse_header(std::string(7, '\0'), 0, header));
+}
@@ -0,0 +1,34 @@
+#include "mime_types.hpp"
+
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+
+TEST(MimeTypesTest, BuiltinTableKnowsModernAssets) {
+  const MimeTypeMap& types = default_mime_types();
+  const std::string fallback = "application/octet-stream";
+  EXPECT_EQ(lookup_mime_type(types, "/app/main.js", fallback), "text/javascript");
+  EXPECT_EQ(lookup_mime_type(types, "/logo.SVG", fallback), "image/svg+xml");
+  EXPECT_EQ(lookup_mime_type(types, "/font.woff2", fallback), "font/woff2");
+  EXPECT_EQ(lookup_mime_type(types, "/mod.wasm", fallback), "application/wasm");
+}
+
+TEST(MimeTypesTest, FallsBackToDefaultType) {
+  const MimeTypeMap& types = default_mime_types();
+  EXPECT_EQ(lookup_mime_type(types, "/README", "text/plain"), "text/plain");
+  EXPECT_EQ(lookup_mime_type(types, "/dir.d/README", "text/plain"), "text/plain");
+  EXPECT_EQ(lookup_mime_type(types, "/a.unknown", "text/plain"), "text/plain");
+}
+
+TEST(MimeTypesTest, ParseTypesBlock) {
+  std::vector<std::string> tokens = {"{", "text/html", "html", "HTM", ";",
+                                     "image/png", "png", ";", "}", "next"};
+  size_t index = 0;
+  MimeTypeMap types;
+  parse_types_block(tokens, index, types);
+  EXPECT_EQ(tokens[index], "next");
+  EXPECT_EQ(types.size(), 3u);
+  EXPECT_EQ(types["htm"], "text/html");
+  EXPECT_EQ(lookup_mime_type(types, "/x.png", ""), "image/png");
+}
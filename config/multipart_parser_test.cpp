@@ -0,0 +1,79 @@
+#include "MultipartParser.hpp"
+
+#include <gtest/gtest.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+namespace {
+const char* kBody =
+    "preamble\r\n"
+    "--XyZ\r\n"
+    "Content-Disposition: form-data; name=\"title\"\r\n"
+    "\r\n"
+    "hello\r\n"
+    "--XyZ\r\n"
+    "Content-Disposition: form-data; name=\"f\"; filename=\"a.txt\"\r\n"
+    "Content-Type: text/plain\r\n"
+    "\r\n"
+    "line\r\n--XyA\r\n--Xy\r\n"
+    "--XyZ--\r\n"
+    "epilogue";
+
+class Recorder : public MultipartParser::Listener {
+ public:
+  std::vector<std::string> dispositions;
+  std::vector<std::string> bodies;
+  bool begin_part(const std::map<std::string, std::string>& headers) {
+    std::map<std::string, std::string>::const_iterator it =
+        headers.find("content-disposition");
+    dispositions.push_back(it == headers.end() ? "" : it->second);
+    bodies.push_back("");
+    return true;
+  }
+  bool part_data(const char* data, std::size_t len) {
+    bodies.back().append(data, len);
+    return true;
+  }
+  bool end_part() { return true; }
+};
+}  // namespace
+
+TEST(MultipartParserTest, PartsSurviveAnySplitOfTheBody) {
+  std::string body = kBody;
+  for (std::size_t piece = 1; piece <= body.size(); ++piece) {
+    Recorder recorder;
+    MultipartParser parser("XyZ", recorder);
+    MultipartParser::Status status = MultipartParser::kMore;
+    for (std::size_t i = 0; i < body.size(); i += piece) {
+      status = parser.feed(body.data() + i, body.substr(i, piece).size());
+    }
+    ASSERT_EQ(status, MultipartParser::kDone) << "piece " << piece;
+    ASSERT_EQ(recorder.bodies.size(), 2u);
+    EXPECT_EQ(recorder.bodies[0], "hello");
+    EXPECT_EQ(recorder.bodies[1], "line\r\n--XyA\r\n--Xy");
+  }
+}
+
+TEST(MultipartParserTest, MalformedPartHeaderIsInvalid) {
+  Recorder recorder;
+  MultipartParser parser("b", recorder);
+  std::string body = "--b\r\nno colon here\r\n\r\ndata\r\n--b--";
+  EXPECT_EQ(parser.feed(body.data(), body.size()), MultipartParser::kInvalid);
+}
+
+TEST(MultipartParserTest, HeaderParameters) {
+  EXPECT_EQ(MultipartParser::boundary_of(
+                "Multipart/Form-Data; boundary=\"a b\"; charset=utf-8"),
+            "a b");
+  EXPECT_EQ(MultipartParser::boundary_of("text/plain; boundary=x"), "");
+  EXPECT_EQ(MultipartParser::boundary_of("multipart/form-data"), "");
+
+  std::string name;
+  std::string filename;
+  MultipartParser::parse_disposition(
+      "form-data; name=\"f\"; filename=\"we\\\"ird;.txt\"", name, filename);
+  EXPECT_EQ(name, "f");
+  EXPECT_EQ(filename, "we\"ird;.txt");
+}
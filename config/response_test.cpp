@@ -0,0 +1,92 @@
+#include "Response.hpp"
+
+#include <gtest/gtest.h>
+
+#include <ctime>
+#include <string>
+
+#include "string_utils.hpp"
+
+namespace {
+const char* kStaleDate = "Mon, 01 Jan 2024 00:00:00 GMT";
+
+std::size_t count(const std::string& text, const std::string& part) {
+  std::size_t n = 0;
+  for (std::size_t pos = text.find(part); pos != std::string::npos;
+       pos = text.find(part, pos + 1)) {
+    ++n;
+  }
+  return n;
+}
+
+// The error page as it would be built at config load
+Response error_page() {
+  Response response;
+  response.prepare_error_response(kNotFound, "");
+  response.add_header("Date", kStaleDate);
+  return response;
+}
+
+std::string body_of(const std::string& bytes) {
+  return bytes.substr(bytes.find("\r\n\r\n") + 4);
+}
+
+TEST(PrebuiltResponseTest, PatchesTheCurrentDate) {
+  PrebuiltResponse prebuilt(error_page());
+  Response response;
+  response.use_prebuilt(prebuilt);
+
+  std::string before = "Date: " + format_http_date(std::time(NULL)) + "\r\n";
+  std::string bytes = response.serialize();
+  std::string after = "Date: " + format_http_date(std::time(NULL)) + "\r\n";
+
+  EXPECT_EQ(0u, bytes.find("HTTP/1.1 404 Not Found\r\n"));
+  EXPECT_EQ(std::string::npos, bytes.find(kStaleDate));
+  EXPECT_TRUE(bytes.find(before) != std::string::npos ||
+              bytes.find(after) != std::string::npos);
+  EXPECT_EQ(body_of(error_page().serialize()), body_of(bytes));
+}
+
+TEST(PrebuiltResponseTest, AddHeaderIsNotDropped) {
+  PrebuiltResponse prebuilt(error_page());
+  Response response;
+  response.use_prebuilt(prebuilt);
+  response.add_header("Retry-After", "5");
+
+  std::string bytes = response.serialize();
+  EXPECT_EQ(0u, bytes.find("HTTP/1.1 404 Not Found\r\n"));
+  EXPECT_NE(std::string::npos, bytes.find("\r\nRetry-After: 5\r\n"));
+  EXPECT_EQ(1u, count(bytes, "\r\nDate: "));
+  EXPECT_EQ(std::string::npos, bytes.find(kStaleDate));
+  EXPECT_EQ(1u, count(bytes, "\r\nContent-Type: text/html\r\n"));
+  EXPECT_EQ(body_of(error_page().serialize()), body_of(bytes));
+}
+
+TEST(PrebuiltResponseTest, SetStatusCodeIsNotDropped) {
+  PrebuiltResponse prebuilt(error_page());
+  Response response;
+  response.use_prebuilt(prebuilt);
+  response.set_status_code(503);
+  response.add_header("Content-Type", "text/plain");
+
+  std::string bytes = response.serialize();
+  EXPECT_EQ(0u, bytes.find("HTTP/1.1 503 Service Unavailable\r\n"));
+  EXPECT_EQ(1u, count(bytes, "\r\nContent-Type: "));
+  EXPECT_NE(std::string::npos, bytes.find("\r\nContent-Type: text/plain\r\n"));
+}
+
+TEST(PrebuiltResponseTest, RepeatedHeadersSurviveAChange) {
+  Response original = error_page();
+  original.add_raw_headers("Set-Cookie: a=1\r\nSet-Cookie: b=2\r\n");
+  PrebuiltResponse prebuilt(original);
+  Response response;
+  response.use_prebuilt(prebuilt);
+  response.add_header("X-Extra", "1");
+
+  std::string bytes = response.serialize();
+  EXPECT_EQ(1u, count(bytes, "\r\nSet-Cookie: a=1\r\n"));
+  EXPECT_EQ(1u, count(bytes, "\r\nSet-Cookie: b=2\r\n"));
+  EXPECT_NE(std::string::npos, bytes.find("\r\nX-Extra: 1\r\n"));
+  EXPECT_EQ(body_of(original.serialize()), body_of(bytes));
+}
+}  // namespace
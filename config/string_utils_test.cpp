@@ -40,3 +40,14 @@ TEST(StringUtilsTest, ConvertToInteger) {
   EXPECT_EQ(res, 0);
   EXPECT_EQ(num, 175);
 }
+
+TEST(StringUtilsTest, ParseHttpDate) {
+  std::time_t t;
+  EXPECT_TRUE(parse_http_date("Sun, 06 Nov 1994 08:49:37 GMT", t));
+  EXPECT_EQ(t, 784111777);
+  EXPECT_EQ(format_http_date(t), "Sun, 06 Nov 1994 08:49:37 GMT");
+
+  EXPECT_FALSE(parse_http_date("Sunday, 06-Nov-94 08:49:37 GMT", t));
+  EXPECT_FALSE(parse_http_date("0", t));
+  EXPECT_FALSE(parse_http_date("Sun, 06 Nov 1994 08:49:37 GMT junk", t));
+}
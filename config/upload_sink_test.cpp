@@ -0,0 +1,96 @@
+#include "UploadSink.hpp"
+
+#include <dirent.h>
+#include <gtest/gtest.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+namespace {
+std::string read_all(const std::string& path) {
+  std::ifstream ifs(path.c_str(), std::ios::binary);
+  std::ostringstream out;
+  out << ifs.rdbuf();
+  return out.str();
+}
+
+// Entries other than . and ..
+int count_entries(const std::string& dir) {
+  DIR* d = opendir(dir.c_str());
+  int count = 0;
+  while (struct dirent* entry = readdir(d)) {
+    std::string name = entry->d_name;
+    count += name != "." && name != "..";
+  }
+  closedir(d);
+  return count;
+}
+
+class UploadSinkTest : public ::testing::Test {
+ protected:
+  void SetUp() override { mkdir("upload_sink_test.d", 0755); }
+  void TearDown() override { std::system("rm -rf upload_sink_test.d"); }
+};
+}  // namespace
+
+TEST_F(UploadSinkTest, FileAppearsWholeOnCommit) {
+  std::ofstream("upload_sink_test.d/file") << "old";
+  UploadSink* sink = UploadSink::create("upload_sink_test.d/file", 11);
+  ASSERT_TRUE(sink != NULL);
+  ASSERT_TRUE(sink->write("hello ", 6));
+  EXPECT_EQ(read_all("upload_sink_test.d/file"), "old");
+  ASSERT_TRUE(sink->write("world", 5));
+  ASSERT_TRUE(sink->commit());
+  delete sink;
+  EXPECT_EQ(read_all("upload_sink_test.d/file"), "hello world");
+  EXPECT_EQ(count_entries("upload_sink_test.d"), 1);
+}
+
+TEST_F(UploadSinkTest, AbandonedUploadLeavesNothing) {
+  UploadSink* sink = UploadSink::create("upload_sink_test.d/file", 1000);
+  ASSERT_TRUE(sink != NULL);
+  ASSERT_TRUE(sink->write("partial", 7));
+  EXPECT_EQ(count_entries("upload_sink_test.d"), 1);
+  delete sink;
+  EXPECT_EQ(count_entries("upload_sink_test.d"), 0);
+}
+
+TEST_F(UploadSinkTest, ShorterBodyGivesBackReservedSpace) {
+  UploadSink* sink = UploadSink::create("upload_sink_test.d/file", 1000);
+  ASSERT_TRUE(sink != NULL);
+  ASSERT_TRUE(sink->write("abc", 3));
+  ASSERT_TRUE(sink->commit());
+  delete sink;
+  EXPECT_EQ(read_all("upload_sink_test.d/file"), "abc");
+}
+
+// splice_in() only fills the pipe, on the event loop; the file is written
+// by flush_spliced(), on a pool thread
+TEST_F(UploadSinkTest, SplicedBytesReachTheFileOnFlush) {
+  UploadSink* sink = UploadSink::create("upload_sink_test.d/file", 0);
+  ASSERT_TRUE(sink != NULL);
+  if (!sink->can_splice()) {
+    delete sink;
+    GTEST_SKIP() << "no splice(2)";
+  }
+  int fds[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  ASSERT_EQ(write(fds[1], "spliced", 7), 7);
+  ASSERT_EQ(sink->splice_in(fds[0], 7), 7);
+  ASSERT_TRUE(sink->flush_spliced());
+  ASSERT_TRUE(sink->write(" and written", 12));
+  ASSERT_EQ(write(fds[1], "!", 1), 1);
+  ASSERT_EQ(sink->splice_in(fds[0], 1), 1);
+  ASSERT_TRUE(sink->flush_spliced());
+  ASSERT_TRUE(sink->commit());
+  delete sink;
+  close(fds[0]);
+  close(fds[1]);
+  EXPECT_EQ(read_all("upload_sink_test.d/file"), "spliced and written!");
+}
@@ -0,0 +1,165 @@
+#include "UpstreamGroups.hpp"
+
+#include <gtest/gtest.h>
+
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "Config.hpp"
+
+namespace {
+const char* kUpstreamConf =
+    "upstream rr {\n"
+    "  server 127.0.0.1:9001 weight=3;\n"
+    "  server 127.0.0.1:9002;\n"
+    "}\n"
+    "upstream lc {\n"
+    "  least_conn;\n"
+    "  server 127.0.0.1:9001;\n"
+    "  server 127.0.0.1:9002;\n"
+    "}\n"
+    "upstream ring {\n"
+    "  hash $request_uri consistent;\n"
+    "  server 127.0.0.1:9001;\n"
+    "  server 127.0.0.1:9002;\n"
+    "  server 127.0.0.1:9003;\n"
+    "}\n"
+    "upstream checked {\n"
+    "  server 127.0.0.1:9001 max_fails=2;\n"
+    "  server 127.0.0.1:9002;\n"
+    "  health_check interval=1s fails=2 passes=1;\n"
+    "}\n"
+    "server {\n"
+    "  listen 8092;\n"
+    "  location /rr/ { proxy_pass http://rr/; }\n"
+    "  location /bare/ { proxy_pass http://backend.test; }\n"
+    "  location /fcgi/ { fastcgi_pass lc; }\n"
+    "}\n";
+
+class UpstreamGroupsTest : public ::testing::Test {
+ protected:
+  Config config;
+  UpstreamGroups groups;
+  std::vector<UpstreamGroups::Peer*> none;
+  std::string path;
+
+  void SetUp() override {
+    path = "upstream_groups_test.conf";
+    std::ofstream ofs(path.c_str());
+    ofs << kUpstreamConf;
+    ofs.close();
+    config.load_file(path);
+    groups.configure(config);
+  }
+  void TearDown() override { std::remove(path.c_str()); }
+
+  std::string pick(const std::string& group, const std::string& key = "") {
+    UpstreamGroups::Peer* peer = groups.select(group, key, none);
+    if (peer == NULL) {
+      return "";
+    }
+    groups.release(peer, false);
+    return peer->address;
+  }
+};
+}  // namespace
+
+TEST_F(UpstreamGroupsTest, TargetsResolveToGroupsOrAddresses) {
+  const LocationContext& rr =
+      config.get_config(8092, "").get_matching_location("/rr/");
+  const LocationContext& bare =
+      config.get_config(8092, "").get_matching_location("/bare/");
+  EXPECT_EQ(rr.proxy_pass, "rr");
+  EXPECT_EQ(bare.proxy_pass, "backend.test:80");
+  EXPECT_EQ(pick("backend.test:80"), "backend.test:80");
+}
+
+TEST_F(UpstreamGroupsTest, SmoothWeightedRoundRobin) {
+  std::string order;
+  for (int i = 0; i < 8; ++i) {
+    order += pick("rr") == "127.0.0.1:9001" ? "a" : "b";
+  }
+  EXPECT_EQ(order, "aabaaaba");
+}
+
+TEST_F(UpstreamGroupsTest, LeastConnPrefersIdleServer) {
+  UpstreamGroups::Peer* busy = groups.select("lc", "", none);
+  ASSERT_NE(busy, (UpstreamGroups::Peer*)NULL);
+  for (int i = 0; i < 3; ++i) {
+    UpstreamGroups::Peer* next = groups.select("lc", "", none);
+    EXPECT_NE(next, busy);
+    groups.release(next, false);
+  }
+  groups.release(busy, false);
+}
+
+TEST_F(UpstreamGroupsTest, ConsistentHashIsStableAndSkipsTried) {
+  std::map<std::string, std::string> first;
+  for (int i = 0; i < 50; ++i) {
+    std::string key = "/item/" + std::to_string(i);
+    first[key] = pick("ring", key);
+  }
+  for (std::map<std::string, std::string>::iterator it = first.begin();
+       it != first.end(); ++it) {
+    EXPECT_EQ(pick("ring", it->first), it->second);
+  }
+
+  // Taking one server out moves only the keys it had
+  UpstreamGroups::Peer* out = groups.select("ring", "/item/0", none);
+  std::vector<UpstreamGroups::Peer*> tried(1, out);
+  for (std::map<std::string, std::string>::iterator it = first.begin();
+       it != first.end(); ++it) {
+    UpstreamGroups::Peer* peer = groups.select("ring", it->first, tried);
+    ASSERT_NE(peer, (UpstreamGroups::Peer*)NULL);
+    EXPECT_NE(peer, out);
+    if (it->second != out->address) {
+      EXPECT_EQ(peer->address, it->second);
+    }
+    groups.release(peer, false);
+  }
+  groups.release(out, false);
+}
+
+TEST_F(UpstreamGroupsTest, MaxFailsTakesServerOut) {
+  UpstreamGroups::Peer* peer = NULL;
+  for (int i = 0; i < 2; ++i) {
+    do {
+      peer = groups.select("checked", "", none);
+      groups.release(peer, peer->address == "127.0.0.1:9001");
+    } while (peer->address != "127.0.0.1:9001");
+  }
+  for (int i = 0; i < 4; ++i) {
+    EXPECT_EQ(pick("checked"), "127.0.0.1:9002");
+  }
+}
+
+TEST_F(UpstreamGroupsTest, LoneServerIsNeverTakenOutByFailures) {
+  for (int i = 0; i < 5; ++i) {
+    UpstreamGroups::Peer* peer = groups.select("backend.test:80", "", none);
+    ASSERT_NE(peer, (UpstreamGroups::Peer*)NULL);
+    groups.release(peer, true);
+  }
+  EXPECT_EQ(pick("backend.test:80"), "backend.test:80");
+}
+
+TEST_F(UpstreamGroupsTest, HealthChecksNeedFailsInARow) {
+  ASSERT_TRUE(groups.has_health_checks());
+  std::vector<UpstreamGroups::Peer*> due = groups.take_due_checks(
+      groups.next_check_sec());
+  ASSERT_EQ(due.size(), 2u);
+  UpstreamGroups::Peer* first = due[0];
+
+  groups.check_done(first, false);
+  groups.check_done(due[1], true);
+  EXPECT_TRUE(first->healthy);
+  groups.check_done(first, false);
+  EXPECT_FALSE(first->healthy);
+  for (int i = 0; i < 4; ++i) {
+    EXPECT_EQ(pick("checked"), due[1]->address);
+  }
+  groups.check_done(first, true);
+  EXPECT_TRUE(first->healthy);
+}
@@ -0,0 +1,33 @@
+#ifndef INCLUDE_AUTOINDEX_HPP_
+#define INCLUDE_AUTOINDEX_HPP_
+
+#include <cstddef>
+#include <string>
+
+#include "BodySource.hpp"
+
+// Directory listings for `autoindex on`.
+// A listing is rendered once per directory version and kept in a small
+// cache keyed by the directory mtime. Every request streams from the cached
+// copy, so even huge directories are read and sorted only when they change.
+class Autoindex {
+ public:
+  // Returns NULL with errno set if the directory can't be read.
+  // uri_path is the (already decoded of its query) request path.
+  static BodySource* open(const std::string& dir_path,
+                          const std::string& uri_path, bool with_details);
+
+  // Cache bounds; the defaults are 128 listings and 64MB. Lowering them
+  // evicts the least recently used listings right away.
+  static void set_cache_limits(std::size_t max_listings,
+                               std::size_t max_bytes);
+  static void clear_cache();
+  static bool is_cached(const std::string& dir_path, bool with_details);
+  static std::size_t cached_listings();
+  static std::size_t cached_bytes();
+
+ private:
+  Autoindex();
+};
+
+#endif  // INCLUDE_AUTOINDEX_HPP_
@@ -0,0 +1,32 @@
+#ifndef INCLUDE_BODYSINK_HPP_
+#define INCLUDE_BODYSINK_HPP_
+
+#include <sys/types.h>
+
+#include <cstddef>
+
+// Where a request body goes as it arrives, the counterpart of BodySource.
+// ClientHandler makes the calls that may block on a FileIoPool thread, and
+// leaves the sink alone until they are back.
+class BodySink {
+ public:
+  virtual ~BodySink() {}
+  // false with errno set on failure
+  virtual bool write(const char* data, std::size_t len) = 0;
+  // Whether splice_in() may move body bytes that never reach the parser
+  virtual bool can_splice() const { return false; }
+  // Moves up to len bytes of the socket into the sink without blocking, to
+  // be written by flush_spliced(). Returns what was moved, 0 on end of file
+  // or -1 with errno set.
+  virtual ssize_t splice_in(int sock_fd, std::size_t len) {
+    (void)sock_fd;
+    (void)len;
+    return -1;
+  }
+  // Writes what splice_in() moved. false with errno set.
+  virtual bool flush_spliced() { return true; }
+  // The whole body is in. false with errno set.
+  virtual bool commit() = 0;
+};
+
+#endif  // INCLUDE_BODYSINK_HPP_
@@ -0,0 +1,33 @@
+#ifndef INCLUDE_BODYSOURCE_HPP_
+#define INCLUDE_BODYSOURCE_HPP_
+
+#include <sys/types.h>
+
+#include <cstddef>
+#include <string>
+
+enum BodyStatus {
+  kBodyMore,   // More data will follow
+  kBodyWait,   // Nothing yet; the source re-arms POLLOUT when data arrives
+  kBodyDone,   // The body is complete
+  kBodyError,  // Abort the response
+};
+
+// Produces a response body piece by piece so that a large body is never
+// held in memory at once. ClientHandler pulls the next piece whenever its
+// send buffer has drained, and owns the source until the body is done.
+class BodySource {
+ public:
+  virtual ~BodySource() {}
+  // Appends at most max_bytes to out
+  virtual BodyStatus read_some(std::string& out, std::size_t max_bytes) = 0;
+  // Bytes that splice_to() can move straight into the socket right now.
+  // 0 means the next piece has to come from read_some().
+  virtual std::size_t spliceable() { return 0; }
+  virtual ssize_t splice_to(int, std::size_t) { return -1; }
+  // Asks for the whole body through read_some(), e.g. to keep a copy of it.
+  // Only effective before the first piece is pulled.
+  virtual void disable_splice() {}
+};
+
+#endif  // INCLUDE_BODYSOURCE_HPP_
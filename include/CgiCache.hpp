@@ -0,0 +1,107 @@
+#ifndef INCLUDE_CGICACHE_HPP_
+#define INCLUDE_CGICACHE_HPP_
+
+#include <stdint.h>
+
+#include <cstddef>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "Config.hpp"
+#include "Parser.hpp"
+#include "Response.hpp"
+
+class Server;
+
+// Microcache of CGI responses to GET, in the zones named by cgi_cache.
+// An entry is fresh for the zone's ttl, or for what the script's own
+// Cache-Control or Expires says, and is then served stale for up to
+// `stale` more seconds while one request refreshes it in the background.
+// Each zone stays within its max_size by dropping the least recently used
+// entries.
+//
+// The request that runs the script for a key holds the key's fill until
+// its response is in. With cgi_cache_lock, misses on a key being filled
+// wait for that response instead of starting a script of their own.
+class CgiCache {
+ public:
+  enum Lookup {
+    kMiss,   // Run the script; another request holds the fill
+    kFill,   // Run the script and end the fill with finish_fill()
+    kWait,   // Wait for the fill, see add_waiter()
+    kHit,
+    kStale,  // Served stale, and the caller refreshes it as with kFill
+  };
+
+  CgiCache() {}
+  // Sets up the zones named by every location with cgi_cache
+  void configure(const Config& config);
+  // Copies the response into out on kHit and kStale
+  Lookup lookup(const CgiCacheConfig& cc, const std::string& key,
+                std::string& out);
+  // Keeps the response if the script allowed it
+  void store(const CgiCacheConfig& cc, const std::string& key, int status,
+             const std::map<std::string, std::string>& headers,
+             const Response& response);
+  // Ends the fill of key. The waiters get response, or with NULL are told
+  // to run the script themselves.
+  void finish_fill(Server& server, const CgiCacheConfig& cc,
+                   const std::string& key, const std::string* response);
+  void add_waiter(const CgiCacheConfig& cc, const std::string& key,
+                  int client_fd, unsigned long serial);
+  void remove_waiter(const CgiCacheConfig& cc, const std::string& key,
+                     int client_fd, unsigned long serial);
+  // Appends one line of counters per zone
+  void report(std::string& out) const;
+
+  // Whether a response may be kept, and for how long when it does not say.
+  // Checked as soon as the script's headers are in, so that others are
+  // streamed right away.
+  static bool freshness(long default_ttl_sec, long default_stale_sec,
+                        int status,
+                        const std::map<std::string, std::string>& headers,
+                        int64_t& ttl_sec, int64_t& stale_sec);
+  // Largest response worth buffering for a zone
+  static std::size_t max_entry_bytes(const CgiCacheConfig& cc);
+  // GET without a body or credentials, the only requests cached
+  static bool is_cacheable(const Request& request);
+  // Expands $request_method, $host, $request_uri, $uri, $args and
+  // $http_<name> in the cgi_cache_key template
+  static std::string build_key(const std::string& key_template,
+                               const Request& request);
+
+ private:
+  struct Entry {
+    PrebuiltResponse response;
+    int64_t fresh_until;
+    int64_t stale_until;
+    std::list<std::string>::iterator lru_pos;
+  };
+  struct Waiter {
+    int client_fd;
+    unsigned long serial;
+  };
+  struct Zone {
+    std::size_t max_bytes;
+    std::size_t bytes;
+    std::map<std::string, Entry> entries;
+    std::list<std::string> lru;  // Most recently used first
+    std::map<std::string, std::vector<Waiter> > fills;
+    unsigned long hits;
+    unsigned long stale_hits;
+    unsigned long misses;
+    unsigned long stores;
+    unsigned long evictions;
+    unsigned long collapsed;
+  };
+  std::map<std::string, Zone> zones_;
+
+  CgiCache(const CgiCache&);
+  CgiCache& operator=(const CgiCache&);
+  static std::size_t entry_bytes_(const std::string& key, const Entry& entry);
+  void erase_(Zone& zone, std::map<std::string, Entry>::iterator it);
+};
+
+#endif  // INCLUDE_CGICACHE_HPP_
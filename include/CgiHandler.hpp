@@ -6,6 +6,7 @@
 #include <vector>
 
 #include "Parser.hpp"
+#include "spawn_utils.hpp"
 
 class CgiHandler {
  public:
@@ -17,12 +18,17 @@ class CgiHandler {
   explicit CgiHandler(const Request& request,
                       const std::string& query_string,
                       const std::string& script_uri,
-                      const std::string& server_name,
+                      const std::string& cgi_env,
                       const std::string& server_port,
                       const std::string& remote_addr);
   ~CgiHandler();
 
-  int execute_cgi(const std::string& script_path, const std::string& cgi_path);
+  // Returned by execute_cgi when the script or interpreter cannot be run,
+  // as opposed to -1 for failures on our side
+  static const int kSpawnFailed = -2;
+
+  int execute_cgi(const std::string& script_path, const std::string& cgi_path,
+                  const ProcessLimits& limits = ProcessLimits());
 
   int get_pipe_in_fd() const { return pipe_in_fd_; }
   int get_pipe_out_fd() const { return pipe_out_fd_; }
@@ -35,13 +41,11 @@ class CgiHandler {
   pid_t cgi_pid_;
   std::string query_string_;
   std::string script_uri_;
-  std::string server_name_;
+  const std::string& cgi_env_;
   std::string server_port_;
   std::string remote_addr_;
 
 
-  void exec_cgi_child(int pipe_in[2], int pipe_out[2], const std::string& script_path, const std::string& cgi_path);
-
   CgiHandler(const CgiHandler&);
   CgiHandler& operator=(const CgiHandler&);
 };
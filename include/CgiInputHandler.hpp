@@ -5,16 +5,26 @@
 #include <sys/types.h>
 #include <stdint.h>
 
+#include "CgiInputRelay.hpp"
 #include "MonitoredFdHandler.hpp"
 
 class Server;
 
-class CgiInputHandler : public MonitoredFdHandler {
+class CgiInputHandler : public MonitoredFdHandler, public RelayConsumer {
  public:
+  // keep_fd_open leaves the pipe to its owner, e.g. a pooled worker
   CgiInputHandler(int pipe_in_fd, pid_t cgi_pid, const std::string& body,
+                  Server& server, int client_fd, bool keep_fd_open = false);
+  // Writes a body that is still arriving, as the relay receives it
+  CgiInputHandler(int pipe_in_fd, pid_t cgi_pid, CgiInputRelay* relay,
                   Server& server, int client_fd);
   ~CgiInputHandler();
 
+  // The relay has more body, or has come to an end
+  void resume_input();
+  // cgi_send_timeout in place of the default
+  void set_send_timeout(int64_t timeout_sec);
+
   HandlerStatus handle_input();
   HandlerStatus handle_output();
   HandlerStatus handle_poll_error();
@@ -24,10 +34,11 @@ class CgiInputHandler : public MonitoredFdHandler {
   virtual HandlerStatus handle_timeout();
 
  private:
-  static const int64_t kCgiInputTimeoutSec = 10;  // 10s
+  static const int64_t kCgiInputTimeoutSec = 10;  // Unless set_send_timeout()
 
   void update_deadline_();
   void close_in_fd_();
+  HandlerStatus write_from_relay_();
 
   int         pipe_in_fd_;
   pid_t       cgi_pid_;
@@ -35,11 +46,15 @@ class CgiInputHandler : public MonitoredFdHandler {
   std::size_t bytes_written_;
   int         client_fd_;
   Server&     server_;
+  bool        keep_fd_open_;
+  CgiInputRelay* relay_;
+  bool        waiting_;  // No deadline while the client is the slow side
 
   // deadline state
   int64_t start_sec_;
   int64_t last_activity_sec_;
   int64_t deadline_sec_;
+  int64_t send_timeout_sec_;
 
   CgiInputHandler(const CgiInputHandler&);
   CgiInputHandler& operator=(const CgiInputHandler&);
@@ -0,0 +1,75 @@
+#ifndef INCLUDE_CGIINPUTRELAY_HPP_
+#define INCLUDE_CGIINPUTRELAY_HPP_
+
+#include <sys/types.h>
+
+#include <cstddef>
+#include <string>
+
+class ClientHandler;
+
+// Whatever drains a CgiInputRelay: a CGI's stdin, or a proxied request
+class RelayConsumer {
+ public:
+  virtual ~RelayConsumer() {}
+  // There is more body, or it has come to an end
+  virtual void resume_input() = 0;
+};
+
+// Bounded buffer between a request body that is still being received and a
+// CGI's stdin. The ClientHandler appends decoded body bytes and stops reading
+// the socket above the high watermark; the consumer writes them out and
+// wakes the producer again below the low watermark.
+// With nothing buffered, the producer may splice the socket straight into
+// the consumer's pipe, if it has one; when the pipe is full the consumer
+// wakes it once there is room.
+// Each side detaches when it goes away; the last one deletes the relay.
+class CgiInputRelay {
+ public:
+  static const std::size_t kHighWatermark = 64 * 1024;
+  static const std::size_t kLowWatermark = 16 * 1024;
+
+  explicit CgiInputRelay(ClientHandler* producer);
+
+  // Producer side
+  void append(const std::string& data);
+  void finish();
+  void fail();
+  bool is_full() const { return buffered() >= kHighWatermark; }
+  bool has_consumer() const { return consumer_ != NULL; }
+  void detach_producer();
+  bool can_splice() const;
+  std::size_t pipe_space() const;
+  ssize_t splice_from(int fd, std::size_t max_bytes);
+  void wait_for_space();
+
+  // Consumer side
+  // pipe_fd is -1 for a consumer that is not a pipe
+  void attach_consumer(RelayConsumer* consumer, int pipe_fd);
+  const char* data() const { return buffer_.data() + read_offset_; }
+  std::size_t buffered() const { return buffer_.size() - read_offset_; }
+  void consume(std::size_t len);
+  bool is_done() const { return done_ && buffered() == 0; }
+  bool has_failed() const { return failed_; }
+  // The pipe has room again
+  void pipe_writable();
+  void detach_consumer();
+
+ private:
+  ClientHandler* producer_;
+  RelayConsumer* consumer_;
+  int pipe_fd_;
+  bool producer_waiting_;
+  std::string buffer_;
+  std::size_t read_offset_;
+  bool done_;
+  bool failed_;
+
+  void wake_consumer_();
+  void delete_if_unused_();
+
+  CgiInputRelay(const CgiInputRelay&);
+  CgiInputRelay& operator=(const CgiInputRelay&);
+};
+
+#endif  // INCLUDE_CGIINPUTRELAY_HPP_
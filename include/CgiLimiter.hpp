@@ -0,0 +1,67 @@
+#ifndef INCLUDE_CGILIMITER_HPP_
+#define INCLUDE_CGILIMITER_HPP_
+
+#include <cstddef>
+#include <deque>
+#include <map>
+#include <string>
+
+#include "Config.hpp"
+
+class Server;
+
+// Caps the one-shot CGI processes of each location with cgi_max_concurrent.
+// Requests over the cap wait in a FIFO of up to cgi_queue entries and are
+// started in arrival order as processes finish; once the queue is full they
+// are turned away. Waiters are kept as (fd, serial) so that a connection
+// closed in the meantime is skipped instead of started.
+class CgiLimiter {
+ public:
+  enum Admission {
+    kAdmitted,  // A process may start now and must be released later
+    kQueued,
+    kRejected,
+  };
+
+  CgiLimiter() {}
+  // Sets up the counters of every location with cgi_max_concurrent
+  void configure(const Config& config);
+  Admission admit(const LocationContext& lc, int client_fd,
+                  unsigned long serial);
+  // Whether admit() would let a process start right away
+  bool has_free_slot(const LocationContext& lc) const;
+  // A process admitted for lc is gone; its slot goes to the next waiter
+  // on the following dispatch()
+  void release(const LocationContext& lc);
+  void cancel(const LocationContext& lc, int client_fd, unsigned long serial,
+              bool timed_out);
+  bool has_pending_dispatch() const;
+  // Hands free slots to waiters. Called from the top of the event loop, as
+  // starting a process registers new fds.
+  void dispatch(Server& server);
+  // Appends one line of counters per limited location
+  void report(std::string& out) const;
+
+ private:
+  struct Waiter {
+    int client_fd;
+    unsigned long serial;
+  };
+  struct Slot {
+    std::string label;
+    std::size_t max_running;
+    std::size_t max_queued;
+    std::size_t running;
+    std::deque<Waiter> queue;
+    unsigned long started;
+    unsigned long queued;
+    unsigned long rejected;
+    unsigned long timed_out;
+  };
+  std::map<const LocationContext*, Slot> slots_;
+
+  CgiLimiter(const CgiLimiter&);
+  CgiLimiter& operator=(const CgiLimiter&);
+};
+
+#endif  // INCLUDE_CGILIMITER_HPP_
@@ -0,0 +1,78 @@
+#ifndef INCLUDE_CGIOUTPUTRELAY_HPP_
+#define INCLUDE_CGIOUTPUTRELAY_HPP_
+
+#include <cstddef>
+#include <string>
+
+#include "BodySource.hpp"
+
+class Server;
+
+// Whatever fills a CgiOutputRelay: a CGI's stdout, or a proxied response
+class RelayProducer {
+ public:
+  virtual ~RelayProducer() {}
+  // The relay drained below its low watermark, or lost its consumer
+  virtual void resume_output() = 0;
+};
+
+// Bounded buffer between a CGI's stdout and the client socket. The
+// producer appends what it reads and stops reading above the high
+// watermark; the ClientHandler drains it through the BodySource returned by
+// open_source() and wakes the producer again below the low watermark.
+// Once enable_splice() is called, the body stays in the pipe and the
+// consumer splices it to the socket; the producer only reports readiness.
+// Each side detaches when it goes away; the last one deletes the relay.
+class CgiOutputRelay {
+ public:
+  static const std::size_t kHighWatermark = 64 * 1024;
+  static const std::size_t kLowWatermark = 16 * 1024;
+
+  CgiOutputRelay(Server& server, int client_fd, RelayProducer* producer);
+
+  // Producer side
+  void append(const char* data, std::size_t len);
+  void finish();
+  void fail();
+  std::size_t buffered() const { return buffer_.size() - read_offset_; }
+  bool is_full() const { return buffered() >= kHighWatermark; }
+  bool has_consumer() const { return has_consumer_; }
+  void detach_producer();
+  void enable_splice(int pipe_fd);
+  bool is_splicing() const { return pipe_fd_ != -1; }
+  void pipe_readable();
+  // The producer is done with the pipe while bytes are still in it
+  void hand_over_pipe();
+
+  // Consumer side; the source is owned by the ClientHandler
+  BodySource* open_source();
+  BodyStatus read_some(std::string& out, std::size_t max_bytes);
+  std::size_t spliceable();
+  ssize_t splice_to(int fd, std::size_t max_bytes);
+  // The consumer needs every byte in the buffer; enable_splice() is ignored
+  void disable_splice() { may_splice_ = false; }
+  void detach_consumer();
+
+ private:
+  Server& server_;
+  int client_fd_;
+  RelayProducer* producer_;
+  std::string buffer_;
+  std::size_t read_offset_;
+  int pipe_fd_;
+  bool owns_pipe_;
+  bool may_splice_;
+  bool done_;
+  bool failed_;
+  bool has_consumer_;
+  bool consumer_waiting_;
+
+  void wake_consumer_();
+  void close_pipe_();
+  void delete_if_unused_();
+
+  CgiOutputRelay(const CgiOutputRelay&);
+  CgiOutputRelay& operator=(const CgiOutputRelay&);
+};
+
+#endif  // INCLUDE_CGIOUTPUTRELAY_HPP_
@@ -1,6 +1,8 @@
 #ifndef INCLUDE_CGIRESPONSEHANDLER_HPP_
 #define INCLUDE_CGIRESPONSEHANDLER_HPP_
 
+#include "ChildReaper.hpp"
+#include "CgiOutputRelay.hpp"
 #include "ClientHandler.hpp"
 #include "MonitoredFdHandler.hpp"
 #include "Config.hpp"
@@ -11,8 +13,12 @@
 
 class Server;  
 class ClientHandler;
+class CgiOutputRelay;
+struct CgiWorker;
 
-class CgiResponseHandler : public MonitoredFdHandler {
+class CgiResponseHandler : public MonitoredFdHandler,
+                           public ChildWatcher,
+                           public RelayProducer {
  public:
    struct ParsedCgiOutput {
     bool is_local_redirect;
@@ -32,18 +38,41 @@ class CgiResponseHandler : public MonitoredFdHandler {
   };
 
   CgiResponseHandler(int out_fd, pid_t cgi_pid, Server& server, int client_fd, const ServerContext& target_config);
+  // Reads one response frame from a pooled worker instead of output up to EOF
+  CgiResponseHandler(CgiWorker* worker, Server& server, int client_fd,
+                     const ServerContext& target_config);
   ~CgiResponseHandler();
 
+  // Turns complete CGI-style output into the client's response
+  static void deliver_output(Server& server, int client_fd,
+                             unsigned long client_serial,
+                             const ServerContext& target_config,
+                             const std::string& cgi_output, bool cgi_error);
+
   HandlerStatus handle_input();
   HandlerStatus handle_output();
   HandlerStatus handle_poll_error();
 
+  // The client drained the relay below its low watermark
+  void resume_output();
+  void child_exited(pid_t pid, int status);
+  // The process counts against lc's cgi_max_concurrent until this is gone
+  void hold_cgi_slot(const LocationContext* lc) { cgi_slot_ = lc; }
+  // cgi_read_timeout and cgi_total_timeout of lc, in place of the defaults
+  void set_timeouts(const LocationContext& lc);
+  // Keeps a cacheable response whole and stores it under key. Responses
+  // the headers rule out, or too big for the zone, are streamed as usual.
+  // With owns_fill the requests waiting on key get the same response.
+  void cache_into(const CgiCacheConfig& cc, const std::string& key,
+                  bool owns_fill);
+
   virtual bool has_deadline() const;
   virtual int64_t deadline_sec() const;
   virtual HandlerStatus handle_timeout();
 
  private:
-  static const int64_t kCgiTimeoutSec = 10;   // 10s
+  static const int64_t kCgiTimeoutSec = 10;   // Unless set_timeouts() is called
+  static const int64_t kExitWaitSec = 2;
   static const std::size_t kReadBufSize = 4096;
   static const std::size_t kMaxCgiHeaderBytes = 16 * 1024;
   static const std::size_t kMaxCgiOutputBytes = 8 * 1024 * 1024;
@@ -56,18 +85,43 @@ class CgiResponseHandler : public MonitoredFdHandler {
   void cleanup_cgi_();
   bool is_cgi_error_();
   void handle_cgi_completion_(bool cgi_error);
+  HandlerStatus handle_worker_output_();
+  HandlerStatus start_streaming_();
+  HandlerStatus handle_splice_input_();
+  void finish_relay_();
+  bool wait_for_exit_();
+  HandlerStatus finish_output_();
+  void pause_output_();
+  void drop_cache_();
   int out_fd_;
   pid_t cgi_pid_;
-  ClientHandler* owner_;
   Server& server_;
   int client_fd_;
+  unsigned long client_serial_;
   const ServerContext& target_config_;
   std::string cgi_output_;
+  CgiWorker* worker_;          // NULL for a one-shot CGI process
+  bool worker_reusable_;
+  std::size_t frame_length_;   // Output bytes announced by the worker
+  int frame_exit_status_;
+  bool frame_header_parsed_;
+  CgiOutputRelay* relay_;  // Set once the headers went out to the client
+  bool paused_;            // Pipe reads stopped while the client catches up
+  bool buffer_to_eof_;     // Local redirects are handled on the full output
+  bool exited_;
+  int exit_status_;
+  int exit_notify_fd_;     // Closed by child_exited() while output is done
+  const LocationContext* cgi_slot_;
+  const CgiCacheConfig* cache_;  // NULL unless the output goes to the cache
+  std::string cache_key_;
+  bool owns_fill_;
 
   bool finished_;
   int64_t start_sec_;
   int64_t last_activity_sec_;
   int64_t deadline_sec_;
+  int64_t read_timeout_sec_;
+  int64_t total_deadline_sec_;  // 0 while the run is not capped
 
 };
 
@@ -0,0 +1,77 @@
+#ifndef INCLUDE_CGIWORKERPOOL_HPP_
+#define INCLUDE_CGIWORKERPOOL_HPP_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <cstddef>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "ChildReaper.hpp"
+#include "Config.hpp"
+
+// A warm interpreter running a worker script that loops over requests.
+//
+// Request frame (worker stdin):
+//   "WSCGI <env_bytes> <body_bytes>\n" NAME=VALUE\0 ... <body>
+// Response frame (worker stdout):
+//   "WSCGI <output_bytes> <exit_status>\n" <CGI output>
+struct CgiWorker {
+  pid_t pid;
+  int in_fd;
+  int out_fd;
+  std::size_t requests_served;
+  int64_t idle_since;
+  std::string pool_key;
+  bool exited;  // Reaped already; its pid must not be signalled
+};
+
+class CgiWorkerPool : public ChildWatcher {
+  struct Pool {
+    CgiPoolConfig config;
+    std::vector<CgiWorker*> idle;
+    std::size_t busy;
+  };
+  std::map<std::string, Pool> pools_;
+  std::map<pid_t, CgiWorker*> workers_;  // Idle and busy
+  ChildReaper& reaper_;
+  int64_t last_maintained_sec_;
+
+  static std::string key_of_(const CgiPoolConfig& config);
+  Pool& find_pool_(const CgiPoolConfig& config);
+  CgiWorker* spawn_(const Pool& pool, const std::string& key);
+  void stop_(CgiWorker* worker);
+
+  CgiWorkerPool(const CgiWorkerPool&);
+  CgiWorkerPool& operator=(const CgiWorkerPool&);
+
+ public:
+  static const char* kFrameMagic;
+  static const std::size_t kMaxFrameHeader = 64;
+
+  explicit CgiWorkerPool(ChildReaper& reaper)
+      : reaper_(reaper), last_maintained_sec_(0) {}
+  ~CgiWorkerPool();
+  // Starts the min_workers of every pool configured in config
+  void prespawn(const Config& config);
+  // Returns an idle or newly spawned worker, or NULL if the pool is at max
+  CgiWorker* acquire(const CgiPoolConfig& config);
+  // The worker answered a full frame and may take the next request
+  void release(CgiWorker* worker);
+  // The worker is in an unknown state (crash, timeout, bad frame)
+  void discard(CgiWorker* worker);
+  // Drops workers that died while idle, retires those idle for too long and
+  // tops pools back up to min_workers, at most once per second
+  void maintain();
+  bool empty() const { return pools_.empty(); }
+  void child_exited(pid_t pid, int status);
+
+  static std::string encode_request(
+      const std::vector<std::pair<std::string, std::string> >& env,
+      const std::string& body);
+};
+
+#endif  // INCLUDE_CGIWORKERPOOL_HPP_
@@ -0,0 +1,60 @@
+#ifndef INCLUDE_CHILDREAPER_HPP_
+#define INCLUDE_CHILDREAPER_HPP_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <map>
+
+#include "MonitoredFdHandler.hpp"
+
+class Server;
+
+// Told about the exit of a child it watches
+class ChildWatcher {
+ public:
+  virtual ~ChildWatcher() {}
+  virtual void child_exited(pid_t pid, int status) = 0;
+};
+
+// Reaps every child of the server without blocking the event loop.
+// SIGCHLD writes to a self-pipe that is polled like any other fd; on each
+// wakeup the exited children are collected with waitpid(WNOHANG) and their
+// watchers are told. Children that are no longer wanted get SIGTERM and,
+// if they are still around after a grace period, SIGKILL.
+//
+// A pid stays valid until it is reaped here, so signalling a child that
+// has not been reported as exited can never hit an unrelated process.
+class ChildReaper : public MonitoredFdHandler {
+ public:
+  static const int64_t kTerminateGraceSec = 3;
+
+  explicit ChildReaper(Server& server);
+  ~ChildReaper();
+
+  int fd() const { return read_fd_; }
+  void watch(pid_t pid, ChildWatcher* watcher);
+  void unwatch(pid_t pid);
+  // Sends SIGTERM now and SIGKILL once the grace period is over
+  void terminate(pid_t pid);
+
+  HandlerStatus handle_input();
+  HandlerStatus handle_output() { return kHandlerContinue; }
+  HandlerStatus handle_poll_error() { return kHandlerFatalError; }
+  bool has_deadline() const;
+  int64_t deadline_sec() const;
+  HandlerStatus handle_timeout();
+
+ private:
+  Server& server_;
+  int read_fd_;
+  int write_fd_;
+  std::map<pid_t, ChildWatcher*> watchers_;
+  std::map<pid_t, int64_t> kill_at_;
+
+  ChildReaper(const ChildReaper&);
+  ChildReaper& operator=(const ChildReaper&);
+  void reap_();
+};
+
+#endif  // INCLUDE_CHILDREAPER_HPP_
@@ -6,51 +6,125 @@
 #include <cstddef>
 #include <string>
 
+#include "BodySource.hpp"
+#include "CgiCache.hpp"
 #include "Config.hpp"
 #include "MonitoredFdHandler.hpp"
 #include "Parser.hpp"
+#include "RequestProcessor.hpp"
 #include "Response.hpp"
 
 class Server;
+class CgiInputRelay;
+class BodySink;
+class NativeCall;
 
 class ClientHandler : public MonitoredFdHandler {
   int client_fd_;
+  // Tells this connection apart from a later one that reuses client_fd_
+  unsigned long serial_;
+  static unsigned long next_serial_;
   std::string addr_;
   std::string port_;
+  int listen_port_;
   std::string client_addr_;
   Server& server_;
   const Config& config_;
-  static const std::size_t buf_size = SO_RCVBUF;
+  // Virtual host resolved once from the Host header, then reused
+  const ServerContext* server_config_;
+  static const std::size_t buf_size = 16 * 1024;
   char buffer_[buf_size];
   Parser parser_;
   Response response_;
   std::size_t bytes_sent_;
   std::string response_str_;
+  // Remaining body after response_str_, pulled in pieces as the socket drains
+  BodySource* body_source_;
+  bool body_chunked_;
+  // Body bytes announced by the source that are still to be spliced
+  std::size_t splice_remaining_;
+  static const std::size_t kStreamPieceSize = 16 * 1024;
+  // Set while the request body is still arriving for a CGI already running
+  CgiInputRelay* body_relay_;
+  bool body_paused_;
+  // Waiting for a free process of the location (cgi_max_concurrent)
+  bool cgi_queued_;
+  ProcessorResult queued_cgi_;  // Also kept while waiting on a cache fill
+  // cgi_cache key of the request under way, empty when it is not cached
+  std::string cgi_cache_key_;
+  bool cgi_cache_fills_;    // Others wait on the script this one is to run
+  bool cgi_cache_waiting_;  // Waiting on the script of another request
+  // disk_cache of the request under way when the backend's response is to
+  // be stored, NULL otherwise
+  const DiskCacheConfig* disk_cache_;
+  std::string disk_cache_key_;
+  // The response to finish once the FileIoPool is done with its call (a
+  // blocking plugin's too), or once upload_sink_ has the whole body
+  ProcessorResult file_io_result_;
+  BodySink* upload_sink_;       // NULL while a FileIoPool step has it
+  ParserStatus upload_status_;  // Of the body up to the step under way
   Request current_request_;
   int internal_redirect_count_;
   static const int kMaxInternalRedirects = 5;
   enum State {
     kReceiving,
     kExecutingCgi,
+    kWaitingFileIo,  // Nothing is polled until file_io_done()
     kSendingResponse,
   };
   State state_;
+  bool request_started_;  // Some of a request has arrived
   int64_t last_activity_sec_;
   int64_t deadline_sec_;
 
   static const int64_t kClientTimeoutSec = 30; // 30s
+  HandlerStatus receive_body_();
+  HandlerStatus splice_body_in_(std::size_t length);
+  HandlerStatus relay_body_(ParserStatus status);
+  HandlerStatus start_upload_(const ProcessorResult& result,
+                              bool body_complete);
+  HandlerStatus receive_upload_();
+  HandlerStatus store_upload_(ParserStatus status);
+  HandlerStatus run_upload_step_(FileTask* task);
+  HandlerStatus upload_step_done_(FileTask& task);
+  HandlerStatus finish_upload_(int error);
+  void end_body_stream_();
+  short body_events_() const;
   void refresh_current_request_();
-  const ServerContext& set_up_target_config_() const;
-  bool do_cgi_(const Request& request,
-               const std::string& script_path,
-               const std::string& cgi_path,
-               const std::string& query_string,
-               const std::string& script_uri,
+  const ServerContext& set_up_target_config_();
+  bool do_cgi_(const Request& request, const ProcessorResult& result,
                const ServerContext& target_config);
+  bool spawn_cgi_(const Request& request, const ProcessorResult& result,
+                  const ServerContext& target_config);
+  bool run_cgi_(const Request& request, const ProcessorResult& result,
+                const ServerContext& target_config);
+  CgiCache::Lookup lookup_cgi_cache_(const Request& request,
+                                     const ProcessorResult& result,
+                                     const ServerContext& target_config);
+  void abandon_cgi_cache_fill_(const LocationContext& lc);
+  bool lookup_disk_cache_(const Request& request, const LocationContext& lc);
+  void refresh_cgi_cache_(const Request& request,
+                          const ProcessorResult& result,
+                          const ServerContext& target_config);
+  bool do_pooled_cgi_(const Request& request, const ProcessorResult& result,
+                      const ServerContext& target_config);
+  bool do_proxy_(const Request& request, const ProcessorResult& result,
+                 const ServerContext& target_config);
+  bool run_native_handler_(const Request& request, ProcessorResult& result,
+                           const ServerContext& target_config);
+  void finish_native_(NativeCall* call, ProcessorResult& result,
+                      const ServerContext& target_config);
+  bool do_fastcgi_(const Request& request, const ProcessorResult& result,
+                   const ServerContext& target_config);
+  void start_file_io_(const ProcessorResult& result);
   void send_prepared_response_();
   void send_error_response_(ParserStatus status);
   void update_deadline_();
-  void start_sending_response_(const std::string& full_response);
+  void start_sending_response_(const std::string& full_response,
+                               BodySource* body_source = NULL,
+                               bool body_chunked = false);
+  bool fill_send_buffer_();
+  HandlerStatus splice_body_();
 
   ClientHandler(const ClientHandler& other);
   ClientHandler& operator=(const ClientHandler& other);
@@ -59,9 +133,26 @@ class ClientHandler : public MonitoredFdHandler {
   ClientHandler(int client_fd, const std::string& addr, const std::string& port,
                 const std::string& client_addr, Server& server, Config& config);
   ~ClientHandler();
+  unsigned long serial() const { return serial_; }
+  // The CGI's stdin drained, read more of the body
+  void resume_body();
+  bool is_receiving_body() const { return body_relay_ != NULL; }
+  // Connected but nothing sent yet; closed first on shutdown
+  bool is_idle() const { return state_ == kReceiving && !request_started_; }
+  // Called by the CgiLimiter once this request got its process slot
+  void start_queued_cgi();
   void cgi_response_ready(const std::string& response);
+  // head carries no body; it is followed by what body produces
+  void cgi_stream_ready(Response& head, BodySource* body, bool has_framing);
   void cgi_local_redirect_ready(const std::string& location);
-  void setup_cgi_(std::string& server_name, std::string& remote_addr) const;
+  // The request this one waited on is done; NULL when it has no response
+  // to share
+  void cgi_cache_fill_done(const std::string* response);
+  // Called by the FileIoPool with the task start_file_io_(), or a step of
+  // an upload, handed it
+  void file_io_done(FileTask& task);
+  // Keeps the connection from timing out before deadline_sec
+  void hold_until(int64_t deadline_sec);
   HandlerStatus handle_input();
   HandlerStatus handle_output();
   HandlerStatus handle_poll_error() { return kHandlerClosed; }
@@ -1,9 +1,14 @@
 #ifndef INCLUDE_CONFIG_HPP_
 #define INCLUDE_CONFIG_HPP_
 
+#include <cstddef>
 #include <map>
-#include <vector>
 #include <string>
+#include <utility>
+#include <vector>
+
+#include "Response.hpp"
+#include "mime_types.hpp"
 
 struct ConfigLimits {
   static const long kPortMin = 0;
@@ -23,6 +28,110 @@ struct CgiConfig {
   std::string binary_path;
 };
 
+// Prespawned interpreters running a looping worker script for one
+// cgi_handler extension, see cgi-bin/cgi_worker.py
+struct CgiPoolConfig {
+  std::string extension;
+  std::string worker_script;
+  std::string interpreter;  // binary of the cgi_handler for extension
+  long min_workers;
+  long max_workers;
+  long idle_timeout_sec;  // Idle workers above min_workers are retired after
+  long max_requests;      // Requests served before a worker is recycled
+
+  CgiPoolConfig()
+      : min_workers(0), max_workers(4), idle_timeout_sec(60),
+        max_requests(1000) {}
+};
+
+// Short-lived copies of CGI responses to GET, see CgiCache
+struct CgiCacheConfig {
+  std::string zone;  // Empty when off; locations naming a zone share it
+  long max_size;     // Bytes kept in the zone, the largest setting wins
+  long ttl_sec;      // Unless the script's Cache-Control or Expires says
+  long stale_sec;    // Served stale this long past the TTL while refreshed
+  std::string key;   // cgi_cache_key template
+  bool lock;         // Misses wait for the one request already running
+  long lock_timeout_sec;  // ...but no longer than this
+
+  CgiCacheConfig()
+      : max_size(16 * 1024 * 1024), ttl_sec(1), stale_sec(0),
+        key("$request_method$host$request_uri"), lock(false),
+        lock_timeout_sec(5) {}
+};
+
+// A top-level `cache_path`: where a disk_cache zone keeps its files
+struct CachePathConfig {
+  std::string name;
+  std::string path;
+  long max_size;      // Bytes of entry files, trimmed in the background
+  long inactive_sec;  // Entries not hit for this long go even if fresh
+  long entries;       // Most entries the index holds
+
+  CachePathConfig()
+      : max_size(1024L * 1024 * 1024), inactive_sec(3600), entries(65536) {}
+};
+
+// Responses of CGI, fastcgi_pass and proxy_pass to GET kept on disk across
+// restarts, see DiskCache
+struct DiskCacheConfig {
+  std::string zone;  // A cache_path name, empty when off
+  long ttl_sec;      // Unless the backend's Cache-Control or Expires says
+  std::string key;   // disk_cache_key template, as for cgi_cache_key
+
+  DiskCacheConfig() : ttl_sec(600), key("$request_method$host$request_uri") {}
+};
+
+struct ExpiresConfig {
+  enum Mode {
+    kExpiresOff,
+    kExpiresMax,
+    kExpiresEpoch,
+    kExpiresDuration,
+  };
+  Mode mode;
+  long seconds;              // kExpiresDuration only, may be negative
+  std::string pattern;       // fnmatch(3) glob on the file name (expires_match)
+  std::string header_block;  // Serialized Expires / Cache-Control lines
+
+  ExpiresConfig() : mode(kExpiresOff), seconds(0) {}
+};
+
+// One `server` line of an upstream block
+struct UpstreamServerConfig {
+  std::string address;  // "host:port" or "unix:/path"
+  long weight;
+  long max_fails;         // Failures within fail_timeout that take it out,
+  long fail_timeout_sec;  // and how long it then stays out; 0 never does
+
+  UpstreamServerConfig() : weight(1), max_fails(1), fail_timeout_sec(10) {}
+};
+
+// `upstream name { ... }`, named by proxy_pass and fastcgi_pass in place of
+// an address, see UpstreamGroups
+struct UpstreamConfig {
+  enum Balance {
+    kRoundRobin,
+    kLeastConn,
+    kHash,
+  };
+  std::string name;
+  std::vector<UpstreamServerConfig> servers;
+  Balance balance;
+  std::string hash_key;     // Template like cgi_cache_key, kHash only
+  bool hash_consistent;     // Ring of points instead of key modulo weights
+  long check_interval_sec;  // 0 without health_check
+  long check_timeout_sec;
+  long check_fails;   // Failed probes in a row that take a server out
+  long check_passes;  // Passed probes in a row that bring it back
+  std::string check_uri;  // GET that must answer 2xx or 3xx; empty when
+                          // connecting is enough
+
+  UpstreamConfig()
+      : balance(kRoundRobin), hash_consistent(false), check_interval_sec(0),
+        check_timeout_sec(2), check_fails(1), check_passes(1) {}
+};
+
 struct LocationContext {
   std::string path;
   std::string root;
@@ -31,10 +140,42 @@ struct LocationContext {
   std::vector<std::string> index;
   bool is_exact_match;
   bool autoindex;
+  bool autoindex_details;  // Size and mtime columns, costs one stat per entry
   int redirect_status_code;
   std::string redirect_url;
   std::string upload_store;
+  long upload_max_parts;      // Parts of a multipart/form-data upload
+  long upload_max_part_size;  // Bytes of one part, 0 for no cap of its own
   std::vector<CgiConfig> cgi_handlers;
+  std::vector<CgiPoolConfig> cgi_pools;
+  // "unix:/path", "host:port" or an upstream name, empty when off
+  std::string fastcgi_pass;
+  std::string proxy_pass;  // "host:port" or an upstream name, empty when off
+  std::string proxy_uri;   // URI of proxy_pass in place of the location path
+  bool has_proxy_uri;      // Even "/" replaces the location path
+  long proxy_connect_timeout_sec;
+  long proxy_read_timeout_sec;  // Longest silence from the upstream
+  long proxy_send_timeout_sec;  // Longest stall writing to the upstream
+  std::string native_handler;   // Shared object answering in-process
+  std::string native_argument;  // Handed to the plugin's init()
+  long cgi_max_concurrent;     // One-shot CGI processes at once, 0 for no cap
+  long cgi_queue_size;         // Requests allowed to wait beyond the cap
+  long cgi_queue_timeout_sec;  // Longest wait before a queued request gets 503
+  long cgi_read_timeout_sec;   // Longest silence on the CGI's stdout
+  long cgi_send_timeout_sec;   // Longest stall writing the CGI's stdin
+  long cgi_total_timeout_sec;  // Whole run of a script, 0 for no cap
+  long cgi_rlimit_as;          // setrlimit() values of one-shot CGI processes,
+  long cgi_rlimit_cpu;         // 0 for the server's own
+  long cgi_rlimit_nofile;
+  CgiCacheConfig cgi_cache;
+  DiskCacheConfig disk_cache;
+  bool stub_status;
+  std::string default_type;
+  ExpiresConfig expires;
+  std::vector<ExpiresConfig> expires_matches;  // First match wins over expires
+  std::vector<std::pair<std::string, std::string> > add_headers;
+  std::string header_block;  // Serialized add_header lines
+  PrebuiltResponse redirect_response;  // Rendered from `return` at load time
 
   LocationContext()
       : path("/"),
@@ -42,7 +183,24 @@ struct LocationContext {
         client_max_body_size(-1),
         is_exact_match(false),
         autoindex(false),
-        redirect_status_code(-1) {}
+        autoindex_details(false),
+        redirect_status_code(-1),
+        upload_max_parts(32),
+        upload_max_part_size(0),
+        has_proxy_uri(false),
+        proxy_connect_timeout_sec(60),
+        proxy_read_timeout_sec(60),
+        proxy_send_timeout_sec(60),
+        cgi_max_concurrent(0),
+        cgi_queue_size(0),
+        cgi_queue_timeout_sec(10),
+        cgi_read_timeout_sec(10),
+        cgi_send_timeout_sec(10),
+        cgi_total_timeout_sec(0),
+        cgi_rlimit_as(0),
+        cgi_rlimit_cpu(0),
+        cgi_rlimit_nofile(0),
+        stub_status(false) {}
 };
 
 struct ListenConfig {
@@ -58,21 +216,71 @@ struct ServerContext {
   std::vector<std::string> server_index;
   std::map<int, std::string> error_pages;
   std::vector<LocationContext> locations;
+  MimeTypeMap mime_types;
+  std::string default_type;
+  // Every error response of this server, rendered at load time
+  std::map<int, PrebuiltResponse> error_responses;
+  // The CGI variables that do not change between requests, rendered at load
+  // time as "NAME=value\0" entries, see MetaVariables
+  std::string cgi_env;
 
-  ServerContext() : client_max_body_size(ConfigLimits::kClientMaxBodyDefault), server_root("./html"){}
+  ServerContext() : client_max_body_size(ConfigLimits::kClientMaxBodyDefault), server_root("./html"), default_type("application/octet-stream"){}
   const LocationContext& get_matching_location(const std::string& uri) const;
+  std::string get_mime_type(const std::string& path,
+                            const LocationContext& lc) const;
 };
 
 class Config {
+  // (port, normalized host) -> index into servers_.
+  // Wildcard names are kept apart so that exact names always win.
+  typedef std::map<std::pair<int, std::string>, std::size_t> VhostMap;
+
   std::vector<ServerContext> servers_;
+  std::vector<UpstreamConfig> upstreams_;
+  std::vector<CachePathConfig> cache_paths_;
+  long file_io_threads_;  // Top-level `file_io_threads`, 0 keeps I/O inline
+  long shutdown_timeout_sec_;  // Top-level `shutdown_timeout`
+  MimeTypeMap types_;  // Top-level `types`, inherited by servers without one
+  std::map<int, std::size_t> default_servers_;
+  VhostMap exact_names_;
+  VhostMap leading_wildcards_;   // "*.example.com" is stored as ".example.com"
+  VhostMap trailing_wildcards_;  // "www.example.*" is stored as "www.example."
   std::string read_file(const std::string& filepath);
   std::vector<std::string> tokenize(const std::string& content);
+  void expand_includes_(std::vector<std::string>& tokens,
+                        const std::string& base_dir, int depth);
   void parse_server(const std::vector<std::string>& tokens, size_t& token_index);
+  void parse_cache_path_(const std::vector<std::string>& tokens,
+                         size_t& token_index);
+  void resolve_upstreams_();
+  void check_disk_caches_() const;
+  void build_vhost_index_();
+  void prebuild_responses_();
+  bool find_wildcard_(int port, const std::string& host,
+                      std::size_t& server_index) const;
 
  public:
+  static const long kDefaultFileIoThreads = 4;
+  static const long kDefaultShutdownTimeoutSec = 30;
+
+  Config()
+      : file_io_threads_(kDefaultFileIoThreads),
+        shutdown_timeout_sec_(kDefaultShutdownTimeoutSec) {}
   void load_file(const std::string& filepath);
   const std::vector<ServerContext>& get_configs() const { return servers_; }
+  const std::vector<UpstreamConfig>& get_upstreams() const {
+    return upstreams_;
+  }
+  const UpstreamConfig* find_upstream(const std::string& name) const;
+  const std::vector<CachePathConfig>& get_cache_paths() const {
+    return cache_paths_;
+  }
+  const CachePathConfig* find_cache_path(const std::string& name) const;
+  long file_io_threads() const { return file_io_threads_; }
+  long shutdown_timeout_sec() const { return shutdown_timeout_sec_; }
   const ServerContext& get_config(int port, const std::string& host) const;
+  std::vector<ListenConfig> get_unique_listens() const;
+  static std::string normalize_host(const std::string& host);
 };
 
 #endif
@@ -0,0 +1,127 @@
+#ifndef INCLUDE_DISKCACHE_HPP_
+#define INCLUDE_DISKCACHE_HPP_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <cstddef>
+#include <map>
+#include <string>
+
+#include "BodySource.hpp"
+#include "Config.hpp"
+#include "MonitoredFdHandler.hpp"
+
+class FileIoPool;
+struct FileTask;
+
+// Responses of CGI, fastcgi_pass and proxy_pass to GET, kept in the
+// directories of cache_path for as long as they are fresh and the zone has
+// room. Each entry is one file holding a fixed header, the key, the
+// response head and the body. Which entries exist, until when and at what
+// size is in a hash table mapped from <dir>/index, so a lookup opens one
+// file and nothing else, and the cache is back as it was after a restart.
+// If the server did not stop cleanly the index is rebuilt from the files.
+//
+// Hits are sent with sendfile(2). An entry is written as its body goes to
+// the first client, and only enters the index once it is complete. The
+// writes, renames and removals of entry files run on the FileIoPool, so a
+// slow disk holds up the cache and not every connection.
+class DiskCache {
+ public:
+  class Writer;
+
+  DiskCache() : pool_(NULL), next_eviction_sec_(0) {}
+  ~DiskCache();
+  // Opens or rebuilds the index of every cache_path. Throws SystemError if a
+  // directory cannot be set up. Without a pool, entry files are written and
+  // removed inline.
+  void configure(const Config& config, FileIoPool* pool = NULL);
+  bool has_zones() const { return !zones_.empty(); }
+  // On a fresh entry, sets head to the response head and body to a source
+  // of the body that the caller owns
+  bool lookup(const DiskCacheConfig& dc, const std::string& key,
+              std::string& head, BodySource*& body);
+  // Keeps a whole serialized response, if the backend allows it
+  void store(const DiskCacheConfig& dc, const std::string& key,
+             const std::string& response);
+  // Returns body itself, or a source that writes it into the cache on the
+  // way when the backend allows it. head is the serialized response head.
+  BodySource* tee(const DiskCacheConfig& dc, const std::string& key,
+                  const std::string& head, BodySource* body);
+  // Drops expired and inactive entries, then the least recently used ones
+  // of zones over max_size
+  void evict(int64_t now);
+  int64_t next_eviction_sec() const { return next_eviction_sec_; }
+  // Appends one line of counters per zone
+  void report(std::string& out) const;
+  // The kCacheWrite steps of FileTask: run on a pool thread, back on the
+  // loop, or dropped by a pool that stops
+  static int run_write(Writer* writer, const std::string& data);
+  void write_done(FileTask& task);
+  static void discard(Writer* writer);
+
+ private:
+  struct IndexHeader;
+  struct IndexSlot;
+  struct Zone {
+    const CachePathConfig* config;
+    int index_fd;
+    void* map;
+    std::size_t map_size;
+    IndexHeader* header;
+    IndexSlot* slots;
+    uint64_t mask;  // Slot count - 1, a power of two
+    unsigned long temp_serial;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long stores;
+    unsigned long evictions;
+  };
+  static const int64_t kEvictionIntervalSec = 10;
+  static const std::size_t kMaxHeadBytes = 64 * 1024;
+  std::map<std::string, Zone> zones_;
+  FileIoPool* pool_;
+  int64_t next_eviction_sec_;
+
+  void open_zone_(Zone& zone);
+  void rebuild_index_(Zone& zone);
+  Zone* find_zone_(const std::string& name);
+  Writer* start_entry_(const DiskCacheConfig& dc, const std::string& key,
+                       const std::string& head, std::size_t& head_end);
+  void commit_(Zone& zone, uint64_t hash, int64_t expires, uint64_t size,
+               const std::string& path);
+  void remove_file_(const std::string& path);
+  static uint64_t hash_key_(const std::string& key);
+  static std::string entry_path_(const Zone& zone, uint64_t hash);
+  static long find_slot_(const Zone& zone, uint64_t hash);
+  static bool insert_slot_(Zone& zone, uint64_t hash, int64_t expires,
+                           int64_t last_used, uint64_t size);
+  static void erase_slot_(Zone& zone, uint64_t slot);
+  void remove_entry_(Zone& zone, uint64_t hash);
+
+  DiskCache(const DiskCache&);
+  DiskCache& operator=(const DiskCache&);
+};
+
+// Runs the eviction of the disk cache zones. Like HealthChecker it has no
+// fd of its own and lives in TimeoutManager only.
+class DiskCacheEvictor : public MonitoredFdHandler {
+ public:
+  explicit DiskCacheEvictor(DiskCache& cache) : cache_(cache) {}
+  HandlerStatus handle_input() { return kHandlerFatalError; }  // Never polled
+  HandlerStatus handle_output() { return kHandlerFatalError; }
+  HandlerStatus handle_poll_error() { return kHandlerFatalError; }
+
+  virtual bool has_deadline() const { return true; }
+  virtual int64_t deadline_sec() const { return cache_.next_eviction_sec(); }
+  virtual HandlerStatus handle_timeout();
+
+ private:
+  DiskCache& cache_;
+
+  DiskCacheEvictor(const DiskCacheEvictor&);
+  DiskCacheEvictor& operator=(const DiskCacheEvictor&);
+};
+
+#endif  // INCLUDE_DISKCACHE_HPP_
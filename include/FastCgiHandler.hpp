@@ -0,0 +1,80 @@
+#ifndef INCLUDE_FASTCGIHANDLER_HPP_
+#define INCLUDE_FASTCGIHANDLER_HPP_
+
+#include <stdint.h>
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "Config.hpp"
+#include "MonitoredFdHandler.hpp"
+#include "Parser.hpp"
+#include "UpstreamGroups.hpp"
+#include "fastcgi_protocol.hpp"
+
+class Server;
+
+// One FastCGI request on a backend socket. The whole request is encoded up
+// front, written while the socket is writable, then STDOUT records are
+// collected until END_REQUEST and handed over like CGI output. Until some
+// of it came back, a failed server is left for the next one of the group.
+class FastCgiHandler : public MonitoredFdHandler {
+ public:
+  // Takes a pooled connection or starts a new one to a server of group and
+  // registers the handler. Returns false if no connection could be started.
+  static bool start(Server& server, const std::string& group,
+                    const std::string& hash_key, const fastcgi::Params& params,
+                    const std::string& body, int client_fd,
+                    const ServerContext& target_config);
+  ~FastCgiHandler();
+
+  HandlerStatus handle_input();
+  HandlerStatus handle_output();
+  HandlerStatus handle_poll_error();
+
+  virtual bool has_deadline() const { return true; }
+  virtual int64_t deadline_sec() const { return deadline_sec_; }
+  virtual HandlerStatus handle_timeout();
+
+ private:
+  static const unsigned short kRequestId = 1;
+  static const int64_t kFastCgiTimeoutSec = 30;
+  static const std::size_t kReadBufSize = 16 * 1024;
+  static const std::size_t kMaxOutputBytes = 8 * 1024 * 1024;
+
+  Server& server_;
+  std::string group_;
+  std::string upstream_;  // Address of peer_
+  UpstreamGroups::Peer* peer_;
+  std::vector<UpstreamGroups::Peer*> tried_;
+  std::string hash_key_;
+  bool peer_failed_;
+  int fd_;
+  bool reused_;
+  bool connected_;
+  std::string request_;
+  std::size_t bytes_written_;
+  std::string in_buf_;
+  std::string stdout_;
+  int client_fd_;
+  unsigned long client_serial_;
+  const ServerContext& target_config_;
+  bool finished_;
+  bool reusable_;  // END_REQUEST seen with nothing trailing it
+  int64_t deadline_sec_;
+
+  FastCgiHandler(Server& server, const std::string& group,
+                 const std::string& request, int client_fd,
+                 const ServerContext& target_config);
+  static bool connect_and_register_(FastCgiHandler* handler, bool allow_reuse);
+  bool consume_records_(bool& ended, bool& failed);
+  HandlerStatus retry_or_fail_();
+  HandlerStatus fail_(ParserStatus status);
+  void update_deadline_();
+
+  FastCgiHandler(const FastCgiHandler&);
+  FastCgiHandler& operator=(const FastCgiHandler&);
+};
+
+#endif  // INCLUDE_FASTCGIHANDLER_HPP_
@@ -0,0 +1,116 @@
+#ifndef INCLUDE_FILEIOPOOL_HPP_
+#define INCLUDE_FILEIOPOOL_HPP_
+
+#include <pthread.h>
+
+#include <cstddef>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "DiskCache.hpp"
+#include "MonitoredFdHandler.hpp"
+
+class BodySink;
+class Server;
+class NativeCall;
+
+// One blocking call made off the event loop: a filesystem call for a
+// client or the disk cache, or a native_handler plugin that declared it
+// may block
+struct FileTask {
+  enum Op {
+    kReadFile,    // The whole file into data
+    kWriteFile,   // data into a new or truncated file
+    kRemove,
+    kNativeCall,  // The plugin's handle()
+    kNativeRead,  // The next piece of a streamed plugin body into data
+    kCacheWrite,  // The next step of a disk cache entry, with data
+    // A streamed upload, one step at a time
+    kUploadOpen,   // The temp file of path, with length bytes reserved
+    kUploadWrite,  // data into upload_sink
+    kUploadFlush,  // What upload_sink took in with splice_in()
+    kUploadCommit,
+    kUploadDrop,   // Removes what an unfinished upload left
+  };
+  Op op;
+  std::string path;
+  std::string data;
+  int error;  // errno of the failed call, 0 on success
+  int client_fd;  // -1 when nobody waits for the result
+  unsigned long client_serial;
+  NativeCall* native_call;          // Deleted with the task unless taken
+  DiskCache::Writer* cache_writer;  // Of a kCacheWrite
+  BodySink* upload_sink;            // Deleted with the task unless taken
+  std::size_t length;               // Bytes to reserve for kUploadOpen
+  FileTask* next;                   // Link in the completion queue
+
+  FileTask(Op task_op, const std::string& task_path, int fd,
+           unsigned long serial)
+      : op(task_op),
+        path(task_path),
+        error(0),
+        client_fd(fd),
+        client_serial(serial),
+        native_call(NULL),
+        cache_writer(NULL),
+        upload_sink(NULL),
+        length(0),
+        next(NULL) {}
+  ~FileTask();
+  void run();
+
+ private:
+  FileTask(const FileTask&);
+  FileTask& operator=(const FileTask&);
+};
+
+// A fixed set of threads for the open, read, write and unlink calls that
+// poll() cannot wait on, and for blocking native_handler plugins. The loop
+// hands a task over and goes on with other clients; the worker pushes it
+// onto a lock-free list when done and wakes the loop through an eventfd (a
+// pipe where there is none), which then gives the task back to its client.
+// Workers only ever touch the task and what it carries, which the loop
+// leaves alone meanwhile, so nothing else needs a lock.
+//
+// With file_io_threads 0, or when too many tasks are queued, submit()
+// refuses and the caller runs the task itself.
+class FileIoPool : public MonitoredFdHandler {
+ public:
+  explicit FileIoPool(Server& server);
+  ~FileIoPool();
+  // Starts the threads. Throws SystemError if the wakeup fd or a thread
+  // cannot be created.
+  void start(long num_threads);
+  int fd() const { return read_fd_; }
+  // Takes ownership of task unless it returns false
+  bool submit(FileTask* task);
+  // Deletes an upload no client waits for, which may unlink its file
+  void drop_upload(BodySink* sink);
+
+  HandlerStatus handle_input();
+  HandlerStatus handle_output() { return kHandlerContinue; }
+  HandlerStatus handle_poll_error() { return kHandlerFatalError; }
+
+ private:
+  static const std::size_t kMaxQueued = 1024;
+  Server& server_;
+  int read_fd_;
+  int write_fd_;  // The same as read_fd_ for an eventfd
+  std::vector<pthread_t> threads_;
+  pthread_mutex_t mutex_;
+  pthread_cond_t cond_;
+  std::deque<FileTask*> queue_;  // Guarded by mutex_
+  bool stopping_;                // Guarded by mutex_
+  FileTask* volatile done_;      // Pushed by workers, taken whole by the loop
+
+  static void* worker_main_(void* arg);
+  void finish_(FileTask* task);
+  FileTask* take_done_();
+  void drain_wakeups_();
+
+  FileIoPool(const FileIoPool&);
+  FileIoPool& operator=(const FileIoPool&);
+};
+
+#endif  // INCLUDE_FILEIOPOOL_HPP_
@@ -0,0 +1,70 @@
+#ifndef INCLUDE_HEALTHCHECKER_HPP_
+#define INCLUDE_HEALTHCHECKER_HPP_
+
+#include <stdint.h>
+
+#include <cstddef>
+#include <string>
+
+#include "MonitoredFdHandler.hpp"
+#include "UpstreamGroups.hpp"
+
+class Server;
+
+// Starts the health checks of the upstream blocks as they fall due. It has
+// no fd of its own: Server keeps it in TimeoutManager only, with the next
+// check as its deadline.
+class HealthChecker : public MonitoredFdHandler {
+ public:
+  HealthChecker(Server& server, UpstreamGroups& groups)
+      : server_(server), groups_(groups) {}
+  HandlerStatus handle_input() { return kHandlerFatalError; }  // Never polled
+  HandlerStatus handle_output() { return kHandlerFatalError; }
+  HandlerStatus handle_poll_error() { return kHandlerFatalError; }
+
+  virtual bool has_deadline() const { return true; }
+  virtual int64_t deadline_sec() const { return groups_.next_check_sec(); }
+  virtual HandlerStatus handle_timeout();
+
+ private:
+  Server& server_;
+  UpstreamGroups& groups_;
+
+  HealthChecker(const HealthChecker&);
+  HealthChecker& operator=(const HealthChecker&);
+};
+
+// One check of one server: it passes once connected or, with a uri, once a
+// GET is answered 2xx or 3xx, all within the check timeout
+class HealthProbe : public MonitoredFdHandler {
+ public:
+  static void start(Server& server, UpstreamGroups::Peer* peer);
+  ~HealthProbe();
+
+  HandlerStatus handle_input();
+  HandlerStatus handle_output();
+  HandlerStatus handle_poll_error();
+
+  virtual bool has_deadline() const { return true; }
+  virtual int64_t deadline_sec() const { return deadline_sec_; }
+  virtual HandlerStatus handle_timeout();
+
+ private:
+  static const std::size_t kMaxStatusLine = 1024;
+
+  Server& server_;
+  UpstreamGroups::Peer* peer_;
+  int fd_;
+  std::string out_buf_;
+  std::size_t bytes_written_;
+  std::string in_buf_;
+  int64_t deadline_sec_;
+
+  HealthProbe(Server& server, UpstreamGroups::Peer* peer, int fd);
+  HandlerStatus finish_(bool passed);
+
+  HealthProbe(const HealthProbe&);
+  HealthProbe& operator=(const HealthProbe&);
+};
+
+#endif  // INCLUDE_HEALTHCHECKER_HPP_
@@ -1,12 +1,34 @@
 #ifndef INCLUDE_METAVARIABLES_HPP_
 #define INCLUDE_METAVARIABLES_HPP_
 
-#include <map>
+#include <cstddef>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "Parser.hpp"
 
+// The environment of one script as a single "NAME=value\0..." block, with
+// envp pointing into it. Two allocations in all, freed together.
+class EnvBlock {
+ public:
+  EnvBlock() {}
+
+  void reserve(std::size_t bytes, std::size_t entries);
+  // Entries already rendered as "NAME=value\0"
+  void append_rendered(const std::string& entries);
+  void append(const std::string& key, const std::string& value);
+  // NULL-terminated; valid until the next append
+  char** envp();
+
+ private:
+  std::vector<char> bytes_;
+  std::vector<char*> envp_;
+
+  EnvBlock(const EnvBlock&);
+  EnvBlock& operator=(const EnvBlock&);
+};
+
 class MetaVariables {
  public:
   MetaVariables();
@@ -15,23 +37,29 @@ class MetaVariables {
   MetaVariables(const MetaVariables& other);
   MetaVariables& operator=(const MetaVariables& other);
 
+  // constants is what render_constants() made for the server at load time.
+  // It is not copied and must outlive the MetaVariables.
   static MetaVariables from_request(const Request& request,
                                     const std::string& script_uri,
                                     const std::string& query_string,
-                                    const std::string& server_name,
+                                    const std::string& constants,
                                     const std::string& server_port,
                                     const std::string& remote_addr);
+  // The variables that are the same for every request to a server
+  static std::string render_constants(const std::string& server_name);
 
-  char** build_envp() const;
-  static void destroy_envp(char** envp);
+  void set(const std::string& key, const std::string& value);
+  // Same variables as render(), as name/value pairs for FCGI_PARAMS
+  std::vector<std::pair<std::string, std::string> > to_pairs() const;
+  void render(EnvBlock& block) const;
 
  private:
-  std::map<std::string, std::string> meta_variables_;
-  std::map<std::string, std::string> http_headers_;
+  typedef std::vector<std::pair<std::string, std::string> > VariableList;
 
-  void add_to_list(std::vector<std::string>& list, const std::string& key,
-                   const std::string& value) const;
+  const std::string* constants_;
+  VariableList variables_;
 
+  static bool is_passed_(const std::pair<std::string, std::string>& variable);
   void set_content_meta_(const Request& request);
   void set_http_headers_(const Request& request);
 };
@@ -0,0 +1,61 @@
+#ifndef INCLUDE_MULTIPARTPARSER_HPP_
+#define INCLUDE_MULTIPARTPARSER_HPP_
+
+#include <cstddef>
+#include <map>
+#include <string>
+
+// Splits a multipart/form-data body into its parts as the body arrives, in
+// pieces of any size. A delimiter cut in two by a read is found all the
+// same: the last bytes of a piece that could start one are held back until
+// the next piece tells. Only those and an unfinished part header are
+// buffered, so memory does not grow with the body.
+class MultipartParser {
+ public:
+  // Gets the parts in order. A false return stops the parser.
+  class Listener {
+   public:
+    virtual ~Listener() {}
+    // names of headers are lowercased
+    virtual bool begin_part(
+        const std::map<std::string, std::string>& headers) = 0;
+    virtual bool part_data(const char* data, std::size_t len) = 0;
+    virtual bool end_part() = 0;
+  };
+  enum Status {
+    kMore,
+    kDone,     // The closing delimiter was seen; anything after it is ignored
+    kInvalid,  // Not multipart, or a part header too long or malformed
+    kStopped,  // The listener said no
+  };
+
+  MultipartParser(const std::string& boundary, Listener& listener);
+  Status feed(const char* data, std::size_t len);
+  Status status() const { return status_; }
+
+  // The boundary parameter of a multipart/form-data Content-Type, or ""
+  static std::string boundary_of(const std::string& content_type);
+  // The name and filename parameters of a Content-Disposition. filename is
+  // empty for a field that is not a file.
+  static void parse_disposition(const std::string& value, std::string& name,
+                                std::string& filename);
+
+ private:
+  enum State {
+    kPreamble,
+    kAfterDelimiter,  // "--" ends the body, "\r\n" starts a part
+    kHeaders,
+    kBody,
+  };
+  static const std::size_t kMaxHeaderBytes = 8 * 1024;
+  std::string delimiter_;  // "\r\n--" boundary
+  Listener& listener_;
+  State state_;
+  Status status_;
+  std::string buffer_;
+
+  bool parse_headers_(std::size_t end);
+  std::size_t step_();
+};
+
+#endif  // INCLUDE_MULTIPARTPARSER_HPP_
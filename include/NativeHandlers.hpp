@@ -0,0 +1,70 @@
+#ifndef INCLUDE_NATIVEHANDLERS_HPP_
+#define INCLUDE_NATIVEHANDLERS_HPP_
+
+#include <map>
+#include <string>
+
+#include "BodySource.hpp"
+#include "Config.hpp"
+#include "Parser.hpp"
+#include "Response.hpp"
+#include "webserv_native.h"
+
+class Server;
+struct FileTask;
+// One request to a plugin, with its own copy of what the plugin is shown
+// so that it can run on any thread. Defined in NativeHandlers.cpp.
+class NativeCall;
+
+// The plugins of native_handler locations, see webserv_native.h. Each
+// shared object is loaded once however many locations name it, and stays
+// loaded until the server exits.
+//
+// A request goes prepare(), execute(), finish(). execute() is the plugin's
+// handle(), which for a WEBSERV_NATIVE_BLOCKING plugin ClientHandler hands
+// to the FileIoPool; so are the reads of a streamed body, through
+// read_piece() and read_done().
+class NativeHandlers {
+ public:
+  explicit NativeHandlers(Server& server) : server_(server) {}
+  ~NativeHandlers();
+  // Loads the plugin of every location with native_handler. Throws when
+  // one cannot be loaded or its init() fails.
+  void configure(const Config& config);
+  // NULL when lc has no plugin
+  NativeCall* prepare(const LocationContext& lc, const Request& request,
+                      const std::string& remote_addr);
+  static bool is_blocking(const NativeCall* call);
+  static void execute(NativeCall* call);
+  // Takes the executed call and fills response from it. A streamed body
+  // comes back as body, to be sent to client_fd; NULL otherwise. Returns
+  // kOk, or the error status to answer with instead.
+  ParserStatus finish(const LocationContext& lc, NativeCall* call,
+                      int client_fd, Response& response, BodySource*& body);
+  static void discard(NativeCall* call);
+  // The next piece of a streamed body into data, empty at the end. Returns
+  // 0 or an errno.
+  static int read_piece(NativeCall* call, std::string& data);
+  // Back on the loop with the piece of a kNativeRead task
+  static void read_done(FileTask& task);
+  // Appends one line of counters per location
+  void report(std::string& out) const;
+
+ private:
+  struct Instance {
+    const webserv_native_plugin* plugin;
+    void* state;
+    std::string label;
+    unsigned long calls;
+    unsigned long errors;
+  };
+  Server& server_;
+  std::map<std::string, void*> libraries_;  // dlopen() handles by path
+  std::map<const LocationContext*, Instance> instances_;
+
+  NativeHandlers(const NativeHandlers&);
+  NativeHandlers& operator=(const NativeHandlers&);
+  const webserv_native_plugin* load_(const std::string& path);
+};
+
+#endif  // INCLUDE_NATIVEHANDLERS_HPP_
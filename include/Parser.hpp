@@ -22,11 +22,13 @@ enum ParserStatus {
   kInternalServerError = 500,
   kNotImplemented = 501,
   kBadGateway = 502,
+  kServiceUnavailable = 503,
   kGatewayTimeout = 504,
   kVersionNotSupported = 505,
   // Custom status used in Parser class
   kParseContinue,
   kParseFinished,
+  kParseHeadersComplete,  // Only when pause_after_headers() was requested
   kKeepParsingChunked,  // Just for parse_chunked_size_section()
 };
 
@@ -90,6 +92,9 @@ class Parser {
   ParserState state_;
   Request request_;
   ChunkedData chunked_data_;
+  bool pause_after_headers_;
+  std::size_t max_body_size_;
+  std::size_t body_bytes_received_;  // Including what take_body() handed out
 
   // Helpers
   ParserStatus parse_method_name(const std::string& method);
@@ -108,9 +113,24 @@ class Parser {
   Parser& operator=(const Parser& ohter);
 
  public:
-  Parser() : state_(kParsingRequestLine) {}
+  Parser()
+      : state_(kParsingRequestLine),
+        pause_after_headers_(false),
+        max_body_size_(kMaxBodySize),
+        body_bytes_received_(0) {}
   ParserStatus parse_request(const char* message, ssize_t num_read);
   const Request& get_request() const { return request_; }
+  // Stops once with kParseHeadersComplete before the body, so the caller
+  // can decide where the body goes before any of it is parsed
+  void pause_after_headers() { pause_after_headers_ = true; }
+  void set_max_body_size(std::size_t size) { max_body_size_ = size; }
+  // Moves the body decoded so far to the end of out
+  void take_body(std::string& out);
+  // Content-Length bytes still to come with nothing buffered, i.e. what the
+  // caller may move past the parser; 0 for a chunked body
+  std::size_t unparsed_body_length() const;
+  // Accounts for len body bytes that were moved past the parser
+  ParserStatus skip_body(std::size_t len);
 };
 
 #endif  // INCLUDE_PARSER_HPP_
@@ -0,0 +1,128 @@
+#ifndef INCLUDE_PROXYHANDLER_HPP_
+#define INCLUDE_PROXYHANDLER_HPP_
+
+#include <stdint.h>
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "CgiInputRelay.hpp"
+#include "CgiOutputRelay.hpp"
+#include "Config.hpp"
+#include "MonitoredFdHandler.hpp"
+#include "Parser.hpp"
+#include "UpstreamGroups.hpp"
+
+class Server;
+
+// One request forwarded to a proxy_pass upstream over HTTP/1.1. A body that
+// is still arriving is passed on through a CgiInputRelay as it comes, and
+// the response body goes back through a CgiOutputRelay, so a slow side
+// holds up the other instead of piling up in memory. Connections whose
+// response ended cleanly go back to the server's proxy pool. Until the
+// response starts, a failed server is left for the next one of the group.
+class ProxyHandler : public MonitoredFdHandler,
+                     public RelayConsumer,
+                     public RelayProducer {
+ public:
+  // Takes a pooled connection or starts a new one and registers the handler.
+  // body_relay is NULL when request.body already holds the whole body.
+  // Returns false if no connection could be started.
+  static bool start(Server& server, const Request& request,
+                    const LocationContext& lc, const std::string& client_addr,
+                    CgiInputRelay* body_relay, int client_fd,
+                    const ServerContext& target_config);
+  ~ProxyHandler();
+
+  HandlerStatus handle_input();
+  HandlerStatus handle_output();
+  HandlerStatus handle_poll_error();
+
+  virtual bool has_deadline() const { return true; }
+  virtual int64_t deadline_sec() const { return deadline_sec_; }
+  virtual HandlerStatus handle_timeout();
+
+  void resume_input();
+  void resume_output();
+
+ private:
+  enum ResponseState {
+    kReadingHead,
+    kReadingBody,
+    kResponseDone,
+  };
+  enum Framing {
+    kContentLength,
+    kChunked,
+    kUntilClose,
+  };
+  enum ChunkState {
+    kChunkSize,
+    kChunkData,
+    kChunkDataEnd,
+    kChunkTrailers,
+  };
+  static const std::size_t kReadBufSize = 16 * 1024;
+  static const std::size_t kMaxHeadBytes = 32 * 1024;
+
+  Server& server_;
+  const LocationContext& lc_;
+  const ServerContext& target_config_;
+  std::string upstream_;  // Address of peer_
+  UpstreamGroups::Peer* peer_;
+  std::vector<UpstreamGroups::Peer*> tried_;
+  std::string hash_key_;
+  bool peer_failed_;
+  int fd_;
+  bool reused_;
+  bool connected_;
+  // The request, kept whole for a retry unless the body is streamed
+  std::string out_buf_;
+  std::size_t bytes_written_;
+  CgiInputRelay* body_relay_;
+  bool body_taken_;  // Some of the streamed body left the relay
+  bool chunked_body_;
+  bool body_complete_;
+  bool request_sent_;
+  std::string in_buf_;
+  ResponseState response_state_;
+  Framing framing_;
+  ChunkState chunk_state_;
+  std::size_t body_remaining_;  // Of the body, or of the current chunk
+  bool upstream_keeps_alive_;
+  CgiOutputRelay* relay_;
+  bool paused_;
+  int client_fd_;
+  unsigned long client_serial_;
+  bool finished_;
+  bool reusable_;
+  int64_t deadline_sec_;
+
+  ProxyHandler(Server& server, const LocationContext& lc,
+               const std::string& request, CgiInputRelay* body_relay,
+               bool chunked_body, int client_fd,
+               const ServerContext& target_config);
+  static bool connect_and_register_(ProxyHandler* handler, bool allow_reuse);
+  static std::string build_request_head_(const Request& request,
+                                         const LocationContext& lc,
+                                         const std::string& client_addr,
+                                         CgiInputRelay* body_relay,
+                                         bool& chunked_body);
+  void fill_output_();
+  bool has_output_() const;
+  int parse_head_();
+  bool decode_body_();
+  bool decode_chunks_();
+  HandlerStatus upstream_closed_();
+  HandlerStatus complete_();
+  HandlerStatus retry_or_fail_(ParserStatus status);
+  HandlerStatus fail_(ParserStatus status);
+  void update_events_();
+  void update_deadline_();
+
+  ProxyHandler(const ProxyHandler&);
+  ProxyHandler& operator=(const ProxyHandler&);
+};
+
+#endif  // INCLUDE_PROXYHANDLER_HPP_
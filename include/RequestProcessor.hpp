@@ -1,6 +1,8 @@
 #ifndef INCLUDE_REQUESTPROCESSOR_HPP_
 #define INCLUDE_REQUESTPROCESSOR_HPP_
 
+#include "BodySource.hpp"
+#include "FileIoPool.hpp"
 #include "Parser.hpp"
 #include "Response.hpp"
 #include "Config.hpp"
@@ -12,14 +14,40 @@ struct ProcessorResult {
   enum Action {
     kSendResponse,
     kExecuteCgi,
+    kExecuteFastCgi,
+    kExecuteNative,  // A native_handler plugin answers, see NativeHandlers
+    kExecuteProxy,   // Forwarded to the location's proxy_pass
+    kReceiveBody,  // Nothing to start before the whole body is in
+    kSendStatus,   // stub_status; the server fills in the body
+    kFileIo,       // file_op on file_path first, see complete_file_io()
+    kStreamUpload,  // The body goes into file_path as it arrives
   };
   Action next_action;
   Response response;  // Needed if normal operation or error
+  // Streamed body following response, owned by whoever sends the response
+  BodySource* body_source;
   // Something CGI needs
   std::string script_path; // CGIスクリプトのパスを保持
   std::string script_uri;
   std::string query_string;
   std::string cgi_path;
+  std::string upstream;  // fastcgi_pass of the location
+  const CgiPoolConfig* cgi_pool;  // Warm workers for this script, if any
+  const LocationContext* location;  // Holds the CGI concurrency limits
+  std::size_t body_limit;  // client_max_body_size for a streamed body
+  // Blocking call left to the FileIoPool; a write takes the request body
+  FileTask::Op file_op;
+  std::string file_path;
+  // Of a multipart/form-data upload, whose file_path is then the directory
+  std::string multipart_boundary;
+
+  ProcessorResult()
+      : next_action(kSendResponse),
+        body_source(NULL),
+        cgi_pool(NULL),
+        location(NULL),
+        body_limit(0),
+        file_op(FileTask::kReadFile) {}
 };
 
 class RequestProcessor {
@@ -28,26 +56,46 @@ class RequestProcessor {
   static ProcessorResult handle_redirect(const LocationContext& lc);
   static ProcessorResult handle_cgi(const std::string& path_only, const std::string& query_string, const std::string& cgi_path,
                                      const LocationContext& lc, const ServerContext& target_config);
+  static ProcessorResult handle_fastcgi(const std::string& script_uri,
+                                        const std::string& query_string,
+                                        const LocationContext& lc);
   static std::string find_index_file(const std::string& directory_path, const LocationContext& lc);
   static ProcessorResult create_autoindex_response(const std::string& path,
-                                                            const std::string& target);
+                                                   const Request& request,
+                                                   const LocationContext& lc,
+                                                   const ServerContext& target_config);
   static ProcessorResult handle_directory(const std::string& path, const Request& request,
                                  const LocationContext& lc, const ServerContext& target_config);
-  static ProcessorResult handle_file(const std::string& path, const ServerContext& target_config);
+  static ProcessorResult handle_file(const std::string& path, const LocationContext& lc,
+                                     const ServerContext& target_config);
   static ProcessorResult handle_upload(const Request& request, const std::string& path_only,
                                         const LocationContext& lc, const ServerContext& target_config);
-  static ProcessorResult handle_delete(std::string& path, const ServerContext& target_config);
+  static ProcessorResult handle_delete(const std::string& path);
   static ProcessorResult handle_static_file(const Request& request,
                                             const std::string& path,
                                             const LocationContext& lc,
                                             const ServerContext& target_config);
   static bool is_method_allowed(HttpMethod method, const LocationContext& lc);
+  static long client_max_body_size(const LocationContext& lc,
+                                   const ServerContext& target_config);
   static int status_to_int(ParserStatus status);
   static ParserStatus errno_to_status(int err_num);
 public:
   static ProcessorResult process(
       ParserStatus status, const Request& request, const ServerContext& target_config);
-  static std::string get_error_page_path(const ServerContext& target_config, ParserStatus status);
+  // Called at the end of the headers of a request with a body. Only a
+  // one-shot CGI is started this early, everything else waits for process().
+  static ProcessorResult process_headers(const Request& request,
+                                         const ServerContext& target_config);
+  // Turns a kFileIo or kStreamUpload result into the response once its
+  // call is done. error is the errno of a failed call; data is the file read.
+  static void complete_file_io(ProcessorResult& result, int error,
+                               std::string& data,
+                               const ServerContext& target_config);
+  static Response make_error_response(const ServerContext& target_config, ParserStatus status);
+  // 503 for load shedding; never prebuilt because of Retry-After
+  static Response make_unavailable_response(const ServerContext& target_config,
+                                            long retry_after_sec);
 };
 
 #endif  // INCLUDE_REQUESTPROCESSOR_HPP_
@@ -1,19 +1,28 @@
 #ifndef INCLUDE_RESPONSE_HPP_
 #define INCLUDE_RESPONSE_HPP_
 
+#include <cstddef>
 #include <map>
 #include <string>
 
 #include "Parser.hpp"
 
+class PrebuiltResponse;
+
 class Response {
   static const HttpVersion version_ = kHttp11;
   std::string status_code_;
   std::string reason_phrase_;
   std::map<std::string, std::string> headers_;
   std::string body_;
+  std::string raw_headers_;  // Pre-serialized "Name: value\r\n" lines
+  const PrebuiltResponse* prebuilt_;  // Owned by Config, serialized as is
+
+  void expand_prebuilt_();
 
  public:
+  Response() : prebuilt_(NULL) {}
+  void use_prebuilt(const PrebuiltResponse& prebuilt) { prebuilt_ = &prebuilt; }
   void generate_default_error_html();
   void prepare_error_response(ParserStatus status, const std::string& path);
   void prepare_success_response(ParserStatus status);
@@ -24,10 +33,26 @@ class Response {
   void set_body_and_content_length(const std::string& body);
   void ensure_content_length();
   void add_header(const std::string& key, const std::string& value);
+  void add_raw_headers(const std::string& header_block);
+  bool is_chunked() const;
   std::string get_reason_phrase(int code);
   bool fill_from_file(const std::string& path);
-  std::string get_mime_type(const std::string& path);
   std::string serialize() const;
 };
 
+// A response fully determined by the configuration (redirects, error pages).
+// It is serialized once at config load; only the Date header is patched
+// when it is sent.
+class PrebuiltResponse {
+  std::string bytes_;
+  std::size_t date_offset_;
+
+ public:
+  PrebuiltResponse() : date_offset_(std::string::npos) {}
+  explicit PrebuiltResponse(const Response& response);
+  bool empty() const { return bytes_.empty(); }
+  std::size_t size() const { return bytes_.size(); }
+  std::string render() const;
+};
+
 #endif  // INCLUDE_RESPONSE_HPP_
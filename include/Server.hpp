@@ -8,11 +8,20 @@
 #include <string>
 #include <vector>
 
+#include "CgiCache.hpp"
+#include "CgiLimiter.hpp"
+#include "CgiWorkerPool.hpp"
+#include "ChildReaper.hpp"
 #include "Config.hpp"
+#include "DiskCache.hpp"
+#include "FileIoPool.hpp"
 #include "ListenSocket.hpp"
 #include "MonitoredFdHandler.hpp"
+#include "NativeHandlers.hpp"
 
 #include "TimeoutManager.hpp"
+#include "UpstreamGroups.hpp"
+#include "UpstreamPool.hpp"
 
 class ClientHandler;
 
@@ -22,10 +31,29 @@ class Server {
   std::vector<ListenSocket*> listen_sockets_;
   std::vector<struct pollfd> poll_fds_;
   std::map<int, MonitoredFdHandler*> monitored_fd_to_handler_;
+  int next_timer_key_;  // Timers are keyed below every fd
   Config config_;
   TimeoutManager timeout_manager_;
+  ChildReaper child_reaper_;  // Outlives the pools, which hand it their workers
+  UpstreamPool fastcgi_pool_;
+  UpstreamPool proxy_pool_;
+  UpstreamGroups upstream_groups_;
+  CgiWorkerPool cgi_worker_pool_;
+  CgiLimiter cgi_limiter_;
+  CgiCache cgi_cache_;
+  DiskCache disk_cache_;
+  // Before the pool, which may still be running plugin code as it stops
+  NativeHandlers native_handlers_;
+  FileIoPool file_io_pool_;
+  static const int kPoolMaintenanceMs = 1000;
+  // After SIGTERM: no more connections, and the open ones get until
+  // drain_deadline_sec_ to finish
+  bool draining_;
+  int64_t drain_deadline_sec_;
+  static const int kDrainPollMs = 1000;
 
   bool handle_timeouts_();
+  void start_draining_();
   
   // 指定したFDのインデックスを返す。見つからなければ -1
   int find_pollfd_index_(int fd) const;
@@ -44,10 +72,29 @@ class Server {
   void remove_fd(int pollfd_index);
 
   void register_fd(int fd, MonitoredFdHandler* handler, short events);
+  void register_timer(MonitoredFdHandler* handler);
   void set_fd_events(int fd, short events);
+  void add_fd_events(int fd, short events);
+  void remove_fd_events(int fd, short events);
   void update_timeout(int fd);
 
   ClientHandler* find_client_handler(int client_fd);
+  // NULL if client_fd was closed and now belongs to another connection
+  ClientHandler* find_client_handler(int client_fd, unsigned long serial);
+  unsigned long client_serial(int client_fd);
+  UpstreamPool& fastcgi_pool() { return fastcgi_pool_; }
+  UpstreamPool& proxy_pool() { return proxy_pool_; }
+  UpstreamGroups& upstreams() { return upstream_groups_; }
+  CgiWorkerPool& cgi_worker_pool() { return cgi_worker_pool_; }
+  ChildReaper& child_reaper() { return child_reaper_; }
+  CgiLimiter& cgi_limiter() { return cgi_limiter_; }
+  CgiCache& cgi_cache() { return cgi_cache_; }
+  DiskCache& disk_cache() { return disk_cache_; }
+  FileIoPool& file_io_pool() { return file_io_pool_; }
+  NativeHandlers& native_handlers() { return native_handlers_; }
+  // Body of a stub_status response
+  std::string status_report() const;
+  bool is_registered(int fd) const;
 };
 
 #endif  // INCLUDE_SERVER_HPP_
@@ -0,0 +1,88 @@
+#ifndef INCLUDE_UPLOADSINK_HPP_
+#define INCLUDE_UPLOADSINK_HPP_
+
+#include <sys/types.h>
+
+#include <cstddef>
+#include <map>
+#include <string>
+
+#include "BodySink.hpp"
+#include "MultipartParser.hpp"
+
+// Where an uploaded body is written as it arrives. The bytes go to a
+// hidden temp file beside the destination, which is renamed over it once
+// the body is complete, so a reader sees the old file or the whole new one
+// and never a partial upload. An upload that does not get that far leaves
+// nothing behind.
+//
+// A Content-Length body moves from the socket through a pipe into the file
+// with splice(2), without being copied into the process. Filling the pipe
+// never blocks; emptying it into the file may.
+class UploadSink : public BodySink {
+ public:
+  // Creates the temp file, with expected_length bytes reserved when it is
+  // known. NULL with errno set on failure.
+  static UploadSink* create(const std::string& path,
+                            std::size_t expected_length);
+  ~UploadSink();
+  bool write(const char* data, std::size_t len);
+  bool can_splice() const;
+  ssize_t splice_in(int sock_fd, std::size_t len);
+  bool flush_spliced();
+  // Puts the file in place of the destination
+  bool commit();
+
+ private:
+  std::string path_;
+  std::string temp_path_;
+  int file_fd_;
+  int pipe_fds_[2];  // Made on the first splice
+  std::size_t in_pipe_;
+  off_t size_;
+  std::size_t reserved_;
+  bool committed_;
+  static unsigned long next_serial_;
+
+  UploadSink(const std::string& path, const std::string& temp_path,
+             int file_fd, std::size_t reserved);
+  bool open_pipe_();
+
+  UploadSink(const UploadSink&);
+  UploadSink& operator=(const UploadSink&);
+};
+
+// A multipart/form-data upload, as browsers send forms. Each part with a
+// filename goes through an UploadSink into the directory under that name,
+// and other fields are dropped. An error leaves the files of the parts
+// already complete; the one under way is removed. The parser's errors come
+// back as EBADMSG and the caps on parts as EFBIG.
+class MultipartUpload : public BodySink, private MultipartParser::Listener {
+ public:
+  // max_part_size 0 leaves parts to client_max_body_size
+  MultipartUpload(const std::string& directory, const std::string& boundary,
+                  std::size_t max_parts, std::size_t max_part_size);
+  ~MultipartUpload();
+  bool write(const char* data, std::size_t len);
+  // Fails unless the closing delimiter was seen
+  bool commit();
+
+ private:
+  std::string directory_;  // Ends with '/'
+  MultipartParser parser_;
+  std::size_t max_parts_;
+  std::size_t max_part_size_;
+  std::size_t parts_;
+  std::size_t part_size_;
+  UploadSink* file_;  // NULL for a field that is not a file
+  int error_;
+
+  bool begin_part(const std::map<std::string, std::string>& headers);
+  bool part_data(const char* data, std::size_t len);
+  bool end_part();
+
+  MultipartUpload(const MultipartUpload&);
+  MultipartUpload& operator=(const MultipartUpload&);
+};
+
+#endif  // INCLUDE_UPLOADSINK_HPP_
@@ -0,0 +1,82 @@
+#ifndef INCLUDE_UPSTREAMGROUPS_HPP_
+#define INCLUDE_UPSTREAMGROUPS_HPP_
+
+#include <stdint.h>
+
+#include <cstddef>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "Config.hpp"
+#include "Parser.hpp"
+
+// The backends proxy_pass and fastcgi_pass spread requests over. Each
+// `upstream` block is a group, and so is every bare address, as a group of
+// one. A server is skipped while it is out after max_fails failures within
+// fail_timeout, or after failing its health checks; a lone server is only
+// ever taken out by health checks.
+class UpstreamGroups {
+ public:
+  struct Peer {
+    const UpstreamServerConfig* config;
+    const UpstreamConfig* group;  // NULL for a bare address
+    std::string address;          // "host:port" or "unix:/path"
+    long current_weight;          // Smooth weighted round-robin state
+    unsigned long active;         // Requests in flight
+    long fails;                   // Within fail_timeout of failed_at
+    int64_t failed_at;
+    bool healthy;  // As the health checks last concluded
+    long streak;   // Probes in a row disagreeing with healthy
+    bool probing;
+    unsigned long requests;
+    unsigned long total_fails;
+  };
+
+  UpstreamGroups() {}
+  void configure(const Config& config);
+  // Empty unless the group balances by hash
+  std::string hash_key(const std::string& group, const Request& request) const;
+  // Picks a server of group that is not out and not in tried, or NULL when
+  // none is left. Every pick is handed back through release().
+  Peer* select(const std::string& group, const std::string& hash_key,
+               const std::vector<Peer*>& tried);
+  // failed counts the attempt against max_fails
+  void release(Peer* peer, bool failed);
+
+  bool has_health_checks() const;
+  int64_t next_check_sec() const;
+  // The servers whose health check is due; they count as probing until
+  // check_done()
+  std::vector<Peer*> take_due_checks(int64_t now);
+  void check_done(Peer* peer, bool passed);
+
+  // Appends one line per server of the upstream blocks
+  void report(std::string& out) const;
+
+ private:
+  struct Group {
+    const UpstreamConfig* config;  // NULL for a bare address
+    std::vector<Peer> peers;
+    // Points of the consistent hash ring, by hash, to peer indexes
+    std::vector<std::pair<uint32_t, std::size_t> > ring;
+    int64_t next_check_sec;
+  };
+  static const long kPointsPerWeight = 160;
+  std::map<std::string, Group> groups_;
+
+  static Peer make_peer_(const UpstreamServerConfig* config,
+                         const UpstreamConfig* group,
+                         const std::string& address);
+  static bool is_usable_(const Group& group, const Peer& peer, int64_t now,
+                         const std::vector<Peer*>& tried);
+  static Peer* pick_weighted_(const std::vector<Peer*>& candidates);
+  Peer* select_by_hash_(Group& group, const std::string& hash_key,
+                        const std::vector<Peer*>& tried, int64_t now);
+
+  UpstreamGroups(const UpstreamGroups&);
+  UpstreamGroups& operator=(const UpstreamGroups&);
+};
+
+#endif  // INCLUDE_UPSTREAMGROUPS_HPP_
@@ -0,0 +1,40 @@
+#ifndef INCLUDE_UPSTREAMPOOL_HPP_
+#define INCLUDE_UPSTREAMPOOL_HPP_
+
+#include <sys/socket.h>
+
+#include <cstddef>
+#include <map>
+#include <string>
+#include <vector>
+
+// Idle keep-alive connections to backends, keyed by "unix:/path" or
+// "host:port". The FastCGI and the HTTP proxy each have their own.
+class UpstreamPool {
+  struct Upstream {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    std::vector<int> idle_fds;
+  };
+  static const std::size_t kMaxIdlePerUpstream = 16;
+  std::string directive_;  // Names the pool in log messages
+  std::map<std::string, Upstream> upstreams_;
+
+  Upstream* find_upstream_(const std::string& upstream);
+  static bool is_alive_(int fd);
+
+  UpstreamPool(const UpstreamPool&);
+  UpstreamPool& operator=(const UpstreamPool&);
+
+ public:
+  explicit UpstreamPool(const std::string& directive)
+      : directive_(directive) {}
+  ~UpstreamPool();
+  // Returns a non-blocking socket, connected or still connecting, or -1.
+  // reused tells whether it came from the pool.
+  int acquire(const std::string& upstream, bool allow_reuse, bool& reused);
+  // Hands a connection whose last request completed cleanly back to the pool
+  void release(const std::string& upstream, int fd);
+};
+
+#endif  // INCLUDE_UPSTREAMPOOL_HPP_
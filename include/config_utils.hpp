@@ -4,6 +4,8 @@
 #include <vector>
 #include <string>
 
+struct ServerContext;
+
 void error_exit(const std::string& msg);
 void check_ip_format(const std::string& ip);
 long safe_strtol(const std::string& str, long min_val, long max_val);
@@ -14,5 +16,10 @@ void set_vector_string(const std::vector<std::string>& tokens,
                        size_t& token_index, std::vector<std::string>& field,
                        const std::string& directive_name);
 std::string to_string_long(long v);
+long parse_duration_sec(const std::string& str);
+long parse_size_bytes(const std::string& str);
+bool split_host_port(const std::string& authority, std::string& host,
+                     std::string& port);
+std::string error_page_path(const ServerContext& target_config, int status);
 
 #endif
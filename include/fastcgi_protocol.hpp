@@ -0,0 +1,54 @@
+#ifndef INCLUDE_FASTCGI_PROTOCOL_HPP_
+#define INCLUDE_FASTCGI_PROTOCOL_HPP_
+
+#include <cstddef>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Record encoding and decoding for the FastCGI 1.0 protocol (responder role)
+namespace fastcgi {
+
+enum RecordType {
+  kBeginRequest = 1,
+  kAbortRequest = 2,
+  kEndRequest = 3,
+  kParams = 4,
+  kStdin = 5,
+  kStdout = 6,
+  kStderr = 7,
+};
+
+const unsigned char kVersion1 = 1;
+const unsigned short kResponder = 1;
+const unsigned char kKeepConn = 1;
+const unsigned char kRequestComplete = 0;
+const std::size_t kHeaderLength = 8;
+const std::size_t kMaxContentLength = 65535;
+
+struct RecordHeader {
+  unsigned char type;
+  unsigned short request_id;
+  std::size_t content_length;
+  std::size_t padding_length;
+};
+
+typedef std::vector<std::pair<std::string, std::string> > Params;
+
+void append_begin_request(std::string& out, unsigned short request_id,
+                          bool keep_conn);
+// Encodes params as a PARAMS stream, including the empty closing record
+void append_params(std::string& out, unsigned short request_id,
+                   const Params& params);
+// Splits data into records of the given type. An empty data appends the
+// empty record that closes the stream.
+void append_stream(std::string& out, unsigned char type,
+                   unsigned short request_id, const char* data,
+                   std::size_t len);
+// Returns false if buf holds less than a full header at offset
+bool parse_header(const std::string& buf, std::size_t offset,
+                  RecordHeader& header);
+
+}  // namespace fastcgi
+
+#endif  // INCLUDE_FASTCGI_PROTOCOL_HPP_
@@ -0,0 +1,22 @@
+#ifndef INCLUDE_MIME_TYPES_HPP_
+#define INCLUDE_MIME_TYPES_HPP_
+
+#include <cstddef>
+#include <map>
+#include <string>
+#include <vector>
+
+// Lowercased extension (without the dot) -> MIME type
+typedef std::map<std::string, std::string> MimeTypeMap;
+
+const MimeTypeMap& default_mime_types();
+
+// Parses the body of a `types { text/html html htm; ... }` block.
+// token_index must point at '{' and is left after the closing '}'.
+void parse_types_block(const std::vector<std::string>& tokens,
+                       size_t& token_index, MimeTypeMap& types);
+
+std::string lookup_mime_type(const MimeTypeMap& types, const std::string& path,
+                             const std::string& default_type);
+
+#endif  // INCLUDE_MIME_TYPES_HPP_
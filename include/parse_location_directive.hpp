@@ -23,10 +23,73 @@ void parse_location_client_max_body_size_directive(const std::vector<std::string
                                    size_t& token_index, LocationContext& lc);
 void parse_autoindex_directive(const std::vector<std::string>& tokens,
                                size_t& token_index, LocationContext& lc);
+void parse_autoindex_details_directive(const std::vector<std::string>& tokens,
+                                       size_t& token_index, LocationContext& lc);
 void parse_return_directive(const std::vector<std::string>& tokens,
                             size_t& token_index, LocationContext& lc);
 
+void parse_upload_max_parts_directive(const std::vector<std::string>& tokens,
+                                      size_t& token_index, LocationContext& lc);
+void parse_upload_max_part_size_directive(
+    const std::vector<std::string>& tokens, size_t& token_index,
+    LocationContext& lc);
 void parse_cgi_handlers_directive(const std::vector<std::string>& tokens,
                             size_t& token_index, LocationContext& lc);
+void parse_cgi_pool_directive(const std::vector<std::string>& tokens,
+                              size_t& token_index, LocationContext& lc);
+void parse_cgi_max_concurrent_directive(const std::vector<std::string>& tokens,
+                                        size_t& token_index, LocationContext& lc);
+void parse_cgi_queue_directive(const std::vector<std::string>& tokens,
+                               size_t& token_index, LocationContext& lc);
+void parse_cgi_read_timeout_directive(const std::vector<std::string>& tokens,
+                                      size_t& token_index, LocationContext& lc);
+void parse_cgi_send_timeout_directive(const std::vector<std::string>& tokens,
+                                      size_t& token_index, LocationContext& lc);
+void parse_cgi_total_timeout_directive(const std::vector<std::string>& tokens,
+                                       size_t& token_index, LocationContext& lc);
+void parse_cgi_rlimit_as_directive(const std::vector<std::string>& tokens,
+                                   size_t& token_index, LocationContext& lc);
+void parse_cgi_rlimit_cpu_directive(const std::vector<std::string>& tokens,
+                                    size_t& token_index, LocationContext& lc);
+void parse_cgi_rlimit_nofile_directive(const std::vector<std::string>& tokens,
+                                       size_t& token_index, LocationContext& lc);
+void parse_cgi_cache_directive(const std::vector<std::string>& tokens,
+                               size_t& token_index, LocationContext& lc);
+void parse_cgi_cache_key_directive(const std::vector<std::string>& tokens,
+                                   size_t& token_index, LocationContext& lc);
+void parse_cgi_cache_lock_directive(const std::vector<std::string>& tokens,
+                                    size_t& token_index, LocationContext& lc);
+void parse_cgi_cache_lock_timeout_directive(
+    const std::vector<std::string>& tokens, size_t& token_index,
+    LocationContext& lc);
+void parse_disk_cache_directive(const std::vector<std::string>& tokens,
+                                size_t& token_index, LocationContext& lc);
+void parse_disk_cache_key_directive(const std::vector<std::string>& tokens,
+                                    size_t& token_index, LocationContext& lc);
+void parse_stub_status_directive(const std::vector<std::string>& tokens,
+                                 size_t& token_index, LocationContext& lc);
+void parse_fastcgi_pass_directive(const std::vector<std::string>& tokens,
+                                  size_t& token_index, LocationContext& lc);
+void parse_proxy_pass_directive(const std::vector<std::string>& tokens,
+                                size_t& token_index, LocationContext& lc);
+void parse_proxy_connect_timeout_directive(
+    const std::vector<std::string>& tokens, size_t& token_index,
+    LocationContext& lc);
+void parse_proxy_read_timeout_directive(const std::vector<std::string>& tokens,
+                                        size_t& token_index,
+                                        LocationContext& lc);
+void parse_proxy_send_timeout_directive(const std::vector<std::string>& tokens,
+                                        size_t& token_index,
+                                        LocationContext& lc);
+void parse_native_handler_directive(const std::vector<std::string>& tokens,
+                                    size_t& token_index, LocationContext& lc);
+void parse_expires_directive(const std::vector<std::string>& tokens,
+                             size_t& token_index, LocationContext& lc);
+void parse_expires_match_directive(const std::vector<std::string>& tokens,
+                                   size_t& token_index, LocationContext& lc);
+void parse_add_header_directive(const std::vector<std::string>& tokens,
+                                size_t& token_index, LocationContext& lc);
+void parse_location_default_type_directive(const std::vector<std::string>& tokens,
+                                           size_t& token_index, LocationContext& lc);
 
 #endif
@@ -27,6 +27,13 @@ void parse_server_index_directive(const std::vector<std::string>& tokens,
 void parse_error_page_directive(const std::vector<std::string>& tokens,
                                 size_t& token_index, ServerContext& sc);
 
+void parse_server_types_directive(const std::vector<std::string>& tokens,
+                                  size_t& token_index, ServerContext& sc);
+
+void parse_server_default_type_directive(
+    const std::vector<std::string>& tokens, size_t& token_index,
+    ServerContext& sc);
+
 void parse_location_directive(const std::vector<std::string>& tokens,
                               size_t& token_index, ServerContext& sc);
 
@@ -0,0 +1,13 @@
+#ifndef INCLUDE_PARSE_UPSTREAM_BLOCK_HPP_
+#define INCLUDE_PARSE_UPSTREAM_BLOCK_HPP_
+
+#include <string>
+#include <vector>
+
+#include "Config.hpp"
+
+// Parses `name { ... }` following `upstream`, leaving token_index past '}'
+void parse_upstream_block(const std::vector<std::string>& tokens,
+                          size_t& token_index, UpstreamConfig& upstream);
+
+#endif  // INCLUDE_PARSE_UPSTREAM_BLOCK_HPP_
@@ -0,0 +1,44 @@
+#ifndef INCLUDE_PIPE_UTILS_HPP_
+#define INCLUDE_PIPE_UTILS_HPP_
+
+#include <sys/types.h>
+
+#include <cstddef>
+
+// splice(2), F_SETPIPE_SZ, fallocate(2) and this form of sendfile(2) are
+// Linux-only; elsewhere bodies are copied
+#ifdef __linux__
+#define WEBSERV_HAVE_SPLICE 1
+#define WEBSERV_HAVE_SENDFILE 1
+#define WEBSERV_HAVE_FALLOCATE 1
+#endif
+
+// Grows the kernel buffer of a pipe so that bulk transfers need fewer
+// wakeups. Best effort, the size is capped by /proc/sys/fs/pipe-max-size.
+void enlarge_pipe(int fd);
+
+// Bytes waiting in the pipe, 0 on error
+std::size_t pipe_buffered(int fd);
+
+// Whether the write end of the pipe is closed, as poll(2) sees it now. The
+// revents a handler is dispatched on may be older than that.
+bool pipe_hung_up(int fd);
+
+// Bytes the pipe still accepts, 0 on error
+std::size_t pipe_free_space(int fd);
+
+// Moves up to len bytes from from_fd to to_fd inside the kernel. One side
+// must be a pipe. Returns -1 where splice(2) is not available.
+ssize_t splice_bytes(int from_fd, int to_fd, std::size_t len);
+
+// Sends up to len bytes of file_fd from offset to the socket inside the
+// kernel, advancing offset. Returns -1 where sendfile(2) is not available.
+ssize_t send_file_bytes(int file_fd, int sock_fd, off_t& offset,
+                        std::size_t len);
+
+// Reserves len bytes of disk for file_fd, so a full disk fails up front and
+// the file is laid out in one piece. Returns -1 with errno set only when the
+// space is not there; a file system that cannot preallocate is left alone.
+int preallocate_file(int file_fd, off_t len);
+
+#endif  // INCLUDE_PIPE_UTILS_HPP_
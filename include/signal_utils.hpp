@@ -1,7 +1,10 @@
 #ifndef INCLUDE_SIGNAL_UTILS_HPP_
 #define INCLUDE_SIGNAL_UTILS_HPP_
 
+// Stops taking new connections; those under way get shutdown_timeout
 void turn_off_running_status(int signum);
+// Closes everything right away
+void stop_immediately(int signum);
 void set_signal_handler(int signum, void (*handler)(int));
 
 #endif  // INCLUDE_SIGNAL_UTILS_HPP_
@@ -0,0 +1,37 @@
+#ifndef INCLUDE_SPAWN_UTILS_HPP_
+#define INCLUDE_SPAWN_UTILS_HPP_
+
+#include <sys/types.h>
+
+#include <string>
+
+// Resource limits of a spawned program; 0 keeps what the server has
+struct ProcessLimits {
+  long address_space;  // RLIMIT_AS in bytes
+  long cpu_sec;        // RLIMIT_CPU; SIGXCPU at the limit, SIGKILL a second later
+  long open_files;     // RLIMIT_NOFILE
+
+  ProcessLimits() : address_space(0), cpu_sec(0), open_files(0) {}
+  bool empty() const {
+    return address_space == 0 && cpu_sec == 0 && open_files == 0;
+  }
+};
+
+// Starts file with stdin/stdout redirected and work_dir as its working
+// directory. argv and envp are prepared by the caller so that nothing runs
+// between fork and exec; posix_spawn is used where it can change directory.
+// posix_spawn cannot set resource limits, so a program with limits is
+// started the way posix_spawn does it, with clone(CLONE_VM | CLONE_VFORK)
+// and no copy of the server, and sets them on itself before exec: they
+// hold from its first instruction on. Either way the child starts with
+// default signal dispositions.
+// Descriptors other than 0-2 are expected to be FD_CLOEXEC.
+// Returns the child's pid, or -1 on failure.
+pid_t spawn_process(const char* file, char* const argv[], char* const envp[],
+                    int stdin_fd, int stdout_fd, const std::string& work_dir,
+                    const ProcessLimits& limits = ProcessLimits());
+
+// Marks fd close-on-exec so that it does not leak into spawned programs
+int set_cloexec(int fd);
+
+#endif  // INCLUDE_SPAWN_UTILS_HPP_
@@ -1,6 +1,7 @@
 #ifndef INCLUDE_STRING_UTILS_HPP_
 #define INCLUDE_STRING_UTILS_HPP_
 
+#include <ctime>
 #include <list>
 #include <string>
 
@@ -19,4 +20,9 @@ std::string int_to_string(int num);
 
 bool is_digits(const std::string& str);
 
+// IMF-fixdate (RFC 9110), e.g. "Sun, 06 Nov 1994 08:49:37 GMT"
+std::string format_http_date(std::time_t t);
+// Only IMF-fixdate, the obsolete formats are treated as invalid
+bool parse_http_date(const std::string& str, std::time_t& t);
+
 #endif  // INCLUDE_STRING_UTILS_HPP_
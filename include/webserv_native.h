@@ -0,0 +1,95 @@
+#ifndef INCLUDE_WEBSERV_NATIVE_H_
+#define INCLUDE_WEBSERV_NATIVE_H_
+
+/*
+ * C ABI of plugins loaded with the native_handler directive.
+ *
+ * A plugin is a shared object exporting one `webserv_plugin` of type
+ * struct webserv_native_plugin. The server dlopen()s it at startup, calls
+ * init() once per location that names it, and then handle() for every
+ * request to those locations, inline on the event loop. handle() therefore
+ * has to answer in microseconds and must never block, unless the plugin
+ * sets WEBSERV_NATIVE_BLOCKING.
+ *
+ *   cc -shared -fPIC -Iinclude -o health.so health.c
+ */
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Version 2 added stream() to the api; plugins built for 1 still load */
+#define WEBSERV_NATIVE_ABI_VERSION 2
+
+/* Set in flags by plugins that may block. Their handle() and stream reads
+ * run on the file_io_threads instead of the event loop, several at once
+ * with the same state, so the plugin has to be thread-safe. With
+ * file_io_threads 0, or when the threads are all busy and too much is
+ * queued, they run on the event loop after all. */
+#define WEBSERV_NATIVE_BLOCKING 0x1u
+
+struct webserv_native_header {
+  const char* name; /* Lower case */
+  const char* value;
+};
+
+/* Valid for the duration of handle() only */
+struct webserv_native_request {
+  const char* method;
+  const char* target; /* As sent, with the query */
+  const char* path;   /* target up to the '?' */
+  const char* query;  /* "" without one */
+  const char* remote_addr;
+  const struct webserv_native_header* headers;
+  size_t header_count;
+  const char* body;
+  size_t body_length;
+};
+
+/* Where handle() writes its answer, through the api below */
+struct webserv_native_response;
+
+struct webserv_native_api {
+  /* 200 unless set */
+  void (*set_status)(struct webserv_native_response* response, int status);
+  /* Names or values with CR or LF and Content-Length are ignored */
+  void (*add_header)(struct webserv_native_response* response,
+                     const char* name, const char* value);
+  /* Appends to the body */
+  void (*write)(struct webserv_native_response* response, const char* data,
+                size_t length);
+  /* Has the rest of the body produced piece by piece as the client takes
+   * it, for a body too large or too slow to write whole. read() puts up to
+   * capacity bytes into buffer and returns how many, 0 at the end, or -1
+   * to cut the response short; it runs where handle() does. close(), which
+   * may be NULL, is called once on the event loop when the body is done or
+   * the client has gone. What write() gave goes out first. ABI 2. */
+  void (*stream)(struct webserv_native_response* response,
+                 long (*read)(void* context, char* buffer, size_t capacity),
+                 void (*close)(void* context), void* context);
+};
+
+struct webserv_native_plugin {
+  unsigned int abi_version; /* WEBSERV_NATIVE_ABI_VERSION */
+  unsigned int flags;
+  /* Optional. argument is the native_handler's second value, or "".
+   * Anything but 0 stops the server from starting. */
+  int (*init)(const char* argument, void** state);
+  /* Optional, called at shutdown for every state init() made */
+  void (*destroy)(void* state);
+  /* Returns 0 once the response is written, or an HTTP status from 400 to
+   * 599 to have the server send its error page instead */
+  int (*handle)(void* state, const struct webserv_native_request* request,
+                struct webserv_native_response* response,
+                const struct webserv_native_api* api);
+};
+
+#define WEBSERV_NATIVE_SYMBOL "webserv_plugin"
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* INCLUDE_WEBSERV_NATIVE_H_ */
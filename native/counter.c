@@ -0,0 +1,59 @@
+/*
+ * Example native_handler: answers every request with how many requests
+ * this location has had, prefixed by the directive's argument.
+ *
+ *   make plugins
+ *   location = /count { native_handler native/counter.so "hits "; }
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "webserv_native.h"
+
+struct counter {
+  const char* prefix;
+  unsigned long hits;
+};
+
+static int counter_init(const char* argument, void** state) {
+  struct counter* counter = malloc(sizeof(*counter));
+  if (counter == NULL) {
+    return -1;
+  }
+  counter->prefix = strdup(argument);
+  counter->hits = 0;
+  *state = counter;
+  return counter->prefix == NULL ? -1 : 0;
+}
+
+static void counter_destroy(void* state) {
+  struct counter* counter = state;
+  free((void*)counter->prefix);
+  free(counter);
+}
+
+static int counter_handle(void* state,
+                          const struct webserv_native_request* request,
+                          struct webserv_native_response* response,
+                          const struct webserv_native_api* api) {
+  struct counter* counter = state;
+  char line[64];
+  int length;
+
+  if (strcmp(request->method, "GET") != 0) {
+    return 405;
+  }
+  counter->hits++;
+  length = snprintf(line, sizeof(line), "%lu\n", counter->hits);
+  api->add_header(response, "Content-Type", "text/plain");
+  api->add_header(response, "Cache-Control", "no-store");
+  api->write(response, counter->prefix, strlen(counter->prefix));
+  api->write(response, line, (size_t)length);
+  return 0;
+}
+
+const struct webserv_native_plugin webserv_plugin = {
+    WEBSERV_NATIVE_ABI_VERSION, 0, counter_init, counter_destroy,
+    counter_handle};
@@ -0,0 +1,59 @@
+/*
+ * Example blocking native_handler: streams the file named by the
+ * directive's argument, read from disk on the file_io_threads a piece at a
+ * time as the client takes it.
+ *
+ *   make plugins
+ *   location = /motd { native_handler native/stream_file.so docs/motd.txt; }
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "webserv_native.h"
+
+static int stream_file_init(const char* argument, void** state) {
+  char* path = strdup(argument);
+  *state = path;
+  return path == NULL || *path == '\0' ? -1 : 0;
+}
+
+static void stream_file_destroy(void* state) { free(state); }
+
+static long stream_file_read(void* context, char* buffer, size_t capacity) {
+  int fd = (int)(long)context;
+  ssize_t num_read;
+
+  do {
+    num_read = read(fd, buffer, capacity);
+  } while (num_read == -1 && errno == EINTR);
+  return (long)num_read;
+}
+
+static void stream_file_close(void* context) { close((int)(long)context); }
+
+static int stream_file_handle(void* state,
+                              const struct webserv_native_request* request,
+                              struct webserv_native_response* response,
+                              const struct webserv_native_api* api) {
+  int fd;
+
+  if (strcmp(request->method, "GET") != 0) {
+    return 405;
+  }
+  fd = open((const char*)state, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return errno == ENOENT ? 404 : 500;
+  }
+  api->add_header(response, "Content-Type", "application/octet-stream");
+  api->stream(response, stream_file_read, stream_file_close,
+              (void*)(long)fd);
+  return 0;
+}
+
+const struct webserv_native_plugin webserv_plugin = {
+    WEBSERV_NATIVE_ABI_VERSION, WEBSERV_NATIVE_BLOCKING, stream_file_init,
+    stream_file_destroy, stream_file_handle};
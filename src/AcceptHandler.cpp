@@ -11,6 +11,7 @@
 
 #include "MonitoredFdHandler.hpp"
 #include "Server.hpp"
+#include "spawn_utils.hpp"
 
 namespace {
 std::string translate_newtwork_addr(const struct sockaddr_in& network_addr) {
@@ -39,9 +40,10 @@ HandlerStatus AcceptHandler::handle_input() {
   if (client_fd == -1) {
     return kHandlerContinue;
   }
-  if (fcntl(client_fd, F_SETFL, O_NONBLOCK) == -1) {
+  if (fcntl(client_fd, F_SETFL, O_NONBLOCK) == -1 ||
+      set_cloexec(client_fd) == -1) {
     return kHandlerFatalError;
-  }  
+  }
   std::string client_ip_addr = translate_newtwork_addr(client_addr);
   if (server_.register_new_client(client_fd, addr_, client_ip_addr, port_) ==
       -1) {
@@ -0,0 +1,338 @@
+#include "Autoindex.hpp"
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace {
+const char* kHtmlStart = "<html><head><title>Index of ";
+const char* kTitleEnd = "</title></head><body><h1>Index of ";
+const char* kHeaderEnd = "</h1><hr><pre><a href=\"../\">../</a>\n";
+const char* kHtmlEnd = "</pre><hr></body></html>";
+
+const std::size_t kMaxCachedListings = 128;
+const std::size_t kMaxCachedBytes = 64 * 1024 * 1024;
+const std::size_t kNameColumnWidth = 50;
+// Sizes and mtimes of files can change without touching the directory,
+// so detailed listings are only trusted for a short while.
+const time_t kDetailsTtlSec = 2;
+
+struct Entry {
+  std::string name;
+  bool is_dir;
+  off_t size;
+  time_t mtime;
+};
+
+bool entry_less(const Entry& a, const Entry& b) {
+  if (a.is_dir != b.is_dir) {
+    return a.is_dir;
+  }
+  return a.name < b.name;
+}
+
+// Rendered entries of one directory, shared by every response streaming it
+struct Listing {
+  std::string html;
+  time_t dir_mtime;
+  time_t built_at;
+  bool with_details;
+  bool is_cached;
+  int refs;
+  uint64_t last_used;
+};
+
+std::map<std::string, Listing*> g_cache;
+std::size_t g_cached_bytes = 0;
+uint64_t g_use_counter = 0;
+std::size_t g_max_listings = kMaxCachedListings;
+std::size_t g_max_bytes = kMaxCachedBytes;
+
+std::string cache_key(const std::string& dir_path, bool with_details) {
+  return dir_path + (with_details ? "\n+details" : "");
+}
+
+void release(Listing* listing) {
+  if (--listing->refs == 0 && !listing->is_cached) {
+    delete listing;
+  }
+}
+
+void evict(std::map<std::string, Listing*>::iterator it) {
+  Listing* listing = it->second;
+  g_cached_bytes -= listing->html.size();
+  g_cache.erase(it);
+  listing->is_cached = false;
+  if (listing->refs == 0) {
+    delete listing;
+  }
+}
+
+void evict_least_recently_used() {
+  std::map<std::string, Listing*>::iterator victim = g_cache.begin();
+  for (std::map<std::string, Listing*>::iterator it = g_cache.begin();
+       it != g_cache.end(); ++it) {
+    if (it->second->last_used < victim->second->last_used) {
+      victim = it;
+    }
+  }
+  if (victim != g_cache.end()) {
+    evict(victim);
+  }
+}
+
+void append_html_escaped(std::string& out, const std::string& text) {
+  for (std::size_t i = 0; i < text.size(); ++i) {
+    switch (text[i]) {
+      case '&': out.append("&amp;"); break;
+      case '<': out.append("&lt;"); break;
+      case '>': out.append("&gt;"); break;
+      case '"': out.append("&quot;"); break;
+      case '\'': out.append("&#39;"); break;
+      default: out.push_back(text[i]);
+    }
+  }
+}
+
+void append_url_encoded(std::string& out, const std::string& name) {
+  static const char* kHex = "0123456789ABCDEF";
+  for (std::size_t i = 0; i < name.size(); ++i) {
+    unsigned char c = static_cast<unsigned char>(name[i]);
+    if (std::isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~') {
+      out.push_back(static_cast<char>(c));
+    } else {
+      out.push_back('%');
+      out.push_back(kHex[c >> 4]);
+      out.push_back(kHex[c & 0xF]);
+    }
+  }
+}
+
+void append_entry(std::string& out, const Entry& entry, bool with_details) {
+  out.append("<a href=\"");
+  append_url_encoded(out, entry.name);
+  if (entry.is_dir) {
+    out.push_back('/');
+  }
+  out.append("\">");
+  append_html_escaped(out, entry.name);
+  if (entry.is_dir) {
+    out.push_back('/');
+  }
+  out.append("</a>");
+
+  if (with_details) {
+    std::size_t shown = entry.name.size() + (entry.is_dir ? 1 : 0);
+    out.append(shown < kNameColumnWidth ? kNameColumnWidth - shown + 1 : 1, ' ');
+    char buf[64];
+    struct tm gmt;
+    gmtime_r(&entry.mtime, &gmt);
+    std::size_t len = std::strftime(buf, sizeof(buf), "%d-%b-%Y %H:%M", &gmt);
+    out.append(buf, len);
+    if (entry.is_dir) {
+      std::snprintf(buf, sizeof(buf), "%20s", "-");
+    } else {
+      std::snprintf(buf, sizeof(buf), "%20lld",
+                    static_cast<long long>(entry.size));
+    }
+    out.append(buf);
+  }
+  out.push_back('\n');
+}
+
+// Reads the directory with readdir's d_type and only calls fstatat() when
+// the type is unknown, for symlinks, or when details are requested.
+Listing* build_listing(const std::string& dir_path, bool with_details) {
+  DIR* dir = opendir(dir_path.c_str());
+  if (dir == NULL) {
+    return NULL;
+  }
+  int dir_fd = dirfd(dir);
+  struct stat dir_stat;
+  if (fstat(dir_fd, &dir_stat) == -1) {
+    int saved_errno = errno;
+    closedir(dir);
+    errno = saved_errno;
+    return NULL;
+  }
+
+  std::vector<Entry> entries;
+  struct dirent* ent;
+  while ((ent = readdir(dir)) != NULL) {
+    if (std::strcmp(ent->d_name, ".") == 0 ||
+        std::strcmp(ent->d_name, "..") == 0) {
+      continue;
+    }
+    Entry entry;
+    entry.name = ent->d_name;
+    entry.is_dir = false;
+    entry.size = 0;
+    entry.mtime = 0;
+
+    bool needs_stat = with_details;
+#ifdef DT_UNKNOWN
+    if (ent->d_type == DT_UNKNOWN || ent->d_type == DT_LNK) {
+      needs_stat = true;
+    } else {
+      entry.is_dir = (ent->d_type == DT_DIR);
+    }
+#else
+    needs_stat = true;
+#endif
+    if (needs_stat) {
+      struct stat st;
+      if (fstatat(dir_fd, ent->d_name, &st, 0) == 0) {
+        entry.is_dir = S_ISDIR(st.st_mode);
+        entry.size = st.st_size;
+        entry.mtime = st.st_mtime;
+      }
+    }
+    entries.push_back(entry);
+  }
+  closedir(dir);
+
+  std::sort(entries.begin(), entries.end(), entry_less);
+
+  Listing* listing = new Listing;
+  listing->html.reserve(entries.size() * (with_details ? 128 : 64));
+  for (std::size_t i = 0; i < entries.size(); ++i) {
+    append_entry(listing->html, entries[i], with_details);
+  }
+  listing->dir_mtime = dir_stat.st_mtime;
+  listing->built_at = std::time(NULL);
+  listing->with_details = with_details;
+  listing->is_cached = false;
+  listing->refs = 1;
+  listing->last_used = ++g_use_counter;
+  return listing;
+}
+
+bool is_fresh(const Listing& listing, const std::string& dir_path) {
+  struct stat st;
+  if (stat(dir_path.c_str(), &st) == -1 || st.st_mtime != listing.dir_mtime) {
+    return false;
+  }
+  // A change in the same second as the build would keep the same mtime
+  if (listing.dir_mtime >= listing.built_at) {
+    return false;
+  }
+  if (listing.with_details &&
+      std::time(NULL) - listing.built_at >= kDetailsTtlSec) {
+    return false;
+  }
+  return true;
+}
+
+Listing* acquire_listing(const std::string& dir_path, bool with_details) {
+  std::string key = cache_key(dir_path, with_details);
+  std::map<std::string, Listing*>::iterator it = g_cache.find(key);
+  if (it != g_cache.end()) {
+    if (is_fresh(*it->second, dir_path)) {
+      it->second->refs++;
+      it->second->last_used = ++g_use_counter;
+      return it->second;
+    }
+    evict(it);
+  }
+
+  Listing* listing = build_listing(dir_path, with_details);
+  if (listing == NULL) {
+    return NULL;
+  }
+  if (listing->html.size() <= g_max_bytes / 4) {
+    while (!g_cache.empty() &&
+           (g_cache.size() >= g_max_listings ||
+            g_cached_bytes + listing->html.size() > g_max_bytes)) {
+      evict_least_recently_used();
+    }
+    listing->is_cached = true;
+    g_cache[key] = listing;
+    g_cached_bytes += listing->html.size();
+  }
+  return listing;
+}
+
+// Streams head + cached entries + tail in bounded pieces
+class ListingSource : public BodySource {
+  Listing* listing_;
+  std::string head_;
+  std::size_t offset_;
+
+  ListingSource(const ListingSource&);
+  ListingSource& operator=(const ListingSource&);
+
+ public:
+  ListingSource(Listing* listing, const std::string& uri_path)
+      : listing_(listing), offset_(0) {
+    head_ = kHtmlStart;
+    append_html_escaped(head_, uri_path);
+    head_.append(kTitleEnd);
+    append_html_escaped(head_, uri_path);
+    head_.append(kHeaderEnd);
+  }
+  ~ListingSource() { release(listing_); }
+
+  BodyStatus read_some(std::string& out, std::size_t max_bytes) {
+    const char* parts[3] = {head_.data(), listing_->html.data(), kHtmlEnd};
+    std::size_t sizes[3] = {head_.size(), listing_->html.size(),
+                            std::strlen(kHtmlEnd)};
+    std::size_t base = 0;
+    for (std::size_t i = 0; i < 3 && max_bytes > 0; ++i) {
+      if (offset_ < base + sizes[i]) {
+        std::size_t start = offset_ - base;
+        std::size_t len = std::min(max_bytes, sizes[i] - start);
+        out.append(parts[i] + start, len);
+        offset_ += len;
+        max_bytes -= len;
+      }
+      base += sizes[i];
+    }
+    return offset_ < base ? kBodyMore : kBodyDone;
+  }
+};
+}  // namespace
+
+BodySource* Autoindex::open(const std::string& dir_path,
+                            const std::string& uri_path, bool with_details) {
+  Listing* listing = acquire_listing(dir_path, with_details);
+  if (listing == NULL) {
+    return NULL;
+  }
+  return new ListingSource(listing, uri_path);
+}
+
+void Autoindex::set_cache_limits(std::size_t max_listings,
+                                 std::size_t max_bytes) {
+  g_max_listings = max_listings;
+  g_max_bytes = max_bytes;
+  while (!g_cache.empty() &&
+         (g_cache.size() > g_max_listings || g_cached_bytes > g_max_bytes)) {
+    evict_least_recently_used();
+  }
+}
+
+void Autoindex::clear_cache() {
+  while (!g_cache.empty()) {
+    evict(g_cache.begin());
+  }
+}
+
+bool Autoindex::is_cached(const std::string& dir_path, bool with_details) {
+  return g_cache.count(cache_key(dir_path, with_details)) != 0;
+}
+
+std::size_t Autoindex::cached_listings() { return g_cache.size(); }
+
+std::size_t Autoindex::cached_bytes() { return g_cached_bytes; }
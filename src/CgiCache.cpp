@@ -0,0 +1,357 @@
+#include "CgiCache.hpp"
+
+#include <cctype>
+#include <cstdlib>
+#include <ctime>
+#include <sstream>
+
+#include "ClientHandler.hpp"
+#include "Server.hpp"
+#include "string_utils.hpp"
+
+namespace {
+int64_t now_time_cache() { return static_cast<int64_t>(std::time(NULL)); }
+
+// "max-age=60" -> 60, for the directive named by prefix
+bool directive_seconds(const std::string& directive, const std::string& prefix,
+                       int64_t& seconds) {
+  if (directive.compare(0, prefix.size(), prefix) != 0) {
+    return false;
+  }
+  std::string value = directive.substr(prefix.size());
+  if (!is_digits(value) || value.size() > 9) {
+    return false;
+  }
+  seconds = std::atol(value.c_str());
+  return true;
+}
+
+const char* method_name(HttpMethod method) {
+  switch (method) {
+    case kGet: return "GET";
+    case kPost: return "POST";
+    case kDelete: return "DELETE";
+    default: return "UNKNOWN";
+  }
+}
+
+std::string header_value(const Request& request, const std::string& name) {
+  std::map<std::string, std::string>::const_iterator it =
+      request.headers.find(name);
+  return it != request.headers.end() ? it->second : std::string();
+}
+}  // namespace
+
+void CgiCache::configure(const Config& config) {
+  const std::vector<ServerContext>& servers = config.get_configs();
+  for (std::size_t i = 0; i < servers.size(); ++i) {
+    const std::vector<LocationContext>& locations = servers[i].locations;
+    for (std::size_t j = 0; j < locations.size(); ++j) {
+      const CgiCacheConfig& cc = locations[j].cgi_cache;
+      if (cc.zone.empty()) {
+        continue;
+      }
+      bool is_new = zones_.find(cc.zone) == zones_.end();
+      Zone& zone = zones_[cc.zone];
+      std::size_t max_bytes = static_cast<std::size_t>(cc.max_size);
+      if (is_new) {
+        zone.max_bytes = max_bytes;
+        zone.bytes = 0;
+        zone.hits = 0;
+        zone.stale_hits = 0;
+        zone.misses = 0;
+        zone.stores = 0;
+        zone.evictions = 0;
+        zone.collapsed = 0;
+      } else if (max_bytes > zone.max_bytes) {
+        zone.max_bytes = max_bytes;
+      }
+    }
+  }
+}
+
+CgiCache::Lookup CgiCache::lookup(const CgiCacheConfig& cc,
+                                  const std::string& key, std::string& out) {
+  std::map<std::string, Zone>::iterator zit = zones_.find(cc.zone);
+  if (zit == zones_.end()) {
+    return kMiss;
+  }
+  Zone& zone = zit->second;
+  bool is_filling = zone.fills.find(key) != zone.fills.end();
+  std::map<std::string, Entry>::iterator it = zone.entries.find(key);
+  int64_t now = now_time_cache();
+  if (it != zone.entries.end() && now >= it->second.stale_until) {
+    erase_(zone, it);
+    it = zone.entries.end();
+  }
+  if (it == zone.entries.end()) {
+    zone.misses++;
+    if (!is_filling) {
+      zone.fills[key];
+      return kFill;
+    }
+    if (cc.lock) {
+      zone.collapsed++;
+      return kWait;
+    }
+    return kMiss;
+  }
+
+  Entry& entry = it->second;
+  zone.lru.splice(zone.lru.begin(), zone.lru, entry.lru_pos);
+  out = entry.response.render();
+  if (now < entry.fresh_until) {
+    zone.hits++;
+    return kHit;
+  }
+  zone.stale_hits++;
+  if (is_filling) {
+    return kHit;
+  }
+  zone.fills[key];
+  return kStale;
+}
+
+void CgiCache::store(const CgiCacheConfig& cc, const std::string& key,
+                     int status,
+                     const std::map<std::string, std::string>& headers,
+                     const Response& response) {
+  std::map<std::string, Zone>::iterator zit = zones_.find(cc.zone);
+  if (zit == zones_.end()) {
+    return;
+  }
+  Zone& zone = zit->second;
+  int64_t ttl_sec;
+  int64_t stale_sec;
+  PrebuiltResponse prebuilt(response);
+  if (!freshness(cc.ttl_sec, cc.stale_sec, status, headers, ttl_sec,
+                 stale_sec) ||
+      prebuilt.size() > max_entry_bytes(cc)) {
+    return;
+  }
+
+  std::map<std::string, Entry>::iterator it = zone.entries.find(key);
+  if (it != zone.entries.end()) {
+    erase_(zone, it);
+  }
+  Entry& entry = zone.entries[key];
+  entry.response = prebuilt;
+  entry.fresh_until = now_time_cache() + ttl_sec;
+  entry.stale_until = entry.fresh_until + stale_sec;
+  zone.lru.push_front(key);
+  entry.lru_pos = zone.lru.begin();
+  zone.bytes += entry_bytes_(key, entry);
+  zone.stores++;
+
+  while (zone.bytes > zone.max_bytes && zone.lru.size() > 1) {
+    erase_(zone, zone.entries.find(zone.lru.back()));
+    zone.evictions++;
+  }
+}
+
+// The waiters are taken out first, as a waiter sent off to run the script
+// may well start a new fill of the same key
+void CgiCache::finish_fill(Server& server, const CgiCacheConfig& cc,
+                           const std::string& key,
+                           const std::string* response) {
+  std::map<std::string, Zone>::iterator zit = zones_.find(cc.zone);
+  if (zit == zones_.end()) {
+    return;
+  }
+  std::map<std::string, std::vector<Waiter> >::iterator it =
+      zit->second.fills.find(key);
+  if (it == zit->second.fills.end()) {
+    return;
+  }
+  std::vector<Waiter> waiters;
+  waiters.swap(it->second);
+  zit->second.fills.erase(it);
+  for (std::size_t i = 0; i < waiters.size(); ++i) {
+    ClientHandler* client =
+        server.find_client_handler(waiters[i].client_fd, waiters[i].serial);
+    if (client != NULL) {
+      client->cgi_cache_fill_done(response);
+    }
+  }
+}
+
+void CgiCache::add_waiter(const CgiCacheConfig& cc, const std::string& key,
+                          int client_fd, unsigned long serial) {
+  Waiter waiter;
+  waiter.client_fd = client_fd;
+  waiter.serial = serial;
+  zones_[cc.zone].fills[key].push_back(waiter);
+}
+
+void CgiCache::remove_waiter(const CgiCacheConfig& cc, const std::string& key,
+                             int client_fd, unsigned long serial) {
+  std::map<std::string, Zone>::iterator zit = zones_.find(cc.zone);
+  if (zit == zones_.end()) {
+    return;
+  }
+  std::map<std::string, std::vector<Waiter> >::iterator it =
+      zit->second.fills.find(key);
+  if (it == zit->second.fills.end()) {
+    return;
+  }
+  std::vector<Waiter>& waiters = it->second;
+  for (std::vector<Waiter>::iterator w = waiters.begin(); w != waiters.end();
+       ++w) {
+    if (w->client_fd == client_fd && w->serial == serial) {
+      waiters.erase(w);
+      return;
+    }
+  }
+}
+
+void CgiCache::report(std::string& out) const {
+  for (std::map<std::string, Zone>::const_iterator it = zones_.begin();
+       it != zones_.end(); ++it) {
+    const Zone& zone = it->second;
+    std::ostringstream line;
+    line << "cgi_cache " << it->first << ": entries " << zone.entries.size()
+         << ", bytes " << zone.bytes << "/" << zone.max_bytes << ", hits "
+         << zone.hits << ", stale " << zone.stale_hits << ", misses "
+         << zone.misses << ", stores " << zone.stores << ", evictions "
+         << zone.evictions << ", collapsed " << zone.collapsed << "\n";
+    out += line.str();
+  }
+}
+
+// Follows what a shared cache may do with the response (RFC 9111):
+// s-maxage over max-age over Expires, and nothing private or with cookies.
+// Expires counts from the script's own Date when it sends one, so that a
+// clock apart from ours does not change the lifetime.
+bool CgiCache::freshness(long default_ttl_sec, long default_stale_sec,
+                         int status,
+                         const std::map<std::string, std::string>& headers,
+                         int64_t& ttl_sec, int64_t& stale_sec) {
+  if (status != 200 && status != 301 && status != 302) {
+    return false;
+  }
+  if (headers.find("set-cookie") != headers.end()) {
+    return false;
+  }
+  std::map<std::string, std::string>::const_iterator it = headers.find("vary");
+  if (it != headers.end() && trim(it->second, " \t") == "*") {
+    return false;
+  }
+
+  ttl_sec = default_ttl_sec;
+  stale_sec = default_stale_sec;
+  bool has_max_age = false;
+  bool has_s_maxage = false;
+  it = headers.find("cache-control");
+  if (it != headers.end()) {
+    std::list<std::string> directives = split_string(it->second, ",");
+    for (std::list<std::string>::iterator d = directives.begin();
+         d != directives.end(); ++d) {
+      std::string directive = to_lower(trim(*d, " \t"));
+      int64_t seconds;
+      if (directive == "no-store" || directive == "no-cache" ||
+          directive == "private") {
+        return false;
+      } else if (directive_seconds(directive, "s-maxage=", seconds)) {
+        ttl_sec = seconds;
+        has_s_maxage = true;
+      } else if (directive_seconds(directive, "max-age=", seconds)) {
+        if (!has_s_maxage) {
+          ttl_sec = seconds;
+        }
+        has_max_age = true;
+      } else if (directive_seconds(directive, "stale-while-revalidate=",
+                                   seconds)) {
+        stale_sec = seconds;
+      }
+    }
+  }
+  it = headers.find("expires");
+  if (!has_max_age && !has_s_maxage && it != headers.end()) {
+    std::time_t expires;
+    if (!parse_http_date(it->second, expires)) {
+      return false;
+    }
+    int64_t date = now_time_cache();
+    std::map<std::string, std::string>::const_iterator date_it =
+        headers.find("date");
+    std::time_t sent;
+    if (date_it != headers.end() && parse_http_date(date_it->second, sent)) {
+      date = static_cast<int64_t>(sent);
+    }
+    ttl_sec = static_cast<int64_t>(expires) - date;
+  }
+  return ttl_sec > 0;
+}
+
+// As with autoindex listings, one entry may not take more than a quarter
+std::size_t CgiCache::max_entry_bytes(const CgiCacheConfig& cc) {
+  return static_cast<std::size_t>(cc.max_size) / 4;
+}
+
+bool CgiCache::is_cacheable(const Request& request) {
+  if (request.method != kGet || request.headers.count("authorization") != 0 ||
+      request.headers.count("transfer-encoding") != 0) {
+    return false;
+  }
+  std::map<std::string, std::string>::const_iterator it =
+      request.headers.find("content-length");
+  return it == request.headers.end() || it->second == "0";
+}
+
+std::string CgiCache::build_key(const std::string& key_template,
+                                const Request& request) {
+  std::string key;
+  std::size_t i = 0;
+  while (i < key_template.size()) {
+    if (key_template[i] != '$') {
+      key.push_back(key_template[i++]);
+      continue;
+    }
+    std::size_t end = i + 1;
+    while (end < key_template.size() &&
+           (std::isalnum(static_cast<unsigned char>(key_template[end])) ||
+            key_template[end] == '_')) {
+      end++;
+    }
+    std::string name = key_template.substr(i + 1, end - i - 1);
+    std::size_t query_pos = request.target.find('?');
+    if (name == "request_method") {
+      key.append(method_name(request.method));
+    } else if (name == "host") {
+      key.append(Config::normalize_host(header_value(request, "host")));
+    } else if (name == "request_uri") {
+      key.append(request.target);
+    } else if (name == "uri") {
+      key.append(request.target, 0, query_pos);
+    } else if (name == "args") {
+      if (query_pos != std::string::npos) {
+        key.append(request.target, query_pos + 1, std::string::npos);
+      }
+    } else if (name.compare(0, 5, "http_") == 0) {
+      std::string header = to_lower(name.substr(5));
+      for (std::size_t j = 0; j < header.size(); ++j) {
+        if (header[j] == '_') {
+          header[j] = '-';
+        }
+      }
+      key.append(header_value(request, header));
+    } else {
+      key.append(key_template, i, end - i);
+    }
+    // Keeps "$uri$args" of /a?bc apart from that of /ab?c
+    key.push_back('\n');
+    i = end;
+  }
+  return key;
+}
+
+std::size_t CgiCache::entry_bytes_(const std::string& key,
+                                   const Entry& entry) {
+  return key.size() * 2 + entry.response.size();
+}
+
+void CgiCache::erase_(Zone& zone, std::map<std::string, Entry>::iterator it) {
+  zone.bytes -= entry_bytes_(it->first, it->second);
+  zone.lru.erase(it->second.lru_pos);
+  zone.entries.erase(it);
+}
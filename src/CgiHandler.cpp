@@ -15,12 +15,14 @@
 #include "Server.hpp"
 #include "CgiResponseHandler.hpp"
 #include "pollfd_utils.hpp"
+#include "pipe_utils.hpp"
+#include "spawn_utils.hpp"
 #include "string_utils.hpp"
 
 CgiHandler::CgiHandler(const Request& request,
                        const std::string& query_string,
                        const std::string& script_uri,
-                       const std::string& server_name,
+                       const std::string& cgi_env,
                        const std::string& server_port,
                        const std::string& remote_addr)
     : request_(request),
@@ -29,18 +31,13 @@ CgiHandler::CgiHandler(const Request& request,
       cgi_pid_(-1),
       query_string_(query_string),
       script_uri_(script_uri),
-      server_name_(server_name),
+      cgi_env_(cgi_env),
       server_port_(server_port),
       remote_addr_(remote_addr) {}
 
 CgiHandler::~CgiHandler() {
 }
 
-static void cgi_error_exit(const char* func_name, int code) {
-  std::cerr << "Error: " << func_name << "\n";
-  std::exit(code);
-}
-
 static int set_nonblocking(int fd) {
   int flags = fcntl(fd, F_GETFL, 0);
   if (flags == -1) {
@@ -52,18 +49,6 @@ static int set_nonblocking(int fd) {
   return 0;
 }
 
-static std::string prepare_script_name(const std::string& script_path) {
-  std::size_t slash = script_path.rfind('/');
-  if (slash == std::string::npos) {
-    return script_path;
-  }
-  std::string script_dir = script_path.substr(0, slash);
-  if (chdir(script_dir.c_str()) == -1) {
-    cgi_error_exit("chdir", -1);
-  }
-  return script_path.substr(slash + 1);
-}
-
 static bool is_executable_regular_file(const std::string& path) {
   struct stat st;
   if (stat(path.c_str(), &st) != 0) {
@@ -81,36 +66,65 @@ static bool is_executable_regular_file(const std::string& path) {
 static CgiHandler::ExecArgv build_exec_argv(const std::string& script_name,
                                             const std::string& cgi_path) {
   CgiHandler::ExecArgv execargv;
-  if (!is_executable_regular_file(script_name)) 
-  return execargv;
-
   execargv.file = cgi_path;
   execargv.argv.push_back(execargv.file);
   execargv.argv.push_back(script_name);
   return execargv;
 }
 
-void CgiHandler::exec_cgi_child(int pipe_in[2], int pipe_out[2], const std::string& script_path, const std::string& cgi_path) {
+static void close_pipes(int pipe_in[2], int pipe_out[2]) {
+  close(pipe_in[0]);
   close(pipe_in[1]);
-  if (dup2(pipe_in[0], STDIN_FILENO) == -1) {
-    cgi_error_exit("dup2(stdin)", -1);
+  close(pipe_out[0]);
+  close(pipe_out[1]);
+}
+
+// Everything the child needs is built here, in the parent, so that the child
+// only has to redirect, change directory and exec.
+int CgiHandler::execute_cgi(const std::string& script_path, const std::string& cgi_path,
+                            const ProcessLimits& limits) {
+  if (!is_executable_regular_file(script_path)) {
+    std::cerr << "Error: CGI script is not executable: " << script_path << "\n";
+    return kSpawnFailed;
   }
-  close(pipe_in[0]);
 
-  close(pipe_out[0]);
-  if (dup2(pipe_out[1], STDOUT_FILENO) == -1) {
-    cgi_error_exit("dup2(stdout)", -1);
+  std::string script_dir;
+  std::string script_name = script_path;
+  std::size_t slash = script_path.rfind('/');
+  if (slash != std::string::npos) {
+    script_dir = script_path.substr(0, slash);
+    script_name = script_path.substr(slash + 1);
   }
-  close(pipe_out[1]);
 
-  std::string script_name = prepare_script_name(script_path);
+  int pipe_in[2];
+  int pipe_out[2];
+  if (pipe(pipe_in) == -1) {
+    std::cerr << "Error: pipe " << "\n";
+    return -1;
+  }
+  if (pipe(pipe_out) == -1) {
+    std::cerr << "Error: pipe " << "\n";
+    close(pipe_in[0]);
+    close(pipe_in[1]);
+    return -1;
+  }
+  // The child gets its ends through dup2, which drops FD_CLOEXEC
+  if (set_cloexec(pipe_in[0]) == -1 || set_cloexec(pipe_in[1]) == -1 ||
+      set_cloexec(pipe_out[0]) == -1 || set_cloexec(pipe_out[1]) == -1) {
+    std::cerr << "Error: fcntl "  << "\n";
+    close_pipes(pipe_in, pipe_out);
+    return -1;
+  }
+  enlarge_pipe(pipe_in[1]);
+  enlarge_pipe(pipe_out[0]);
 
-  MetaVariables env = \
-  MetaVariables::from_request(request_, script_uri_, query_string_,
-                                  server_name_, server_port_, remote_addr_);
+  MetaVariables env =
+      MetaVariables::from_request(request_, script_uri_, query_string_,
+                                  cgi_env_, server_port_, remote_addr_);
+  EnvBlock env_block;
+  env.render(env_block);
 
   ExecArgv eargv = build_exec_argv(script_name, cgi_path);
-
   std::vector<char*> argv_ptrs;
   argv_ptrs.reserve(eargv.argv.size() + 1);
   for (std::size_t i = 0; i < eargv.argv.size(); ++i) {
@@ -118,33 +132,13 @@ void CgiHandler::exec_cgi_child(int pipe_in[2], int pipe_out[2], const std::stri
   }
   argv_ptrs.push_back(NULL);
 
-  execve(eargv.file.c_str(), &argv_ptrs[0], env.build_envp());
-
-  cgi_error_exit("execve", 127);
-}
-
-int CgiHandler::execute_cgi(const std::string& script_path, const std::string& cgi_path) {  
-  int pipe_in[2];
-  int pipe_out[2];
-
-  if (pipe(pipe_in) == -1 || pipe(pipe_out) == -1) {
-    std::cerr << "Error: pipe " << "\n";
-    return -1;
-  }
-
-  cgi_pid_ = fork();
+  cgi_pid_ = spawn_process(eargv.file.c_str(), &argv_ptrs[0], env_block.envp(),
+                           pipe_in[0], pipe_out[1], script_dir, limits);
 
   if (cgi_pid_ == -1) {
-    std::cerr << "Error: fork "  << "\n";
-    close(pipe_in[0]);  
-    close(pipe_in[1]);
-    close(pipe_out[0]); 
-    close(pipe_out[1]);
-    return -1;
-  }
-
-  if (cgi_pid_ == 0) {
-    exec_cgi_child(pipe_in, pipe_out, script_path, cgi_path);
+    std::cerr << "Error: spawn " << cgi_path << "\n";
+    close_pipes(pipe_in, pipe_out);
+    return kSpawnFailed;
   }
 
   close(pipe_in[0]);
@@ -160,5 +154,3 @@ int CgiHandler::execute_cgi(const std::string& script_path, const std::string& c
   
   return 0; // 成功
 }
-
-
@@ -1,6 +1,8 @@
 #include "CgiInputHandler.hpp"
+#include "CgiInputRelay.hpp"
 #include "Server.hpp"
 
+#include <poll.h>
 #include <unistd.h>
 #include <cstring>
 #include <iostream>
@@ -14,35 +16,67 @@ static int64_t now_time_cgi_in() {
 
 CgiInputHandler::CgiInputHandler(int pipe_in_fd, pid_t cgi_pid,
                                  const std::string& body, Server& server,
-                                 int client_fd)
+                                 int client_fd, bool keep_fd_open)
     : pipe_in_fd_(pipe_in_fd),
       cgi_pid_(cgi_pid),
       body_(body),
       bytes_written_(0),
       client_fd_(client_fd),
       server_(server),
+      keep_fd_open_(keep_fd_open),
+      relay_(NULL),
+      waiting_(false),
       start_sec_(now_time_cgi_in()),
-      last_activity_sec_(start_sec_) {
+      last_activity_sec_(start_sec_),
+      send_timeout_sec_(kCgiInputTimeoutSec) {
   deadline_sec_ = start_sec_ + kCgiInputTimeoutSec;
 }
 
+CgiInputHandler::CgiInputHandler(int pipe_in_fd, pid_t cgi_pid,
+                                 CgiInputRelay* relay, Server& server,
+                                 int client_fd)
+    : pipe_in_fd_(pipe_in_fd),
+      cgi_pid_(cgi_pid),
+      bytes_written_(0),
+      client_fd_(client_fd),
+      server_(server),
+      keep_fd_open_(false),
+      relay_(relay),
+      waiting_(false),
+      start_sec_(now_time_cgi_in()),
+      last_activity_sec_(start_sec_),
+      send_timeout_sec_(kCgiInputTimeoutSec) {
+  deadline_sec_ = start_sec_ + kCgiInputTimeoutSec;
+  relay_->attach_consumer(this, pipe_in_fd_);
+}
+
 CgiInputHandler::~CgiInputHandler() {
+  if (relay_ != NULL) {
+    relay_->detach_consumer();
+  }
   close_in_fd_();
 }
 
 void CgiInputHandler::close_in_fd_() {
   if (pipe_in_fd_ != -1) {
-    close(pipe_in_fd_);
+    if (!keep_fd_open_) {
+      close(pipe_in_fd_);
+    }
     pipe_in_fd_ = -1;
   }
 }
 
-bool CgiInputHandler::has_deadline() const { return true; }
+bool CgiInputHandler::has_deadline() const { return !waiting_; }
 int64_t CgiInputHandler::deadline_sec() const { return deadline_sec_; }
 
+void CgiInputHandler::set_send_timeout(int64_t timeout_sec) {
+  send_timeout_sec_ = timeout_sec;
+  deadline_sec_ = last_activity_sec_ + send_timeout_sec_;
+}
+
 void CgiInputHandler::update_deadline_() {
   last_activity_sec_ = now_time_cgi_in();
-  deadline_sec_ = last_activity_sec_ + kCgiInputTimeoutSec;
+  deadline_sec_ = last_activity_sec_ + send_timeout_sec_;
   server_.update_timeout(pipe_in_fd_);
   // Keep the parent connection alive while CGI stdin is still flowing.
   if (client_fd_ >= 0) {
@@ -59,7 +93,47 @@ HandlerStatus CgiInputHandler::handle_input() {
   return kHandlerContinue;
 }
 
+void CgiInputHandler::resume_input() {
+  if (waiting_ && pipe_in_fd_ != -1) {
+    waiting_ = false;
+    server_.set_fd_events(pipe_in_fd_, POLLOUT);
+    update_deadline_();
+  }
+}
+
+HandlerStatus CgiInputHandler::write_from_relay_() {
+  if (relay_->has_failed() || relay_->is_done()) {
+    close_in_fd_();
+    return kCgiInputDone;
+  }
+  if (relay_->buffered() == 0) {
+    // The client splices into the pipe itself and only needed to hear
+    // that the script made room
+    relay_->pipe_writable();
+    // Sleep until the client sends more; its own timeout still applies
+    waiting_ = true;
+    server_.set_fd_events(pipe_in_fd_, 0);
+    server_.update_timeout(pipe_in_fd_);
+    return kHandlerContinue;
+  }
+
+  ssize_t n = write(pipe_in_fd_, relay_->data(), relay_->buffered());
+  if (n == -1) {
+    return handle_poll_error();
+  }
+  relay_->consume(static_cast<std::size_t>(n));
+  update_deadline_();
+  if (relay_->is_done()) {
+    close_in_fd_();
+    return kCgiInputDone;
+  }
+  return kHandlerContinue;
+}
+
 HandlerStatus CgiInputHandler::handle_output() {
+  if (relay_ != NULL) {
+    return write_from_relay_();
+  }
   if (body_.empty() || bytes_written_ >= body_.size()) {
     close_in_fd_();
     return kCgiInputDone;
@@ -0,0 +1,112 @@
+#include "CgiInputRelay.hpp"
+
+#include "ClientHandler.hpp"
+#include "pipe_utils.hpp"
+
+CgiInputRelay::CgiInputRelay(ClientHandler* producer)
+    : producer_(producer),
+      consumer_(NULL),
+      pipe_fd_(-1),
+      producer_waiting_(false),
+      read_offset_(0),
+      done_(false),
+      failed_(false) {}
+
+void CgiInputRelay::append(const std::string& data) {
+  // A CGI that stopped reading gets nothing more; the rest is dropped
+  if (data.empty() || consumer_ == NULL) {
+    return;
+  }
+  buffer_.append(data);
+  wake_consumer_();
+}
+
+void CgiInputRelay::finish() {
+  done_ = true;
+  wake_consumer_();
+}
+
+void CgiInputRelay::fail() {
+  failed_ = true;
+  wake_consumer_();
+}
+
+void CgiInputRelay::attach_consumer(RelayConsumer* consumer, int pipe_fd) {
+  consumer_ = consumer;
+  pipe_fd_ = pipe_fd;
+}
+
+bool CgiInputRelay::can_splice() const {
+#ifdef WEBSERV_HAVE_SPLICE
+  return consumer_ != NULL && pipe_fd_ != -1 && !done_ && !failed_ &&
+         buffered() == 0;
+#else
+  return false;
+#endif
+}
+
+std::size_t CgiInputRelay::pipe_space() const {
+  return pipe_free_space(pipe_fd_);
+}
+
+ssize_t CgiInputRelay::splice_from(int fd, std::size_t max_bytes) {
+  return splice_bytes(fd, pipe_fd_, max_bytes);
+}
+
+void CgiInputRelay::wait_for_space() {
+  producer_waiting_ = true;
+  wake_consumer_();
+}
+
+void CgiInputRelay::pipe_writable() {
+  if (producer_waiting_ && producer_ != NULL) {
+    producer_->resume_body();
+  }
+  producer_waiting_ = false;
+}
+
+void CgiInputRelay::wake_consumer_() {
+  if (consumer_ != NULL) {
+    consumer_->resume_input();
+  }
+}
+
+void CgiInputRelay::consume(std::size_t len) {
+  read_offset_ += len;
+  if (read_offset_ == buffer_.size()) {
+    buffer_.clear();
+    read_offset_ = 0;
+  } else if (read_offset_ >= kLowWatermark) {
+    buffer_.erase(0, read_offset_);
+    read_offset_ = 0;
+  }
+  if (producer_ != NULL && buffered() <= kLowWatermark) {
+    producer_->resume_body();
+  }
+}
+
+void CgiInputRelay::detach_producer() {
+  producer_ = NULL;
+  if (!done_) {
+    fail();
+  }
+  delete_if_unused_();
+}
+
+void CgiInputRelay::detach_consumer() {
+  consumer_ = NULL;
+  pipe_fd_ = -1;
+  buffer_.clear();
+  read_offset_ = 0;
+  // A paused producer has to go on reading, only to discard
+  if (producer_ != NULL) {
+    producer_->resume_body();
+  }
+  delete_if_unused_();
+}
+
+void CgiInputRelay::delete_if_unused_() {
+  if (producer_ == NULL && consumer_ == NULL) {
+    delete this;
+  }
+}
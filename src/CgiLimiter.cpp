@@ -0,0 +1,135 @@
+#include "CgiLimiter.hpp"
+
+#include <sstream>
+
+#include "ClientHandler.hpp"
+#include "Server.hpp"
+
+void CgiLimiter::configure(const Config& config) {
+  const std::vector<ServerContext>& servers = config.get_configs();
+  for (std::size_t i = 0; i < servers.size(); ++i) {
+    const ServerContext& sc = servers[i];
+    for (std::size_t j = 0; j < sc.locations.size(); ++j) {
+      const LocationContext& lc = sc.locations[j];
+      if (lc.cgi_max_concurrent == 0) {
+        continue;
+      }
+      Slot& slot = slots_[&lc];
+      slot.label = sc.server_names[0] + lc.path;
+      slot.max_running = static_cast<std::size_t>(lc.cgi_max_concurrent);
+      slot.max_queued = static_cast<std::size_t>(lc.cgi_queue_size);
+      slot.running = 0;
+      slot.started = 0;
+      slot.queued = 0;
+      slot.rejected = 0;
+      slot.timed_out = 0;
+    }
+  }
+}
+
+CgiLimiter::Admission CgiLimiter::admit(const LocationContext& lc,
+                                        int client_fd, unsigned long serial) {
+  std::map<const LocationContext*, Slot>::iterator it = slots_.find(&lc);
+  if (it == slots_.end()) {
+    return kAdmitted;
+  }
+  Slot& slot = it->second;
+  // Waiters go first, even when a slot has just been freed
+  if (slot.running < slot.max_running && slot.queue.empty()) {
+    slot.running++;
+    slot.started++;
+    return kAdmitted;
+  }
+  if (slot.queue.size() >= slot.max_queued) {
+    slot.rejected++;
+    return kRejected;
+  }
+  Waiter waiter;
+  waiter.client_fd = client_fd;
+  waiter.serial = serial;
+  slot.queue.push_back(waiter);
+  slot.queued++;
+  return kQueued;
+}
+
+bool CgiLimiter::has_free_slot(const LocationContext& lc) const {
+  std::map<const LocationContext*, Slot>::const_iterator it = slots_.find(&lc);
+  if (it == slots_.end()) {
+    return true;
+  }
+  return it->second.running < it->second.max_running &&
+         it->second.queue.empty();
+}
+
+void CgiLimiter::release(const LocationContext& lc) {
+  std::map<const LocationContext*, Slot>::iterator it = slots_.find(&lc);
+  if (it != slots_.end() && it->second.running > 0) {
+    it->second.running--;
+  }
+}
+
+void CgiLimiter::cancel(const LocationContext& lc, int client_fd,
+                        unsigned long serial, bool timed_out) {
+  std::map<const LocationContext*, Slot>::iterator it = slots_.find(&lc);
+  if (it == slots_.end()) {
+    return;
+  }
+  std::deque<Waiter>& queue = it->second.queue;
+  for (std::deque<Waiter>::iterator w = queue.begin(); w != queue.end(); ++w) {
+    if (w->client_fd == client_fd && w->serial == serial) {
+      queue.erase(w);
+      if (timed_out) {
+        it->second.timed_out++;
+      }
+      return;
+    }
+  }
+}
+
+bool CgiLimiter::has_pending_dispatch() const {
+  for (std::map<const LocationContext*, Slot>::const_iterator it =
+           slots_.begin();
+       it != slots_.end(); ++it) {
+    if (it->second.running < it->second.max_running &&
+        !it->second.queue.empty()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// A waiter that fails to start releases its slot right away, so the loop
+// simply goes on with the next one
+void CgiLimiter::dispatch(Server& server) {
+  for (std::map<const LocationContext*, Slot>::iterator it = slots_.begin();
+       it != slots_.end(); ++it) {
+    Slot& slot = it->second;
+    while (slot.running < slot.max_running && !slot.queue.empty()) {
+      Waiter waiter = slot.queue.front();
+      slot.queue.pop_front();
+      ClientHandler* client =
+          server.find_client_handler(waiter.client_fd, waiter.serial);
+      if (client == NULL) {
+        continue;
+      }
+      slot.running++;
+      slot.started++;
+      client->start_queued_cgi();
+    }
+  }
+}
+
+void CgiLimiter::report(std::string& out) const {
+  for (std::map<const LocationContext*, Slot>::const_iterator it =
+           slots_.begin();
+       it != slots_.end(); ++it) {
+    const Slot& slot = it->second;
+    std::ostringstream line;
+    line << "cgi " << slot.label << ": running " << slot.running << "/"
+         << slot.max_running << ", waiting " << slot.queue.size() << "/"
+         << slot.max_queued << ", started " << slot.started << ", queued "
+         << slot.queued << ", rejected " << slot.rejected
+         << ", queue_timeouts " << slot.timed_out << "\n";
+    out += line.str();
+  }
+}
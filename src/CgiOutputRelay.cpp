@@ -0,0 +1,183 @@
+#include "CgiOutputRelay.hpp"
+
+#include <poll.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "Server.hpp"
+#include "pipe_utils.hpp"
+
+namespace {
+class RelaySource : public BodySource {
+  CgiOutputRelay* relay_;
+
+  RelaySource(const RelaySource&);
+  RelaySource& operator=(const RelaySource&);
+
+ public:
+  explicit RelaySource(CgiOutputRelay* relay) : relay_(relay) {}
+  ~RelaySource() { relay_->detach_consumer(); }
+  BodyStatus read_some(std::string& out, std::size_t max_bytes) {
+    return relay_->read_some(out, max_bytes);
+  }
+  std::size_t spliceable() { return relay_->spliceable(); }
+  ssize_t splice_to(int fd, std::size_t max_bytes) {
+    return relay_->splice_to(fd, max_bytes);
+  }
+  void disable_splice() { relay_->disable_splice(); }
+};
+}  // namespace
+
+CgiOutputRelay::CgiOutputRelay(Server& server, int client_fd,
+                               RelayProducer* producer)
+    : server_(server),
+      client_fd_(client_fd),
+      producer_(producer),
+      read_offset_(0),
+      pipe_fd_(-1),
+      owns_pipe_(false),
+      may_splice_(true),
+      done_(false),
+      failed_(false),
+      has_consumer_(false),
+      consumer_waiting_(false) {}
+
+BodySource* CgiOutputRelay::open_source() {
+  has_consumer_ = true;
+  return new RelaySource(this);
+}
+
+void CgiOutputRelay::append(const char* data, std::size_t len) {
+  if (len == 0) {
+    return;
+  }
+  buffer_.append(data, len);
+  wake_consumer_();
+}
+
+void CgiOutputRelay::finish() {
+  done_ = true;
+  // Only called once the pipe is empty, unless the pipe was handed over
+  if (!owns_pipe_) {
+    pipe_fd_ = -1;
+  }
+  wake_consumer_();
+}
+
+void CgiOutputRelay::fail() {
+  failed_ = true;
+  close_pipe_();
+  wake_consumer_();
+}
+
+void CgiOutputRelay::enable_splice(int pipe_fd) {
+#ifdef WEBSERV_HAVE_SPLICE
+  if (may_splice_) {
+    pipe_fd_ = pipe_fd;
+  }
+#else
+  (void)pipe_fd;
+#endif
+}
+
+void CgiOutputRelay::pipe_readable() {
+  wake_consumer_();
+}
+
+void CgiOutputRelay::hand_over_pipe() {
+  owns_pipe_ = true;
+  finish();
+}
+
+void CgiOutputRelay::close_pipe_() {
+  if (owns_pipe_ && pipe_fd_ != -1) {
+    close(pipe_fd_);
+  }
+  owns_pipe_ = false;
+  pipe_fd_ = -1;
+}
+
+// Buffered bytes go first; after them, whatever the pipe holds
+std::size_t CgiOutputRelay::spliceable() {
+  if (pipe_fd_ == -1 || failed_ || buffered() > 0) {
+    return 0;
+  }
+  std::size_t available = pipe_buffered(pipe_fd_);
+  if (available == 0) {
+    if (owns_pipe_) {
+      close_pipe_();
+    } else if (producer_ != NULL) {
+      producer_->resume_output();
+    }
+  }
+  return available;
+}
+
+ssize_t CgiOutputRelay::splice_to(int fd, std::size_t max_bytes) {
+  return splice_bytes(pipe_fd_, fd, max_bytes);
+}
+
+void CgiOutputRelay::wake_consumer_() {
+  if (consumer_waiting_ && has_consumer_) {
+    consumer_waiting_ = false;
+    server_.add_fd_events(client_fd_, POLLOUT);
+  }
+}
+
+BodyStatus CgiOutputRelay::read_some(std::string& out, std::size_t max_bytes) {
+  if (failed_) {
+    return kBodyError;
+  }
+  std::size_t available = buffer_.size() - read_offset_;
+  if (available == 0) {
+    if (done_ && pipe_fd_ == -1) {
+      return kBodyDone;
+    }
+    consumer_waiting_ = true;
+    return kBodyWait;
+  }
+
+  std::size_t len = std::min(available, max_bytes);
+  out.append(buffer_, read_offset_, len);
+  read_offset_ += len;
+  if (read_offset_ == buffer_.size()) {
+    buffer_.clear();
+    read_offset_ = 0;
+  } else if (read_offset_ >= kLowWatermark) {
+    buffer_.erase(0, read_offset_);
+    read_offset_ = 0;
+  }
+  if (producer_ != NULL && buffered() <= kLowWatermark) {
+    producer_->resume_output();
+  }
+  if (done_ && buffer_.empty() && pipe_fd_ == -1) {
+    return kBodyDone;
+  }
+  return kBodyMore;
+}
+
+void CgiOutputRelay::detach_producer() {
+  producer_ = NULL;
+  if (!done_) {
+    failed_ = true;
+    wake_consumer_();
+  }
+  delete_if_unused_();
+}
+
+void CgiOutputRelay::detach_consumer() {
+  has_consumer_ = false;
+  // A paused producer has to notice that nobody is reading any more
+  if (producer_ != NULL) {
+    producer_->resume_output();
+  }
+  delete_if_unused_();
+}
+
+void CgiOutputRelay::delete_if_unused_() {
+  if (producer_ == NULL && !has_consumer_) {
+    close_pipe_();
+    delete this;
+  }
+}
@@ -1,10 +1,11 @@
 #include "CgiResponseHandler.hpp"
 #include "Response.hpp"
 
+#include <poll.h>
 #include <unistd.h>
 #include <sys/wait.h>
-#include <signal.h>
 
+#include <cerrno>
 #include <cstring>
 #include <iostream>
 #include <sstream>
@@ -14,7 +15,12 @@
 
 #include "Server.hpp"
 #include "ClientHandler.hpp"
+#include "CgiCache.hpp"
+#include "CgiOutputRelay.hpp"
+#include "CgiWorkerPool.hpp"
 #include "RequestProcessor.hpp"
+#include "pipe_utils.hpp"
+#include "spawn_utils.hpp"
 #include "string_utils.hpp"
 
 namespace {
@@ -68,9 +74,7 @@ static Response build_response_from_parsed(
     const ServerContext& target_config) {
   Response response;
   if (!parsed.is_valid) {
-    response.prepare_error_response(
-        kBadGateway,
-        RequestProcessor::get_error_page_path(target_config, kBadGateway));
+    response = RequestProcessor::make_error_response(target_config, kBadGateway);
     return response;
   }
 
@@ -92,6 +96,19 @@ static Response build_response_from_parsed(
   return response;
 }
 
+// Status line and headers only; the body is relayed as it arrives
+static Response build_stream_head(
+    const CgiResponseHandler::ParsedCgiOutput& parsed) {
+  Response response;
+  response.set_status_code(parsed.status_code);
+  for (std::map<std::string, std::string>::const_iterator it =
+           parsed.headers.begin();
+       it != parsed.headers.end(); ++it) {
+    response.add_header(it->first, it->second);
+  }
+  return response;
+}
+
 static bool parse_header_line(const std::string& line, bool& seen_status,
                               std::string& status_line,
                               std::map<std::string, std::string>& headers) {
@@ -154,9 +171,25 @@ static bool apply_content_type_location_rules(
 bool CgiResponseHandler::has_deadline() const { return true; }
 int64_t CgiResponseHandler::deadline_sec() const { return deadline_sec_; }
 
+void CgiResponseHandler::set_timeouts(const LocationContext& lc) {
+  read_timeout_sec_ = lc.cgi_read_timeout_sec;
+  total_deadline_sec_ = lc.cgi_total_timeout_sec > 0
+                            ? start_sec_ + lc.cgi_total_timeout_sec
+                            : 0;
+  deadline_sec_ = last_activity_sec_ + read_timeout_sec_;
+  if (total_deadline_sec_ != 0 && total_deadline_sec_ < deadline_sec_) {
+    deadline_sec_ = total_deadline_sec_;
+  }
+}
+
+// Whichever comes first: the script going quiet for too long, or the end
+// of the whole run
 void CgiResponseHandler::update_deadline_() {
   last_activity_sec_ = now_time_cgi_out();
-  deadline_sec_ = last_activity_sec_ + kCgiTimeoutSec;
+  deadline_sec_ = last_activity_sec_ + read_timeout_sec_;
+  if (total_deadline_sec_ != 0 && total_deadline_sec_ < deadline_sec_) {
+    deadline_sec_ = total_deadline_sec_;
+  }
   server_.update_timeout(out_fd_);
   // Keep the parent connection alive while CGI stdout is still flowing.
   if (client_fd_ >= 0) {
@@ -169,51 +202,216 @@ CgiResponseHandler::CgiResponseHandler(int out_fd, pid_t cgi_pid, Server& server
       cgi_pid_(cgi_pid),
       server_(server),
       client_fd_(client_fd),
+      client_serial_(server.client_serial(client_fd)),
       target_config_(target_config),
       cgi_output_(),
+      worker_(NULL),
+      worker_reusable_(false),
+      frame_length_(0),
+      frame_exit_status_(0),
+      frame_header_parsed_(false),
+      relay_(NULL),
+      paused_(false),
+      buffer_to_eof_(false),
+      exited_(false),
+      exit_status_(0),
+      exit_notify_fd_(-1),
+      cgi_slot_(NULL),
+      cache_(NULL),
+      owns_fill_(false),
       finished_(false),
       start_sec_(now_time_cgi_out()),
-      last_activity_sec_(start_sec_) {
+      last_activity_sec_(start_sec_),
+      read_timeout_sec_(kCgiTimeoutSec),
+      total_deadline_sec_(0) {
+  deadline_sec_ = start_sec_ + kCgiTimeoutSec;
+  server_.child_reaper().watch(cgi_pid_, this);
+}
+
+CgiResponseHandler::CgiResponseHandler(CgiWorker* worker, Server& server,
+                                       int client_fd,
+                                       const ServerContext& target_config)
+    : out_fd_(worker->out_fd),
+      cgi_pid_(-1),
+      server_(server),
+      client_fd_(client_fd),
+      client_serial_(server.client_serial(client_fd)),
+      target_config_(target_config),
+      cgi_output_(),
+      worker_(worker),
+      worker_reusable_(false),
+      frame_length_(0),
+      frame_exit_status_(0),
+      frame_header_parsed_(false),
+      relay_(NULL),
+      paused_(false),
+      buffer_to_eof_(false),
+      exited_(false),
+      exit_status_(0),
+      exit_notify_fd_(-1),
+      cgi_slot_(NULL),
+      cache_(NULL),
+      owns_fill_(false),
+      finished_(false),
+      start_sec_(now_time_cgi_out()),
+      last_activity_sec_(start_sec_),
+      read_timeout_sec_(kCgiTimeoutSec),
+      total_deadline_sec_(0) {
   deadline_sec_ = start_sec_ + kCgiTimeoutSec;
 }
 
 CgiResponseHandler::~CgiResponseHandler() {
+  if (relay_ != NULL) {
+    relay_->detach_producer();
+    relay_ = NULL;
+  }
+  // Released here rather than on completion, once the fd left the poll set
+  if (worker_ != NULL && worker_reusable_ &&
+      !server_.is_registered(worker_->in_fd)) {
+    server_.cgi_worker_pool().release(worker_);
+    worker_ = NULL;
+    out_fd_ = -1;
+  }
   cleanup_cgi_();
+  if (cgi_slot_ != NULL) {
+    server_.cgi_limiter().release(*cgi_slot_);
+  }
+  drop_cache_();
+}
+
+void CgiResponseHandler::cache_into(const CgiCacheConfig& cc,
+                                    const std::string& key, bool owns_fill) {
+  cache_ = &cc;
+  cache_key_ = key;
+  owns_fill_ = owns_fill;
+}
+
+// Nothing to share: the waiters run the script themselves, and the next
+// stale hit tries the refresh again
+void CgiResponseHandler::drop_cache_() {
+  if (cache_ != NULL && owns_fill_) {
+    server_.cgi_cache().finish_fill(server_, *cache_, cache_key_, NULL);
+  }
+  cache_ = NULL;
 }
 
 void CgiResponseHandler::cleanup_cgi_() {
+  if (worker_ != NULL) {
+    // The worker's pipes are closed with it
+    server_.cgi_worker_pool().discard(worker_);
+    worker_ = NULL;
+    out_fd_ = -1;
+  }
   if (out_fd_ != -1) {
     close(out_fd_);
     out_fd_ = -1;
   }
+  if (exit_notify_fd_ != -1) {
+    close(exit_notify_fd_);
+    exit_notify_fd_ = -1;
+  }
 
+  // Reaped later by the ChildReaper, the loop never waits for it
   if (cgi_pid_ > 0) {
-    kill(cgi_pid_, SIGKILL);
-    int status;
-    waitpid(cgi_pid_, &status, 0);
+    if (!exited_) {
+      server_.child_reaper().terminate(cgi_pid_);
+    }
     cgi_pid_ = -1;
   }
 }
 
+void CgiResponseHandler::child_exited(pid_t, int status) {
+  exited_ = true;
+  exit_status_ = status;
+  if (exit_notify_fd_ != -1) {
+    close(exit_notify_fd_);
+    exit_notify_fd_ = -1;
+  }
+}
+
+// A script still running after closing stdout is judged by its output alone
 bool CgiResponseHandler::is_cgi_error_() {
-  if (cgi_pid_ <= 0) {
+  if (!exited_) {
     return false;
   }
+  return (WIFEXITED(exit_status_) && WEXITSTATUS(exit_status_) != 0) ||
+         WIFSIGNALED(exit_status_);
+}
 
-  int status;
-  pid_t wpid = waitpid(cgi_pid_, &status, 0);
-
-  if (wpid != cgi_pid_) {
+// The output ended but the exit status is not in yet, usually because
+// stdout closes a moment before the script can be reaped. Its pipe only
+// reports hangups from now on, so the fd number is taken over by a quiet
+// pipe that child_exited() closes, and the wait is capped by kExitWaitSec.
+// Only a pipe the script has closed and that holds nothing more is taken
+// over; replacing a live one would kill the script with EPIPE.
+bool CgiResponseHandler::wait_for_exit_() {
+  if (cgi_pid_ <= 0 || exited_ || exit_notify_fd_ != -1) {
+    return false;
+  }
+  if (!pipe_hung_up(out_fd_) || pipe_buffered(out_fd_) != 0) {
+    return false;
+  }
+  int fds[2];
+  if (pipe(fds) == -1) {
     return false;
   }
+  if (set_cloexec(fds[1]) == -1 || dup2(fds[0], out_fd_) == -1 ||
+      set_cloexec(out_fd_) == -1) {
+    close(fds[0]);
+    close(fds[1]);
+    return false;
+  }
+  close(fds[0]);
+  exit_notify_fd_ = fds[1];
+  paused_ = false;
+  server_.set_fd_events(out_fd_, POLLIN);
+  deadline_sec_ = now_time_cgi_out() + kExitWaitSec;
+  server_.update_timeout(out_fd_);
+  return true;
+}
 
-  return (WIFEXITED(status) && WEXITSTATUS(status) != 0) ||
-         WIFSIGNALED(status);
+HandlerStatus CgiResponseHandler::finish_output_() {
+  if (relay_ != NULL) {
+    finish_relay_();
+    return kCgiInputDone;
+  }
+  finished_ = true;
+  handle_cgi_completion_(is_cgi_error_());
+  return kCgiInputDone;
 }
 
 void CgiResponseHandler::handle_cgi_completion_(bool cgi_error) {
-  const ParsedCgiOutput parsed = parse_cgi_output_(cgi_output_);
-  ClientHandler* ch = server_.find_client_handler(client_fd_);
+  if (cache_ != NULL && !cgi_error) {
+    const ParsedCgiOutput parsed = parse_cgi_output_(cgi_output_);
+    if (parsed.is_valid && !parsed.is_local_redirect) {
+      Response response = build_response_from_parsed(parsed, target_config_);
+      std::string serialized = response.serialize();
+      CgiCache& cache = server_.cgi_cache();
+      cache.store(*cache_, cache_key_, parsed.status_code, parsed.headers,
+                  response);
+      if (owns_fill_) {
+        cache.finish_fill(server_, *cache_, cache_key_, &serialized);
+      }
+      cache_ = NULL;
+      ClientHandler* ch =
+          server_.find_client_handler(client_fd_, client_serial_);
+      if (ch != NULL) {
+        ch->cgi_response_ready(serialized);
+      }
+      return;
+    }
+  }
+  deliver_output(server_, client_fd_, client_serial_, target_config_,
+                 cgi_output_, cgi_error);
+}
+
+void CgiResponseHandler::deliver_output(Server& server, int client_fd,
+                                        unsigned long client_serial,
+                                        const ServerContext& target_config,
+                                        const std::string& cgi_output,
+                                        bool cgi_error) {
+  const ParsedCgiOutput parsed = parse_cgi_output_(cgi_output);
+  ClientHandler* ch = server.find_client_handler(client_fd, client_serial);
   if (ch == NULL) {
     return;
   }
@@ -225,11 +423,9 @@ void CgiResponseHandler::handle_cgi_completion_(bool cgi_error) {
 
     Response response;
     if (cgi_error || !parsed.is_valid) {
-      response.prepare_error_response(
-          kBadGateway,
-          RequestProcessor::get_error_page_path(target_config_, kBadGateway));
+      response = RequestProcessor::make_error_response(target_config, kBadGateway);
     } else {
-      response = build_response_from_parsed(parsed, target_config_);
+      response = build_response_from_parsed(parsed, target_config);
     }
   ch->cgi_response_ready(response.serialize());
 }
@@ -295,14 +491,31 @@ HandlerStatus CgiResponseHandler::handle_timeout() {
   if (finished_){ 
     return kCgiInputDone;
   }
+  if (exit_notify_fd_ != -1) {
+    return finish_output_();
+  }
+  // A script reading a slow upload may have nothing to say until the end,
+  // but it still has to be done within cgi_total_timeout
+  ClientHandler* owner =
+      server_.find_client_handler(client_fd_, client_serial_);
+  bool overran = total_deadline_sec_ != 0 &&
+                 now_time_cgi_out() >= total_deadline_sec_;
+  if (relay_ == NULL && owner != NULL && owner->is_receiving_body() &&
+      !overran) {
+    update_deadline_();
+    return kHandlerContinue;
+  }
   finished_ = true;
   cleanup_cgi_();
-  ClientHandler* ch = server_.find_client_handler(client_fd_);
+  if (relay_ != NULL) {
+    // The status line is already out, all we can do is cut the body short
+    relay_->fail();
+    return kCgiInputDone;
+  }
+  ClientHandler* ch = server_.find_client_handler(client_fd_, client_serial_);
   if (ch != NULL) {
     Response response;
-    response.prepare_error_response(
-        kGatewayTimeout,
-        RequestProcessor::get_error_page_path(target_config_, kGatewayTimeout));
+    response = RequestProcessor::make_error_response(target_config_, kGatewayTimeout);
     ch->cgi_response_ready(response.serialize());
   }
 
@@ -313,6 +526,12 @@ HandlerStatus CgiResponseHandler::handle_input() {
   if (finished_) {
     return kCgiInputDone;
   }
+  if (worker_ != NULL) {
+    return handle_worker_output_();
+  }
+  if (relay_ != NULL && relay_->is_splicing()) {
+    return handle_splice_input_();
+  }
   char buf[kReadBufSize];
   ssize_t n = read(out_fd_, buf, sizeof(buf));
 
@@ -321,30 +540,216 @@ HandlerStatus CgiResponseHandler::handle_input() {
   }
 
   if (n == 0) {
-    finished_ = true;
-    bool cgi_error = is_cgi_error_();
-    cgi_pid_ = -1;
-
-    handle_cgi_completion_(cgi_error);
-    return kCgiInputDone;
+    if (wait_for_exit_()) {
+      return kHandlerContinue;
+    }
+    return finish_output_();
   }
 
   update_deadline_();
 
+  if (relay_ != NULL) {
+    if (!relay_->has_consumer()) {
+      // The client is gone, nobody wants the rest of the output
+      finished_ = true;
+      cleanup_cgi_();
+      return kCgiInputDone;
+    }
+    relay_->append(buf, n);
+    if (relay_->is_full()) {
+      pause_output_();
+    }
+    return kHandlerContinue;
+  }
+
+  if (cache_ != NULL && buffer_to_eof_ &&
+      cgi_output_.size() + static_cast<std::size_t>(n) >
+          CgiCache::max_entry_bytes(*cache_)) {
+    // Too big to keep, so it goes out as it comes after all
+    drop_cache_();
+    buffer_to_eof_ = false;
+    cgi_output_.append(buf, n);
+    return start_streaming_();
+  }
   if (cgi_output_.size() + static_cast<std::size_t>(n) > kMaxCgiOutputBytes) {
     return fail_with_bad_gateway_();
   }
 
   cgi_output_.append(buf, n);
 
-  if (!has_header_terminator(cgi_output_) &&
-      cgi_output_.size() > kMaxCgiHeaderBytes) {
+  if (!has_header_terminator(cgi_output_)) {
+    if (cgi_output_.size() > kMaxCgiHeaderBytes) {
+      return fail_with_bad_gateway_();
+    }
+    return kHandlerContinue;
+  }
+  if (!buffer_to_eof_) {
+    return start_streaming_();
+  }
+  return kHandlerContinue;
+}
+
+void CgiResponseHandler::finish_relay_() {
+  finished_ = true;
+  if (is_cgi_error_()) {
+    relay_->fail();
+  } else {
+    relay_->finish();
+  }
+}
+
+// The body stays in the pipe and the client splices it to its socket, so
+// only readiness and the end of the output are handled here. The event may
+// be stale: the client can empty the pipe earlier in the same poll round,
+// so an empty pipe is the end only once the script has closed its end.
+HandlerStatus CgiResponseHandler::handle_splice_input_() {
+  if (!relay_->has_consumer()) {
+    finished_ = true;
+    cleanup_cgi_();
+    return kCgiInputDone;
+  }
+  bool hung_up = pipe_hung_up(out_fd_);
+  if (pipe_buffered(out_fd_) == 0) {
+    if (!hung_up) {
+      paused_ = false;
+      server_.set_fd_events(out_fd_, POLLIN);
+      return kHandlerContinue;
+    }
+    if (wait_for_exit_()) {
+      return kHandlerContinue;
+    }
+    return finish_output_();
+  }
+  update_deadline_();
+  // The script is gone, but the client has yet to take the rest, so the
+  // relay keeps the pipe. The exit status counts only if it is already in.
+  if (paused_ && hung_up) {
+    finished_ = true;
+    if (is_cgi_error_()) {
+      relay_->fail();
+    } else {
+      relay_->hand_over_pipe();
+      out_fd_ = -1;
+    }
+    return kCgiInputDone;
+  }
+  relay_->pipe_readable();
+  pause_output_();
+  return kHandlerContinue;
+}
+
+// Called once the header block is complete. From here on the body goes to
+// the client as it is read instead of being collected up to EOF.
+HandlerStatus CgiResponseHandler::start_streaming_() {
+  ParsedCgiOutput parsed = parse_cgi_output_(cgi_output_);
+  if (!parsed.is_valid) {
     return fail_with_bad_gateway_();
   }
+  if (parsed.is_local_redirect) {
+    // Handled as a whole once the script has exited
+    drop_cache_();
+    buffer_to_eof_ = true;
+    return kHandlerContinue;
+  }
+  if (cache_ != NULL) {
+    int64_t ttl_sec;
+    int64_t stale_sec;
+    if (CgiCache::freshness(cache_->ttl_sec, cache_->stale_sec,
+                            parsed.status_code, parsed.headers, ttl_sec,
+                            stale_sec)) {
+      buffer_to_eof_ = true;
+      return kHandlerContinue;
+    }
+    drop_cache_();
+  }
+  ClientHandler* ch = server_.find_client_handler(client_fd_, client_serial_);
+  if (ch == NULL) {
+    finished_ = true;
+    cleanup_cgi_();
+    return kCgiInputDone;
+  }
 
+  bool has_framing =
+      parsed.headers.find("content-length") != parsed.headers.end() ||
+      parsed.headers.find("transfer-encoding") != parsed.headers.end();
+  Response head = build_stream_head(parsed);
+  relay_ = new CgiOutputRelay(server_, client_fd_, this);
+  ch->cgi_stream_ready(head, relay_->open_source(), has_framing);
+  relay_->append(parsed.body.data(), parsed.body.size());
+  relay_->enable_splice(out_fd_);
+  cgi_output_.clear();
+  if (relay_->is_full()) {
+    pause_output_();
+  }
   return kHandlerContinue;
 }
 
+void CgiResponseHandler::pause_output_() {
+  paused_ = true;
+  server_.set_fd_events(out_fd_, 0);
+}
+
+void CgiResponseHandler::resume_output() {
+  if (finished_ || out_fd_ == -1 || exit_notify_fd_ != -1) {
+    return;
+  }
+  // The client is making progress, so the script is not stuck either
+  update_deadline_();
+  if (paused_) {
+    paused_ = false;
+    server_.set_fd_events(out_fd_, POLLIN);
+  }
+}
+
+HandlerStatus CgiResponseHandler::handle_worker_output_() {
+  char buf[kReadBufSize];
+  ssize_t n = read(out_fd_, buf, sizeof(buf));
+  // Anything else stays readable and would be reported again forever
+  if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+    return kHandlerContinue;
+  }
+  if (n == -1) {
+    std::cerr << "cgi_pool: reading from worker " << worker_->pid << ": "
+              << std::strerror(errno) << "\n";
+    return fail_with_bad_gateway_();
+  }
+  if (n == 0) {
+    std::cerr << "cgi_pool: worker " << worker_->pid << " died mid-request\n";
+    return fail_with_bad_gateway_();
+  }
+  update_deadline_();
+  cgi_output_.append(buf, n);
+
+  if (!frame_header_parsed_) {
+    std::size_t eol = cgi_output_.find('\n');
+    if (eol == std::string::npos) {
+      if (cgi_output_.size() > CgiWorkerPool::kMaxFrameHeader) {
+        return fail_with_bad_gateway_();
+      }
+      return kHandlerContinue;
+    }
+    std::istringstream header(cgi_output_.substr(0, eol));
+    std::string magic;
+    unsigned long length;
+    if (!(header >> magic >> length >> frame_exit_status_) ||
+        magic != CgiWorkerPool::kFrameMagic || length > kMaxCgiOutputBytes) {
+      return fail_with_bad_gateway_();
+    }
+    frame_length_ = length;
+    frame_header_parsed_ = true;
+    cgi_output_.erase(0, eol + 1);
+  }
+
+  if (cgi_output_.size() < frame_length_) {
+    return kHandlerContinue;
+  }
+  finished_ = true;
+  // Anything past the frame means the worker is out of step with us
+  worker_reusable_ = cgi_output_.size() == frame_length_;
+  handle_cgi_completion_(frame_exit_status_ != 0);
+  return kCgiInputDone;
+}
+
 HandlerStatus CgiResponseHandler::handle_output() {
   return kHandlerContinue;
 }
@@ -358,13 +763,15 @@ HandlerStatus CgiResponseHandler::fail_with_bad_gateway_() {
   finished_ = true;
 
   cleanup_cgi_();
+  if (relay_ != NULL) {
+    relay_->fail();
+    return kCgiInputDone;
+  }
 
-  ClientHandler* ch = server_.find_client_handler(client_fd_);
+  ClientHandler* ch = server_.find_client_handler(client_fd_, client_serial_);
   if (ch != NULL) {
     Response response;
-    response.prepare_error_response(
-        kBadGateway,
-        RequestProcessor::get_error_page_path(target_config_, kBadGateway));
+    response = RequestProcessor::make_error_response(target_config_, kBadGateway);
     ch->cgi_response_ready(response.serialize());
   }
 
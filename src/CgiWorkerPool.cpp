@@ -0,0 +1,224 @@
+#include "CgiWorkerPool.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <ctime>
+#include <iostream>
+
+#include "spawn_utils.hpp"
+
+const char* CgiWorkerPool::kFrameMagic = "WSCGI";
+
+static int64_t now_time_worker() {
+  return static_cast<int64_t>(std::time(NULL));
+}
+
+static int set_parent_end_flags(int fd) {
+  return fcntl(fd, F_SETFL, O_NONBLOCK);
+}
+
+CgiWorkerPool::~CgiWorkerPool() {
+  for (std::map<std::string, Pool>::iterator it = pools_.begin();
+       it != pools_.end(); ++it) {
+    for (std::size_t i = 0; i < it->second.idle.size(); ++i) {
+      stop_(it->second.idle[i]);
+    }
+  }
+}
+
+std::string CgiWorkerPool::key_of_(const CgiPoolConfig& config) {
+  return config.interpreter + " " + config.worker_script;
+}
+
+// Locations sharing interpreter and worker script share one pool; the
+// settings of the first one seen are used.
+CgiWorkerPool::Pool& CgiWorkerPool::find_pool_(const CgiPoolConfig& config) {
+  std::string key = key_of_(config);
+  std::map<std::string, Pool>::iterator it = pools_.find(key);
+  if (it != pools_.end()) {
+    return it->second;
+  }
+  Pool& pool = pools_[key];
+  pool.config = config;
+  pool.busy = 0;
+  return pool;
+}
+
+CgiWorker* CgiWorkerPool::spawn_(const Pool& pool, const std::string& key) {
+  int pipe_in[2];
+  int pipe_out[2];
+  if (pipe(pipe_in) == -1) {
+    return NULL;
+  }
+  if (pipe(pipe_out) == -1) {
+    close(pipe_in[0]);
+    close(pipe_in[1]);
+    return NULL;
+  }
+
+  const char* argv[] = {pool.config.interpreter.c_str(),
+                        pool.config.worker_script.c_str(), NULL};
+  char* envp[] = {NULL};
+  pid_t pid = -1;
+  if (set_cloexec(pipe_in[0]) == 0 && set_cloexec(pipe_in[1]) == 0 &&
+      set_cloexec(pipe_out[0]) == 0 && set_cloexec(pipe_out[1]) == 0) {
+    pid = spawn_process(argv[0], const_cast<char* const*>(argv), envp,
+                        pipe_in[0], pipe_out[1], "");
+  }
+  if (pid == -1) {
+    close(pipe_in[0]);
+    close(pipe_in[1]);
+    close(pipe_out[0]);
+    close(pipe_out[1]);
+    return NULL;
+  }
+
+  close(pipe_in[0]);
+  close(pipe_out[1]);
+  CgiWorker* worker = new CgiWorker;
+  worker->pid = pid;
+  worker->in_fd = pipe_in[1];
+  worker->out_fd = pipe_out[0];
+  worker->requests_served = 0;
+  worker->idle_since = now_time_worker();
+  worker->pool_key = key;
+  worker->exited = false;
+  workers_[pid] = worker;
+  reaper_.watch(pid, this);
+  if (set_parent_end_flags(worker->in_fd) == -1 ||
+      set_parent_end_flags(worker->out_fd) == -1) {
+    stop_(worker);
+    return NULL;
+  }
+  return worker;
+}
+
+void CgiWorkerPool::stop_(CgiWorker* worker) {
+  close(worker->in_fd);
+  close(worker->out_fd);
+  workers_.erase(worker->pid);
+  if (!worker->exited) {
+    // Closing stdin already asks a well-behaved worker to leave
+    reaper_.terminate(worker->pid);
+  }
+  delete worker;
+}
+
+void CgiWorkerPool::child_exited(pid_t pid, int) {
+  std::map<pid_t, CgiWorker*>::iterator it = workers_.find(pid);
+  if (it != workers_.end()) {
+    it->second->exited = true;
+  }
+}
+
+void CgiWorkerPool::prespawn(const Config& config) {
+  const std::vector<ServerContext>& servers = config.get_configs();
+  for (std::size_t i = 0; i < servers.size(); ++i) {
+    for (std::size_t j = 0; j < servers[i].locations.size(); ++j) {
+      const std::vector<CgiPoolConfig>& pools = servers[i].locations[j].cgi_pools;
+      for (std::size_t k = 0; k < pools.size(); ++k) {
+        find_pool_(pools[k]);
+      }
+    }
+  }
+  maintain();
+}
+
+CgiWorker* CgiWorkerPool::acquire(const CgiPoolConfig& config) {
+  std::string key = key_of_(config);
+  Pool& pool = find_pool_(config);
+  while (!pool.idle.empty()) {
+    CgiWorker* worker = pool.idle.back();
+    pool.idle.pop_back();
+    if (!worker->exited) {
+      pool.busy++;
+      return worker;
+    }
+    stop_(worker);
+  }
+  if (pool.busy >= static_cast<std::size_t>(pool.config.max_workers)) {
+    return NULL;
+  }
+  CgiWorker* worker = spawn_(pool, key);
+  if (worker != NULL) {
+    pool.busy++;
+  }
+  return worker;
+}
+
+void CgiWorkerPool::release(CgiWorker* worker) {
+  Pool& pool = pools_[worker->pool_key];
+  pool.busy--;
+  worker->requests_served++;
+  if (worker->requests_served >=
+      static_cast<std::size_t>(pool.config.max_requests)) {
+    stop_(worker);
+    return;
+  }
+  worker->idle_since = now_time_worker();
+  pool.idle.push_back(worker);
+}
+
+void CgiWorkerPool::discard(CgiWorker* worker) {
+  pools_[worker->pool_key].busy--;
+  stop_(worker);
+}
+
+void CgiWorkerPool::maintain() {
+  int64_t now = now_time_worker();
+  if (now == last_maintained_sec_) {
+    return;
+  }
+  last_maintained_sec_ = now;
+  for (std::map<std::string, Pool>::iterator it = pools_.begin();
+       it != pools_.end(); ++it) {
+    Pool& pool = it->second;
+    std::size_t min_workers = static_cast<std::size_t>(pool.config.min_workers);
+    for (std::size_t i = 0; i < pool.idle.size();) {
+      CgiWorker* worker = pool.idle[i];
+      bool exited = worker->exited;
+      bool expired = pool.idle.size() + pool.busy > min_workers &&
+                     now - worker->idle_since >= pool.config.idle_timeout_sec;
+      if (exited) {
+        std::cerr << "cgi_pool: worker " << worker->pid << " exited\n";
+        stop_(worker);
+      } else if (expired) {
+        stop_(worker);
+      } else {
+        ++i;
+        continue;
+      }
+      pool.idle.erase(pool.idle.begin() + i);
+    }
+    while (pool.idle.size() + pool.busy < min_workers) {
+      CgiWorker* worker = spawn_(pool, it->first);
+      if (worker == NULL) {
+        break;
+      }
+      pool.idle.push_back(worker);
+    }
+  }
+}
+
+std::string CgiWorkerPool::encode_request(
+    const std::vector<std::pair<std::string, std::string> >& env,
+    const std::string& body) {
+  std::string env_block;
+  for (std::size_t i = 0; i < env.size(); ++i) {
+    env_block += env[i].first;
+    env_block += '=';
+    env_block += env[i].second;
+    env_block += '\0';
+  }
+  char header[kMaxFrameHeader];
+  std::snprintf(header, sizeof(header), "%s %lu %lu\n", kFrameMagic,
+                static_cast<unsigned long>(env_block.size()),
+                static_cast<unsigned long>(body.size()));
+  std::string frame(header);
+  frame.reserve(frame.size() + env_block.size() + body.size());
+  frame += env_block;
+  frame += body;
+  return frame;
+}
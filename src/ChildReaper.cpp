@@ -0,0 +1,134 @@
+#include "ChildReaper.hpp"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <ctime>
+
+#include "Server.hpp"
+#include "SystemError.hpp"
+#include "spawn_utils.hpp"
+
+namespace {
+int g_sigchld_write_fd = -1;
+
+void notify_sigchld(int) {
+  int saved_errno = errno;
+  char byte = 0;
+  // A full pipe already holds a pending wakeup
+  ssize_t ret = write(g_sigchld_write_fd, &byte, 1);
+  (void)ret;
+  errno = saved_errno;
+}
+
+int64_t now_time_reaper() { return static_cast<int64_t>(std::time(NULL)); }
+}  // namespace
+
+ChildReaper::ChildReaper(Server& server) : server_(server) {
+  int fds[2];
+  if (pipe(fds) == -1) {
+    throw SystemError("pipe");
+  }
+  read_fd_ = fds[0];
+  write_fd_ = fds[1];
+  if (fcntl(read_fd_, F_SETFL, O_NONBLOCK) == -1 ||
+      fcntl(write_fd_, F_SETFL, O_NONBLOCK) == -1 ||
+      set_cloexec(read_fd_) == -1 || set_cloexec(write_fd_) == -1) {
+    throw SystemError("fcntl");
+  }
+  g_sigchld_write_fd = write_fd_;
+
+  struct sigaction sa;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+  sa.sa_handler = notify_sigchld;
+  if (sigaction(SIGCHLD, &sa, NULL) == -1) {
+    throw SystemError("sigaction");
+  }
+}
+
+// Nothing runs the grace timers any more, so stragglers are killed outright
+// and left to init
+ChildReaper::~ChildReaper() {
+  signal(SIGCHLD, SIG_DFL);
+  g_sigchld_write_fd = -1;
+  for (std::map<pid_t, int64_t>::iterator it = kill_at_.begin();
+       it != kill_at_.end(); ++it) {
+    kill(it->first, SIGKILL);
+  }
+  close(read_fd_);
+  close(write_fd_);
+}
+
+void ChildReaper::watch(pid_t pid, ChildWatcher* watcher) {
+  watchers_[pid] = watcher;
+}
+
+void ChildReaper::unwatch(pid_t pid) { watchers_.erase(pid); }
+
+void ChildReaper::terminate(pid_t pid) {
+  if (pid <= 0 || kill_at_.count(pid) != 0) {
+    return;
+  }
+  watchers_.erase(pid);
+  kill(pid, SIGTERM);
+  kill_at_[pid] = now_time_reaper() + kTerminateGraceSec;
+  server_.update_timeout(read_fd_);
+}
+
+HandlerStatus ChildReaper::handle_input() {
+  char buf[64];
+  while (read(read_fd_, buf, sizeof(buf)) > 0) {
+  }
+  reap_();
+  server_.update_timeout(read_fd_);
+  return kHandlerContinue;
+}
+
+// Watchers may unwatch or terminate other children from their callback, so
+// each one is looked up only after its child has been collected
+void ChildReaper::reap_() {
+  int status;
+  pid_t pid;
+  while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+    kill_at_.erase(pid);
+    std::map<pid_t, ChildWatcher*>::iterator it = watchers_.find(pid);
+    if (it == watchers_.end()) {
+      continue;
+    }
+    ChildWatcher* watcher = it->second;
+    watchers_.erase(it);
+    watcher->child_exited(pid, status);
+  }
+}
+
+bool ChildReaper::has_deadline() const { return !kill_at_.empty(); }
+
+int64_t ChildReaper::deadline_sec() const {
+  int64_t earliest = 0;
+  for (std::map<pid_t, int64_t>::const_iterator it = kill_at_.begin();
+       it != kill_at_.end(); ++it) {
+    if (it == kill_at_.begin() || it->second < earliest) {
+      earliest = it->second;
+    }
+  }
+  return earliest;
+}
+
+// The killed children are reaped when their SIGCHLD comes in
+HandlerStatus ChildReaper::handle_timeout() {
+  int64_t now = now_time_reaper();
+  for (std::map<pid_t, int64_t>::iterator it = kill_at_.begin();
+       it != kill_at_.end();) {
+    if (it->second <= now) {
+      kill(it->first, SIGKILL);
+      kill_at_.erase(it++);
+    } else {
+      ++it;
+    }
+  }
+  return kHandlerContinue;
+}
@@ -4,56 +4,148 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <cerrno>
+#include <cstdio>
 #include <cstdlib>  
 #include <cstring>
 #include <iostream>
 #include <ctime>
 
+#include "CgiCache.hpp"
 #include "CgiHandler.hpp"
 #include "CgiInputHandler.hpp"
+#include "CgiInputRelay.hpp"
+#include "CgiLimiter.hpp"
 #include "CgiResponseHandler.hpp"
+#include "CgiWorkerPool.hpp"
 #include "Config.hpp"
+#include "FastCgiHandler.hpp"
+#include "MetaVariables.hpp"
 #include "MonitoredFdHandler.hpp"
 #include "Parser.hpp"
+#include "ProxyHandler.hpp"
 #include "RequestProcessor.hpp"
 #include "Server.hpp"
+#include "UploadSink.hpp"
 #include "pollfd_utils.hpp"
 
+unsigned long ClientHandler::next_serial_ = 0;
+
+namespace {
+ProcessLimits cgi_process_limits(const LocationContext& lc) {
+  ProcessLimits limits;
+  limits.address_space = lc.cgi_rlimit_as;
+  limits.cpu_sec = lc.cgi_rlimit_cpu;
+  limits.open_files = lc.cgi_rlimit_nofile;
+  return limits;
+}
+}  // namespace
+
 ClientHandler::ClientHandler(int client_fd, const std::string& addr,
                              const std::string& port,
                              const std::string& client_addr, Server& server,
                              Config& config)
     : client_fd_(client_fd),
+      serial_(++next_serial_),
       addr_(addr),
       port_(port),
+      listen_port_(std::atoi(port.c_str())),
       client_addr_(client_addr),
       server_(server),
       config_(config),
+      server_config_(NULL),
       bytes_sent_(0),
+      body_source_(NULL),
+      body_chunked_(false),
+      splice_remaining_(0),
+      body_relay_(NULL),
+      body_paused_(false),
+      cgi_queued_(false),
+      cgi_cache_fills_(false),
+      cgi_cache_waiting_(false),
+      disk_cache_(NULL),
+      upload_sink_(NULL),
+      upload_status_(kParseContinue),
       state_(kReceiving),
+      request_started_(false),
       last_activity_sec_(static_cast<int64_t>(std::time(NULL))) {
   deadline_sec_ = last_activity_sec_ + kClientTimeoutSec;
+  parser_.pause_after_headers();
 }
 
 ClientHandler::~ClientHandler() {
+  if (cgi_queued_) {
+    server_.cgi_limiter().cancel(*queued_cgi_.location, client_fd_, serial_,
+                                 false);
+    abandon_cgi_cache_fill_(*queued_cgi_.location);
+  }
+  if (cgi_cache_waiting_) {
+    server_.cgi_cache().remove_waiter(queued_cgi_.location->cgi_cache,
+                                      cgi_cache_key_, client_fd_, serial_);
+  }
+  if (body_relay_ != NULL) {
+    body_relay_->detach_producer();
+  }
+  delete body_source_;
+  if (upload_sink_ != NULL) {
+    server_.file_io_pool().drop_upload(upload_sink_);
+  }
   if (client_fd_ != -1 && close(client_fd_) == -1) {
     std::cerr << "Error: ~ClientHandler(): close() failed\n";
   }
 }
 
 HandlerStatus ClientHandler::handle_input() {
+  if (body_relay_ != NULL) {
+    return receive_body_();
+  }
+  if (upload_sink_ != NULL) {
+    return receive_upload_();
+  }
   if (state_ == kExecutingCgi) {
     return kHandlerContinue;
   }
+  // Nothing is polled meanwhile, so only a hangup gets here
+  if (state_ == kWaitingFileIo) {
+    return kHandlerClosed;
+  }
 
   ssize_t num_read = recv(client_fd_, buffer_, buf_size, 0);
   if (num_read == -1 || num_read == 0) {
     return kHandlerClosed;
   }
 
+  request_started_ = true;
   update_deadline_();
 
   ParserStatus status = parser_.parse_request(buffer_, num_read);
+  if (status == kParseHeadersComplete) {
+    refresh_current_request_();
+    const ServerContext& target_config = set_up_target_config_();
+    ProcessorResult result =
+        RequestProcessor::process_headers(current_request_, target_config);
+    if (result.next_action == ProcessorResult::kStreamUpload) {
+      return start_upload_(result, false);
+    }
+    // The CGI reads the body from its stdin while it is still arriving. One
+    // that has to wait for a process slot gets the whole body first.
+    bool is_proxy = result.next_action == ProcessorResult::kExecuteProxy;
+    if (is_proxy ||
+        (result.next_action == ProcessorResult::kExecuteCgi &&
+         server_.cgi_limiter().has_free_slot(*result.location))) {
+      internal_redirect_count_ = 0;
+      parser_.set_max_body_size(result.body_limit);
+      body_relay_ = new CgiInputRelay(this);
+      bool started = is_proxy
+                         ? do_proxy_(current_request_, result, target_config)
+                         : do_cgi_(current_request_, result, target_config);
+      if (!started) {
+        return kHandlerReceived;
+      }
+      return relay_body_(parser_.parse_request(buffer_, 0));
+    }
+    status = parser_.parse_request(buffer_, 0);
+  }
   if (status == kParseContinue) {
     return kHandlerContinue;
   }
@@ -66,18 +158,246 @@ HandlerStatus ClientHandler::handle_input() {
   internal_redirect_count_ = 0;
 
   if (result.next_action == ProcessorResult::kExecuteCgi) {
-    if (!do_cgi_(current_request_, result.script_path,
-                result.cgi_path, result.query_string, result.script_uri,
-                target_config)) {
+    if (!do_cgi_(current_request_, result, target_config)) {
+      return kHandlerReceived;
+    }
+    return kHandlerContinue;
+  }
+  if (result.next_action == ProcessorResult::kExecuteFastCgi) {
+    if (!do_fastcgi_(current_request_, result, target_config)) {
+      return kHandlerReceived;
+    }
+    return kHandlerContinue;
+  }
+  if (result.next_action == ProcessorResult::kExecuteProxy) {
+    if (!do_proxy_(current_request_, result, target_config)) {
       return kHandlerReceived;
     }
     return kHandlerContinue;
   }
+  if (result.next_action == ProcessorResult::kFileIo) {
+    start_file_io_(result);
+    return state_ == kWaitingFileIo ? kHandlerContinue : kHandlerReceived;
+  }
+  if (result.next_action == ProcessorResult::kStreamUpload) {
+    return start_upload_(result, true);
+  }
+
+  if (result.next_action == ProcessorResult::kSendStatus) {
+    result.response.set_body_and_content_length(server_.status_report());
+  }
+  if (result.next_action == ProcessorResult::kExecuteNative &&
+      !run_native_handler_(current_request_, result, target_config)) {
+    return kHandlerContinue;
+  }
+  start_sending_response_(result.response.serialize(), result.body_source,
+                          result.response.is_chunked());
+  return kHandlerReceived;
+}
+
+// The body is written to its file as it arrives, so an upload of any size
+// takes one buffer of memory. body_complete when process() had it all.
+HandlerStatus ClientHandler::start_upload_(const ProcessorResult& result,
+                                           bool body_complete) {
+  const Request::BodyLengthInfo& info = current_request_.body_parse_info;
+  file_io_result_ = result;
+  ParserStatus status = kParseFinished;
+  if (!body_complete) {
+    parser_.set_max_body_size(result.body_limit);
+    status = parser_.parse_request(buffer_, 0);
+  }
+  if (!result.multipart_boundary.empty()) {
+    const LocationContext& lc = *result.location;
+    upload_sink_ = new MultipartUpload(
+        result.file_path, result.multipart_boundary,
+        static_cast<std::size_t>(lc.upload_max_parts),
+        static_cast<std::size_t>(lc.upload_max_part_size));
+    return store_upload_(status);
+  }
+  if (status != kParseContinue && status != kParseFinished) {
+    send_error_response_(status);
+    return kHandlerReceived;
+  }
+  upload_status_ = status;
+  FileTask* task = new FileTask(FileTask::kUploadOpen, result.file_path,
+                                client_fd_, serial_);
+  task->length = info.is_chunked ? 0 : info.content_length;
+  return run_upload_step_(task);
+}
+
+// Like receive_body_(), a plain Content-Length body is spliced past the
+// parser, here into the file
+HandlerStatus ClientHandler::receive_upload_() {
+  std::size_t unparsed = parser_.unparsed_body_length();
+  if (unparsed > 0 && upload_sink_->can_splice()) {
+    ssize_t num_moved = upload_sink_->splice_in(client_fd_, unparsed);
+    if (num_moved <= 0) {
+      return kHandlerClosed;
+    }
+    update_deadline_();
+    upload_status_ = parser_.skip_body(static_cast<std::size_t>(num_moved));
+    return run_upload_step_(
+        new FileTask(FileTask::kUploadFlush, "", client_fd_, serial_));
+  }
+  ssize_t num_read = recv(client_fd_, buffer_, buf_size, 0);
+  if (num_read == -1 || num_read == 0) {
+    return kHandlerClosed;
+  }
+  update_deadline_();
+  return store_upload_(parser_.parse_request(buffer_, num_read));
+}
+
+// Hands what the parser decoded to the sink, then goes on as status says
+// once it is written
+HandlerStatus ClientHandler::store_upload_(ParserStatus status) {
+  std::string body;
+  parser_.take_body(body);
+  if (status != kParseContinue && status != kParseFinished) {
+    // A truncated or oversized body goes with its temp file
+    server_.file_io_pool().drop_upload(upload_sink_);
+    upload_sink_ = NULL;
+    send_error_response_(status);
+    return kHandlerReceived;
+  }
+  upload_status_ = status;
+  if (!body.empty()) {
+    FileTask* task =
+        new FileTask(FileTask::kUploadWrite, "", client_fd_, serial_);
+    task->data.swap(body);
+    return run_upload_step_(task);
+  }
+  if (status == kParseFinished) {
+    return run_upload_step_(
+        new FileTask(FileTask::kUploadCommit, "", client_fd_, serial_));
+  }
+  return kHandlerContinue;
+}
+
+// The sink goes with the task, and the socket is not read, until
+// upload_step_done_() has it back. When the pool is off or full the step
+// runs right here instead.
+HandlerStatus ClientHandler::run_upload_step_(FileTask* task) {
+  task->upload_sink = upload_sink_;
+  upload_sink_ = NULL;
+  state_ = kWaitingFileIo;
+  if (server_.file_io_pool().submit(task)) {
+    server_.set_fd_events(client_fd_, 0);
+    return kHandlerContinue;
+  }
+  task->run();
+  HandlerStatus status = upload_step_done_(*task);
+  delete task;
+  return status;
+}
+
+HandlerStatus ClientHandler::upload_step_done_(FileTask& task) {
+  state_ = kReceiving;
+  upload_sink_ = task.upload_sink;
+  task.upload_sink = NULL;
+  if (task.error != 0 || task.op == FileTask::kUploadCommit) {
+    return finish_upload_(task.error);
+  }
+  HandlerStatus status = store_upload_(upload_status_);
+  if (status == kHandlerContinue && state_ == kReceiving) {
+    server_.set_fd_events(client_fd_, POLLIN);
+  }
+  return status;
+}
 
-  start_sending_response_(result.response.serialize());
+HandlerStatus ClientHandler::finish_upload_(int error) {
+  if (upload_sink_ != NULL) {
+    server_.file_io_pool().drop_upload(upload_sink_);
+    upload_sink_ = NULL;
+  }
+  std::string no_data;
+  RequestProcessor::complete_file_io(file_io_result_, error, no_data,
+                                     set_up_target_config_());
+  start_sending_response_(file_io_result_.response.serialize());
   return kHandlerReceived;
 }
 
+HandlerStatus ClientHandler::receive_body_() {
+  std::size_t unparsed = parser_.unparsed_body_length();
+  if (unparsed > 0 && body_relay_->can_splice()) {
+    return splice_body_in_(unparsed);
+  }
+  ssize_t num_read = recv(client_fd_, buffer_, buf_size, 0);
+  if (num_read == -1 || num_read == 0) {
+    return kHandlerClosed;
+  }
+  update_deadline_();
+  return relay_body_(parser_.parse_request(buffer_, num_read));
+}
+
+// A plain Content-Length body goes from the socket into the CGI's stdin
+// without passing through user space
+HandlerStatus ClientHandler::splice_body_in_(std::size_t length) {
+  std::size_t space = body_relay_->pipe_space();
+  if (space == 0) {
+    body_paused_ = true;
+    server_.remove_fd_events(client_fd_, POLLIN);
+    body_relay_->wait_for_space();
+    return kHandlerContinue;
+  }
+  ssize_t num_moved = body_relay_->splice_from(
+      client_fd_, length < space ? length : space);
+  if (num_moved <= 0) {
+    return kHandlerClosed;
+  }
+  update_deadline_();
+  return relay_body_(parser_.skip_body(static_cast<std::size_t>(num_moved)));
+}
+
+// Hands what the parser decoded to the CGI and stops reading the socket
+// while the CGI is behind
+HandlerStatus ClientHandler::relay_body_(ParserStatus status) {
+  std::string body;
+  parser_.take_body(body);
+  body_relay_->append(body);
+  if (status == kParseContinue) {
+    if (body_relay_->is_full() && !body_paused_) {
+      body_paused_ = true;
+      server_.remove_fd_events(client_fd_, POLLIN);
+    }
+    return kHandlerContinue;
+  }
+
+  if (status == kParseFinished) {
+    body_relay_->finish();
+  }
+  end_body_stream_();
+  if (status == kParseFinished) {
+    return kHandlerContinue;
+  }
+  // The CGI got a truncated body; its output must not reach the client
+  if (state_ != kExecutingCgi) {
+    return kHandlerClosed;
+  }
+  send_error_response_(status);
+  return kHandlerContinue;
+}
+
+void ClientHandler::end_body_stream_() {
+  if (body_relay_ == NULL) {
+    return;
+  }
+  body_relay_->detach_producer();
+  body_relay_ = NULL;
+  body_paused_ = false;
+  server_.remove_fd_events(client_fd_, POLLIN);
+}
+
+void ClientHandler::resume_body() {
+  if (body_paused_) {
+    body_paused_ = false;
+    server_.add_fd_events(client_fd_, POLLIN);
+  }
+}
+
+short ClientHandler::body_events_() const {
+  return (body_relay_ != NULL && !body_paused_) ? POLLIN : 0;
+}
+
 HandlerStatus ClientHandler::handle_output() {
   if (state_ == kExecutingCgi) {
     return kHandlerContinue;
@@ -85,6 +405,25 @@ HandlerStatus ClientHandler::handle_output() {
   if (state_ != kSendingResponse) {
     return kHandlerContinue;
   }
+  if (bytes_sent_ >= response_str_.size()) {
+    if (splice_remaining_ > 0) {
+      return splice_body_();
+    }
+    if (!fill_send_buffer_()) {
+      return kHandlerClosed;
+    }
+  }
+  if (response_str_.empty()) {
+    if (splice_remaining_ > 0) {
+      return splice_body_();
+    }
+    if (body_source_ == NULL) {
+      return kHandlerSent;
+    }
+    // The source re-arms POLLOUT once it has more
+    server_.remove_fd_events(client_fd_, POLLOUT);
+    return kHandlerContinue;
+  }
 
   ssize_t remaining = response_str_.size() - bytes_sent_;
   ssize_t num_sent =
@@ -100,71 +439,478 @@ HandlerStatus ClientHandler::handle_output() {
   update_deadline_();
   bytes_sent_ += num_sent;
 
-  if (bytes_sent_ < response_str_.size()) {
+  if (bytes_sent_ < response_str_.size() || body_source_ != NULL) {
     return kHandlerContinue;
   }
 
   return kHandlerSent;
 }
 
+// Replaces the drained send buffer with the next piece of the streamed body.
+// Returns false if the body source failed and the connection must be closed.
+bool ClientHandler::fill_send_buffer_() {
+  response_str_.clear();
+  bytes_sent_ = 0;
+  if (body_source_ == NULL) {
+    return true;
+  }
+
+  // Bytes sitting in a pipe go to the socket without being copied; a
+  // chunk's size line and CRLF are the only parts sent from here
+  std::size_t spliceable = body_source_->spliceable();
+  if (spliceable > 0) {
+    splice_remaining_ = spliceable;
+    if (body_chunked_) {
+      char size_line[32];
+      std::snprintf(size_line, sizeof(size_line), "%lx\r\n",
+                    static_cast<unsigned long>(spliceable));
+      response_str_.append(size_line);
+    }
+    return true;
+  }
+
+  std::string piece;
+  BodyStatus status = body_source_->read_some(piece, kStreamPieceSize);
+  if (status == kBodyError) {
+    delete body_source_;
+    body_source_ = NULL;
+    return false;
+  }
+  if (body_chunked_ && !piece.empty()) {
+    char size_line[32];
+    std::snprintf(size_line, sizeof(size_line), "%lx\r\n",
+                  static_cast<unsigned long>(piece.size()));
+    response_str_.append(size_line);
+    response_str_.append(piece);
+    response_str_.append("\r\n");
+  } else {
+    response_str_.swap(piece);
+  }
+  if (status == kBodyDone) {
+    if (body_chunked_) {
+      response_str_.append("0\r\n\r\n");
+    }
+    delete body_source_;
+    body_source_ = NULL;
+  }
+  return true;
+}
+
+HandlerStatus ClientHandler::splice_body_() {
+  ssize_t num_sent = body_source_->splice_to(client_fd_, splice_remaining_);
+  if (num_sent <= 0) {
+    return kHandlerClosed;
+  }
+  update_deadline_();
+  splice_remaining_ -= static_cast<std::size_t>(num_sent);
+  if (splice_remaining_ == 0 && body_chunked_) {
+    response_str_ = "\r\n";
+    bytes_sent_ = 0;
+  }
+  return kHandlerContinue;
+}
+
 bool ClientHandler::do_cgi_(const Request& request,
-                           const std::string& script_path,
-                           const std::string& cgi_path,
-                           const std::string& query_string,
-                           const std::string& script_uri,
-                           const ServerContext& target_config) {
+                            const ProcessorResult& result,
+                            const ServerContext& target_config) {
   state_ = kExecutingCgi;
+  if (lookup_disk_cache_(request, *result.location)) {
+    return false;
+  }
 
-  std::string server_name;
-  std::string remote_addr;
-  setup_cgi_(server_name, remote_addr);
+  switch (lookup_cgi_cache_(request, result, target_config)) {
+    case CgiCache::kHit:
+    case CgiCache::kStale:
+      return false;
+    case CgiCache::kWait:
+      return true;
+    default:
+      break;
+  }
+  return run_cgi_(request, result, target_config);
+}
 
-  CgiHandler cgi(request, query_string, script_uri, server_name, port_, remote_addr);
-  if (cgi.execute_cgi(script_path, cgi_path) == -1) {
-    send_error_response_(kInternalServerError);
+bool ClientHandler::run_cgi_(const Request& request,
+                             const ProcessorResult& result,
+                             const ServerContext& target_config) {
+  // A saturated pool falls back to a one-shot process
+  if (result.cgi_pool != NULL &&
+      do_pooled_cgi_(request, result, target_config)) {
+    return true;
+  }
+
+  const LocationContext& lc = *result.location;
+  switch (server_.cgi_limiter().admit(lc, client_fd_, serial_)) {
+    case CgiLimiter::kRejected:
+      abandon_cgi_cache_fill_(lc);
+      end_body_stream_();
+      response_ = RequestProcessor::make_unavailable_response(
+          target_config, lc.cgi_queue_timeout_sec);
+      send_prepared_response_();
+      return false;
+    case CgiLimiter::kQueued:
+      // Started by the limiter once a process of this location is done
+      queued_cgi_ = result;
+      cgi_queued_ = true;
+      server_.set_fd_events(client_fd_, 0);
+      deadline_sec_ =
+          static_cast<int64_t>(std::time(NULL)) + lc.cgi_queue_timeout_sec;
+      server_.update_timeout(client_fd_);
+      return true;
+    case CgiLimiter::kAdmitted:
+      break;
+  }
+  return spawn_cgi_(request, result, target_config);
+}
+
+void ClientHandler::start_queued_cgi() {
+  cgi_queued_ = false;
+  update_deadline_();
+  spawn_cgi_(current_request_, queued_cgi_, set_up_target_config_());
+}
+
+// Starts a one-shot process holding a slot of the location's limit
+bool ClientHandler::spawn_cgi_(const Request& request,
+                               const ProcessorResult& result,
+                               const ServerContext& target_config) {
+  const LocationContext& lc = *result.location;
+  CgiHandler cgi(request, result.query_string, result.script_uri,
+                 target_config.cgi_env, port_, client_addr_);
+  int rc = cgi.execute_cgi(result.script_path, result.cgi_path,
+                           cgi_process_limits(lc));
+  if (rc != 0) {
+    server_.cgi_limiter().release(lc);
+    abandon_cgi_cache_fill_(lc);
+    end_body_stream_();
+    send_error_response_(rc == CgiHandler::kSpawnFailed ? kBadGateway
+                                                        : kInternalServerError);
     return false;
   }
 
-  server_.set_fd_events(client_fd_, 0);
+  server_.set_fd_events(client_fd_, body_events_());
+
+  CgiInputHandler* input_handler;
+  if (body_relay_ != NULL) {
+    input_handler = new CgiInputHandler(cgi.get_pipe_in_fd(),
+                                        cgi.get_cgi_pid(), body_relay_,
+                                        server_, client_fd_);
+  } else {
+    input_handler = new CgiInputHandler(cgi.get_pipe_in_fd(),
+                                        cgi.get_cgi_pid(), request.body,
+                                        server_, client_fd_);
+  }
+  input_handler->set_send_timeout(lc.cgi_send_timeout_sec);
+  server_.register_fd(cgi.get_pipe_in_fd(), input_handler, POLLOUT);
 
-  server_.register_fd(cgi.get_pipe_in_fd(),
-                      new CgiInputHandler(cgi.get_pipe_in_fd(),
-                                          cgi.get_cgi_pid(),
-                                          request.body,
-                                          server_,
-                                          client_fd_),
-                      POLLOUT);
-
-  server_.register_fd(cgi.get_pipe_out_fd(),
-                      new CgiResponseHandler(cgi.get_pipe_out_fd(),
-                                             cgi.get_cgi_pid(),
-                                             server_,
-                                             client_fd_,
-                                             target_config),
-                      POLLIN);
+  CgiResponseHandler* output_handler = new CgiResponseHandler(
+      cgi.get_pipe_out_fd(), cgi.get_cgi_pid(), server_, client_fd_,
+      target_config);
+  output_handler->hold_cgi_slot(result.location);
+  output_handler->set_timeouts(lc);
+  if (!cgi_cache_key_.empty()) {
+    output_handler->cache_into(lc.cgi_cache, cgi_cache_key_,
+                               cgi_cache_fills_);
+    cgi_cache_fills_ = false;
+  }
+  server_.register_fd(cgi.get_pipe_out_fd(), output_handler, POLLIN);
   return true;
 }
 
-void ClientHandler::setup_cgi_(std::string& server_name,
-                               std::string& remote_addr) const {
-  server_name = "localhost";
+// Answers a GET without a body from the location's cgi_cache. The request
+// that gets a stale copy also starts the refresh of the entry, and one
+// that misses while another runs the script may wait for its response.
+// kMiss when the request is not for the cache at all.
+CgiCache::Lookup ClientHandler::lookup_cgi_cache_(
+    const Request& request, const ProcessorResult& result,
+    const ServerContext& target_config) {
+  cgi_cache_key_.clear();
+  const CgiCacheConfig& cc = result.location->cgi_cache;
+  if (cc.zone.empty() || !CgiCache::is_cacheable(request)) {
+    return CgiCache::kMiss;
+  }
 
-  int listen_port = std::atoi(port_.c_str());
-  const ServerContext& sc = config_.get_config(listen_port, "");
-  for (std::size_t i = 0; i < sc.server_names.size(); ++i) {
-    if (!sc.server_names[i].empty()) {
-      server_name = sc.server_names[i];
+  cgi_cache_key_ = CgiCache::build_key(cc.key, request);
+  std::string cached;
+  CgiCache::Lookup found =
+      server_.cgi_cache().lookup(cc, cgi_cache_key_, cached);
+  switch (found) {
+    case CgiCache::kFill:
+      cgi_cache_fills_ = true;
+      break;
+    case CgiCache::kWait:
+      // Until cgi_cache_fill_done(), or the lock timeout
+      server_.cgi_cache().add_waiter(cc, cgi_cache_key_, client_fd_, serial_);
+      queued_cgi_ = result;
+      cgi_cache_waiting_ = true;
+      server_.set_fd_events(client_fd_, 0);
+      deadline_sec_ =
+          static_cast<int64_t>(std::time(NULL)) + cc.lock_timeout_sec;
+      server_.update_timeout(client_fd_);
+      break;
+    case CgiCache::kHit:
+    case CgiCache::kStale:
+      end_body_stream_();
+      start_sending_response_(cached);
+      if (found == CgiCache::kStale) {
+        refresh_cgi_cache_(request, result, target_config);
+      }
       break;
+    default:
+      break;
+  }
+  return found;
+}
+
+// Answers from the location's disk_cache. On a miss the key is kept, and
+// the backend's response is written to the cache on its way to the client.
+bool ClientHandler::lookup_disk_cache_(const Request& request,
+                                       const LocationContext& lc) {
+  disk_cache_ = NULL;
+  if (lc.disk_cache.zone.empty() || !CgiCache::is_cacheable(request)) {
+    return false;
+  }
+  std::string key = CgiCache::build_key(lc.disk_cache.key, request);
+  std::string head;
+  BodySource* body;
+  if (server_.disk_cache().lookup(lc.disk_cache, key, head, body)) {
+    end_body_stream_();
+    start_sending_response_(head, body);
+    return true;
+  }
+  disk_cache_ = &lc.disk_cache;
+  disk_cache_key_ = key;
+  return false;
+}
+
+// The script will not run for this request after all, so the requests
+// waiting on its fill run it themselves
+void ClientHandler::abandon_cgi_cache_fill_(const LocationContext& lc) {
+  if (cgi_cache_fills_) {
+    cgi_cache_fills_ = false;
+    server_.cgi_cache().finish_fill(server_, lc.cgi_cache, cgi_cache_key_,
+                                    NULL);
+  }
+}
+
+void ClientHandler::cgi_cache_fill_done(const std::string* response) {
+  if (!cgi_cache_waiting_) {
+    return;
+  }
+  if (response != NULL) {
+    cgi_cache_waiting_ = false;
+    start_sending_response_(*response);
+    return;
+  }
+  // Started from handle_timeout(), as this may run while a handler is
+  // being destroyed
+  deadline_sec_ = static_cast<int64_t>(std::time(NULL));
+  server_.update_timeout(client_fd_);
+}
+
+// Runs the script for the cache alone, the client already has the stale
+// copy. A location at its cgi_max_concurrent skips the refresh, and the
+// next stale hit tries again.
+void ClientHandler::refresh_cgi_cache_(const Request& request,
+                                       const ProcessorResult& result,
+                                       const ServerContext& target_config) {
+  const LocationContext& lc = *result.location;
+  CgiCache& cache = server_.cgi_cache();
+  if (!server_.cgi_limiter().has_free_slot(lc)) {
+    cache.finish_fill(server_, lc.cgi_cache, cgi_cache_key_, NULL);
+    return;
+  }
+  server_.cgi_limiter().admit(lc, -1, 0);
+
+  CgiHandler cgi(request, result.query_string, result.script_uri,
+                 target_config.cgi_env, port_, client_addr_);
+  if (cgi.execute_cgi(result.script_path, result.cgi_path,
+                      cgi_process_limits(lc)) != 0) {
+    server_.cgi_limiter().release(lc);
+    cache.finish_fill(server_, lc.cgi_cache, cgi_cache_key_, NULL);
+    return;
+  }
+  // No body to send
+  close(cgi.get_pipe_in_fd());
+
+  CgiResponseHandler* output_handler = new CgiResponseHandler(
+      cgi.get_pipe_out_fd(), cgi.get_cgi_pid(), server_, -1, target_config);
+  output_handler->hold_cgi_slot(result.location);
+  output_handler->set_timeouts(lc);
+  output_handler->cache_into(lc.cgi_cache, cgi_cache_key_, true);
+  server_.register_fd(cgi.get_pipe_out_fd(), output_handler, POLLIN);
+}
+
+bool ClientHandler::do_pooled_cgi_(const Request& request,
+                                   const ProcessorResult& result,
+                                   const ServerContext& target_config) {
+  CgiWorker* worker = server_.cgi_worker_pool().acquire(*result.cgi_pool);
+  if (worker == NULL) {
+    return false;
+  }
+
+  MetaVariables env = MetaVariables::from_request(
+      request, result.script_uri, result.query_string, target_config.cgi_env,
+      port_, client_addr_);
+  // The worker resolves it against its own starting directory
+  env.set("SCRIPT_FILENAME", result.script_path);
+
+  server_.set_fd_events(client_fd_, 0);
+  CgiInputHandler* input_handler = new CgiInputHandler(
+      worker->in_fd, -1,
+      CgiWorkerPool::encode_request(env.to_pairs(), request.body), server_,
+      client_fd_, true);
+  input_handler->set_send_timeout(result.location->cgi_send_timeout_sec);
+  server_.register_fd(worker->in_fd, input_handler, POLLOUT);
+  CgiResponseHandler* output_handler =
+      new CgiResponseHandler(worker, server_, client_fd_, target_config);
+  output_handler->set_timeouts(*result.location);
+  if (!cgi_cache_key_.empty()) {
+    output_handler->cache_into(result.location->cgi_cache, cgi_cache_key_,
+                               cgi_cache_fills_);
+    cgi_cache_fills_ = false;
+  }
+  server_.register_fd(worker->out_fd, output_handler, POLLIN);
+  return true;
+}
+
+bool ClientHandler::do_fastcgi_(const Request& request,
+                                const ProcessorResult& result,
+                                const ServerContext& target_config) {
+  state_ = kExecutingCgi;
+  if (lookup_disk_cache_(request, *result.location)) {
+    return false;
+  }
+
+  MetaVariables env = MetaVariables::from_request(
+      request, result.script_uri, result.query_string, target_config.cgi_env,
+      port_, client_addr_);
+  env.set("SCRIPT_FILENAME", result.script_path);
+  env.set("DOCUMENT_ROOT", result.script_path.substr(
+                               0, result.script_path.size() -
+                                      result.script_uri.size()));
+  env.set("REQUEST_URI", request.target);
+  if (!FastCgiHandler::start(
+          server_, result.upstream,
+          server_.upstreams().hash_key(result.upstream, request),
+          env.to_pairs(), request.body, client_fd_, target_config)) {
+    send_error_response_(kBadGateway);
+    return false;
+  }
+
+  server_.set_fd_events(client_fd_, 0);
+  return true;
+}
+
+// With body_relay_ set, the body is passed on as it arrives
+bool ClientHandler::do_proxy_(const Request& request,
+                              const ProcessorResult& result,
+                              const ServerContext& target_config) {
+  state_ = kExecutingCgi;
+  if (lookup_disk_cache_(request, *result.location)) {
+    return false;
+  }
+  if (!ProxyHandler::start(server_, request, *result.location, client_addr_,
+                           body_relay_, client_fd_, target_config)) {
+    end_body_stream_();
+    send_error_response_(kBadGateway);
+    return false;
+  }
+  server_.set_fd_events(client_fd_, body_events_());
+  return true;
+}
+
+// A backend answering for this connection keeps it open for as long as the
+// backend's own timeouts allow
+void ClientHandler::hold_until(int64_t deadline_sec) {
+  if (deadline_sec > deadline_sec_) {
+    deadline_sec_ = deadline_sec;
+    server_.update_timeout(client_fd_);
+  }
+}
+
+// The plugin's answer or error replaces result.response. A plugin that may
+// block runs on a FileIoPool thread like the file calls, and false means
+// the answer comes through file_io_done(); the others run inline, as do all
+// of them when the pool is off or full.
+bool ClientHandler::run_native_handler_(const Request& request,
+                                        ProcessorResult& result,
+                                        const ServerContext& target_config) {
+  NativeCall* call =
+      server_.native_handlers().prepare(*result.location, request,
+                                        client_addr_);
+  if (NativeHandlers::is_blocking(call)) {
+    FileTask* task = new FileTask(FileTask::kNativeCall, "", client_fd_,
+                                  serial_);
+    task->native_call = call;
+    if (server_.file_io_pool().submit(task)) {
+      file_io_result_ = result;
+      state_ = kWaitingFileIo;
+      server_.set_fd_events(client_fd_, 0);
+      return false;
     }
+    task->native_call = NULL;
+    delete task;
+  }
+  NativeHandlers::execute(call);
+  finish_native_(call, result, target_config);
+  return true;
+}
+
+// A streamed body has no length: chunks on HTTP/1.1, closing the
+// connection on HTTP/1.0
+void ClientHandler::finish_native_(NativeCall* call, ProcessorResult& result,
+                                   const ServerContext& target_config) {
+  ParserStatus status = server_.native_handlers().finish(
+      *result.location, call, client_fd_, result.response,
+      result.body_source);
+  if (status != kOk) {
+    result.response =
+        RequestProcessor::make_error_response(target_config, status);
+    return;
+  }
+  if (result.body_source != NULL && current_request_.version == kHttp11) {
+    result.response.add_header("Transfer-Encoding", "chunked");
   }
-  remote_addr = client_addr_;
 }
 
 void ClientHandler::cgi_response_ready(const std::string& response) {
+  // Already answered, e.g. the body was rejected while the CGI ran
+  if (state_ != kExecutingCgi) {
+    return;
+  }
+  if (disk_cache_ != NULL) {
+    server_.disk_cache().store(*disk_cache_, disk_cache_key_, response);
+    disk_cache_ = NULL;
+  }
   start_sending_response_(response);
 }
 
+void ClientHandler::cgi_stream_ready(Response& head, BodySource* body,
+                                     bool has_framing) {
+  if (state_ != kExecutingCgi) {
+    delete body;
+    return;
+  }
+  if (disk_cache_ != NULL) {
+    body = server_.disk_cache().tee(*disk_cache_, disk_cache_key_,
+                                    head.serialize(), body);
+    disk_cache_ = NULL;
+  }
+  // Without a length the end of the body has to be marked: chunks on
+  // HTTP/1.1, closing the connection on HTTP/1.0
+  bool chunked = !has_framing && current_request_.version == kHttp11;
+  if (chunked) {
+    head.add_header("Transfer-Encoding", "chunked");
+  }
+  start_sending_response_(head.serialize(), body, chunked);
+}
+
 void ClientHandler::cgi_local_redirect_ready(const std::string& location) {
+  if (state_ != kExecutingCgi) {
+    return;
+  }
+  // The rest of a streamed body belonged to the first script
+  end_body_stream_();
   if (location.empty() || location[0] != '/') {
     send_error_response_(kBadGateway);
     return;
@@ -183,16 +929,83 @@ void ClientHandler::cgi_local_redirect_ready(const std::string& location) {
   ProcessorResult result =
       RequestProcessor::process(kParseFinished, current_request_, target_config);
   if (result.next_action == ProcessorResult::kExecuteCgi) {
-    if (!do_cgi_(current_request_, result.script_path,
-                result.cgi_path, result.query_string, result.script_uri,
-                target_config)) {
-      return;
-    }
+    do_cgi_(current_request_, result, target_config);
+    return;
+  }
+  if (result.next_action == ProcessorResult::kExecuteFastCgi) {
+    do_fastcgi_(current_request_, result, target_config);
+    return;
+  }
+  if (result.next_action == ProcessorResult::kExecuteProxy) {
+    do_proxy_(current_request_, result, target_config);
+    return;
+  }
+  if (result.next_action == ProcessorResult::kFileIo) {
+    start_file_io_(result);
+    return;
+  }
+  if (result.next_action == ProcessorResult::kStreamUpload) {
+    start_upload_(result, true);
     return;
   }
 
+  if (result.next_action == ProcessorResult::kExecuteNative &&
+      !run_native_handler_(current_request_, result, target_config)) {
+    return;
+  }
   response_ = result.response;
-  send_prepared_response_();
+  if (result.next_action == ProcessorResult::kSendStatus) {
+    response_.set_body_and_content_length(server_.status_report());
+  }
+  start_sending_response_(response_.serialize(), result.body_source,
+                          response_.is_chunked());
+}
+
+// The call runs on a FileIoPool thread while the loop serves others. When
+// the pool is off or full it runs right here instead.
+void ClientHandler::start_file_io_(const ProcessorResult& result) {
+  FileTask* task =
+      new FileTask(result.file_op, result.file_path, client_fd_, serial_);
+  if (result.file_op == FileTask::kWriteFile) {
+    task->data.swap(current_request_.body);
+  }
+  file_io_result_ = result;
+  state_ = kWaitingFileIo;
+  if (server_.file_io_pool().submit(task)) {
+    server_.set_fd_events(client_fd_, 0);
+    return;
+  }
+  task->run();
+  file_io_done(*task);
+  delete task;
+}
+
+void ClientHandler::file_io_done(FileTask& task) {
+  if (state_ != kWaitingFileIo) {
+    return;
+  }
+  switch (task.op) {
+    case FileTask::kUploadOpen:
+    case FileTask::kUploadWrite:
+    case FileTask::kUploadFlush:
+    case FileTask::kUploadCommit:
+      upload_step_done_(task);
+      return;
+    default:
+      break;
+  }
+  if (task.op == FileTask::kNativeCall) {
+    NativeCall* call = task.native_call;
+    task.native_call = NULL;
+    finish_native_(call, file_io_result_, set_up_target_config_());
+    start_sending_response_(file_io_result_.response.serialize(),
+                            file_io_result_.body_source,
+                            file_io_result_.response.is_chunked());
+    return;
+  }
+  RequestProcessor::complete_file_io(file_io_result_, task.error, task.data,
+                                     set_up_target_config_());
+  start_sending_response_(file_io_result_.response.serialize());
 }
 
 void ClientHandler::send_prepared_response_() {
@@ -202,9 +1015,7 @@ void ClientHandler::send_prepared_response_() {
 void ClientHandler::send_error_response_(ParserStatus status) {
   refresh_current_request_();
   const ServerContext& target_config = set_up_target_config_();
-  response_.prepare_error_response(
-      status,
-      RequestProcessor::get_error_page_path(target_config, status));
+  response_ = RequestProcessor::make_error_response(target_config, status);
   send_prepared_response_();
 }
 
@@ -212,14 +1023,18 @@ void ClientHandler::refresh_current_request_() {
   current_request_ = parser_.get_request();
 }
 
-const ServerContext& ClientHandler::set_up_target_config_() const {
+const ServerContext& ClientHandler::set_up_target_config_() {
+  if (server_config_ != NULL) {
+    return *server_config_;
+  }
   std::string host_name = "";
   std::map<std::string, std::string>::const_iterator it =
       current_request_.headers.find("host");
   if (it != current_request_.headers.end()) {
     host_name = it->second;
   }
-  return config_.get_config(std::atoi(port_.c_str()), host_name);
+  server_config_ = &config_.get_config(listen_port_, host_name);
+  return *server_config_;
 }
 
 void ClientHandler::update_deadline_() {
@@ -229,16 +1044,43 @@ void ClientHandler::update_deadline_() {
 }
 
 HandlerStatus ClientHandler::handle_timeout() {
+  if (cgi_queued_) {
+    cgi_queued_ = false;
+    server_.cgi_limiter().cancel(*queued_cgi_.location, client_fd_, serial_,
+                                 true);
+    abandon_cgi_cache_fill_(*queued_cgi_.location);
+    response_ = RequestProcessor::make_unavailable_response(
+        set_up_target_config_(), queued_cgi_.location->cgi_queue_timeout_sec);
+    send_prepared_response_();
+    return kHandlerContinue;
+  }
+  if (cgi_cache_waiting_) {
+    // The lock timed out, or the other request had nothing to share: the
+    // script runs for this request alone, and its output is not cached
+    cgi_cache_waiting_ = false;
+    server_.cgi_cache().remove_waiter(queued_cgi_.location->cgi_cache,
+                                      cgi_cache_key_, client_fd_, serial_);
+    cgi_cache_key_.clear();
+    update_deadline_();
+    run_cgi_(current_request_, queued_cgi_, set_up_target_config_());
+    return kHandlerContinue;
+  }
   if (state_ == kSendingResponse) {
     std::cout << "Response sending timeout: " << client_addr_ << "\n";
   }
   return kHandlerClosed;
 }
 
-void ClientHandler::start_sending_response_(const std::string& full_response) {
+void ClientHandler::start_sending_response_(const std::string& full_response,
+                                            BodySource* body_source,
+                                            bool body_chunked) {
   response_str_ = full_response;
   bytes_sent_ = 0;
+  delete body_source_;
+  body_source_ = body_source;
+  body_chunked_ = body_chunked;
+  splice_remaining_ = 0;
   state_ = kSendingResponse;
-  server_.set_fd_events(client_fd_, POLLOUT);
+  server_.set_fd_events(client_fd_, POLLOUT | body_events_());
   update_deadline_();
 }
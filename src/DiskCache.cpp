@@ -0,0 +1,893 @@
+#include "DiskCache.hpp"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <sstream>
+#include <utility>
+#include <vector>
+
+#include "CgiCache.hpp"
+#include "FileIoPool.hpp"
+#include "Response.hpp"
+#include "SystemError.hpp"
+#include "pipe_utils.hpp"
+#include "spawn_utils.hpp"
+#include "string_utils.hpp"
+
+// The index and entry headers hold 8-byte fields only, so that their layout
+// needs no packing. They are only ever read back by the same build.
+struct DiskCache::IndexHeader {
+  char magic[8];
+  uint64_t slot_count;
+  uint64_t entries;
+  uint64_t bytes;  // Of the entry files
+  uint64_t clean;  // 1 while no server has it open
+};
+
+struct DiskCache::IndexSlot {
+  uint64_t hash;  // 0 when free
+  int64_t expires;
+  int64_t last_used;
+  uint64_t size;
+};
+
+namespace {
+const char kIndexMagic[8] = {'W', 'S', 'I', 'N', 'D', 'E', 'X', '1'};
+const char kEntryMagic[8] = {'W', 'S', 'E', 'N', 'T', 'R', 'Y', '1'};
+
+// Followed by the key, the head lines and the body
+struct EntryHeader {
+  char magic[8];
+  int64_t expires;
+  uint64_t status;
+  uint64_t key_len;
+  uint64_t head_len;
+  uint64_t body_len;
+};
+
+int64_t now_time_disk() { return static_cast<int64_t>(std::time(NULL)); }
+
+bool read_at(int fd, char* buf, std::size_t len, off_t offset) {
+  while (len > 0) {
+    ssize_t n = pread(fd, buf, len, offset);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    buf += n;
+    len -= static_cast<std::size_t>(n);
+    offset += n;
+  }
+  return true;
+}
+
+bool write_all(int fd, const char* data, std::size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, data, len);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    data += n;
+    len -= static_cast<std::size_t>(n);
+  }
+  return true;
+}
+
+void make_directory(const std::string& path) {
+  if (mkdir(path.c_str(), 0700) == -1 && errno != EEXIST) {
+    throw SystemError("cache_path " + path);
+  }
+}
+
+// Reads the status and headers of a serialized response, names lowercased.
+// kept gets the header lines worth storing: framing and Date are set again
+// when the entry is sent. head_end is where the body starts.
+bool parse_head(const std::string& response, std::size_t& head_end,
+                int& status, std::map<std::string, std::string>& headers,
+                std::string& kept) {
+  std::size_t blank = response.find("\r\n\r\n");
+  std::size_t space = response.find(' ');
+  if (blank == std::string::npos || response.compare(0, 5, "HTTP/") != 0 ||
+      space == std::string::npos || space + 4 > blank) {
+    return false;
+  }
+  std::string code = response.substr(space + 1, 3);
+  if (!is_digits(code)) {
+    return false;
+  }
+  status = std::atoi(code.c_str());
+  std::size_t pos = response.find("\r\n") + 2;
+  while (pos <= blank) {
+    std::size_t eol = response.find("\r\n", pos);
+    std::string line = response.substr(pos, eol - pos);
+    pos = eol + 2;
+    std::size_t colon = line.find(':');
+    if (colon == std::string::npos) {
+      continue;
+    }
+    std::string name = to_lower(line.substr(0, colon));
+    headers[name] = trim(line.substr(colon + 1), " \t");
+    if (name != "date" && name != "content-length" &&
+        name != "transfer-encoding" && name != "connection" &&
+        name != "keep-alive") {
+      kept.append(line);
+      kept.append("\r\n");
+    }
+  }
+  head_end = blank + 4;
+  return true;
+}
+
+// The body of an entry, sent from the file by the kernel where it can be
+class FileSource : public BodySource {
+  int fd_;
+  off_t offset_;
+  std::size_t remaining_;
+
+  FileSource(const FileSource&);
+  FileSource& operator=(const FileSource&);
+
+ public:
+  FileSource(int fd, off_t offset, std::size_t len)
+      : fd_(fd), offset_(offset), remaining_(len) {}
+  ~FileSource() { close(fd_); }
+  BodyStatus read_some(std::string& out, std::size_t max_bytes) {
+    std::size_t len = std::min(max_bytes, remaining_);
+    if (len == 0) {
+      return kBodyDone;
+    }
+    std::size_t start = out.size();
+    out.resize(start + len);
+    if (!read_at(fd_, &out[start], len, offset_)) {
+      out.resize(start);
+      return kBodyError;
+    }
+    offset_ += static_cast<off_t>(len);
+    remaining_ -= len;
+    return remaining_ == 0 ? kBodyDone : kBodyMore;
+  }
+#ifdef WEBSERV_HAVE_SENDFILE
+  std::size_t spliceable() { return remaining_; }
+#endif
+  ssize_t splice_to(int fd, std::size_t max_bytes) {
+    ssize_t n = send_file_bytes(fd_, fd, offset_,
+                                std::min(max_bytes, remaining_));
+    if (n > 0) {
+      remaining_ -= static_cast<std::size_t>(n);
+    }
+    return n;
+  }
+};
+}  // namespace
+
+// An entry being written under <dir>/tmp. Its bytes gather on the loop
+// and go to the file on the FileIoPool a piece at a time, so that they stay
+// in order. The last step fills in the body length and renames the file
+// into place, and commit_() then indexes it; an entry given up is removed
+// the same way. The writer goes once its owner has released it and no step
+// is under way.
+class DiskCache::Writer {
+ public:
+  Writer(DiskCache& cache, Zone& zone, uint64_t hash, int64_t expires,
+         int status, const std::string& key, const std::string& head_lines,
+         long declared_length)
+      : cache_(cache),
+        zone_(zone),
+        hash_(hash),
+        expires_(expires),
+        path_(entry_path_(zone, hash)),
+        fd_(-1),
+        body_len_(0),
+        declared_length_(declared_length),
+        step_(kAppend),
+        created_(false),
+        done_(false),
+        busy_(false),
+        committing_(false),
+        failed_(false),
+        released_(false) {
+    std::ostringstream path;
+    path << zone.config->path << "/tmp/" << getpid() << '.'
+         << ++zone.temp_serial;
+    temp_path_ = path.str();
+    std::memset(&header_, 0, sizeof(header_));
+    std::memcpy(header_.magic, kEntryMagic, sizeof(header_.magic));
+    header_.expires = expires;
+    header_.status = static_cast<uint64_t>(status);
+    header_.key_len = key.size();
+    header_.head_len = head_lines.size();
+    pending_.append(reinterpret_cast<const char*>(&header_), sizeof(header_));
+    pending_.append(key);
+    pending_.append(head_lines);
+  }
+
+  // Only left with a file when the pool stopped before its last step
+  ~Writer() {
+    if (fd_ != -1) {
+      close(fd_);
+    }
+    if (created_ && !done_) {
+      unlink(temp_path_.c_str());
+    }
+  }
+
+  // Entries may not take more than a quarter of the zone
+  bool append(const char* data, std::size_t len) {
+    body_len_ += len;
+    if (failed_ ||
+        body_len_ > static_cast<uint64_t>(zone_.config->max_size / 4)) {
+      failed_ = true;
+      return false;
+    }
+    pending_.append(data, len);
+    next_step_();
+    return !failed_;
+  }
+
+  void commit() {
+    if (failed_ || (declared_length_ >= 0 &&
+                    body_len_ != static_cast<uint64_t>(declared_length_))) {
+      failed_ = true;
+      return;
+    }
+    header_.body_len = body_len_;
+    committing_ = true;
+    next_step_();
+  }
+
+  // By its owner, which is done with it. A committed entry is still
+  // finished; any other is given up.
+  static void release(Writer* writer) {
+    if (writer == NULL) {
+      return;
+    }
+    writer->released_ = true;
+    writer->next_step_();
+  }
+
+  // On a pool thread. The loop leaves the writer alone until the step is
+  // back in step_done().
+  int run_step(const std::string& data) {
+    if (step_ == kAbort) {
+      return fail_(0);
+    }
+    if (fd_ == -1) {
+      fd_ = open(temp_path_.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+      if (fd_ == -1) {
+        done_ = true;
+        return errno;
+      }
+      created_ = true;
+      set_cloexec(fd_);
+    }
+    if (!write_all(fd_, data.data(), data.size())) {
+      return fail_(errno != 0 ? errno : EIO);
+    }
+    if (step_ != kCommit) {
+      return 0;
+    }
+    if (pwrite(fd_, &header_, sizeof(header_), 0) !=
+        static_cast<ssize_t>(sizeof(header_))) {
+      return fail_(errno != 0 ? errno : EIO);
+    }
+    close(fd_);
+    fd_ = -1;
+    if (rename(temp_path_.c_str(), path_.c_str()) == -1) {
+      return fail_(errno);
+    }
+    done_ = true;
+    return 0;
+  }
+
+  // Back on the loop
+  void step_done(int error) {
+    busy_ = false;
+    if (error != 0) {
+      failed_ = true;
+    } else if (step_ == kCommit) {
+      cache_.commit_(zone_, hash_, expires_,
+                     sizeof(header_) + header_.key_len + header_.head_len +
+                         body_len_,
+                     path_);
+    }
+    next_step_();
+  }
+
+  // The pool stopped with the step still queued. It only stops once every
+  // client, and so every owner, is gone.
+  void step_dropped() {
+    busy_ = false;
+    failed_ = true;
+    if (released_) {
+      delete this;
+    }
+  }
+
+ private:
+  enum Step { kAppend, kCommit, kAbort };
+  static const std::size_t kPieceBytes = 64 * 1024;
+  DiskCache& cache_;
+  Zone& zone_;
+  uint64_t hash_;
+  int64_t expires_;
+  std::string path_;
+  std::string temp_path_;
+  std::string pending_;  // Not yet handed to a step
+  // Touched by the step under way only
+  int fd_;
+  EntryHeader header_;
+  uint64_t body_len_;
+  long declared_length_;  // -1 without a Content-Length
+  Step step_;
+  bool created_;  // The temp file exists
+  bool done_;     // ... and is gone again, renamed or removed
+  // Loop side
+  bool busy_;  // A step is under way
+  bool committing_;
+  bool failed_;
+  bool released_;
+
+  // Starts the step that is due, if any, and deletes the writer when
+  // nothing is left for it to do. Without a pool the step runs right here.
+  void next_step_() {
+    if (busy_) {
+      return;
+    }
+    if (done_ || (!created_ && (failed_ || (released_ && !committing_)))) {
+      if (released_) {
+        delete this;
+      }
+      return;
+    }
+    if (failed_ || (released_ && !committing_)) {
+      step_ = kAbort;
+    } else if (committing_) {
+      step_ = kCommit;
+    } else if (pending_.size() >= kPieceBytes) {
+      step_ = kAppend;
+    } else {
+      return;
+    }
+    busy_ = true;
+    FileTask* task = new FileTask(FileTask::kCacheWrite, "", -1, 0);
+    task->data.swap(pending_);
+    task->cache_writer = this;
+    if (cache_.pool_ != NULL && cache_.pool_->submit(task)) {
+      return;
+    }
+    task->run();
+    cache_.write_done(*task);
+    delete task;
+  }
+
+  int fail_(int error) {
+    if (fd_ != -1) {
+      close(fd_);
+      fd_ = -1;
+    }
+    if (created_) {
+      unlink(temp_path_.c_str());
+    }
+    done_ = true;
+    return error;
+  }
+
+  Writer(const Writer&);
+  Writer& operator=(const Writer&);
+};
+
+namespace {
+// Copies what goes to the client into the writer. Splicing would bypass
+// it, so the bytes are pulled through read_some() until the entry is done
+// or given up.
+class TeeSource : public BodySource {
+  BodySource* body_;
+  DiskCache::Writer* writer_;
+
+  TeeSource(const TeeSource&);
+  TeeSource& operator=(const TeeSource&);
+
+  void drop_writer_() {
+    DiskCache::Writer::release(writer_);
+    writer_ = NULL;
+  }
+
+ public:
+  TeeSource(BodySource* body, DiskCache::Writer* writer)
+      : body_(body), writer_(writer) {
+    body_->disable_splice();
+  }
+  ~TeeSource() {
+    DiskCache::Writer::release(writer_);
+    delete body_;
+  }
+  BodyStatus read_some(std::string& out, std::size_t max_bytes) {
+    std::size_t start = out.size();
+    BodyStatus status = body_->read_some(out, max_bytes);
+    if (writer_ == NULL) {
+      return status;
+    }
+    if (status == kBodyError ||
+        !writer_->append(out.data() + start, out.size() - start)) {
+      drop_writer_();
+    } else if (status == kBodyDone) {
+      writer_->commit();
+      drop_writer_();
+    }
+    return status;
+  }
+  std::size_t spliceable() {
+    return writer_ == NULL ? body_->spliceable() : 0;
+  }
+  ssize_t splice_to(int fd, std::size_t max_bytes) {
+    return body_->splice_to(fd, max_bytes);
+  }
+};
+}  // namespace
+
+DiskCache::~DiskCache() {
+  for (std::map<std::string, Zone>::iterator it = zones_.begin();
+       it != zones_.end(); ++it) {
+    Zone& zone = it->second;
+    if (zone.map == NULL) {
+      continue;
+    }
+    zone.header->clean = 1;
+    msync(zone.map, zone.map_size, MS_SYNC);
+    munmap(zone.map, zone.map_size);
+    close(zone.index_fd);
+  }
+}
+
+void DiskCache::configure(const Config& config, FileIoPool* pool) {
+  pool_ = pool;
+  const std::vector<CachePathConfig>& paths = config.get_cache_paths();
+  for (std::size_t i = 0; i < paths.size(); ++i) {
+    Zone& zone = zones_[paths[i].name];
+    std::memset(&zone, 0, sizeof(zone));
+    zone.config = &paths[i];
+    zone.index_fd = -1;
+    open_zone_(zone);
+  }
+  next_eviction_sec_ = now_time_disk() + kEvictionIntervalSec;
+}
+
+// The table keeps a quarter of its slots free so that probes stay short
+void DiskCache::open_zone_(Zone& zone) {
+  const std::string& dir = zone.config->path;
+  make_directory(dir);
+  make_directory(dir + "/tmp");
+  for (int i = 0; i < 256; ++i) {
+    char name[4];
+    std::snprintf(name, sizeof(name), "%02x", i);
+    make_directory(dir + "/" + name);
+  }
+
+  uint64_t slot_count = 16;
+  while (slot_count < static_cast<uint64_t>(zone.config->entries) * 4 / 3) {
+    slot_count *= 2;
+  }
+  zone.mask = slot_count - 1;
+  zone.map_size = sizeof(IndexHeader) + slot_count * sizeof(IndexSlot);
+  std::string index_path = dir + "/index";
+  zone.index_fd = open(index_path.c_str(), O_RDWR | O_CREAT, 0600);
+  if (zone.index_fd == -1) {
+    throw SystemError("cache_path " + index_path);
+  }
+  set_cloexec(zone.index_fd);
+  struct stat st;
+  bool fits = fstat(zone.index_fd, &st) == 0 &&
+              static_cast<std::size_t>(st.st_size) == zone.map_size;
+  if (!fits && (ftruncate(zone.index_fd, 0) == -1 ||
+                ftruncate(zone.index_fd,
+                          static_cast<off_t>(zone.map_size)) == -1)) {
+    throw SystemError("cache_path " + index_path);
+  }
+  void* map = mmap(NULL, zone.map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   zone.index_fd, 0);
+  if (map == MAP_FAILED) {
+    throw SystemError("cache_path " + index_path);
+  }
+  zone.map = map;
+  zone.header = static_cast<IndexHeader*>(map);
+  zone.slots = reinterpret_cast<IndexSlot*>(static_cast<char*>(map) +
+                                            sizeof(IndexHeader));
+  if (!fits || std::memcmp(zone.header->magic, kIndexMagic, 8) != 0 ||
+      zone.header->slot_count != slot_count || zone.header->clean != 1) {
+    rebuild_index_(zone);
+  }
+  zone.header->clean = 0;
+
+  // Left by writers that never finished
+  DIR* tmp = opendir((dir + "/tmp").c_str());
+  if (tmp != NULL) {
+    while (struct dirent* entry = readdir(tmp)) {
+      if (entry->d_name[0] != '.') {
+        unlink((dir + "/tmp/" + entry->d_name).c_str());
+      }
+    }
+    closedir(tmp);
+  }
+}
+
+// Indexes every entry file that is whole, fresh and where its key hashes
+// to; the others are removed
+void DiskCache::rebuild_index_(Zone& zone) {
+  std::memset(zone.map, 0, zone.map_size);
+  std::memcpy(zone.header->magic, kIndexMagic, 8);
+  zone.header->slot_count = zone.mask + 1;
+  int64_t now = now_time_disk();
+  for (int i = 0; i < 256; ++i) {
+    char name[4];
+    std::snprintf(name, sizeof(name), "%02x", i);
+    std::string subdir = zone.config->path + "/" + name;
+    DIR* dir = opendir(subdir.c_str());
+    if (dir == NULL) {
+      continue;
+    }
+    while (struct dirent* entry = readdir(dir)) {
+      if (entry->d_name[0] == '.') {
+        continue;
+      }
+      std::string path = subdir + "/" + entry->d_name;
+      int fd = open(path.c_str(), O_RDONLY);
+      EntryHeader header;
+      struct stat st;
+      bool keep = false;
+      if (fd != -1 && fstat(fd, &st) == 0 &&
+          read_at(fd, reinterpret_cast<char*>(&header), sizeof(header), 0) &&
+          std::memcmp(header.magic, kEntryMagic, 8) == 0 &&
+          header.expires > now && header.key_len < kMaxHeadBytes &&
+          static_cast<uint64_t>(st.st_size) ==
+              sizeof(header) + header.key_len + header.head_len +
+                  header.body_len) {
+        std::string key(header.key_len, '\0');
+        uint64_t hash = 0;
+        if (read_at(fd, &key[0], key.size(), sizeof(header))) {
+          hash = hash_key_(key);
+        }
+        keep = hash != 0 && entry_path_(zone, hash) == path &&
+               insert_slot_(zone, hash, header.expires, now,
+                            static_cast<uint64_t>(st.st_size));
+      }
+      if (fd != -1) {
+        close(fd);
+      }
+      if (!keep) {
+        unlink(path.c_str());
+      }
+    }
+    closedir(dir);
+  }
+  std::cerr << "disk_cache " << zone.config->name << ": index rebuilt, "
+            << zone.header->entries << " entries\n";
+}
+
+DiskCache::Zone* DiskCache::find_zone_(const std::string& name) {
+  std::map<std::string, Zone>::iterator it = zones_.find(name);
+  return it != zones_.end() ? &it->second : NULL;
+}
+
+bool DiskCache::lookup(const DiskCacheConfig& dc, const std::string& key,
+                       std::string& head, BodySource*& body) {
+  Zone* zone = find_zone_(dc.zone);
+  if (zone == NULL) {
+    return false;
+  }
+  uint64_t hash = hash_key_(key);
+  long slot = find_slot_(*zone, hash);
+  int64_t now = now_time_disk();
+  if (slot != -1 && zone->slots[slot].expires <= now) {
+    remove_entry_(*zone, hash);
+    slot = -1;
+  }
+  if (slot == -1) {
+    zone->misses++;
+    return false;
+  }
+
+  std::string path = entry_path_(*zone, hash);
+  int fd = open(path.c_str(), O_RDONLY);
+  EntryHeader header;
+  struct stat st;
+  bool valid = fd != -1 && fstat(fd, &st) == 0 &&
+               read_at(fd, reinterpret_cast<char*>(&header), sizeof(header),
+                       0) &&
+               std::memcmp(header.magic, kEntryMagic, 8) == 0 &&
+               header.key_len < kMaxHeadBytes &&
+               header.head_len < kMaxHeadBytes &&
+               static_cast<uint64_t>(st.st_size) ==
+                   sizeof(header) + header.key_len + header.head_len +
+                       header.body_len;
+  std::string stored;
+  if (valid) {
+    stored.resize(header.key_len + header.head_len);
+    valid = read_at(fd, &stored[0], stored.size(), sizeof(header));
+  }
+  // Another key with the same hash is only a miss; the entry stays
+  bool same_key = valid && stored.compare(0, header.key_len, key) == 0;
+  if (!same_key) {
+    if (fd != -1) {
+      close(fd);
+    }
+    if (!valid) {
+      remove_entry_(*zone, hash);
+    }
+    zone->misses++;
+    return false;
+  }
+
+  zone->slots[slot].last_used = now;
+  zone->hits++;
+  Response response;
+  response.set_status_code(static_cast<int>(header.status));
+  response.add_raw_headers(stored.substr(header.key_len));
+  std::ostringstream length;
+  length << header.body_len;
+  response.add_header("Content-Length", length.str());
+  head = response.serialize();
+  body = new FileSource(
+      fd, static_cast<off_t>(sizeof(header) + stored.size()),
+      static_cast<std::size_t>(header.body_len));
+  return true;
+}
+
+// Returns NULL unless the backend allows the response to be kept
+DiskCache::Writer* DiskCache::start_entry_(const DiskCacheConfig& dc,
+                                           const std::string& key,
+                                           const std::string& head,
+                                           std::size_t& head_end) {
+  Zone* zone = find_zone_(dc.zone);
+  int status;
+  std::map<std::string, std::string> headers;
+  std::string kept;
+  int64_t ttl_sec;
+  int64_t stale_sec;
+  if (zone == NULL || !parse_head(head, head_end, status, headers, kept) ||
+      headers.count("transfer-encoding") != 0 ||
+      !CgiCache::freshness(dc.ttl_sec, 0, status, headers, ttl_sec,
+                           stale_sec) ||
+      key.size() + kept.size() >= kMaxHeadBytes) {
+    return NULL;
+  }
+  long declared_length = -1;
+  std::map<std::string, std::string>::const_iterator it =
+      headers.find("content-length");
+  if (it != headers.end()) {
+    if (!is_digits(it->second) || it->second.size() > 15) {
+      return NULL;
+    }
+    declared_length = std::atol(it->second.c_str());
+  }
+  return new Writer(*this, *zone, hash_key_(key), now_time_disk() + ttl_sec,
+                    status, key, kept, declared_length);
+}
+
+void DiskCache::store(const DiskCacheConfig& dc, const std::string& key,
+                      const std::string& response) {
+  std::size_t head_end;
+  Writer* writer = start_entry_(dc, key, response, head_end);
+  if (writer == NULL) {
+    return;
+  }
+  if (writer->append(response.data() + head_end,
+                     response.size() - head_end)) {
+    writer->commit();
+  }
+  Writer::release(writer);
+}
+
+BodySource* DiskCache::tee(const DiskCacheConfig& dc, const std::string& key,
+                           const std::string& head, BodySource* body) {
+  std::size_t head_end;
+  Writer* writer = start_entry_(dc, key, head, head_end);
+  if (writer == NULL) {
+    return body;
+  }
+  return new TeeSource(body, writer);
+}
+
+void DiskCache::write_done(FileTask& task) {
+  Writer* writer = task.cache_writer;
+  task.cache_writer = NULL;
+  writer->step_done(task.error);
+}
+
+int DiskCache::run_write(Writer* writer, const std::string& data) {
+  return writer->run_step(data);
+}
+
+void DiskCache::discard(Writer* writer) {
+  if (writer != NULL) {
+    writer->step_dropped();
+  }
+}
+
+// Renamed into place before it is indexed, so that the index never points
+// at half an entry
+void DiskCache::commit_(Zone& zone, uint64_t hash, int64_t expires,
+                        uint64_t size, const std::string& path) {
+  if (!insert_slot_(zone, hash, expires, now_time_disk(), size)) {
+    // The index is full until the next eviction
+    remove_file_(path);
+    return;
+  }
+  zone.stores++;
+}
+
+// Off the loop when there is a pool; nobody waits for the result
+void DiskCache::remove_file_(const std::string& path) {
+  FileTask* task = new FileTask(FileTask::kRemove, path, -1, 0);
+  if (pool_ == NULL || !pool_->submit(task)) {
+    task->run();
+    delete task;
+  }
+}
+
+void DiskCache::evict(int64_t now) {
+  next_eviction_sec_ = now + kEvictionIntervalSec;
+  for (std::map<std::string, Zone>::iterator it = zones_.begin();
+       it != zones_.end(); ++it) {
+    Zone& zone = it->second;
+    const CachePathConfig& config = *zone.config;
+    // An erase shifts a later entry into the slot, so it is looked at again
+    for (uint64_t i = 0; i <= zone.mask;) {
+      IndexSlot& slot = zone.slots[i];
+      if (slot.hash != 0 && (slot.expires <= now ||
+                             now - slot.last_used >= config.inactive_sec)) {
+        remove_entry_(zone, slot.hash);
+        zone.evictions++;
+      } else {
+        ++i;
+      }
+    }
+
+    // Down to nine tenths, so that a full zone is not trimmed on every run
+    // and a full index takes new entries again
+    uint64_t max_bytes = static_cast<uint64_t>(config.max_size);
+    uint64_t max_entries = static_cast<uint64_t>(config.entries);
+    if (zone.header->bytes <= max_bytes &&
+        zone.header->entries < max_entries) {
+      continue;
+    }
+    std::vector<std::pair<int64_t, uint64_t> > by_age;
+    for (uint64_t i = 0; i <= zone.mask; ++i) {
+      if (zone.slots[i].hash != 0) {
+        by_age.push_back(
+            std::make_pair(zone.slots[i].last_used, zone.slots[i].hash));
+      }
+    }
+    std::sort(by_age.begin(), by_age.end());
+    for (std::size_t i = 0;
+         i < by_age.size() &&
+         (zone.header->bytes > max_bytes - max_bytes / 10 ||
+          zone.header->entries >= max_entries - max_entries / 10);
+         ++i) {
+      remove_entry_(zone, by_age[i].second);
+      zone.evictions++;
+    }
+  }
+}
+
+void DiskCache::report(std::string& out) const {
+  for (std::map<std::string, Zone>::const_iterator it = zones_.begin();
+       it != zones_.end(); ++it) {
+    const Zone& zone = it->second;
+    std::ostringstream line;
+    line << "disk_cache " << it->first << ": entries "
+         << zone.header->entries << ", bytes " << zone.header->bytes << "/"
+         << zone.config->max_size << ", hits " << zone.hits << ", misses "
+         << zone.misses << ", stores " << zone.stores << ", evictions "
+         << zone.evictions << "\n";
+    out += line.str();
+  }
+}
+
+// FNV-1a over 64 bits; 0 marks a free slot and is moved aside
+uint64_t DiskCache::hash_key_(const std::string& key) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (std::size_t i = 0; i < key.size(); ++i) {
+    hash ^= static_cast<unsigned char>(key[i]);
+    hash *= 1099511628211ULL;
+  }
+  return hash != 0 ? hash : 1;
+}
+
+// <dir>/<last two hex digits>/<hash in hex>, so no directory gets crowded
+std::string DiskCache::entry_path_(const Zone& zone, uint64_t hash) {
+  char name[32];
+  std::snprintf(name, sizeof(name), "/%02x/%016llx",
+                static_cast<unsigned>(hash & 0xff),
+                static_cast<unsigned long long>(hash));
+  return zone.config->path + name;
+}
+
+long DiskCache::find_slot_(const Zone& zone, uint64_t hash) {
+  for (uint64_t i = hash & zone.mask;; i = (i + 1) & zone.mask) {
+    if (zone.slots[i].hash == hash) {
+      return static_cast<long>(i);
+    }
+    if (zone.slots[i].hash == 0) {
+      return -1;
+    }
+  }
+}
+
+// Linear probing. Replacing an entry keeps its slot; a new one is turned
+// away once the zone holds its `entries`.
+bool DiskCache::insert_slot_(Zone& zone, uint64_t hash, int64_t expires,
+                             int64_t last_used, uint64_t size) {
+  uint64_t i = hash & zone.mask;
+  while (zone.slots[i].hash != 0 && zone.slots[i].hash != hash) {
+    i = (i + 1) & zone.mask;
+  }
+  IndexSlot& slot = zone.slots[i];
+  if (slot.hash == 0) {
+    if (zone.header->entries >=
+        static_cast<uint64_t>(zone.config->entries)) {
+      return false;
+    }
+    zone.header->entries++;
+  } else {
+    zone.header->bytes -= slot.size;
+  }
+  slot.hash = hash;
+  slot.expires = expires;
+  slot.last_used = last_used;
+  slot.size = size;
+  zone.header->bytes += size;
+  return true;
+}
+
+// Moves later entries of the probe run back into the hole, which keeps
+// every entry reachable without tombstones
+void DiskCache::erase_slot_(Zone& zone, uint64_t hole) {
+  zone.header->entries--;
+  zone.header->bytes -= zone.slots[hole].size;
+  uint64_t i = hole;
+  for (;;) {
+    i = (i + 1) & zone.mask;
+    if (zone.slots[i].hash == 0) {
+      break;
+    }
+    uint64_t home = zone.slots[i].hash & zone.mask;
+    // Stays unless its home is outside (hole, i]
+    bool stays = hole <= i ? (hole < home && home <= i)
+                           : (hole < home || home <= i);
+    if (!stays) {
+      zone.slots[hole] = zone.slots[i];
+      hole = i;
+    }
+  }
+  std::memset(&zone.slots[hole], 0, sizeof(IndexSlot));
+}
+
+void DiskCache::remove_entry_(Zone& zone, uint64_t hash) {
+  long slot = find_slot_(zone, hash);
+  if (slot == -1) {
+    return;
+  }
+  erase_slot_(zone, static_cast<uint64_t>(slot));
+  remove_file_(entry_path_(zone, hash));
+}
+
+HandlerStatus DiskCacheEvictor::handle_timeout() {
+  cache_.evict(static_cast<int64_t>(std::time(NULL)));
+  return kHandlerContinue;
+}
@@ -0,0 +1,287 @@
+#include "FastCgiHandler.hpp"
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <ctime>
+#include <iostream>
+
+#include "CgiResponseHandler.hpp"
+#include "ClientHandler.hpp"
+#include "RequestProcessor.hpp"
+#include "Server.hpp"
+#include "UpstreamPool.hpp"
+
+static int64_t now_time_fastcgi() {
+  return static_cast<int64_t>(std::time(NULL));
+}
+
+bool FastCgiHandler::start(Server& server, const std::string& group,
+                           const std::string& hash_key,
+                           const fastcgi::Params& params,
+                           const std::string& body, int client_fd,
+                           const ServerContext& target_config) {
+  std::string request;
+  fastcgi::append_begin_request(request, kRequestId, true);
+  fastcgi::append_params(request, kRequestId, params);
+  if (!body.empty()) {
+    fastcgi::append_stream(request, fastcgi::kStdin, kRequestId, body.data(),
+                           body.size());
+  }
+  fastcgi::append_stream(request, fastcgi::kStdin, kRequestId, NULL, 0);
+  FastCgiHandler* handler =
+      new FastCgiHandler(server, group, request, client_fd, target_config);
+  handler->hash_key_ = hash_key;
+  if (!connect_and_register_(handler, true)) {
+    delete handler;
+    return false;
+  }
+  return true;
+}
+
+// Servers the connection cannot even be started to are passed over on the
+// spot, each counting as a failure
+bool FastCgiHandler::connect_and_register_(FastCgiHandler* handler,
+                                           bool allow_reuse) {
+  Server& server = handler->server_;
+  while (true) {
+    UpstreamGroups::Peer* peer = server.upstreams().select(
+        handler->group_, handler->hash_key_, handler->tried_);
+    if (peer == NULL) {
+      std::cerr << "fastcgi_pass: no live upstream in " << handler->group_
+                << "\n";
+      return false;
+    }
+    handler->tried_.push_back(peer);
+    bool reused;
+    int fd = server.fastcgi_pool().acquire(peer->address, allow_reuse, reused);
+    if (fd == -1) {
+      server.upstreams().release(peer, true);
+      continue;
+    }
+    handler->peer_ = peer;
+    handler->upstream_ = peer->address;
+    handler->fd_ = fd;
+    handler->reused_ = reused;
+    handler->connected_ = reused;
+    server.register_fd(fd, handler, POLLOUT);
+    return true;
+  }
+}
+
+FastCgiHandler::FastCgiHandler(Server& server, const std::string& group,
+                               const std::string& request, int client_fd,
+                               const ServerContext& target_config)
+    : server_(server),
+      group_(group),
+      peer_(NULL),
+      peer_failed_(false),
+      fd_(-1),
+      reused_(false),
+      connected_(false),
+      request_(request),
+      bytes_written_(0),
+      client_fd_(client_fd),
+      client_serial_(server.client_serial(client_fd)),
+      target_config_(target_config),
+      finished_(false),
+      reusable_(false),
+      deadline_sec_(now_time_fastcgi() + kFastCgiTimeoutSec) {}
+
+FastCgiHandler::~FastCgiHandler() {
+  if (peer_ != NULL) {
+    server_.upstreams().release(peer_, peer_failed_);
+  }
+  if (fd_ == -1) {
+    return;
+  }
+  if (reusable_) {
+    server_.fastcgi_pool().release(upstream_, fd_);
+  } else {
+    close(fd_);
+  }
+}
+
+void FastCgiHandler::update_deadline_() {
+  deadline_sec_ = now_time_fastcgi() + kFastCgiTimeoutSec;
+  server_.update_timeout(fd_);
+  if (client_fd_ >= 0) {
+    server_.update_timeout(client_fd_);
+  }
+}
+
+HandlerStatus FastCgiHandler::handle_output() {
+  if (finished_) {
+    return kCgiInputDone;
+  }
+  if (!connected_) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(fd_, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err != 0) {
+      std::cerr << "fastcgi_pass: connect to " << upstream_ << " failed\n";
+      return retry_or_fail_();
+    }
+    connected_ = true;
+  }
+  if (bytes_written_ >= request_.size()) {
+    return kHandlerContinue;
+  }
+
+  ssize_t n = send(fd_, request_.data() + bytes_written_,
+                   request_.size() - bytes_written_, 0);
+  if (n == -1) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return kHandlerContinue;
+    }
+    return retry_or_fail_();
+  }
+  bytes_written_ += static_cast<std::size_t>(n);
+  update_deadline_();
+  if (bytes_written_ >= request_.size()) {
+    server_.set_fd_events(fd_, POLLIN);
+  }
+  return kHandlerContinue;
+}
+
+HandlerStatus FastCgiHandler::handle_input() {
+  if (finished_) {
+    return kCgiInputDone;
+  }
+  char buf[kReadBufSize];
+  ssize_t n = recv(fd_, buf, sizeof(buf), 0);
+  if (n == -1) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return kHandlerContinue;
+    }
+    return retry_or_fail_();
+  }
+  if (n == 0) {
+    // The backend closed the connection before END_REQUEST
+    return retry_or_fail_();
+  }
+  update_deadline_();
+  in_buf_.append(buf, n);
+
+  bool ended = false;
+  bool failed = false;
+  if (!consume_records_(ended, failed)) {
+    peer_failed_ = true;
+    return fail_(kBadGateway);
+  }
+  if (!ended) {
+    return kHandlerContinue;
+  }
+
+  finished_ = true;
+  reusable_ = in_buf_.empty();
+  CgiResponseHandler::deliver_output(server_, client_fd_, client_serial_,
+                                     target_config_, stdout_, failed);
+  return kCgiInputDone;
+}
+
+// Returns false on a malformed or oversized response
+bool FastCgiHandler::consume_records_(bool& ended, bool& failed) {
+  std::size_t offset = 0;
+  fastcgi::RecordHeader header;
+  while (!ended && fastcgi::parse_header(in_buf_, offset, header)) {
+    std::size_t record_len = fastcgi::kHeaderLength + header.content_length +
+                             header.padding_length;
+    if (in_buf_.size() - offset < record_len) {
+      break;
+    }
+    const char* content = in_buf_.data() + offset + fastcgi::kHeaderLength;
+    if (header.request_id == kRequestId) {
+      switch (header.type) {
+        case fastcgi::kStdout:
+          if (stdout_.size() + header.content_length > kMaxOutputBytes) {
+            return false;
+          }
+          stdout_.append(content, header.content_length);
+          break;
+        case fastcgi::kStderr:
+          std::cerr.write(content, header.content_length);
+          break;
+        case fastcgi::kEndRequest:
+          if (header.content_length < 8) {
+            return false;
+          }
+          failed = static_cast<unsigned char>(content[4]) !=
+                   fastcgi::kRequestComplete;
+          ended = true;
+          break;
+        default:
+          break;
+      }
+    }
+    offset += record_len;
+  }
+  in_buf_.erase(0, offset);
+  return true;
+}
+
+// A request none of which reached the backend goes to the next one of the
+// group; once sent, it may have had effects and is not repeated. A pooled
+// connection the backend closed while idle is the exception and is not held
+// against the server: the request is replayed on a new connection, which
+// may well be to the same one.
+HandlerStatus FastCgiHandler::retry_or_fail_() {
+  bool stale = reused_;
+  if (!stale) {
+    peer_failed_ = true;
+  }
+  if (!stdout_.empty() || !in_buf_.empty() ||
+      (!stale && bytes_written_ > 0)) {
+    return fail_(kBadGateway);
+  }
+  // The new handler is bound to whoever owns client_fd_ now
+  if (server_.find_client_handler(client_fd_, client_serial_) == NULL) {
+    return fail_(kBadGateway);
+  }
+  FastCgiHandler* next = new FastCgiHandler(server_, group_, request_,
+                                            client_fd_, target_config_);
+  next->hash_key_ = hash_key_;
+  next->tried_ = tried_;
+  if (stale) {
+    next->tried_.pop_back();
+  }
+  if (!connect_and_register_(next, !stale)) {
+    delete next;
+    return fail_(kBadGateway);
+  }
+  finished_ = true;
+  return kCgiInputDone;
+}
+
+HandlerStatus FastCgiHandler::fail_(ParserStatus status) {
+  finished_ = true;
+  ClientHandler* ch = server_.find_client_handler(client_fd_, client_serial_);
+  if (ch != NULL) {
+    Response response = RequestProcessor::make_error_response(target_config_,
+                                                              status);
+    ch->cgi_response_ready(response.serialize());
+  }
+  return kCgiInputDone;
+}
+
+HandlerStatus FastCgiHandler::handle_poll_error() {
+  if (finished_) {
+    return kCgiInputDone;
+  }
+  if (!connected_) {
+    std::cerr << "fastcgi_pass: connect to " << upstream_ << " failed\n";
+  }
+  return retry_or_fail_();
+}
+
+HandlerStatus FastCgiHandler::handle_timeout() {
+  if (finished_) {
+    return kCgiInputDone;
+  }
+  if (!connected_) {
+    return retry_or_fail_();
+  }
+  peer_failed_ = true;
+  return fail_(kGatewayTimeout);
+}
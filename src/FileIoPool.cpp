@@ -0,0 +1,296 @@
+#include "FileIoPool.hpp"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include <cerrno>
+#include <cstdio>
+
+#include "ClientHandler.hpp"
+#include "NativeHandlers.hpp"
+#include "Server.hpp"
+#include "SystemError.hpp"
+#include "UploadSink.hpp"
+#include "spawn_utils.hpp"
+
+namespace {
+int read_whole_file(const std::string& path, std::string& data) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1) {
+    return errno;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    data.reserve(static_cast<std::size_t>(st.st_size));
+  }
+  char buffer[64 * 1024];
+  for (;;) {
+    ssize_t num_read = read(fd, buffer, sizeof(buffer));
+    if (num_read == -1 && errno == EINTR) {
+      continue;
+    }
+    if (num_read <= 0) {
+      int err = num_read == -1 ? errno : 0;
+      close(fd);
+      return err;
+    }
+    data.append(buffer, static_cast<std::size_t>(num_read));
+  }
+}
+
+// Through a temp file, like a streamed upload
+int write_whole_file(const std::string& path, const std::string& data) {
+  UploadSink* sink = UploadSink::create(path, data.size());
+  if (sink == NULL) {
+    return errno;
+  }
+  int err = 0;
+  if (!sink->write(data.data(), data.size()) || !sink->commit()) {
+    err = errno;
+  }
+  delete sink;
+  return err;
+}
+}  // namespace
+
+void FileTask::run() {
+  switch (op) {
+    case kReadFile:
+      error = read_whole_file(path, data);
+      break;
+    case kWriteFile:
+      error = write_whole_file(path, data);
+      std::string().swap(data);
+      break;
+    case kRemove:
+      error = std::remove(path.c_str()) == 0 ? 0 : errno;
+      break;
+    case kNativeCall:
+      NativeHandlers::execute(native_call);
+      break;
+    case kNativeRead:
+      error = NativeHandlers::read_piece(native_call, data);
+      break;
+    case kCacheWrite:
+      error = DiskCache::run_write(cache_writer, data);
+      std::string().swap(data);
+      break;
+    case kUploadOpen:
+      upload_sink = UploadSink::create(path, length);
+      error = upload_sink == NULL ? errno : 0;
+      break;
+    case kUploadWrite:
+      error = upload_sink->write(data.data(), data.size()) ? 0 : errno;
+      std::string().swap(data);
+      break;
+    case kUploadFlush:
+      error = upload_sink->flush_spliced() ? 0 : errno;
+      break;
+    case kUploadCommit:
+      error = upload_sink->commit() ? 0 : errno;
+      break;
+    case kUploadDrop:
+      delete upload_sink;
+      upload_sink = NULL;
+      break;
+  }
+}
+
+FileTask::~FileTask() {
+  NativeHandlers::discard(native_call);
+  DiskCache::discard(cache_writer);
+  delete upload_sink;
+}
+
+FileIoPool::FileIoPool(Server& server)
+    : server_(server),
+      read_fd_(-1),
+      write_fd_(-1),
+      stopping_(false),
+      done_(NULL) {
+  pthread_mutex_init(&mutex_, NULL);
+  pthread_cond_init(&cond_, NULL);
+}
+
+FileIoPool::~FileIoPool() {
+  pthread_mutex_lock(&mutex_);
+  stopping_ = true;
+  pthread_cond_broadcast(&cond_);
+  pthread_mutex_unlock(&mutex_);
+  // A task under way is finished first; its client is gone by now
+  for (std::size_t i = 0; i < threads_.size(); ++i) {
+    pthread_join(threads_[i], NULL);
+  }
+  for (std::size_t i = 0; i < queue_.size(); ++i) {
+    delete queue_[i];
+  }
+  FileTask* task = take_done_();
+  while (task != NULL) {
+    FileTask* next = task->next;
+    delete task;
+    task = next;
+  }
+  if (write_fd_ != -1 && write_fd_ != read_fd_) {
+    close(write_fd_);
+  }
+  if (read_fd_ != -1) {
+    close(read_fd_);
+  }
+  pthread_cond_destroy(&cond_);
+  pthread_mutex_destroy(&mutex_);
+}
+
+void FileIoPool::start(long num_threads) {
+#ifdef __linux__
+  read_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (read_fd_ == -1) {
+    throw SystemError("eventfd");
+  }
+  write_fd_ = read_fd_;
+#else
+  int fds[2];
+  if (pipe(fds) == -1) {
+    throw SystemError("pipe");
+  }
+  read_fd_ = fds[0];
+  write_fd_ = fds[1];
+  if (fcntl(read_fd_, F_SETFL, O_NONBLOCK) == -1 ||
+      fcntl(write_fd_, F_SETFL, O_NONBLOCK) == -1 ||
+      set_cloexec(read_fd_) == -1 || set_cloexec(write_fd_) == -1) {
+    throw SystemError("fcntl");
+  }
+#endif
+
+  // Signals stay with the loop thread, whose poll() they are meant to wake
+  sigset_t all;
+  sigset_t saved;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &saved);
+  for (long i = 0; i < num_threads; ++i) {
+    pthread_t thread;
+    int ret = pthread_create(&thread, NULL, worker_main_, this);
+    if (ret != 0) {
+      pthread_sigmask(SIG_SETMASK, &saved, NULL);
+      errno = ret;
+      throw SystemError("pthread_create");
+    }
+    threads_.push_back(thread);
+  }
+  pthread_sigmask(SIG_SETMASK, &saved, NULL);
+}
+
+bool FileIoPool::submit(FileTask* task) {
+  if (threads_.empty()) {
+    return false;
+  }
+  pthread_mutex_lock(&mutex_);
+  bool accepted = queue_.size() < kMaxQueued;
+  if (accepted) {
+    queue_.push_back(task);
+    pthread_cond_signal(&cond_);
+  }
+  pthread_mutex_unlock(&mutex_);
+  return accepted;
+}
+
+void FileIoPool::drop_upload(BodySink* sink) {
+  FileTask* task = new FileTask(FileTask::kUploadDrop, "", -1, 0);
+  task->upload_sink = sink;
+  if (!submit(task)) {
+    task->run();
+    delete task;
+  }
+}
+
+void* FileIoPool::worker_main_(void* arg) {
+  FileIoPool* pool = static_cast<FileIoPool*>(arg);
+  for (;;) {
+    pthread_mutex_lock(&pool->mutex_);
+    while (pool->queue_.empty() && !pool->stopping_) {
+      pthread_cond_wait(&pool->cond_, &pool->mutex_);
+    }
+    if (pool->stopping_) {
+      pthread_mutex_unlock(&pool->mutex_);
+      return NULL;
+    }
+    FileTask* task = pool->queue_.front();
+    pool->queue_.pop_front();
+    pthread_mutex_unlock(&pool->mutex_);
+
+    task->run();
+    pool->finish_(task);
+  }
+}
+
+// Only the push onto an empty list wakes the loop: a list that already
+// held tasks has a wakeup on its way
+void FileIoPool::finish_(FileTask* task) {
+  FileTask* head;
+  do {
+    head = done_;
+    task->next = head;
+  } while (!__sync_bool_compare_and_swap(&done_, head, task));
+  if (head != NULL) {
+    return;
+  }
+#ifdef __linux__
+  uint64_t one = 1;
+  ssize_t ret = write(write_fd_, &one, sizeof(one));
+#else
+  char one = 0;
+  ssize_t ret = write(write_fd_, &one, 1);
+#endif
+  (void)ret;
+}
+
+// The whole list at once, oldest first
+FileTask* FileIoPool::take_done_() {
+  FileTask* task = __sync_lock_test_and_set(&done_, NULL);
+  FileTask* ordered = NULL;
+  while (task != NULL) {
+    FileTask* next = task->next;
+    task->next = ordered;
+    ordered = task;
+    task = next;
+  }
+  return ordered;
+}
+
+void FileIoPool::drain_wakeups_() {
+  char buffer[64];
+  while (read(read_fd_, buffer, sizeof(buffer)) > 0) {
+  }
+}
+
+HandlerStatus FileIoPool::handle_input() {
+  // Drained before the list is taken, so a push after this wakes us again
+  drain_wakeups_();
+  FileTask* task = take_done_();
+  while (task != NULL) {
+    FileTask* next = task->next;
+    if (task->op == FileTask::kNativeRead) {
+      // The stream outlives its reads, even its client
+      NativeHandlers::read_done(*task);
+    } else if (task->op == FileTask::kCacheWrite) {
+      server_.disk_cache().write_done(*task);
+    } else if (task->client_fd != -1) {
+      ClientHandler* client =
+          server_.find_client_handler(task->client_fd, task->client_serial);
+      if (client != NULL) {
+        client->file_io_done(*task);
+      } else if (task->upload_sink != NULL) {
+        drop_upload(task->upload_sink);
+        task->upload_sink = NULL;
+      }
+    }
+    delete task;
+    task = next;
+  }
+  return kHandlerContinue;
+}
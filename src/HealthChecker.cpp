@@ -0,0 +1,108 @@
+#include "HealthChecker.hpp"
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <ctime>
+#include <vector>
+
+#include "Server.hpp"
+#include "UpstreamPool.hpp"
+#include "string_utils.hpp"
+
+static int64_t now_time_check() {
+  return static_cast<int64_t>(std::time(NULL));
+}
+
+HandlerStatus HealthChecker::handle_timeout() {
+  std::vector<UpstreamGroups::Peer*> due =
+      groups_.take_due_checks(now_time_check());
+  for (std::size_t i = 0; i < due.size(); ++i) {
+    HealthProbe::start(server_, due[i]);
+  }
+  return kHandlerContinue;
+}
+
+void HealthProbe::start(Server& server, UpstreamGroups::Peer* peer) {
+  bool reused;
+  int fd = server.proxy_pool().acquire(peer->address, false, reused);
+  if (fd == -1) {
+    server.upstreams().check_done(peer, false);
+    return;
+  }
+  server.register_fd(fd, new HealthProbe(server, peer, fd), POLLOUT);
+}
+
+HealthProbe::HealthProbe(Server& server, UpstreamGroups::Peer* peer, int fd)
+    : server_(server),
+      peer_(peer),
+      fd_(fd),
+      bytes_written_(0),
+      deadline_sec_(now_time_check() + peer->group->check_timeout_sec) {
+  if (!peer->group->check_uri.empty()) {
+    out_buf_ = "GET " + peer->group->check_uri + " HTTP/1.0\r\nHost: " +
+               peer->group->name +
+               "\r\nConnection: close\r\nUser-Agent: webserv health "
+               "check\r\n\r\n";
+  }
+}
+
+HealthProbe::~HealthProbe() { close(fd_); }
+
+HandlerStatus HealthProbe::finish_(bool passed) {
+  server_.upstreams().check_done(peer_, passed);
+  return kCgiInputDone;
+}
+
+HandlerStatus HealthProbe::handle_output() {
+  if (bytes_written_ == 0) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(fd_, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err != 0) {
+      return finish_(false);
+    }
+    if (out_buf_.empty()) {
+      return finish_(true);
+    }
+  }
+  ssize_t n = send(fd_, out_buf_.data() + bytes_written_,
+                   out_buf_.size() - bytes_written_, 0);
+  if (n == -1) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return kHandlerContinue;
+    }
+    return finish_(false);
+  }
+  bytes_written_ += static_cast<std::size_t>(n);
+  if (bytes_written_ == out_buf_.size()) {
+    server_.set_fd_events(fd_, POLLIN);
+  }
+  return kHandlerContinue;
+}
+
+// Only the status line matters, the rest is left unread
+HandlerStatus HealthProbe::handle_input() {
+  char buf[512];
+  ssize_t n = recv(fd_, buf, sizeof(buf), 0);
+  if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    return kHandlerContinue;
+  }
+  if (n <= 0) {
+    return finish_(false);
+  }
+  in_buf_.append(buf, n);
+  std::size_t line_end = in_buf_.find("\r\n");
+  if (line_end == std::string::npos) {
+    return in_buf_.size() > kMaxStatusLine ? finish_(false) : kHandlerContinue;
+  }
+  bool passed = line_end >= 12 && in_buf_.compare(0, 7, "HTTP/1.") == 0 &&
+                in_buf_[8] == ' ' && is_digits(in_buf_.substr(9, 3)) &&
+                (in_buf_[9] == '2' || in_buf_[9] == '3');
+  return finish_(passed);
+}
+
+HandlerStatus HealthProbe::handle_poll_error() { return finish_(false); }
+
+HandlerStatus HealthProbe::handle_timeout() { return finish_(false); }
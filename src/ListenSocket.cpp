@@ -12,6 +12,7 @@
 #include <string>
 
 #include "SystemError.hpp"
+#include "spawn_utils.hpp"
 
 ListenSocket::ListenSocket(const std::string& addr, const std::string& port,
                            int maxpending)
@@ -35,7 +36,7 @@ ListenSocket::ListenSocket(const std::string& addr, const std::string& port,
     if (sfd == -1) {
       continue;
     }
-    if (fcntl(sfd, F_SETFL, O_NONBLOCK) == -1) {
+    if (fcntl(sfd, F_SETFL, O_NONBLOCK) == -1 || set_cloexec(sfd) == -1) {
       close(sfd);
       freeaddrinfo(result_info);
       throw SystemError("fcntl()");
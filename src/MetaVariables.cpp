@@ -2,21 +2,50 @@
 
 #include <algorithm>
 #include <cctype>
-#include <cstring>
+#include <map>
 #include <sstream>
 #include <vector>
 
-MetaVariables::MetaVariables() {}
+void EnvBlock::reserve(std::size_t bytes, std::size_t entries) {
+  bytes_.reserve(bytes);
+  envp_.reserve(entries + 1);
+}
+
+void EnvBlock::append_rendered(const std::string& entries) {
+  bytes_.insert(bytes_.end(), entries.begin(), entries.end());
+}
+
+void EnvBlock::append(const std::string& key, const std::string& value) {
+  bytes_.insert(bytes_.end(), key.begin(), key.end());
+  bytes_.push_back('=');
+  bytes_.insert(bytes_.end(), value.begin(), value.end());
+  bytes_.push_back('\0');
+}
+
+// The pointers are only taken once the block has stopped growing
+char** EnvBlock::envp() {
+  envp_.clear();
+  std::size_t start = 0;
+  for (std::size_t i = 0; i < bytes_.size(); ++i) {
+    if (bytes_[i] == '\0') {
+      envp_.push_back(&bytes_[start]);
+      start = i + 1;
+    }
+  }
+  envp_.push_back(NULL);
+  return &envp_[0];
+}
+
+MetaVariables::MetaVariables() : constants_(NULL) {}
 MetaVariables::~MetaVariables() {}
 
 MetaVariables::MetaVariables(const MetaVariables& other)
-    : meta_variables_(other.meta_variables_),
-      http_headers_(other.http_headers_) {}
+    : constants_(other.constants_), variables_(other.variables_) {}
 
 MetaVariables& MetaVariables::operator=(const MetaVariables& other) {
   if (this != &other) {
-    meta_variables_ = other.meta_variables_;
-    http_headers_ = other.http_headers_;
+    constants_ = other.constants_;
+    variables_ = other.variables_;
   }
   return *this;
 }
@@ -74,18 +103,21 @@ void MetaVariables::set_content_meta_(const Request& request) {
 
   if (has_content_length && has_transfer_encoding && 
       request.headers.count("content-type")) {
-    meta_variables_["CONTENT_TYPE"] = request.headers.at("content-type");
+    set("CONTENT_TYPE", request.headers.at("content-type"));
   }
 
+  // A chunked body still streaming in has no length yet; the script reads
+  // stdin up to EOF instead
   if (has_content_length) {
-    meta_variables_["CONTENT_LENGTH"] = request.headers.at("content-length");
-  } else if (has_transfer_encoding) {
+    set("CONTENT_LENGTH", request.headers.at("content-length"));
+  } else if (has_transfer_encoding && !request.body.empty()) {
     std::ostringstream oss;
     oss << request.body.size();
-    meta_variables_["CONTENT_LENGTH"] = oss.str();
+    set("CONTENT_LENGTH", oss.str());
   }
 }
 
+// Header names are unique, so the variables are appended without a lookup
 void MetaVariables::set_http_headers_(const Request& request) {
   for (std::map<std::string, std::string>::const_iterator it =
            request.headers.begin(); it != request.headers.end(); ++it) {
@@ -94,17 +126,18 @@ void MetaVariables::set_http_headers_(const Request& request) {
     if (k.empty() || k == "content-type" || k == "content-length") {
       continue;
     }
-    http_headers_[to_upper_http_env_key(k)] = v;
+    variables_.push_back(std::make_pair(to_upper_http_env_key(k), v));
   }
 }
 
 MetaVariables MetaVariables::from_request(const Request& request,
                                           const std::string& script_uri,
                                           const std::string& query_string,
-                                          const std::string& server_name,
+                                          const std::string& constants,
                                           const std::string& server_port,
                                           const std::string& remote_addr) {
   MetaVariables env;
+  env.constants_ = &constants;
 
   std::string full_path = set_up_full_path(request);
 
@@ -119,59 +152,94 @@ MetaVariables MetaVariables::from_request(const Request& request,
   std::string http_version = set_up_http_version(request);
   std::string script_filename = set_up_script_filename(script_name);
 
-  env.meta_variables_["REQUEST_METHOD"] = method_to_str(request.method);
-  env.meta_variables_["QUERY_STRING"] = query_string;
-  env.meta_variables_["SCRIPT_NAME"] = script_name;
-  env.meta_variables_["PATH_INFO"] = path_info;
-  env.meta_variables_["SERVER_PROTOCOL"] = http_version;
-  env.meta_variables_["GATEWAY_INTERFACE"] = "CGI/1.1";
-  env.meta_variables_["SERVER_SOFTWARE"] = "webserv/1.0";
-  env.meta_variables_["SERVER_NAME"] = server_name;
-  env.meta_variables_["SERVER_PORT"] = server_port;
-  env.meta_variables_["REMOTE_ADDR"] = remote_addr;
-  env.meta_variables_["SCRIPT_FILENAME"] = script_filename;
-  env.meta_variables_["REDIRECT_STATUS"] = "200";
+  env.variables_.reserve(request.headers.size() + 12);
+  env.set("REQUEST_METHOD", method_to_str(request.method));
+  env.set("QUERY_STRING", query_string);
+  env.set("SCRIPT_NAME", script_name);
+  env.set("PATH_INFO", path_info);
+  env.set("SERVER_PROTOCOL", http_version);
+  env.set("SERVER_PORT", server_port);
+  env.set("REMOTE_ADDR", remote_addr);
+  env.set("SCRIPT_FILENAME", script_filename);
 
   env.set_content_meta_(request);
   env.set_http_headers_(request);
   return env;
 }
 
-void MetaVariables::add_to_list(std::vector<std::string>& list,
-                                const std::string& key,
-                                const std::string& value) const {
-  if (!value.empty() || key == "QUERY_STRING") {
-    list.push_back(key + "=" + value);
-  }
+std::string MetaVariables::render_constants(const std::string& server_name) {
+  std::string out;
+  out.append("GATEWAY_INTERFACE=CGI/1.1", sizeof("GATEWAY_INTERFACE=CGI/1.1"));
+  out.append("SERVER_SOFTWARE=webserv/1.0",
+             sizeof("SERVER_SOFTWARE=webserv/1.0"));
+  out.append("REDIRECT_STATUS=200", sizeof("REDIRECT_STATUS=200"));
+  out.append("SERVER_NAME=");
+  out.append(server_name);
+  out.push_back('\0');
+  return out;
 }
 
-char** MetaVariables::build_envp() const {
-  std::vector<std::string> env_list;
+bool MetaVariables::is_passed_(
+    const std::pair<std::string, std::string>& variable) {
+  return !variable.second.empty() || variable.first == "QUERY_STRING";
+}
 
-  for (std::map<std::string, std::string>::const_iterator it = meta_variables_.begin();
-       it != meta_variables_.end(); ++it) {
-    add_to_list(env_list, it->first, it->second);
+// A handful of variables, so a linear search beats keeping them in a map
+void MetaVariables::set(const std::string& key, const std::string& value) {
+  for (VariableList::iterator it = variables_.begin(); it != variables_.end();
+       ++it) {
+    if (it->first == key) {
+      it->second = value;
+      return;
+    }
   }
+  variables_.push_back(std::make_pair(key, value));
+}
 
-  for (std::map<std::string, std::string>::const_iterator it =
-           http_headers_.begin();
-       it != http_headers_.end(); ++it) {
-    add_to_list(env_list, it->first, it->second);
+std::vector<std::pair<std::string, std::string> > MetaVariables::to_pairs()
+    const {
+  VariableList pairs;
+  if (constants_ != NULL) {
+    std::size_t start = 0;
+    while (start < constants_->size()) {
+      std::size_t end = constants_->find('\0', start);
+      std::size_t eq_pos = constants_->find('=', start);
+      pairs.push_back(
+          std::make_pair(constants_->substr(start, eq_pos - start),
+                         constants_->substr(eq_pos + 1, end - eq_pos - 1)));
+      start = end + 1;
+    }
   }
-
-  char** envp = new char*[env_list.size() + 1];
-  for (std::size_t i = 0; i < env_list.size(); ++i) {
-    envp[i] = new char[env_list[i].size() + 1];
-    std::strcpy(envp[i], env_list[i].c_str());
+  for (VariableList::const_iterator it = variables_.begin();
+       it != variables_.end(); ++it) {
+    if (is_passed_(*it)) {
+      pairs.push_back(*it);
+    }
   }
-  envp[env_list.size()] = NULL;
-  return envp;
+  return pairs;
 }
 
-void MetaVariables::destroy_envp(char** envp) {
-  if (!envp) return;
-  for (std::size_t i = 0; envp[i] != NULL; ++i) {
-    delete[] envp[i];
+// Sized up front so that the block is allocated once
+void MetaVariables::render(EnvBlock& block) const {
+  std::size_t bytes = 0;
+  std::size_t entries = 0;
+  if (constants_ != NULL) {
+    bytes = constants_->size();
+    entries = std::count(constants_->begin(), constants_->end(), '\0');
+  }
+  for (VariableList::const_iterator it = variables_.begin();
+       it != variables_.end(); ++it) {
+    bytes += it->first.size() + it->second.size() + 2;
+    entries++;
+  }
+  block.reserve(bytes, entries);
+  if (constants_ != NULL) {
+    block.append_rendered(*constants_);
+  }
+  for (VariableList::const_iterator it = variables_.begin();
+       it != variables_.end(); ++it) {
+    if (is_passed_(*it)) {
+      block.append(it->first, it->second);
+    }
   }
-  delete[] envp;
 }
@@ -0,0 +1,187 @@
+#include "MultipartParser.hpp"
+
+#include "string_utils.hpp"
+
+namespace {
+const char* kWhitespace = " \t";
+
+// Splits `type; key=value; key="quoted \"value\""` into the lowercased
+// type and its parameters, keyed by lowercased name
+std::string parse_parameters(const std::string& header,
+                             std::map<std::string, std::string>& params) {
+  std::size_t pos = header.find(';');
+  std::string type = to_lower(trim(header.substr(0, pos), kWhitespace));
+  while (pos != std::string::npos && pos < header.size()) {
+    ++pos;
+    std::size_t equals = header.find('=', pos);
+    std::size_t next = header.find(';', pos);
+    if (equals == std::string::npos ||
+        (next != std::string::npos && next < equals)) {
+      pos = next;
+      continue;
+    }
+    std::string key =
+        to_lower(trim(header.substr(pos, equals - pos), kWhitespace));
+    pos = header.find_first_not_of(kWhitespace, equals + 1);
+    std::string value;
+    if (pos != std::string::npos && header[pos] == '"') {
+      for (++pos; pos < header.size() && header[pos] != '"'; ++pos) {
+        if (header[pos] == '\\' && pos + 1 < header.size()) {
+          ++pos;
+        }
+        value += header[pos];
+      }
+      pos = header.find(';', pos);
+    } else {
+      next = pos == std::string::npos ? pos : header.find(';', pos);
+      if (pos != std::string::npos) {
+        value = trim(header.substr(pos, next - pos), kWhitespace);
+      }
+      pos = next;
+    }
+    params[key] = value;
+  }
+  return type;
+}
+}  // namespace
+
+// The body is read as if it began with a line break, so a delimiter on its
+// first line is found like every other
+MultipartParser::MultipartParser(const std::string& boundary,
+                                 Listener& listener)
+    : delimiter_("\r\n--" + boundary),
+      listener_(listener),
+      state_(kPreamble),
+      status_(kMore),
+      buffer_("\r\n") {}
+
+std::string MultipartParser::boundary_of(const std::string& content_type) {
+  std::map<std::string, std::string> params;
+  if (parse_parameters(content_type, params) != "multipart/form-data") {
+    return "";
+  }
+  const std::string& boundary = params["boundary"];
+  return boundary.size() <= 70 ? boundary : "";
+}
+
+void MultipartParser::parse_disposition(const std::string& value,
+                                        std::string& name,
+                                        std::string& filename) {
+  std::map<std::string, std::string> params;
+  parse_parameters(value, params);
+  name = params["name"];
+  filename = params["filename"];
+}
+
+MultipartParser::Status MultipartParser::feed(const char* data,
+                                              std::size_t len) {
+  if (status_ != kMore) {
+    return status_;
+  }
+  buffer_.append(data, len);
+  for (;;) {
+    std::size_t used = step_();
+    if (status_ != kMore) {
+      buffer_.clear();
+      return status_;
+    }
+    if (used == 0) {
+      return kMore;
+    }
+    buffer_.erase(0, used);
+  }
+}
+
+// Handles what is at the front of buffer_ and returns how much of it is
+// used up, 0 when more input is needed
+std::size_t MultipartParser::step_() {
+  switch (state_) {
+    case kPreamble: {
+      std::size_t pos = buffer_.find(delimiter_);
+      if (pos == std::string::npos) {
+        // Only what could be the start of a delimiter is kept
+        std::size_t keep = delimiter_.size() - 1;
+        return buffer_.size() > keep ? buffer_.size() - keep : 0;
+      }
+      state_ = kAfterDelimiter;
+      return pos + delimiter_.size();
+    }
+    case kAfterDelimiter: {
+      // Transport padding may follow a delimiter
+      std::size_t pos = buffer_.find_first_not_of(kWhitespace);
+      if (pos == std::string::npos || buffer_.size() - pos < 2) {
+        return 0;
+      }
+      if (buffer_.compare(pos, 2, "--") == 0) {
+        status_ = kDone;
+      } else if (buffer_.compare(pos, 2, "\r\n") == 0) {
+        state_ = kHeaders;
+      } else {
+        status_ = kInvalid;
+      }
+      return pos + 2;
+    }
+    case kHeaders: {
+      std::size_t end = 0;
+      if (buffer_.compare(0, 2, "\r\n") != 0) {
+        end = buffer_.find("\r\n\r\n");
+        if (end == std::string::npos) {
+          if (buffer_.size() > kMaxHeaderBytes) {
+            status_ = kInvalid;
+          }
+          return 0;
+        }
+        end += 2;
+      }
+      if (end > kMaxHeaderBytes || !parse_headers_(end)) {
+        status_ = status_ == kMore ? kInvalid : status_;
+        return 0;
+      }
+      state_ = kBody;
+      return end + 2;
+    }
+    case kBody: {
+      std::size_t pos = buffer_.find(delimiter_);
+      if (pos == std::string::npos) {
+        std::size_t keep = delimiter_.size() - 1;
+        if (buffer_.size() <= keep) {
+          return 0;
+        }
+        std::size_t len = buffer_.size() - keep;
+        if (!listener_.part_data(buffer_.data(), len)) {
+          status_ = kStopped;
+        }
+        return len;
+      }
+      if ((pos > 0 && !listener_.part_data(buffer_.data(), pos)) ||
+          !listener_.end_part()) {
+        status_ = kStopped;
+      }
+      state_ = kAfterDelimiter;
+      return pos + delimiter_.size();
+    }
+  }
+  return 0;
+}
+
+// The header lines are buffer_[0, end), each ending in CRLF
+bool MultipartParser::parse_headers_(std::size_t end) {
+  std::map<std::string, std::string> headers;
+  std::size_t pos = 0;
+  while (pos < end) {
+    std::size_t line_end = buffer_.find("\r\n", pos);
+    std::size_t colon = buffer_.find(':', pos);
+    if (colon == std::string::npos || colon > line_end || colon == pos) {
+      return false;
+    }
+    std::string name = to_lower(buffer_.substr(pos, colon - pos));
+    headers[name] =
+        trim(buffer_.substr(colon + 1, line_end - colon - 1), kWhitespace);
+    pos = line_end + 2;
+  }
+  if (!listener_.begin_part(headers)) {
+    status_ = kStopped;
+    return false;
+  }
+  return true;
+}
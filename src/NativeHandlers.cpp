@@ -0,0 +1,425 @@
+#include "NativeHandlers.hpp"
+
+#include <dlfcn.h>
+#include <poll.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <sstream>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "FileIoPool.hpp"
+#include "Server.hpp"
+#include "string_utils.hpp"
+
+struct webserv_native_response {
+  int status;
+  std::vector<std::pair<std::string, std::string> > headers;
+  std::string body;
+  long (*stream_read)(void* context, char* buffer, size_t capacity);
+  void (*stream_close)(void* context);
+  void* stream_context;
+};
+
+class NativeStream;
+
+class NativeCall {
+ public:
+  const webserv_native_plugin* plugin;
+  void* state;
+  std::string method;
+  std::string target;
+  std::string path;
+  std::string query;
+  std::string remote_addr;
+  std::vector<std::pair<std::string, std::string> > headers;
+  std::string body;
+  webserv_native_response response;
+  int rc;
+  // The body being streamed from the call; NULL once the client is gone,
+  // while a read is still out
+  NativeStream* stream;
+
+  NativeCall() : plugin(NULL), state(NULL), rc(0), stream(NULL) {
+    response.status = kOk;
+    response.stream_read = NULL;
+    response.stream_close = NULL;
+    response.stream_context = NULL;
+  }
+  ~NativeCall() {
+    if (response.stream_close != NULL) {
+      response.stream_close(response.stream_context);
+    }
+  }
+
+ private:
+  NativeCall(const NativeCall&);
+  NativeCall& operator=(const NativeCall&);
+};
+
+// Pulls a plugin's streamed body. The reads of a blocking plugin go to the
+// FileIoPool one at a time, the next one as soon as a piece is handed on;
+// the others read inline when the client wants more.
+class NativeStream : public BodySource {
+ public:
+  NativeStream(Server& server, NativeCall* call, int client_fd)
+      : server_(server),
+        call_(call),
+        client_fd_(client_fd),
+        reading_(false),
+        done_(false),
+        failed_(false),
+        waiting_(false) {
+    call_->stream = this;
+    buffer_.swap(call_->response.body);
+  }
+  // A read still out gets the call, and deletes it when it is back
+  ~NativeStream() {
+    if (reading_) {
+      call_->stream = NULL;
+    } else {
+      delete call_;
+    }
+  }
+
+  BodyStatus read_some(std::string& out, std::size_t max_bytes) {
+    if (buffer_.empty() && !done_ && !failed_) {
+      if (!NativeHandlers::is_blocking(call_)) {
+        failed_ = NativeHandlers::read_piece(call_, buffer_) != 0;
+        done_ = buffer_.empty();
+      } else {
+        start_read_();
+        if (reading_) {
+          waiting_ = true;
+          return kBodyWait;
+        }
+      }
+    }
+    if (failed_) {
+      return kBodyError;
+    }
+    if (buffer_.empty()) {
+      return kBodyDone;
+    }
+    std::size_t len = std::min(max_bytes, buffer_.size());
+    out.append(buffer_, 0, len);
+    buffer_.erase(0, len);
+    if (buffer_.empty() && NativeHandlers::is_blocking(call_)) {
+      start_read_();
+    }
+    return kBodyMore;
+  }
+
+  void piece_read(FileTask& task) {
+    reading_ = false;
+    if (task.error != 0) {
+      failed_ = true;
+    } else if (task.data.empty()) {
+      done_ = true;
+    } else {
+      buffer_.swap(task.data);
+    }
+    if (waiting_) {
+      waiting_ = false;
+      server_.add_fd_events(client_fd_, POLLOUT);
+    }
+  }
+
+ private:
+  Server& server_;
+  NativeCall* call_;
+  int client_fd_;
+  std::string buffer_;
+  bool reading_;
+  bool done_;
+  bool failed_;
+  bool waiting_;  // The client was told kBodyWait
+
+  // Inline when the pool will not take it
+  void start_read_() {
+    if (reading_ || done_ || failed_) {
+      return;
+    }
+    FileTask* task = new FileTask(FileTask::kNativeRead, "", client_fd_, 0);
+    task->native_call = call_;
+    reading_ = true;
+    if (server_.file_io_pool().submit(task)) {
+      return;
+    }
+    task->run();
+    NativeHandlers::read_done(*task);
+    delete task;
+  }
+
+  NativeStream(const NativeStream&);
+  NativeStream& operator=(const NativeStream&);
+};
+
+namespace {
+bool is_header_safe(const char* text) {
+  for (; *text != '\0'; ++text) {
+    if (*text == '\r' || *text == '\n') {
+      return false;
+    }
+  }
+  return true;
+}
+
+const char* method_name(HttpMethod method) {
+  switch (method) {
+    case kGet: return "GET";
+    case kPost: return "POST";
+    case kDelete: return "DELETE";
+    default: return "UNKNOWN";
+  }
+}
+}  // namespace
+
+extern "C" {
+static void native_set_status(webserv_native_response* response,
+                              int status) {
+  if (status >= 100 && status <= 599) {
+    response->status = status;
+  }
+}
+
+static void native_add_header(webserv_native_response* response,
+                              const char* name, const char* value) {
+  if (name == NULL || value == NULL || *name == '\0' ||
+      !is_header_safe(name) || !is_header_safe(value)) {
+    return;
+  }
+  std::string key(name);
+  if (to_lower(key) == "content-length") {
+    return;
+  }
+  response->headers.push_back(std::make_pair(key, std::string(value)));
+}
+
+static void native_write(webserv_native_response* response, const char* data,
+                         size_t length) {
+  if (data != NULL) {
+    response->body.append(data, length);
+  }
+}
+
+// A second call replaces the first, whose close() is called right away
+static void native_stream(webserv_native_response* response,
+                          long (*read)(void*, char*, size_t),
+                          void (*close)(void*), void* context) {
+  if (response->stream_close != NULL) {
+    response->stream_close(response->stream_context);
+  }
+  response->stream_read = read;
+  response->stream_close = read != NULL ? close : NULL;
+  response->stream_context = context;
+}
+}
+
+namespace {
+const webserv_native_api kNativeApi = {native_set_status, native_add_header,
+                                       native_write, native_stream};
+const std::size_t kStreamPieceSize = 64 * 1024;
+}  // namespace
+
+NativeHandlers::~NativeHandlers() {
+  for (std::map<const LocationContext*, Instance>::iterator it =
+           instances_.begin();
+       it != instances_.end(); ++it) {
+    if (it->second.plugin->destroy != NULL) {
+      it->second.plugin->destroy(it->second.state);
+    }
+  }
+  for (std::map<std::string, void*>::iterator it = libraries_.begin();
+       it != libraries_.end(); ++it) {
+    dlclose(it->second);
+  }
+}
+
+void NativeHandlers::configure(const Config& config) {
+  const std::vector<ServerContext>& servers = config.get_configs();
+  for (std::size_t i = 0; i < servers.size(); ++i) {
+    const ServerContext& sc = servers[i];
+    for (std::size_t j = 0; j < sc.locations.size(); ++j) {
+      const LocationContext& lc = sc.locations[j];
+      if (lc.native_handler.empty()) {
+        continue;
+      }
+      Instance instance;
+      instance.plugin = load_(lc.native_handler);
+      instance.state = NULL;
+      instance.label = sc.server_names[0] + lc.path;
+      instance.calls = 0;
+      instance.errors = 0;
+      if (instance.plugin->init != NULL &&
+          instance.plugin->init(lc.native_argument.c_str(),
+                                &instance.state) != 0) {
+        throw std::runtime_error("native_handler: init failed for " +
+                                 lc.native_handler);
+      }
+      instances_[&lc] = instance;
+    }
+  }
+}
+
+const webserv_native_plugin* NativeHandlers::load_(const std::string& path) {
+  std::map<std::string, void*>::iterator it = libraries_.find(path);
+  void* handle;
+  if (it != libraries_.end()) {
+    handle = it->second;
+  } else {
+    handle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (handle == NULL) {
+      throw std::runtime_error("native_handler: " + std::string(dlerror()));
+    }
+    libraries_[path] = handle;
+  }
+
+  const webserv_native_plugin* plugin =
+      static_cast<const webserv_native_plugin*>(
+          dlsym(handle, WEBSERV_NATIVE_SYMBOL));
+  if (plugin == NULL || plugin->handle == NULL) {
+    throw std::runtime_error("native_handler: " + path + " has no " +
+                             WEBSERV_NATIVE_SYMBOL);
+  }
+  if (plugin->abi_version < 1 ||
+      plugin->abi_version > WEBSERV_NATIVE_ABI_VERSION) {
+    throw std::runtime_error("native_handler: " + path +
+                             " was built for another ABI version");
+  }
+  return plugin;
+}
+
+NativeCall* NativeHandlers::prepare(const LocationContext& lc,
+                                   const Request& request,
+                                   const std::string& remote_addr) {
+  std::map<const LocationContext*, Instance>::iterator it =
+      instances_.find(&lc);
+  if (it == instances_.end()) {
+    return NULL;
+  }
+  Instance& instance = it->second;
+  instance.calls++;
+
+  NativeCall* call = new NativeCall;
+  call->plugin = instance.plugin;
+  call->state = instance.state;
+  call->method = method_name(request.method);
+  call->target = request.target;
+  call->path = request.target;
+  std::size_t query_pos = call->path.find('?');
+  if (query_pos != std::string::npos) {
+    call->query = call->path.substr(query_pos + 1);
+    call->path.erase(query_pos);
+  }
+  call->remote_addr = remote_addr;
+  call->headers.assign(request.headers.begin(), request.headers.end());
+  call->body = request.body;
+  return call;
+}
+
+bool NativeHandlers::is_blocking(const NativeCall* call) {
+  return call != NULL && (call->plugin->flags & WEBSERV_NATIVE_BLOCKING) != 0;
+}
+
+// Touches nothing but the call, so any thread may run it
+void NativeHandlers::execute(NativeCall* call) {
+  if (call == NULL) {
+    return;
+  }
+  std::vector<webserv_native_header> headers;
+  headers.reserve(call->headers.size());
+  for (std::size_t i = 0; i < call->headers.size(); ++i) {
+    webserv_native_header header = {call->headers[i].first.c_str(),
+                                     call->headers[i].second.c_str()};
+    headers.push_back(header);
+  }
+
+  webserv_native_request request;
+  request.method = call->method.c_str();
+  request.target = call->target.c_str();
+  request.path = call->path.c_str();
+  request.query = call->query.c_str();
+  request.remote_addr = call->remote_addr.c_str();
+  request.headers = headers.empty() ? NULL : &headers[0];
+  request.header_count = headers.size();
+  request.body = call->body.data();
+  request.body_length = call->body.size();
+  call->rc = call->plugin->handle(call->state, &request, &call->response,
+                                  &kNativeApi);
+  std::string().swap(call->body);
+}
+
+ParserStatus NativeHandlers::finish(const LocationContext& lc,
+                                    NativeCall* call, int client_fd,
+                                    Response& response, BodySource*& body) {
+  body = NULL;
+  if (call == NULL) {
+    return kInternalServerError;
+  }
+  int rc = call->rc;
+  if (rc != 0) {
+    delete call;
+    std::map<const LocationContext*, Instance>::iterator it =
+        instances_.find(&lc);
+    if (it != instances_.end()) {
+      it->second.errors++;
+    }
+    if (rc < 400 || rc > 599) {
+      return kInternalServerError;
+    }
+    return static_cast<ParserStatus>(rc);
+  }
+
+  const webserv_native_response& native_response = call->response;
+  response.set_status_code(native_response.status);
+  for (std::size_t i = 0; i < native_response.headers.size(); ++i) {
+    response.add_header(native_response.headers[i].first,
+                        native_response.headers[i].second);
+  }
+  response.add_raw_headers(lc.header_block);
+  if (native_response.stream_read != NULL) {
+    body = new NativeStream(server_, call, client_fd);
+    return kOk;
+  }
+  response.set_body_and_content_length(native_response.body);
+  delete call;
+  return kOk;
+}
+
+void NativeHandlers::discard(NativeCall* call) { delete call; }
+
+int NativeHandlers::read_piece(NativeCall* call, std::string& data) {
+  data.resize(kStreamPieceSize);
+  long num_read = call->response.stream_read(call->response.stream_context,
+                                             &data[0], data.size());
+  if (num_read < 0 || static_cast<std::size_t>(num_read) > data.size()) {
+    data.clear();
+    return EIO;
+  }
+  data.resize(static_cast<std::size_t>(num_read));
+  return 0;
+}
+
+void NativeHandlers::read_done(FileTask& task) {
+  NativeCall* call = task.native_call;
+  task.native_call = NULL;
+  if (call->stream == NULL) {
+    delete call;
+    return;
+  }
+  call->stream->piece_read(task);
+}
+
+void NativeHandlers::report(std::string& out) const {
+  for (std::map<const LocationContext*, Instance>::const_iterator it =
+           instances_.begin();
+       it != instances_.end(); ++it) {
+    std::ostringstream line;
+    line << "native " << it->second.label << ": calls " << it->second.calls
+         << ", errors " << it->second.errors << "\n";
+    out += line.str();
+  }
+}
@@ -225,9 +225,6 @@ ParserStatus Parser::determine_next_action() {
   if (convert_to_size(length, value, 10) == -1) {
     return kBadRequest;
   }
-  if (length > kMaxBodySize) {
-    return kContentTooLarge;
-  }
   request_.body_parse_info.content_length = length;
   request_.body_parse_info.is_chunked = false;
   return kParseContinue;
@@ -252,7 +249,7 @@ ParserStatus Parser::parse_chunked_size_section() {
     chunked_data_.tmp_buf.erase(0, crlf_pos + 2);  // Discard chunk extension
     return kKeepParsingChunked;
   }
-  if (delimiter_pos == std::string::npos) {
+  if (word_end == crlf_pos) {  // A ';' further on belongs to the data
     chunked_data_.state = kParsingData;
     chunked_data_.tmp_buf.erase(0, crlf_pos + 2);
   } else {
@@ -268,7 +265,7 @@ ParserStatus Parser::parse_chunked_body(const std::string& body) {
     if (chunked_data_.tmp_buf.size() > kMaxBodySize) {
       return kContentTooLarge;
     }
-    if (request_.body.size() > kMaxBodySize) {
+    if (body_bytes_received_ > max_body_size_) {
       return kContentTooLarge;
     }
     if (chunked_data_.state == kParsingSize) {
@@ -291,11 +288,13 @@ ParserStatus Parser::parse_chunked_body(const std::string& body) {
       std::size_t remain = chunked_data_.remaining_size;
       if (size_read < remain) {
         request_.body.append(chunked_data_.tmp_buf);
+        body_bytes_received_ += size_read;
         chunked_data_.tmp_buf.clear();
         chunked_data_.remaining_size -= size_read;
         return kParseContinue;
       }
-      request_.body.append(chunked_data_.tmp_buf.substr(0, remain));
+      request_.body.append(chunked_data_.tmp_buf, 0, remain);
+      body_bytes_received_ += remain;
       chunked_data_.tmp_buf.erase(0, remain);
       chunked_data_.remaining_size = 0;
       chunked_data_.state = kParsingCrlf;
@@ -334,13 +333,18 @@ ParserStatus Parser::parse_chunked_body(const std::string& body) {
 
 // Request Pipelining is not supported
 ParserStatus Parser::parse_content_length_body(const std::string& body) {
+  if (request_.body_parse_info.content_length > max_body_size_) {
+    return kContentTooLarge;
+  }
   std::size_t remaining =
-      request_.body_parse_info.content_length - request_.body.size();
+      request_.body_parse_info.content_length - body_bytes_received_;
   if (body.size() < remaining) {
     request_.body.append(body);
+    body_bytes_received_ += body.size();
     return kParseContinue;
   }
-  request_.body.append(body.substr(0, remaining));
+  request_.body.append(body, 0, remaining);
+  body_bytes_received_ += remaining;
   return kParseFinished;
 }
 
@@ -398,6 +402,10 @@ ParserStatus Parser::parse_request(const char* message, ssize_t num_read) {
       return status;
     }
     state_ = kParsingBody;
+    if (pause_after_headers_) {
+      pause_after_headers_ = false;
+      return kParseHeadersComplete;
+    }
   }
   if (state_ == kParsingBody) {
     ParserStatus status = parse_body(buffer_);
@@ -406,3 +414,28 @@ ParserStatus Parser::parse_request(const char* message, ssize_t num_read) {
   }
   return kParseContinue;  // Won't reach here
 }
+
+void Parser::take_body(std::string& out) {
+  if (out.empty()) {
+    out.swap(request_.body);
+  } else {
+    out.append(request_.body);
+  }
+  request_.body.clear();
+}
+
+std::size_t Parser::unparsed_body_length() const {
+  if (state_ != kParsingBody || request_.body_parse_info.is_chunked ||
+      !buffer_.empty()) {
+    return 0;
+  }
+  return request_.body_parse_info.content_length - body_bytes_received_;
+}
+
+ParserStatus Parser::skip_body(std::size_t len) {
+  body_bytes_received_ += len;
+  if (body_bytes_received_ < request_.body_parse_info.content_length) {
+    return kParseContinue;
+  }
+  return kParseFinished;
+}
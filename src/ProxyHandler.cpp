@@ -0,0 +1,722 @@
+#include "ProxyHandler.hpp"
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <ctime>
+#include <iostream>
+#include <list>
+#include <map>
+#include <set>
+#include <sstream>
+
+#include "ClientHandler.hpp"
+#include "RequestProcessor.hpp"
+#include "Server.hpp"
+#include "UpstreamPool.hpp"
+#include "string_utils.hpp"
+
+namespace {
+int64_t now_time_proxy() { return static_cast<int64_t>(std::time(NULL)); }
+
+const char* method_name(HttpMethod method) {
+  switch (method) {
+    case kGet: return "GET";
+    case kPost: return "POST";
+    case kDelete: return "DELETE";
+    default: return "UNKNOWN";
+  }
+}
+
+// Meant for one connection only (RFC 9110, 7.6.1), so never forwarded
+bool is_hop_by_hop(const std::string& name) {
+  return name == "connection" || name == "keep-alive" ||
+         name == "proxy-connection" || name == "te" || name == "trailer" ||
+         name == "transfer-encoding" || name == "upgrade" ||
+         name == "proxy-authenticate" || name == "proxy-authorization";
+}
+
+// The headers a Connection header names are hop-by-hop as well
+std::set<std::string> connection_options(const std::string& value) {
+  std::set<std::string> options;
+  std::list<std::string> tokens = split_string(value, ",");
+  for (std::list<std::string>::iterator it = tokens.begin();
+       it != tokens.end(); ++it) {
+    options.insert(to_lower(trim(*it, " \t")));
+  }
+  return options;
+}
+
+bool parse_decimal(const std::string& text, std::size_t& value) {
+  if (text.empty() || text.size() > 18 || !is_digits(text)) {
+    return false;
+  }
+  value = 0;
+  for (std::size_t i = 0; i < text.size(); ++i) {
+    value = value * 10 + static_cast<std::size_t>(text[i] - '0');
+  }
+  return true;
+}
+
+// "1a;ext=x" -> 26
+bool parse_chunk_size(const std::string& line, std::size_t& size) {
+  std::string digits = trim(line.substr(0, line.find(';')), " \t");
+  if (digits.empty() || digits.size() > 15) {
+    return false;
+  }
+  char* end;
+  size = static_cast<std::size_t>(std::strtoul(digits.c_str(), &end, 16));
+  return *end == '\0';
+}
+
+std::string hex_size(std::size_t size) {
+  std::ostringstream oss;
+  oss << std::hex << size;
+  return oss.str();
+}
+}  // namespace
+
+bool ProxyHandler::start(Server& server, const Request& request,
+                         const LocationContext& lc,
+                         const std::string& client_addr,
+                         CgiInputRelay* body_relay, int client_fd,
+                         const ServerContext& target_config) {
+  bool chunked_body = false;
+  std::string head =
+      build_request_head_(request, lc, client_addr, body_relay, chunked_body);
+  if (body_relay == NULL) {
+    head.append(request.body);
+  }
+  ProxyHandler* handler = new ProxyHandler(server, lc, head, body_relay,
+                                           chunked_body, client_fd,
+                                           target_config);
+  handler->hash_key_ = server.upstreams().hash_key(lc.proxy_pass, request);
+  if (!connect_and_register_(handler, true)) {
+    delete handler;
+    return false;
+  }
+  return true;
+}
+
+// Servers the connection cannot even be started to are passed over on the
+// spot, each counting as a failure
+bool ProxyHandler::connect_and_register_(ProxyHandler* handler,
+                                         bool allow_reuse) {
+  Server& server = handler->server_;
+  while (true) {
+    UpstreamGroups::Peer* peer = server.upstreams().select(
+        handler->lc_.proxy_pass, handler->hash_key_, handler->tried_);
+    if (peer == NULL) {
+      std::cerr << "proxy_pass: no live upstream in "
+                << handler->lc_.proxy_pass << "\n";
+      return false;
+    }
+    handler->tried_.push_back(peer);
+    bool reused;
+    int fd = server.proxy_pool().acquire(peer->address, allow_reuse, reused);
+    if (fd == -1) {
+      server.upstreams().release(peer, true);
+      continue;
+    }
+    handler->peer_ = peer;
+    handler->upstream_ = peer->address;
+    handler->fd_ = fd;
+    handler->reused_ = reused;
+    handler->connected_ = reused;
+    server.register_fd(fd, handler, POLLOUT);
+    handler->update_deadline_();
+    return true;
+  }
+}
+
+// Host and the rest go through as the client sent them, minus what only
+// concerned the client's own connection
+std::string ProxyHandler::build_request_head_(const Request& request,
+                                              const LocationContext& lc,
+                                              const std::string& client_addr,
+                                              CgiInputRelay* body_relay,
+                                              bool& chunked_body) {
+  std::string uri = request.target;
+  if (lc.has_proxy_uri && uri.compare(0, lc.path.size(), lc.path) == 0) {
+    uri = lc.proxy_uri + uri.substr(lc.path.size());
+  }
+
+  std::string head;
+  head.append(method_name(request.method));
+  head.append(" ");
+  head.append(uri);
+  head.append(" HTTP/1.1\r\n");
+
+  std::set<std::string> options;
+  std::map<std::string, std::string>::const_iterator it =
+      request.headers.find("connection");
+  if (it != request.headers.end()) {
+    options = connection_options(it->second);
+  }
+  std::string forwarded_for = client_addr;
+  for (it = request.headers.begin(); it != request.headers.end(); ++it) {
+    const std::string& name = it->first;
+    if (is_hop_by_hop(name) || options.count(name) != 0 ||
+        name == "content-length" || name == "expect") {
+      continue;
+    }
+    if (name == "x-forwarded-for") {
+      forwarded_for = it->second + ", " + client_addr;
+      continue;
+    }
+    head.append(name);
+    head.append(": ");
+    head.append(it->second);
+    head.append("\r\n");
+  }
+  if (request.headers.find("host") == request.headers.end()) {
+    head.append("host: " + lc.proxy_pass + "\r\n");
+  }
+  head.append("x-forwarded-for: " + forwarded_for + "\r\n");
+  head.append("x-forwarded-proto: http\r\n");
+
+  // A body still arriving has its length only if the client gave one
+  chunked_body = false;
+  if (body_relay != NULL) {
+    if (request.body_parse_info.is_chunked) {
+      chunked_body = true;
+      head.append("transfer-encoding: chunked\r\n");
+    } else {
+      std::ostringstream oss;
+      oss << request.body_parse_info.content_length;
+      head.append("content-length: " + oss.str() + "\r\n");
+    }
+  } else if (!request.body.empty() || request.method == kPost) {
+    std::ostringstream oss;
+    oss << request.body.size();
+    head.append("content-length: " + oss.str() + "\r\n");
+  }
+  head.append("connection: keep-alive\r\n\r\n");
+  return head;
+}
+
+ProxyHandler::ProxyHandler(Server& server, const LocationContext& lc,
+                           const std::string& request,
+                           CgiInputRelay* body_relay, bool chunked_body,
+                           int client_fd, const ServerContext& target_config)
+    : server_(server),
+      lc_(lc),
+      target_config_(target_config),
+      peer_(NULL),
+      peer_failed_(false),
+      fd_(-1),
+      reused_(false),
+      connected_(false),
+      out_buf_(request),
+      bytes_written_(0),
+      body_relay_(body_relay),
+      body_taken_(false),
+      chunked_body_(chunked_body),
+      body_complete_(body_relay == NULL),
+      request_sent_(false),
+      response_state_(kReadingHead),
+      framing_(kUntilClose),
+      chunk_state_(kChunkSize),
+      body_remaining_(0),
+      upstream_keeps_alive_(true),
+      relay_(NULL),
+      paused_(false),
+      client_fd_(client_fd),
+      client_serial_(server.client_serial(client_fd)),
+      finished_(false),
+      reusable_(false),
+      deadline_sec_(0) {
+  if (body_relay_ != NULL) {
+    body_relay_->attach_consumer(this, -1);
+  }
+}
+
+ProxyHandler::~ProxyHandler() {
+  if (body_relay_ != NULL) {
+    body_relay_->detach_consumer();
+  }
+  if (relay_ != NULL) {
+    relay_->detach_producer();
+  }
+  if (peer_ != NULL) {
+    server_.upstreams().release(peer_, peer_failed_);
+  }
+  if (fd_ == -1) {
+    return;
+  }
+  if (reusable_) {
+    server_.proxy_pool().release(upstream_, fd_);
+  } else {
+    close(fd_);
+  }
+}
+
+// Connecting, writing the request and waiting for the response each have
+// their own limit; the client is held open for as long as they allow
+void ProxyHandler::update_deadline_() {
+  long timeout_sec = lc_.proxy_read_timeout_sec;
+  if (!connected_) {
+    timeout_sec = lc_.proxy_connect_timeout_sec;
+  } else if (has_output_()) {
+    timeout_sec = lc_.proxy_send_timeout_sec;
+  }
+  deadline_sec_ = now_time_proxy() + timeout_sec;
+  server_.update_timeout(fd_);
+  if (paused_) {
+    return;
+  }
+  ClientHandler* ch = server_.find_client_handler(client_fd_, client_serial_);
+  if (ch != NULL) {
+    ch->hold_until(deadline_sec_ + 1);
+  }
+}
+
+void ProxyHandler::update_events_() {
+  short events = 0;
+  if (!connected_) {
+    events = POLLOUT;
+  } else {
+    if (!paused_ && response_state_ != kResponseDone) {
+      events |= POLLIN;
+    }
+    if (has_output_()) {
+      events |= POLLOUT;
+    }
+  }
+  server_.set_fd_events(fd_, events);
+}
+
+bool ProxyHandler::has_output_() const {
+  if (request_sent_) {
+    return false;
+  }
+  if (bytes_written_ < out_buf_.size()) {
+    return true;
+  }
+  return body_relay_ != NULL &&
+         (body_relay_->buffered() > 0 || body_relay_->is_done() ||
+          body_relay_->has_failed());
+}
+
+// Moves the next piece of a streamed body behind what is left to send
+void ProxyHandler::fill_output_() {
+  if (body_relay_ == NULL || body_complete_ ||
+      bytes_written_ < out_buf_.size()) {
+    return;
+  }
+  out_buf_.clear();
+  bytes_written_ = 0;
+  body_taken_ = true;
+  std::size_t len = body_relay_->buffered();
+  if (len > 0) {
+    if (chunked_body_) {
+      out_buf_.append(hex_size(len) + "\r\n");
+    }
+    out_buf_.append(body_relay_->data(), len);
+    if (chunked_body_) {
+      out_buf_.append("\r\n");
+    }
+    body_relay_->consume(len);
+  }
+  if (body_relay_->is_done()) {
+    if (chunked_body_) {
+      out_buf_.append("0\r\n\r\n");
+    }
+    body_complete_ = true;
+  }
+}
+
+void ProxyHandler::resume_input() {
+  if (!finished_ && connected_) {
+    update_events_();
+  }
+}
+
+void ProxyHandler::resume_output() {
+  if (finished_ || !paused_) {
+    return;
+  }
+  paused_ = false;
+  update_deadline_();
+  update_events_();
+}
+
+HandlerStatus ProxyHandler::handle_output() {
+  if (finished_) {
+    return kCgiInputDone;
+  }
+  if (!connected_) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(fd_, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err != 0) {
+      std::cerr << "proxy_pass: connect to " << upstream_ << " failed\n";
+      return retry_or_fail_(kBadGateway);
+    }
+    connected_ = true;
+    update_deadline_();
+  }
+  fill_output_();
+  if (body_relay_ != NULL && body_relay_->has_failed()) {
+    // The client's body broke off and it has had its answer already
+    finished_ = true;
+    if (relay_ != NULL) {
+      relay_->fail();
+    }
+    return kCgiInputDone;
+  }
+
+  if (bytes_written_ < out_buf_.size()) {
+    ssize_t n = send(fd_, out_buf_.data() + bytes_written_,
+                     out_buf_.size() - bytes_written_, 0);
+    if (n == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return kHandlerContinue;
+      }
+      return retry_or_fail_(kBadGateway);
+    }
+    bytes_written_ += static_cast<std::size_t>(n);
+    update_deadline_();
+  }
+  if (bytes_written_ == out_buf_.size() && body_complete_) {
+    request_sent_ = true;
+  }
+  update_events_();
+  return kHandlerContinue;
+}
+
+HandlerStatus ProxyHandler::handle_input() {
+  if (finished_) {
+    return kCgiInputDone;
+  }
+  char buf[kReadBufSize];
+  ssize_t n = recv(fd_, buf, sizeof(buf), 0);
+  if (n == -1) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return kHandlerContinue;
+    }
+    return retry_or_fail_(kBadGateway);
+  }
+  if (n == 0) {
+    return upstream_closed_();
+  }
+  update_deadline_();
+  in_buf_.append(buf, n);
+
+  if (response_state_ == kReadingHead) {
+    int rc = parse_head_();
+    if (rc == -1) {
+      peer_failed_ = true;
+      return fail_(kBadGateway);
+    }
+    if (rc == 0) {
+      return kHandlerContinue;
+    }
+  }
+  if (response_state_ == kReadingBody) {
+    if (!relay_->has_consumer()) {
+      // The client is gone, nobody wants the rest of the response
+      finished_ = true;
+      return kCgiInputDone;
+    }
+    if (!decode_body_()) {
+      std::cerr << "proxy_pass: malformed response body from " << upstream_
+                << "\n";
+      peer_failed_ = true;
+      return fail_(kBadGateway);
+    }
+  }
+  if (response_state_ == kResponseDone) {
+    return complete_();
+  }
+  if (relay_ != NULL && relay_->is_full()) {
+    paused_ = true;
+    update_events_();
+  }
+  return kHandlerContinue;
+}
+
+// Returns 1 once the head is parsed and handed on, 0 while it is
+// incomplete and -1 if it is malformed
+int ProxyHandler::parse_head_() {
+  std::size_t end = in_buf_.find("\r\n\r\n");
+  if (end == std::string::npos) {
+    return in_buf_.size() > kMaxHeadBytes ? -1 : 0;
+  }
+  std::string head = in_buf_.substr(0, end);
+  in_buf_.erase(0, end + 4);
+
+  std::size_t line_end = head.find("\r\n");
+  std::string status_line = head.substr(0, line_end);
+  if (status_line.compare(0, 7, "HTTP/1.") != 0 || status_line.size() < 12 ||
+      status_line[8] != ' ' || !is_digits(status_line.substr(9, 3))) {
+    return -1;
+  }
+  int status = std::atoi(status_line.substr(9, 3).c_str());
+  if (status == 101) {
+    return -1;
+  }
+  if (status >= 100 && status < 200) {
+    // Interim responses are not passed on; the final one follows
+    return parse_head_();
+  }
+
+  std::list<std::pair<std::string, std::string> > headers;
+  std::set<std::string> options;
+  std::size_t pos = line_end;
+  while (pos != std::string::npos) {
+    pos += 2;
+    std::size_t next = head.find("\r\n", pos);
+    std::string line = head.substr(pos, next == std::string::npos
+                                            ? std::string::npos
+                                            : next - pos);
+    pos = next;
+    std::size_t colon_pos = line.find(':');
+    if (colon_pos == std::string::npos || colon_pos == 0 ||
+        line[0] == ' ' || line[0] == '\t') {
+      return -1;
+    }
+    std::string name = line.substr(0, colon_pos);
+    std::string value = trim(line.substr(colon_pos + 1), " \t");
+    std::string lower = to_lower(name);
+    if (lower == "connection") {
+      options = connection_options(value);
+    }
+    headers.push_back(std::make_pair(name, value));
+  }
+  upstream_keeps_alive_ = options.count("close") == 0 &&
+                          status_line.compare(0, 8, "HTTP/1.0") != 0;
+
+  Response response;
+  response.set_status_code(status);
+  framing_ = kUntilClose;
+  bool has_length = false;
+  for (std::list<std::pair<std::string, std::string> >::iterator it =
+           headers.begin();
+       it != headers.end(); ++it) {
+    std::string lower = to_lower(it->first);
+    if (lower == "transfer-encoding") {
+      if (to_lower(it->second).find("chunked") == std::string::npos) {
+        return -1;
+      }
+      framing_ = kChunked;
+    } else if (lower == "content-length") {
+      if (!parse_decimal(it->second, body_remaining_)) {
+        return -1;
+      }
+      has_length = true;
+    } else if (lower == "date") {
+      response.add_header("Date", it->second);
+    } else if (!is_hop_by_hop(lower) && options.count(lower) == 0) {
+      response.add_raw_headers(it->first + ": " + it->second + "\r\n");
+    }
+  }
+  if (framing_ != kChunked && has_length) {
+    framing_ = kContentLength;
+  }
+  if (status == 204 || status == 304) {
+    framing_ = kContentLength;
+    body_remaining_ = 0;
+  }
+  response.add_raw_headers(lc_.header_block);
+
+  ClientHandler* ch = server_.find_client_handler(client_fd_, client_serial_);
+  if (framing_ == kContentLength && body_remaining_ == 0) {
+    if (status != 204 && status != 304) {
+      response.add_header("Content-Length", "0");
+    }
+    response_state_ = kResponseDone;
+    if (ch != NULL) {
+      ch->cgi_response_ready(response.serialize());
+    }
+    return 1;
+  }
+  if (ch == NULL) {
+    finished_ = true;
+    return -1;
+  }
+  if (framing_ == kContentLength) {
+    std::ostringstream oss;
+    oss << body_remaining_;
+    response.add_header("Content-Length", oss.str());
+  }
+  response_state_ = kReadingBody;
+  relay_ = new CgiOutputRelay(server_, client_fd_, this);
+  ch->cgi_stream_ready(response, relay_->open_source(),
+                       framing_ == kContentLength);
+  return 1;
+}
+
+// Moves what in_buf_ holds of the body into the relay
+bool ProxyHandler::decode_body_() {
+  if (framing_ == kChunked) {
+    return decode_chunks_();
+  }
+  if (framing_ == kUntilClose) {
+    relay_->append(in_buf_.data(), in_buf_.size());
+    in_buf_.clear();
+    return true;
+  }
+  std::size_t len = std::min(in_buf_.size(), body_remaining_);
+  relay_->append(in_buf_.data(), len);
+  in_buf_.erase(0, len);
+  body_remaining_ -= len;
+  if (body_remaining_ == 0) {
+    response_state_ = kResponseDone;
+  }
+  return true;
+}
+
+// The client gets the body re-chunked or unframed as its own version
+// allows, so the upstream's chunk boundaries and trailers are dropped here
+bool ProxyHandler::decode_chunks_() {
+  while (response_state_ == kReadingBody) {
+    if (chunk_state_ == kChunkData) {
+      std::size_t len = std::min(in_buf_.size(), body_remaining_);
+      relay_->append(in_buf_.data(), len);
+      in_buf_.erase(0, len);
+      body_remaining_ -= len;
+      if (body_remaining_ > 0) {
+        return true;
+      }
+      chunk_state_ = kChunkDataEnd;
+      continue;
+    }
+    if (chunk_state_ == kChunkDataEnd) {
+      if (in_buf_.size() < 2) {
+        return true;
+      }
+      if (in_buf_.compare(0, 2, "\r\n") != 0) {
+        return false;
+      }
+      in_buf_.erase(0, 2);
+      chunk_state_ = kChunkSize;
+      continue;
+    }
+
+    std::size_t line_end = in_buf_.find("\r\n");
+    if (line_end == std::string::npos) {
+      return in_buf_.size() <= kMaxHeadBytes;
+    }
+    std::string line = in_buf_.substr(0, line_end);
+    in_buf_.erase(0, line_end + 2);
+    if (chunk_state_ == kChunkTrailers) {
+      if (line.empty()) {
+        response_state_ = kResponseDone;
+      }
+      continue;
+    }
+    if (!parse_chunk_size(line, body_remaining_)) {
+      return false;
+    }
+    chunk_state_ = body_remaining_ == 0 ? kChunkTrailers : kChunkData;
+  }
+  return true;
+}
+
+HandlerStatus ProxyHandler::upstream_closed_() {
+  if (response_state_ == kReadingBody && framing_ == kUntilClose) {
+    response_state_ = kResponseDone;
+    upstream_keeps_alive_ = false;
+    return complete_();
+  }
+  if (response_state_ == kReadingHead) {
+    return retry_or_fail_(kBadGateway);
+  }
+  std::cerr << "proxy_pass: " << upstream_ << " closed mid-response\n";
+  peer_failed_ = true;
+  return fail_(kBadGateway);
+}
+
+// The connection goes back to the pool only if both messages ended where
+// their framing said, with nothing trailing them
+HandlerStatus ProxyHandler::complete_() {
+  finished_ = true;
+  if (relay_ != NULL) {
+    relay_->finish();
+  }
+  reusable_ = request_sent_ && in_buf_.empty() && upstream_keeps_alive_;
+  return kCgiInputDone;
+}
+
+// A request none of which reached the server goes to the next one of the
+// group; once sent, it may have had effects and is not repeated. A pooled
+// connection the upstream closed while idle is the exception and is not
+// held against the server: the request is replayed on a new connection,
+// which may well be to the same one.
+HandlerStatus ProxyHandler::retry_or_fail_(ParserStatus status) {
+  bool stale = reused_;
+  if (!stale) {
+    peer_failed_ = true;
+  }
+  if (response_state_ != kReadingHead || !in_buf_.empty() || body_taken_ ||
+      (!stale && bytes_written_ > 0) ||
+      server_.find_client_handler(client_fd_, client_serial_) == NULL) {
+    return fail_(status);
+  }
+  CgiInputRelay* body_relay = body_relay_;
+  if (body_relay_ != NULL) {
+    body_relay_->detach_consumer();
+    body_relay_ = NULL;
+  }
+  ProxyHandler* next =
+      new ProxyHandler(server_, lc_, out_buf_, body_relay, chunked_body_,
+                       client_fd_, target_config_);
+  next->hash_key_ = hash_key_;
+  next->tried_ = tried_;
+  if (stale) {
+    next->tried_.pop_back();
+  }
+  if (!connect_and_register_(next, !stale)) {
+    delete next;
+    return fail_(status);
+  }
+  finished_ = true;
+  return kCgiInputDone;
+}
+
+HandlerStatus ProxyHandler::fail_(ParserStatus status) {
+  finished_ = true;
+  if (relay_ != NULL) {
+    // The status line is already out, all we can do is cut the body short
+    relay_->fail();
+    return kCgiInputDone;
+  }
+  ClientHandler* ch = server_.find_client_handler(client_fd_, client_serial_);
+  if (ch != NULL) {
+    Response response =
+        RequestProcessor::make_error_response(target_config_, status);
+    ch->cgi_response_ready(response.serialize());
+  }
+  return kCgiInputDone;
+}
+
+HandlerStatus ProxyHandler::handle_poll_error() {
+  if (finished_) {
+    return kCgiInputDone;
+  }
+  if (!connected_) {
+    std::cerr << "proxy_pass: connect to " << upstream_ << " failed\n";
+  }
+  return retry_or_fail_(kBadGateway);
+}
+
+HandlerStatus ProxyHandler::handle_timeout() {
+  if (finished_) {
+    return kCgiInputDone;
+  }
+  // Waiting on a slow client is the client's business, not the upstream's
+  if (paused_) {
+    update_deadline_();
+    return kHandlerContinue;
+  }
+  std::cerr << "proxy_pass: " << upstream_ << " timed out\n";
+  if (!connected_) {
+    return retry_or_fail_(kGatewayTimeout);
+  }
+  peer_failed_ = true;
+  return fail_(kGatewayTimeout);
+}
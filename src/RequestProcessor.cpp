@@ -1,42 +1,22 @@
 #include "RequestProcessor.hpp"
 
+#include "Autoindex.hpp"
+#include "MultipartParser.hpp"
 #include "Parser.hpp"
 #include "Response.hpp"
+#include "config_utils.hpp"
 #include "string_utils.hpp"
 #include <sys/stat.h>
 #include <dirent.h>
+#include <fnmatch.h>
 #include <unistd.h>
-#include <fstream>
-
-namespace http_constants {
-  const char* kHtmlStart    = "<html><head><title>Index of ";
-  const char* kTitleEnd     = "</title></head><body><h1>Index of ";
-  const char* kHeaderEnd    = "</h1><hr><pre>";
-  const char* kHtmlEnd      = "</pre><hr></body></html>";
-}
+#include <climits>
+#include <ctime>
 
 ProcessorResult RequestProcessor::handle_error(ParserStatus status,
                                     const ServerContext& target_config) {
   ProcessorResult result;
-  std::string error_page_full_path = "";
-
-  if (target_config.error_pages.count(status)) {
-    std::string error_uri = target_config.error_pages.at(status);
-    std::string root = "";
-    const LocationContext& error_lc = target_config.get_matching_location(error_uri);
-    if (error_lc.root.empty()) {
-      root = target_config.server_root;
-    } else {
-      root = error_lc.root;
-    }
-
-    if (error_uri[0] != '/') {
-      error_uri.insert(0, "/");
-    }
-    error_page_full_path = root + error_uri;
-  }
-
-  result.response.prepare_error_response(status, error_page_full_path);
+  result.response = make_error_response(target_config, status);
   result.next_action = ProcessorResult::kSendResponse;
 
   return result;
@@ -45,7 +25,11 @@ ProcessorResult RequestProcessor::handle_error(ParserStatus status,
 ProcessorResult RequestProcessor::handle_redirect(const LocationContext& lc) {
   ProcessorResult result;
 
-  result.response.prepare_redirect_response(lc.redirect_status_code, lc.redirect_url);
+  if (!lc.redirect_response.empty()) {
+    result.response.use_prebuilt(lc.redirect_response);
+  } else {
+    result.response.prepare_redirect_response(lc.redirect_status_code, lc.redirect_url);
+  }
   result.next_action = ProcessorResult::kSendResponse;
   return result;
 }
@@ -123,10 +107,48 @@ ProcessorResult RequestProcessor::handle_cgi(const std::string& path_only,
   result.query_string = query_string;
   result.cgi_path = cgi_path;
   result.script_path = full_script_path;
+  result.location = &lc;
+  for (size_t i = 0; i < lc.cgi_pools.size(); ++i) {
+    const std::string& extension = lc.cgi_pools[i].extension;
+    if (path_only.size() >= extension.size() &&
+        path_only.compare(path_only.size() - extension.size(),
+                          extension.size(), extension) == 0) {
+      result.cgi_pool = &lc.cgi_pools[i];
+      break;
+    }
+  }
 
   return result;
 }
 
+// The backend runs in its own working directory, so SCRIPT_FILENAME has to be
+// absolute. Whether the script exists is left to the backend to decide.
+ProcessorResult RequestProcessor::handle_fastcgi(const std::string& script_uri,
+                                                 const std::string& query_string,
+                                                 const LocationContext& lc) {
+  ProcessorResult result;
+  std::string root = lc.root;
+  if (root.empty() || root[0] != '/') {
+    if (root == "." || root.compare(0, 2, "./") == 0) {
+      root.erase(0, 2);
+    }
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) != NULL) {
+      root = root.empty() ? std::string(cwd) : std::string(cwd) + "/" + root;
+    }
+  }
+  if (!root.empty() && root[root.size() - 1] == '/') {
+    root.erase(root.size() - 1);
+  }
+
+  result.next_action = ProcessorResult::kExecuteFastCgi;
+  result.script_uri = script_uri;
+  result.query_string = query_string;
+  result.script_path = root + script_uri;
+  result.upstream = lc.fastcgi_pass;
+  return result;
+}
+
 ParserStatus RequestProcessor::errno_to_status(int err_num) {
   switch (err_num) {
     case ENOENT:
@@ -139,6 +161,12 @@ ParserStatus RequestProcessor::errno_to_status(int err_num) {
     case ENAMETOOLONG:
       return kUriTooLong;
 
+    case EBADMSG:
+      return kBadRequest;
+
+    case EFBIG:
+      return kContentTooLarge;
+
     default:
       return kInternalServerError;
   }
@@ -162,49 +190,25 @@ std::string RequestProcessor::find_index_file(const std::string& directory_path,
   return "";
 }
 
+// The listing is streamed: chunked for HTTP/1.1, delimited by the
+// connection close for HTTP/1.0.
 ProcessorResult RequestProcessor::create_autoindex_response(
-  const std::string& path, const std::string& target) {
+  const std::string& path, const Request& request, const LocationContext& lc,
+  const ServerContext& target_config) {
 
   ProcessorResult result;
-  DIR* dir = opendir(path.c_str());
-  if (dir == NULL) {
-    result.response.prepare_error_response(kForbidden, "");
-    result.next_action = ProcessorResult::kSendResponse;
-    return result;
-  }
-
-  std::string body = http_constants::kHtmlStart;
-  body.append(target);
-  body.append(http_constants::kTitleEnd);
-  body.append(target);
-  body.append(http_constants::kHeaderEnd);
-
-  struct dirent* entry;
-  while ((entry = readdir(dir)) != NULL) {
-    std::string name = entry->d_name;
-    if (name == ".") {
-      continue;
-    }
-    std::string link = name;
-    struct stat ent_s;
-
-    std::string full_ent_path = path;
-    if (!full_ent_path.empty() && full_ent_path[full_ent_path.length() - 1] != '/') {
-      full_ent_path += "/";
-    }
-    full_ent_path += name;
-    if (stat(full_ent_path.c_str(), &ent_s) == 0 && S_ISDIR(ent_s.st_mode)) {
-      link += "/";
-    }
-    body += "<a href=\"" + link + "\">" + link + "</a>\n";
+  std::string uri_path = request.target.substr(0, request.target.find('?'));
+  BodySource* source = Autoindex::open(path, uri_path, lc.autoindex_details);
+  if (source == NULL) {
+    return handle_error(errno_to_status(errno), target_config);
   }
-  closedir(dir);
-
-  body += http_constants::kHtmlEnd;
 
-  result.response.set_body(body);
+  result.response.set_status_code(kOk);
   result.response.add_header("Content-Type", "text/html");
-  result.response.prepare_success_response(kOk);
+  if (request.version == kHttp11) {
+    result.response.add_header("Transfer-Encoding", "chunked");
+  }
+  result.body_source = source;
   result.next_action = ProcessorResult::kSendResponse;
   return result;
 }
@@ -214,30 +218,44 @@ ProcessorResult RequestProcessor::handle_directory(const std::string& path, cons
   std::string index_file_path = find_index_file(path, lc);
 
   if (!index_file_path.empty()) {
-    return handle_file(index_file_path, target_config);
+    return handle_file(index_file_path, lc, target_config);
   }
 
   if (lc.autoindex) {
-    return create_autoindex_response(path, request.target);
+    return create_autoindex_response(path, request, lc, target_config);
   }
 
   return handle_error(kForbidden, target_config);
 }
 
-ProcessorResult RequestProcessor::handle_file(const std::string& path, const ServerContext& target_config) {
-  ProcessorResult result;
-  if (!result.response.fill_from_file(path)) {
-    if (errno == ENOENT) {
-      return handle_error(kNotFound, target_config);
-    } else if (errno == EACCES) {
-      return handle_error(kForbidden, target_config);
+static void add_cache_headers(Response& response, const std::string& path,
+                              const LocationContext& lc) {
+  const ExpiresConfig* expires = &lc.expires;
+  if (!lc.expires_matches.empty()) {
+    std::string filename = path.substr(path.find_last_of('/') + 1);
+    for (size_t i = 0; i < lc.expires_matches.size(); ++i) {
+      if (fnmatch(lc.expires_matches[i].pattern.c_str(), filename.c_str(), 0) == 0) {
+        expires = &lc.expires_matches[i];
+        break;
+      }
     }
-    return handle_error(kInternalServerError, target_config);
   }
-  std::string mime = result.response.get_mime_type(path);
+  if (expires->mode == ExpiresConfig::kExpiresDuration) {
+    response.add_header("Expires", format_http_date(std::time(NULL) + expires->seconds));
+  }
+  response.add_raw_headers(expires->header_block);
+  response.add_raw_headers(lc.header_block);
+}
+
+ProcessorResult RequestProcessor::handle_file(const std::string& path, const LocationContext& lc,
+                                              const ServerContext& target_config) {
+  ProcessorResult result;
+  std::string mime = target_config.get_mime_type(path, lc);
   result.response.add_header("Content-Type", mime);
-  result.response.prepare_success_response(kOk);
-  result.next_action = ProcessorResult::kSendResponse;
+  add_cache_headers(result.response, path, lc);
+  result.next_action = ProcessorResult::kFileIo;
+  result.file_op = FileTask::kReadFile;
+  result.file_path = path;
   return result;
 }
 
@@ -247,6 +265,22 @@ ProcessorResult RequestProcessor::handle_upload(const Request& request, const st
   ProcessorResult result;
   std::string save_path;
 
+  // A browser form: its files go into the directory, each under its name
+  std::map<std::string, std::string>::const_iterator type =
+      request.headers.find("content-type");
+  if (type != request.headers.end() &&
+      to_lower(type->second).find("multipart/form-data") != std::string::npos) {
+    result.multipart_boundary = MultipartParser::boundary_of(type->second);
+    if (result.multipart_boundary.empty()) {
+      return handle_error(kBadRequest, target_config);
+    }
+    result.next_action = ProcessorResult::kStreamUpload;
+    result.file_op = FileTask::kWriteFile;
+    result.file_path = lc.upload_store.empty() ? lc.root + path_only : lc.upload_store;
+    result.location = &lc;
+    return result;
+  }
+
   if (path_only.empty() || path_only[path_only.size() - 1] == '/') {
     return handle_error(kForbidden, target_config);
   }
@@ -268,33 +302,36 @@ ProcessorResult RequestProcessor::handle_upload(const Request& request, const st
     save_path = lc.root + path_only;
   }
 
-  std::ofstream ofs(save_path.c_str(), std::ios::binary);
-
-  if (!ofs) {
-    return handle_error(errno_to_status(errno), target_config);
-  }
-  if (!request.body.empty()) {
-    ofs.write(request.body.data(), request.body.size());
-  }
-  ofs.close();
-
-  result.response.prepare_success_response(kCreated);
-  result.next_action = ProcessorResult::kSendResponse;
+  result.next_action = ProcessorResult::kFileIo;
+  result.file_op = FileTask::kWriteFile;
+  result.file_path = save_path;
   return result;
 }
 
-ProcessorResult RequestProcessor::handle_delete(std::string& path,
-  const ServerContext& target_config) {
-
+ProcessorResult RequestProcessor::handle_delete(const std::string& path) {
   ProcessorResult result;
+  result.next_action = ProcessorResult::kFileIo;
+  result.file_op = FileTask::kRemove;
+  result.file_path = path;
+  return result;
+}
 
-  if (std::remove(path.c_str()) != 0) {
-    return handle_error(errno_to_status(errno), target_config);
+void RequestProcessor::complete_file_io(ProcessorResult& result, int error,
+                                        std::string& data,
+                                        const ServerContext& target_config) {
+  if (error != 0) {
+    result = handle_error(errno_to_status(error), target_config);
+    return;
   }
-
-  result.response.prepare_success_response(kNoContent);
   result.next_action = ProcessorResult::kSendResponse;
-  return result;
+  if (result.file_op == FileTask::kReadFile) {
+    result.response.set_body_and_content_length(data);
+    result.response.prepare_success_response(kOk);
+  } else if (result.file_op == FileTask::kWriteFile) {
+    result.response.prepare_success_response(kCreated);
+  } else {
+    result.response.prepare_success_response(kNoContent);
+  }
 }
 
 ProcessorResult RequestProcessor::handle_static_file(const Request& request, const std::string& path,
@@ -317,14 +354,14 @@ ProcessorResult RequestProcessor::handle_static_file(const Request& request, con
     if (S_ISDIR(s.st_mode)) {
     return handle_directory(physical_path, request, lc, target_config);
   } else if (S_ISREG(s.st_mode)) {
-      return handle_file(physical_path, target_config);
+      return handle_file(physical_path, lc, target_config);
     }
   }
   else if (request.method == kDelete) {
     if (S_ISDIR(s.st_mode)) {
       return handle_error(kForbidden, target_config);
     } else {
-      return handle_delete(physical_path, target_config);
+      return handle_delete(physical_path);
     }
   }
   return handle_error(kForbidden, target_config);
@@ -351,15 +388,28 @@ ProcessorResult RequestProcessor::process(
     return handle_error(kMethodNotAllowed, target_config);
   }
 
-  long client_max_body_size;
-  if (lc.client_max_body_size != -1) {
-    client_max_body_size = lc.client_max_body_size;
-  } else {
-    client_max_body_size = target_config.client_max_body_size;
+  if (static_cast<long>(request.body.size()) >
+      client_max_body_size(lc, target_config)) {
+   return handle_error(kContentTooLarge, target_config);
   }
 
-  if (static_cast<long>(request.body.size()) > client_max_body_size) {
-   return handle_error(kContentTooLarge, target_config);
+  if (lc.stub_status) {
+    result.next_action = ProcessorResult::kSendStatus;
+    result.response.set_status_code(kOk);
+    result.response.add_header("Content-Type", "text/plain");
+    result.response.add_header("Cache-Control", "no-store");
+    return result;
+  }
+
+  if (!lc.native_handler.empty()) {
+    result.next_action = ProcessorResult::kExecuteNative;
+    result.location = &lc;
+    return result;
+  }
+  if (!lc.proxy_pass.empty()) {
+    result.next_action = ProcessorResult::kExecuteProxy;
+    result.location = &lc;
+    return result;
   }
 
   std::string path_only = request.target;
@@ -372,7 +422,11 @@ ProcessorResult RequestProcessor::process(
 
   std::string cgi_path;
   std::string script_uri;
-  if (is_cgi_handler(lc, path_only, cgi_path, script_uri)) {
+  bool is_cgi = is_cgi_handler(lc, path_only, cgi_path, script_uri);
+  if (!lc.fastcgi_pass.empty()) {
+    return handle_fastcgi(is_cgi ? script_uri : path_only, query_string, lc);
+  }
+  if (is_cgi) {
     return handle_cgi(script_uri, query_string, cgi_path, lc, target_config);
   }
 
@@ -383,29 +437,103 @@ ProcessorResult RequestProcessor::process(
   return handle_static_file(request, path_only, lc, target_config);
 }
 
-std::string RequestProcessor::get_error_page_path(
-    const ServerContext& target_config, ParserStatus status) {
+ProcessorResult RequestProcessor::process_headers(
+    const Request& request, const ServerContext& target_config) {
+  ProcessorResult result;
+  result.next_action = ProcessorResult::kReceiveBody;
 
-  std::map<int, std::string>::const_iterator it = target_config.error_pages.find(status);
-  if (it == target_config.error_pages.end()) {
-    return "";
+  const LocationContext& lc = target_config.get_matching_location(request.target);
+  if (lc.path == "__NOT_FOUND__" || lc.redirect_status_code != -1 ||
+      !is_method_allowed(request.method, lc) || !lc.fastcgi_pass.empty() ||
+      !lc.native_handler.empty() || lc.stub_status) {
+    return result;
+  }
+  // The upstream gets the body as it arrives, like a one-shot CGI
+  if (!lc.proxy_pass.empty()) {
+    std::size_t body_limit =
+        static_cast<std::size_t>(client_max_body_size(lc, target_config));
+    if (!request.body_parse_info.is_chunked &&
+        request.body_parse_info.content_length > body_limit) {
+      return result;
+    }
+    result.next_action = ProcessorResult::kExecuteProxy;
+    result.location = &lc;
+    result.body_limit = body_limit;
+    return result;
   }
 
-  std::string error_uri = it->second;
-
-  const LocationContext& error_lc = target_config.get_matching_location(error_uri);
+  std::string path_only = request.target;
+  std::string query_string = "";
+  size_t q_pos = path_only.find("?");
+  if (q_pos != std::string::npos) {
+    query_string = path_only.substr(q_pos + 1);
+    path_only = path_only.substr(0, q_pos);
+  }
 
-  std::string root;
+  std::string cgi_path;
+  std::string script_uri;
+  if (!is_cgi_handler(lc, path_only, cgi_path, script_uri)) {
+    if (request.method != kPost) {
+      return result;
+    }
+    // An upload is written to its file as it arrives instead of being held
+    std::size_t body_limit =
+        static_cast<std::size_t>(client_max_body_size(lc, target_config));
+    ProcessorResult upload = handle_upload(request, path_only, lc, target_config);
+    if ((upload.next_action != ProcessorResult::kFileIo &&
+         upload.next_action != ProcessorResult::kStreamUpload) ||
+        (!request.body_parse_info.is_chunked &&
+         request.body_parse_info.content_length > body_limit)) {
+      return result;
+    }
+    upload.next_action = ProcessorResult::kStreamUpload;
+    upload.body_limit = body_limit;
+    return upload;
+  }
+  ProcessorResult cgi = handle_cgi(script_uri, query_string, cgi_path, lc,
+                                   target_config);
+  // Errors are answered by process() once the body is read, and a pooled
+  // worker's request frame needs the body length up front
+  if (cgi.next_action != ProcessorResult::kExecuteCgi || cgi.cgi_pool != NULL) {
+    return result;
+  }
+  cgi.body_limit =
+      static_cast<std::size_t>(client_max_body_size(lc, target_config));
+  if (!request.body_parse_info.is_chunked &&
+      request.body_parse_info.content_length > cgi.body_limit) {
+    return result;
+  }
+  return cgi;
+}
 
-  if (error_lc.path != "__NOT_FOUND__" && !error_lc.root.empty()) {
-    root = error_lc.root;
-  } else {
-    root = target_config.server_root;
+long RequestProcessor::client_max_body_size(const LocationContext& lc,
+                                            const ServerContext& target_config) {
+  if (lc.client_max_body_size != -1) {
+    return lc.client_max_body_size;
   }
+  return target_config.client_max_body_size;
+}
 
-  if (!error_uri.empty() && error_uri[0] != '/') {
-    root += "/";
+Response RequestProcessor::make_error_response(
+    const ServerContext& target_config, ParserStatus status) {
+  Response response;
+
+  std::map<int, PrebuiltResponse>::const_iterator it =
+      target_config.error_responses.find(status);
+  if (it != target_config.error_responses.end() && !it->second.empty()) {
+    response.use_prebuilt(it->second);
+    return response;
   }
+  response.prepare_error_response(status, error_page_path(target_config, status));
+  return response;
+}
 
-  return root + error_uri;
+Response RequestProcessor::make_unavailable_response(
+    const ServerContext& target_config, long retry_after_sec) {
+  Response response;
+  response.prepare_error_response(
+      kServiceUnavailable, error_page_path(target_config, kServiceUnavailable));
+  response.add_header("Retry-After",
+                      int_to_string(static_cast<int>(retry_after_sec)));
+  return response;
 }
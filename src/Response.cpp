@@ -3,6 +3,7 @@
 #include <string>
 #include <sstream>
 #include <fstream>
+#include <ctime>
 #include <unistd.h>
 
 #include "Parser.hpp"
@@ -21,35 +22,67 @@ namespace http_redirect_constants {
   const char* kRedirectBodyEnd    = "\">here</a>.</p></body></html>";
 }
 
+// The Date header only changes once a second, so it is formatted once a second
+static const std::string& current_http_date() {
+  static std::time_t cached_sec = -1;
+  static std::string cached_date;
+  std::time_t now = std::time(NULL);
+  if (now != cached_sec) {
+    cached_sec = now;
+    cached_date = format_http_date(now);
+  }
+  return cached_date;
+}
+
 std::string Response::get_reason_phrase(int code) {
   switch (code) {
     case 200: return "OK";
     case 201: return "Created";
+    case 202: return "Accepted";
     case 204: return "NoContent";
+    case 206: return "Partial Content";
     case 301: return "Moved Permanently";
     case 302: return "Found";
+    case 303: return "See Other";
+    case 304: return "Not Modified";
+    case 307: return "Temporary Redirect";
+    case 308: return "Permanent Redirect";
     case 400: return "Bad Request";
+    case 401: return "Unauthorized";
     case 403: return "Forbidden";
     case 404: return "Not Found";
     case 405: return "Method Not Allowed";
+    case 409: return "Conflict";
+    case 410: return "Gone";
+    case 412: return "Precondition Failed";
     case 413: return "Content Too Large";
     case 414: return "URI Too Long";
     case 431: return "RequestHeaderFieldsTooLarge";
     case 500: return "Internal Server Error";
     case 501: return "Not Implemented";
     case 502: return "Bad Gateway";
+    case 503: return "Service Unavailable";
     case 504: return "Gateway Timeout";
     case 505: return "HTTP Version Not Supported";
-    default:  return "Internal Server Error";
+  }
+  // Backends may answer with any status; fall back on its class
+  switch (code / 100) {
+    case 1:  return "Informational";
+    case 2:  return "Success";
+    case 3:  return "Redirection";
+    case 4:  return "Client Error";
+    default: return "Internal Server Error";
   }
 }
 
 void Response::set_status_code(int code) {
+  expand_prebuilt_();
   status_code_ = int_to_string(code);
   reason_phrase_ = get_reason_phrase(code);
 }
 
 void Response::ensure_content_length() {
+  expand_prebuilt_();
   if (headers_.find("Content-Length") != headers_.end()) {
     return;
   }
@@ -118,7 +151,42 @@ void Response::prepare_redirect_response(int status, const std::string& redirect
   set_body_and_content_length(html);
 }
 
+// A prebuilt response is only bytes, so before it is changed it is turned
+// back into fields; otherwise serialize() would drop the change. Repeated
+// header names stay raw lines, and the Date is left to serialize().
+void Response::expand_prebuilt_() {
+  if (prebuilt_ == NULL) {
+    return;
+  }
+  std::string bytes = prebuilt_->render();
+  prebuilt_ = NULL;
+  std::size_t line_end = bytes.find("\r\n");
+  std::size_t head_end = bytes.find("\r\n\r\n");
+  std::size_t code_start = bytes.find(' ') + 1;
+  std::size_t code_end = bytes.find(' ', code_start);
+  if (head_end == std::string::npos || code_end > line_end) {
+    return;
+  }
+  status_code_ = bytes.substr(code_start, code_end - code_start);
+  reason_phrase_ = bytes.substr(code_end + 1, line_end - code_end - 1);
+  for (std::size_t pos = line_end + 2; pos < head_end + 2;) {
+    std::size_t end = bytes.find("\r\n", pos);
+    std::size_t colon = bytes.find(": ", pos);
+    std::string name = bytes.substr(pos, colon - pos);
+    if (colon > end || headers_.find(name) != headers_.end()) {
+      raw_headers_.append(bytes, pos, end + 2 - pos);
+    } else if (name != "Date") {
+      headers_[name] = bytes.substr(colon + 2, end - colon - 2);
+    }
+    pos = end + 2;
+  }
+  body_ = bytes.substr(head_end + 4);
+}
+
 std::string Response::serialize() const {
+  if (prebuilt_ != NULL) {
+    return prebuilt_->render();
+  }
   std::string response;
   if (version_ == kHttp10) {
     response.append("HTTP/1.0 ");
@@ -129,6 +197,11 @@ std::string Response::serialize() const {
   response.append(" ");
   response.append(reason_phrase_);
   response.append("\r\n");
+  if (headers_.find("Date") == headers_.end()) {
+    response.append("Date: ");
+    response.append(current_http_date());
+    response.append("\r\n");
+  }
   // TODO:write header into string
   for (std::map<std::string, std::string>::const_iterator it = headers_.begin();
       it != headers_.end(); ++it) {
@@ -137,6 +210,7 @@ std::string Response::serialize() const {
     response.append(it->second);
     response.append("\r\n");
   }
+  response.append(raw_headers_);
   response.append("\r\n");  // End of header
   // write body into string
   response.append(body_);
@@ -144,6 +218,7 @@ std::string Response::serialize() const {
 }
 
 void Response::set_body(const std::string& body) {
+  expand_prebuilt_();
   body_ = body;
 }
 
@@ -175,9 +250,21 @@ static std::string normalize_header_name(const std::string& key) {
 }
 
 void Response::add_header(const std::string& key, const std::string& value) {
+  expand_prebuilt_();
   headers_[normalize_header_name(key)] = value;
 }
 
+bool Response::is_chunked() const {
+  std::map<std::string, std::string>::const_iterator it =
+      headers_.find("Transfer-Encoding");
+  return it != headers_.end() && to_lower(it->second).find("chunked") != std::string::npos;
+}
+
+void Response::add_raw_headers(const std::string& header_block) {
+  expand_prebuilt_();
+  raw_headers_.append(header_block);
+}
+
 bool Response::fill_from_file(const std::string& path) {
   std::ifstream ifs(path.c_str(), std::ios::binary);
   if (!ifs) {
@@ -190,18 +277,19 @@ bool Response::fill_from_file(const std::string& path) {
   return true;
 }
 
-std::string Response::get_mime_type(const std::string& path) {
-  size_t pos = path.find_last_of('.');
-  if (pos == std::string::npos) {
-    return "application/octet-stream";
+PrebuiltResponse::PrebuiltResponse(const Response& response)
+    : bytes_(response.serialize()), date_offset_(std::string::npos) {
+  std::size_t pos = bytes_.find("\r\nDate: ");
+  if (pos != std::string::npos) {
+    date_offset_ = pos + std::string("\r\nDate: ").size();
   }
+}
 
-  std::string extension = path.substr(pos + 1);
-  if (extension == "html" || extension == "htm") return "text/html";
-  if (extension == "css")  return "text/css";
-  if (extension == "jpg" || extension == "jpeg") return "image/jpeg";
-  if (extension == "png")  return "image/png";
-  if (extension == "txt" || extension == "py")  return "text/plain";
-
-  return "application/octet-stream";
+std::string PrebuiltResponse::render() const {
+  std::string out = bytes_;
+  if (date_offset_ != std::string::npos) {
+    const std::string& date = current_http_date();
+    out.replace(date_offset_, date.size(), date);
+  }
+  return out;
 }
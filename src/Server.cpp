@@ -20,6 +20,7 @@
 #include "AcceptHandler.hpp"
 #include "CgiInputHandler.hpp"
 #include "ClientHandler.hpp"
+#include "HealthChecker.hpp"
 #include "ListenSocket.hpp"
 #include "MonitoredFdHandler.hpp"
 #include "SystemError.hpp"
@@ -27,24 +28,49 @@
 #include "string_utils.hpp"
 
 volatile sig_atomic_t g_running = true;
-
-Server::Server(const std::string& config_file) : num_clients_(0) {
+volatile sig_atomic_t g_stop_now = false;
+
+Server::Server(const std::string& config_file)
+    : num_clients_(0),
+      next_timer_key_(-1),
+      child_reaper_(*this),
+      fastcgi_pool_("fastcgi_pass"),
+      proxy_pool_("proxy_pass"),
+      cgi_worker_pool_(child_reaper_),
+      native_handlers_(*this),
+      file_io_pool_(*this),
+      draining_(false),
+      drain_deadline_sec_(0) {
   config_.load_file(config_file);
-  for (std::size_t i = 0; i < config_.get_configs().size(); i++) {
-    const ServerContext& sc = config_.get_configs()[i];
-    for (std::size_t j = 0; j < sc.listens.size(); j++) {
-      std::string addr = sc.listens[j].address;
-      std::string port = int_to_string(sc.listens[j].port);
-      ListenSocket* listen_sock = new ListenSocket(addr, port, kMaxClients);
-      listen_sockets_.push_back(listen_sock);
-      struct pollfd tmp;
-      set_pollfd_in(tmp, listen_sock->fd());
-      poll_fds_.push_back(tmp);
-      MonitoredFdHandler* handler =
-          new AcceptHandler(listen_sock->fd(), *this, addr, port);
-      monitored_fd_to_handler_[listen_sock->fd()] = handler;
-      timeout_manager_.add_timeout(listen_sock->fd(), handler);
-    }
+  register_fd(child_reaper_.fd(), &child_reaper_, POLLIN);
+  file_io_pool_.start(config_.file_io_threads());
+  register_fd(file_io_pool_.fd(), &file_io_pool_, POLLIN);
+  // One listener per unique addr:port, shared by every server block on it
+  std::vector<ListenConfig> listens = config_.get_unique_listens();
+  for (std::size_t i = 0; i < listens.size(); i++) {
+    std::string addr = listens[i].address;
+    std::string port = int_to_string(listens[i].port);
+    ListenSocket* listen_sock = new ListenSocket(addr, port, kMaxClients);
+    listen_sockets_.push_back(listen_sock);
+    struct pollfd tmp;
+    set_pollfd_in(tmp, listen_sock->fd());
+    poll_fds_.push_back(tmp);
+    MonitoredFdHandler* handler =
+        new AcceptHandler(listen_sock->fd(), *this, addr, port);
+    monitored_fd_to_handler_[listen_sock->fd()] = handler;
+    timeout_manager_.add_timeout(listen_sock->fd(), handler);
+  }
+  cgi_worker_pool_.prespawn(config_);
+  cgi_limiter_.configure(config_);
+  cgi_cache_.configure(config_);
+  disk_cache_.configure(config_, &file_io_pool_);
+  if (disk_cache_.has_zones()) {
+    register_timer(new DiskCacheEvictor(disk_cache_));
+  }
+  native_handlers_.configure(config_);
+  upstream_groups_.configure(config_);
+  if (upstream_groups_.has_health_checks()) {
+    register_timer(new HealthChecker(*this, upstream_groups_));
   }
 }
 
@@ -52,6 +78,9 @@ Server::~Server() {
   for (std::size_t i = 0; i < listen_sockets_.size(); i++) {
     delete listen_sockets_[i];
   }
+  // Members, not owned by the map
+  monitored_fd_to_handler_.erase(child_reaper_.fd());
+  monitored_fd_to_handler_.erase(file_io_pool_.fd());
   std::map<int, MonitoredFdHandler*>::iterator iter;
   for (iter = monitored_fd_to_handler_.begin();
        iter != monitored_fd_to_handler_.end(); iter++) {
@@ -64,12 +93,35 @@ void Server::run() {
     throw SystemError("signal()");
   }
 
-  while (g_running) {
+  while (!g_stop_now) {
+    if (!g_running && !draining_) {
+      start_draining_();
+    }
+    if (draining_) {
+      if (num_clients_ == 0) {
+        break;
+      }
+      if (static_cast<int64_t>(std::time(NULL)) >= drain_deadline_sec_) {
+        std::cerr << "shutdown_timeout: closing " << num_clients_
+                  << " connection(s)\n";
+        break;
+      }
+    }
     if (poll_fds_.empty()) {
       throw std::runtime_error("Error: poll_fds_ must not be empty");
     }
 
     int timeout_ms = timeout_manager_.get_next_timeout_ms();
+    if (draining_ && (timeout_ms < 0 || timeout_ms > kDrainPollMs)) {
+      timeout_ms = kDrainPollMs;
+    }
+    if (!cgi_worker_pool_.empty() &&
+        (timeout_ms < 0 || timeout_ms > kPoolMaintenanceMs)) {
+      timeout_ms = kPoolMaintenanceMs;
+    }
+    if (cgi_limiter_.has_pending_dispatch()) {
+      timeout_ms = 0;
+    }
 
     int poll_ret = poll(&poll_fds_[0], poll_fds_.size(), timeout_ms);
     if (poll_ret == -1) {
@@ -83,6 +135,8 @@ void Server::run() {
     if (!timeout_ok) {
       break;
     }
+    cgi_worker_pool_.maintain();
+    cgi_limiter_.dispatch(*this);
 
     if (poll_ret == 0) {
       continue;
@@ -113,6 +167,31 @@ void Server::run() {
   }
 }
 
+// Stops listening and closes the connections that have not sent anything.
+// Requests under way, with their CGIs and upstreams, are left to finish.
+void Server::start_draining_() {
+  draining_ = true;
+  drain_deadline_sec_ =
+      static_cast<int64_t>(std::time(NULL)) + config_.shutdown_timeout_sec();
+  for (std::size_t i = 0; i < listen_sockets_.size(); i++) {
+    int idx = find_pollfd_index_(listen_sockets_[i]->fd());
+    if (idx != -1) {
+      remove_fd(idx);
+    }
+    delete listen_sockets_[i];
+  }
+  listen_sockets_.clear();
+  for (std::size_t i = 0; i < poll_fds_.size(); ++i) {
+    ClientHandler* client = find_client_handler(poll_fds_[i].fd);
+    if (client != NULL && client->is_idle()) {
+      remove_client(i);
+      --i;
+    }
+  }
+  std::cerr << "Shutting down, waiting for " << num_clients_
+            << " connection(s)\n";
+}
+
 HandlerStatus Server::handle_fd_event(int pollfd_index) {
   struct pollfd& poll_fd = poll_fds_[pollfd_index];
 
@@ -138,6 +217,9 @@ HandlerStatus Server::handle_fd_event(int pollfd_index) {
     if (status == kHandlerClosed) {
       return kHandlerClosed;
     }
+    if (status == kCgiInputDone) {
+      return kCgiInputDone;
+    }
     if (status == kHandlerAccepted || status == kHandlerContinue) {
       return kHandlerContinue;
     }
@@ -207,6 +289,14 @@ void Server::register_fd(int fd, MonitoredFdHandler* handler, short events) {
   timeout_manager_.add_timeout(fd, handler);
 }
 
+// A timer has nothing to poll; it only wakes up through handle_timeout()
+// and stays registered for as long as that answers kHandlerContinue
+void Server::register_timer(MonitoredFdHandler* handler) {
+  int key = next_timer_key_--;
+  monitored_fd_to_handler_.insert(std::make_pair(key, handler));
+  timeout_manager_.add_timeout(key, handler);
+}
+
 void Server::set_fd_events(int fd, short events) {
   int idx = find_pollfd_index_(fd);
   if (idx != -1) {
@@ -214,6 +304,20 @@ void Server::set_fd_events(int fd, short events) {
   }
 }
 
+void Server::add_fd_events(int fd, short events) {
+  int idx = find_pollfd_index_(fd);
+  if (idx != -1) {
+    poll_fds_[idx].events |= events;
+  }
+}
+
+void Server::remove_fd_events(int fd, short events) {
+  int idx = find_pollfd_index_(fd);
+  if (idx != -1) {
+    poll_fds_[idx].events &= ~events;
+  }
+}
+
 void Server::update_timeout(int fd) {
   timeout_manager_.update_timeout(fd);
 }
@@ -226,6 +330,10 @@ int Server::find_pollfd_index_(int fd) const {
   return -1;
 }
 
+bool Server::is_registered(int fd) const {
+  return monitored_fd_to_handler_.count(fd) != 0;
+}
+
 ClientHandler* Server::find_client_handler(int client_fd) {
   std::map<int, MonitoredFdHandler*>::iterator it =
       monitored_fd_to_handler_.find(client_fd);
@@ -235,6 +343,31 @@ ClientHandler* Server::find_client_handler(int client_fd) {
   return dynamic_cast<ClientHandler*>(it->second);
 }
 
+ClientHandler* Server::find_client_handler(int client_fd,
+                                           unsigned long serial) {
+  ClientHandler* handler = find_client_handler(client_fd);
+  if (handler == NULL || handler->serial() != serial) {
+    return NULL;
+  }
+  return handler;
+}
+
+unsigned long Server::client_serial(int client_fd) {
+  ClientHandler* handler = find_client_handler(client_fd);
+  return handler != NULL ? handler->serial() : 0;
+}
+
+std::string Server::status_report() const {
+  std::string out = "Active connections: " +
+                    int_to_string(static_cast<int>(num_clients_)) + "\n";
+  cgi_limiter_.report(out);
+  cgi_cache_.report(out);
+  disk_cache_.report(out);
+  native_handlers_.report(out);
+  upstream_groups_.report(out);
+  return out;
+}
+
 bool Server::handle_timeouts_() {
   std::vector<int> timeout_fd = timeout_manager_.get_timedout_fds();
 
@@ -251,6 +384,11 @@ bool Server::handle_timeouts_() {
       std::cerr << "Fatal error occurred. Stopping server.\n";
       return false;
     }
+    // The handler moved its deadline and stays
+    if (status == kHandlerContinue) {
+      timeout_manager_.update_timeout(fd);
+      continue;
+    }
 
     int idx = find_pollfd_index_(fd);
     if (idx != -1) {
@@ -0,0 +1,249 @@
+#include "UploadSink.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <sstream>
+
+#include "pipe_utils.hpp"
+#include "spawn_utils.hpp"
+
+// Shared with the FileIoPool threads
+unsigned long UploadSink::next_serial_ = 0;
+
+UploadSink::UploadSink(const std::string& path, const std::string& temp_path,
+                       int file_fd, std::size_t reserved)
+    : path_(path),
+      temp_path_(temp_path),
+      file_fd_(file_fd),
+      in_pipe_(0),
+      size_(0),
+      reserved_(reserved),
+      committed_(false) {
+  pipe_fds_[0] = -1;
+  pipe_fds_[1] = -1;
+}
+
+UploadSink* UploadSink::create(const std::string& path,
+                               std::size_t expected_length) {
+  std::size_t slash = path.find_last_of('/');
+  std::ostringstream temp_path;
+  if (slash != std::string::npos) {
+    temp_path << path.substr(0, slash + 1);
+  }
+  temp_path << '.' << path.substr(slash == std::string::npos ? 0 : slash + 1)
+            << ".upload." << getpid() << '.'
+            << __sync_add_and_fetch(&next_serial_, 1);
+
+  int fd = open(temp_path.str().c_str(), O_WRONLY | O_CREAT | O_EXCL, 0666);
+  if (fd == -1) {
+    return NULL;
+  }
+  set_cloexec(fd);
+  UploadSink* sink = new UploadSink(path, temp_path.str(), fd, expected_length);
+  if (expected_length > 0 &&
+      preallocate_file(fd, static_cast<off_t>(expected_length)) == -1) {
+    int err = errno;
+    delete sink;
+    errno = err;
+    return NULL;
+  }
+  return sink;
+}
+
+UploadSink::~UploadSink() {
+  if (pipe_fds_[0] != -1) {
+    close(pipe_fds_[0]);
+    close(pipe_fds_[1]);
+  }
+  if (file_fd_ != -1) {
+    close(file_fd_);
+  }
+  if (!committed_) {
+    unlink(temp_path_.c_str());
+  }
+}
+
+bool UploadSink::write(const char* data, std::size_t len) {
+  while (len > 0) {
+    ssize_t num_written = ::write(file_fd_, data, len);
+    if (num_written == -1 && errno == EINTR) {
+      continue;
+    }
+    if (num_written == -1) {
+      return false;
+    }
+    data += num_written;
+    len -= static_cast<std::size_t>(num_written);
+    size_ += num_written;
+  }
+  return true;
+}
+
+bool UploadSink::can_splice() const {
+#ifdef WEBSERV_HAVE_SPLICE
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool UploadSink::open_pipe_() {
+  if (pipe_fds_[0] != -1) {
+    return true;
+  }
+  if (pipe(pipe_fds_) == -1) {
+    return false;
+  }
+  set_cloexec(pipe_fds_[0]);
+  set_cloexec(pipe_fds_[1]);
+  enlarge_pipe(pipe_fds_[1]);
+  return true;
+}
+
+// At most a pipe's worth, which flush_spliced() empties before the next
+// call
+ssize_t UploadSink::splice_in(int sock_fd, std::size_t len) {
+  if (!open_pipe_()) {
+    return -1;
+  }
+  ssize_t num_moved = splice_bytes(sock_fd, pipe_fds_[1], len);
+  if (num_moved > 0) {
+    in_pipe_ += static_cast<std::size_t>(num_moved);
+  }
+  return num_moved;
+}
+
+bool UploadSink::flush_spliced() {
+  while (in_pipe_ > 0) {
+    ssize_t num_written = splice_bytes(pipe_fds_[0], file_fd_, in_pipe_);
+    if (num_written == -1 && errno == EINTR) {
+      continue;
+    }
+    if (num_written <= 0) {
+      if (num_written == 0) {
+        errno = EIO;
+      }
+      return false;
+    }
+    in_pipe_ -= static_cast<std::size_t>(num_written);
+    size_ += num_written;
+  }
+  return true;
+}
+
+bool UploadSink::commit() {
+  // Space reserved for a body that turned out shorter is given back
+  if (static_cast<std::size_t>(size_) < reserved_ &&
+      ftruncate(file_fd_, size_) == -1) {
+    return false;
+  }
+  int fd = file_fd_;
+  file_fd_ = -1;
+  if (close(fd) == -1 || std::rename(temp_path_.c_str(), path_.c_str()) != 0) {
+    return false;
+  }
+  committed_ = true;
+  return true;
+}
+
+MultipartUpload::MultipartUpload(const std::string& directory,
+                                 const std::string& boundary,
+                                 std::size_t max_parts,
+                                 std::size_t max_part_size)
+    : directory_(directory),
+      parser_(boundary, *this),
+      max_parts_(max_parts),
+      max_part_size_(max_part_size),
+      parts_(0),
+      part_size_(0),
+      file_(NULL),
+      error_(0) {
+  if (directory_.empty() || directory_[directory_.size() - 1] != '/') {
+    directory_ += '/';
+  }
+}
+
+MultipartUpload::~MultipartUpload() { delete file_; }
+
+bool MultipartUpload::write(const char* data, std::size_t len) {
+  MultipartParser::Status status = parser_.feed(data, len);
+  if (status == MultipartParser::kInvalid) {
+    errno = EBADMSG;
+    return false;
+  }
+  if (status == MultipartParser::kStopped) {
+    errno = error_;
+    return false;
+  }
+  return true;
+}
+
+bool MultipartUpload::commit() {
+  if (parser_.status() != MultipartParser::kDone) {
+    errno = EBADMSG;
+    return false;
+  }
+  return true;
+}
+
+// Only the last path segment of a filename is used, and names that could
+// be ours (temp files) or climb out of the directory are refused
+bool MultipartUpload::begin_part(
+    const std::map<std::string, std::string>& headers) {
+  if (++parts_ > max_parts_) {
+    error_ = EFBIG;
+    return false;
+  }
+  part_size_ = 0;
+  std::map<std::string, std::string>::const_iterator it =
+      headers.find("content-disposition");
+  if (it == headers.end()) {
+    error_ = EBADMSG;
+    return false;
+  }
+  std::string name;
+  std::string filename;
+  MultipartParser::parse_disposition(it->second, name, filename);
+  filename = filename.substr(filename.find_last_of("/\\") + 1);
+  // A file input left empty still sends its part, with no name
+  if (filename.empty()) {
+    return true;
+  }
+  if (filename[0] == '.') {
+    error_ = EBADMSG;
+    return false;
+  }
+  file_ = UploadSink::create(directory_ + filename, 0);
+  if (file_ == NULL) {
+    error_ = errno;
+    return false;
+  }
+  return true;
+}
+
+bool MultipartUpload::part_data(const char* data, std::size_t len) {
+  part_size_ += len;
+  if (max_part_size_ > 0 && part_size_ > max_part_size_) {
+    error_ = EFBIG;
+    return false;
+  }
+  if (file_ != NULL && !file_->write(data, len)) {
+    error_ = errno;
+    return false;
+  }
+  return true;
+}
+
+bool MultipartUpload::end_part() {
+  if (file_ == NULL) {
+    return true;
+  }
+  bool committed = file_->commit();
+  error_ = errno;
+  delete file_;
+  file_ = NULL;
+  return committed;
+}
@@ -0,0 +1,334 @@
+#include "UpstreamGroups.hpp"
+
+#include <algorithm>
+#include <ctime>
+#include <iostream>
+#include <sstream>
+
+#include "CgiCache.hpp"
+
+namespace {
+int64_t now_time_upstream() { return static_cast<int64_t>(std::time(NULL)); }
+
+// Settings of a bare address, a group of one
+const UpstreamServerConfig kLoneServer;
+
+// FNV-1a, spreads short similar keys well enough for a hash ring
+uint32_t hash_string(const std::string& text) {
+  uint32_t hash = 2166136261u;
+  for (std::size_t i = 0; i < text.size(); ++i) {
+    hash ^= static_cast<unsigned char>(text[i]);
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+bool contains(const std::vector<UpstreamGroups::Peer*>& peers,
+              const UpstreamGroups::Peer* peer) {
+  return std::find(peers.begin(), peers.end(), peer) != peers.end();
+}
+}  // namespace
+
+UpstreamGroups::Peer UpstreamGroups::make_peer_(
+    const UpstreamServerConfig* config, const UpstreamConfig* group,
+    const std::string& address) {
+  Peer peer;
+  peer.config = config;
+  peer.group = group;
+  peer.address = address;
+  peer.current_weight = 0;
+  peer.active = 0;
+  peer.fails = 0;
+  peer.failed_at = 0;
+  peer.healthy = true;
+  peer.streak = 0;
+  peer.probing = false;
+  peer.requests = 0;
+  peer.total_fails = 0;
+  return peer;
+}
+
+void UpstreamGroups::configure(const Config& config) {
+  const std::vector<UpstreamConfig>& upstreams = config.get_upstreams();
+  for (std::size_t i = 0; i < upstreams.size(); ++i) {
+    const UpstreamConfig& uc = upstreams[i];
+    Group& group = groups_[uc.name];
+    group.config = &uc;
+    // Checked right away, so servers already down are found before traffic
+    group.next_check_sec = now_time_upstream();
+    for (std::size_t j = 0; j < uc.servers.size(); ++j) {
+      group.peers.push_back(
+          make_peer_(&uc.servers[j], &uc, uc.servers[j].address));
+    }
+    if (uc.balance == UpstreamConfig::kHash && uc.hash_consistent) {
+      for (std::size_t j = 0; j < group.peers.size(); ++j) {
+        long points = kPointsPerWeight * group.peers[j].config->weight;
+        for (long k = 0; k < points; ++k) {
+          std::ostringstream point;
+          point << group.peers[j].address << '-' << k;
+          group.ring.push_back(std::make_pair(hash_string(point.str()), j));
+        }
+      }
+      std::sort(group.ring.begin(), group.ring.end());
+    }
+  }
+
+  const std::vector<ServerContext>& servers = config.get_configs();
+  for (std::size_t i = 0; i < servers.size(); ++i) {
+    for (std::size_t j = 0; j < servers[i].locations.size(); ++j) {
+      const LocationContext& lc = servers[i].locations[j];
+      const std::string* targets[] = {&lc.proxy_pass, &lc.fastcgi_pass};
+      for (std::size_t k = 0; k < 2; ++k) {
+        const std::string& target = *targets[k];
+        if (target.empty() || groups_.count(target) != 0) {
+          continue;
+        }
+        Group& group = groups_[target];
+        group.config = NULL;
+        group.next_check_sec = 0;
+        group.peers.push_back(make_peer_(&kLoneServer, NULL, target));
+      }
+    }
+  }
+}
+
+std::string UpstreamGroups::hash_key(const std::string& group,
+                                     const Request& request) const {
+  std::map<std::string, Group>::const_iterator it = groups_.find(group);
+  if (it == groups_.end() || it->second.config == NULL ||
+      it->second.config->balance != UpstreamConfig::kHash) {
+    return "";
+  }
+  return CgiCache::build_key(it->second.config->hash_key, request);
+}
+
+bool UpstreamGroups::is_usable_(const Group& group, const Peer& peer,
+                                int64_t now,
+                                const std::vector<Peer*>& tried) {
+  if (!peer.healthy || contains(tried, &peer)) {
+    return false;
+  }
+  if (group.peers.size() == 1 || peer.config->max_fails == 0) {
+    return true;
+  }
+  return peer.fails < peer.config->max_fails ||
+         now - peer.failed_at >= peer.config->fail_timeout_sec;
+}
+
+// Smooth weighted round-robin: every candidate gains its weight, the one
+// ahead is picked and loses the total, so weight 3:1 goes a a b a
+UpstreamGroups::Peer* UpstreamGroups::pick_weighted_(
+    const std::vector<Peer*>& candidates) {
+  Peer* best = NULL;
+  long total = 0;
+  for (std::size_t i = 0; i < candidates.size(); ++i) {
+    Peer* peer = candidates[i];
+    peer->current_weight += peer->config->weight;
+    total += peer->config->weight;
+    if (best == NULL || peer->current_weight > best->current_weight) {
+      best = peer;
+    }
+  }
+  if (best != NULL) {
+    best->current_weight -= total;
+  }
+  return best;
+}
+
+// The same key keeps landing on the same server. On the ring, a server
+// that is out hands its keys to the next points only, leaving the rest
+// where they were.
+UpstreamGroups::Peer* UpstreamGroups::select_by_hash_(
+    Group& group, const std::string& hash_key,
+    const std::vector<Peer*>& tried, int64_t now) {
+  uint32_t hash = hash_string(hash_key);
+  if (!group.ring.empty()) {
+    std::vector<std::pair<uint32_t, std::size_t> >::iterator it =
+        std::lower_bound(group.ring.begin(), group.ring.end(),
+                         std::make_pair(hash, static_cast<std::size_t>(0)));
+    for (std::size_t n = 0; n < group.ring.size(); ++n, ++it) {
+      if (it == group.ring.end()) {
+        it = group.ring.begin();
+      }
+      Peer& peer = group.peers[it->second];
+      if (is_usable_(group, peer, now, tried)) {
+        return &peer;
+      }
+    }
+    return NULL;
+  }
+
+  long total = 0;
+  for (std::size_t i = 0; i < group.peers.size(); ++i) {
+    total += group.peers[i].config->weight;
+  }
+  long slot = static_cast<long>(hash % static_cast<uint32_t>(total));
+  std::size_t start = 0;
+  while (slot >= group.peers[start].config->weight) {
+    slot -= group.peers[start].config->weight;
+    start++;
+  }
+  for (std::size_t n = 0; n < group.peers.size(); ++n) {
+    Peer& peer = group.peers[(start + n) % group.peers.size()];
+    if (is_usable_(group, peer, now, tried)) {
+      return &peer;
+    }
+  }
+  return NULL;
+}
+
+UpstreamGroups::Peer* UpstreamGroups::select(const std::string& group_name,
+                                             const std::string& hash_key,
+                                             const std::vector<Peer*>& tried) {
+  std::map<std::string, Group>::iterator it = groups_.find(group_name);
+  if (it == groups_.end()) {
+    return NULL;
+  }
+  Group& group = it->second;
+  int64_t now = now_time_upstream();
+  Peer* peer = NULL;
+  if (group.config != NULL && group.config->balance == UpstreamConfig::kHash) {
+    peer = select_by_hash_(group, hash_key, tried, now);
+  } else {
+    std::vector<Peer*> candidates;
+    for (std::size_t i = 0; i < group.peers.size(); ++i) {
+      Peer& candidate = group.peers[i];
+      if (!is_usable_(group, candidate, now, tried)) {
+        continue;
+      }
+      // Least connections keeps only the least loaded for their weight
+      if (group.config != NULL &&
+          group.config->balance == UpstreamConfig::kLeastConn &&
+          !candidates.empty()) {
+        unsigned long load = candidate.active * candidates[0]->config->weight;
+        unsigned long best = candidates[0]->active * candidate.config->weight;
+        if (load > best) {
+          continue;
+        }
+        if (load < best) {
+          candidates.clear();
+        }
+      }
+      candidates.push_back(&candidate);
+    }
+    peer = pick_weighted_(candidates);
+  }
+  if (peer != NULL) {
+    peer->active++;
+    peer->requests++;
+  }
+  return peer;
+}
+
+void UpstreamGroups::release(Peer* peer, bool failed) {
+  if (peer->active > 0) {
+    peer->active--;
+  }
+  if (!failed) {
+    peer->fails = 0;
+    return;
+  }
+  int64_t now = now_time_upstream();
+  peer->total_fails++;
+  if (now - peer->failed_at >= peer->config->fail_timeout_sec) {
+    peer->fails = 0;
+  }
+  peer->fails++;
+  peer->failed_at = now;
+  if (peer->group != NULL && peer->group->servers.size() > 1 &&
+      peer->fails == peer->config->max_fails) {
+    std::cerr << "upstream " << peer->group->name << ": " << peer->address
+              << " out for " << peer->config->fail_timeout_sec
+              << "s after failures: " << peer->fails << "\n";
+  }
+}
+
+bool UpstreamGroups::has_health_checks() const {
+  for (std::map<std::string, Group>::const_iterator it = groups_.begin();
+       it != groups_.end(); ++it) {
+    if (it->second.config != NULL &&
+        it->second.config->check_interval_sec > 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+int64_t UpstreamGroups::next_check_sec() const {
+  int64_t next = 0;
+  for (std::map<std::string, Group>::const_iterator it = groups_.begin();
+       it != groups_.end(); ++it) {
+    if (it->second.config == NULL ||
+        it->second.config->check_interval_sec == 0) {
+      continue;
+    }
+    if (next == 0 || it->second.next_check_sec < next) {
+      next = it->second.next_check_sec;
+    }
+  }
+  return next;
+}
+
+std::vector<UpstreamGroups::Peer*> UpstreamGroups::take_due_checks(
+    int64_t now) {
+  std::vector<Peer*> due;
+  for (std::map<std::string, Group>::iterator it = groups_.begin();
+       it != groups_.end(); ++it) {
+    Group& group = it->second;
+    if (group.config == NULL || group.config->check_interval_sec == 0 ||
+        group.next_check_sec > now) {
+      continue;
+    }
+    group.next_check_sec = now + group.config->check_interval_sec;
+    for (std::size_t i = 0; i < group.peers.size(); ++i) {
+      // A probe still running from last time is not doubled
+      if (!group.peers[i].probing) {
+        group.peers[i].probing = true;
+        due.push_back(&group.peers[i]);
+      }
+    }
+  }
+  return due;
+}
+
+void UpstreamGroups::check_done(Peer* peer, bool passed) {
+  peer->probing = false;
+  if (passed == peer->healthy) {
+    peer->streak = 0;
+    return;
+  }
+  peer->streak++;
+  if (!passed && peer->streak >= peer->group->check_fails) {
+    peer->healthy = false;
+    peer->streak = 0;
+    std::cerr << "upstream " << peer->group->name << ": " << peer->address
+              << " failed its health check, out\n";
+  } else if (passed && peer->streak >= peer->group->check_passes) {
+    peer->healthy = true;
+    peer->streak = 0;
+    peer->fails = 0;
+    std::cerr << "upstream " << peer->group->name << ": " << peer->address
+              << " passed its health check, back in\n";
+  }
+}
+
+void UpstreamGroups::report(std::string& out) const {
+  int64_t now = now_time_upstream();
+  std::vector<Peer*> none;
+  for (std::map<std::string, Group>::const_iterator it = groups_.begin();
+       it != groups_.end(); ++it) {
+    const Group& group = it->second;
+    if (group.config == NULL) {
+      continue;
+    }
+    for (std::size_t i = 0; i < group.peers.size(); ++i) {
+      const Peer& peer = group.peers[i];
+      std::ostringstream line;
+      line << "upstream " << it->first << " " << peer.address << ": "
+           << (is_usable_(group, peer, now, none) ? "up" : "down")
+           << ", active " << peer.active << ", requests " << peer.requests
+           << ", fails " << peer.total_fails << "\n";
+      out += line.str();
+    }
+  }
+}
@@ -0,0 +1,121 @@
+#include "UpstreamPool.hpp"
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+#include "spawn_utils.hpp"
+
+UpstreamPool::~UpstreamPool() {
+  for (std::map<std::string, Upstream>::iterator it = upstreams_.begin();
+       it != upstreams_.end(); ++it) {
+    for (std::size_t i = 0; i < it->second.idle_fds.size(); ++i) {
+      close(it->second.idle_fds[i]);
+    }
+  }
+}
+
+// Resolves the address once per upstream and keeps it for later connects
+UpstreamPool::Upstream* UpstreamPool::find_upstream_(const std::string& upstream) {
+  std::map<std::string, Upstream>::iterator it = upstreams_.find(upstream);
+  if (it != upstreams_.end()) {
+    return &it->second;
+  }
+
+  Upstream entry;
+  std::memset(&entry.addr, 0, sizeof(entry.addr));
+  if (upstream.compare(0, 5, "unix:") == 0) {
+    std::string path = upstream.substr(5);
+    struct sockaddr_un* sun = reinterpret_cast<struct sockaddr_un*>(&entry.addr);
+    if (path.size() >= sizeof(sun->sun_path)) {
+      std::cerr << directive_ << ": socket path too long: " << path << "\n";
+      return NULL;
+    }
+    sun->sun_family = AF_UNIX;
+    std::memcpy(sun->sun_path, path.c_str(), path.size() + 1);
+    entry.addr_len = sizeof(struct sockaddr_un);
+  } else {
+    std::size_t colon_pos = upstream.rfind(':');
+    std::string host = upstream.substr(0, colon_pos);
+    std::string port = upstream.substr(colon_pos + 1);
+    // "[::1]" is looked up as "::1"
+    if (host.size() > 2 && host[0] == '[' && host[host.size() - 1] == ']') {
+      host = host.substr(1, host.size() - 2);
+    }
+    struct addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* res;
+    int rc = getaddrinfo(host.c_str(), port.c_str(), &hints, &res);
+    if (rc != 0) {
+      std::cerr << directive_ << ": " << upstream << ": " << gai_strerror(rc)
+                << "\n";
+      return NULL;
+    }
+    std::memcpy(&entry.addr, res->ai_addr, res->ai_addrlen);
+    entry.addr_len = res->ai_addrlen;
+    freeaddrinfo(res);
+  }
+  return &(upstreams_[upstream] = entry);
+}
+
+// An idle backend connection must have nothing to read: EOF means the
+// backend closed it, and stray bytes mean the stream is out of sync.
+bool UpstreamPool::is_alive_(int fd) {
+  char c;
+  ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+  return n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+int UpstreamPool::acquire(const std::string& upstream, bool allow_reuse,
+                         bool& reused) {
+  reused = false;
+  Upstream* entry = find_upstream_(upstream);
+  if (entry == NULL) {
+    return -1;
+  }
+
+  while (allow_reuse && !entry->idle_fds.empty()) {
+    int fd = entry->idle_fds.back();
+    entry->idle_fds.pop_back();
+    if (is_alive_(fd)) {
+      reused = true;
+      return fd;
+    }
+    close(fd);
+  }
+
+  int fd = socket(entry->addr.ss_family, SOCK_STREAM, 0);
+  if (fd == -1) {
+    return -1;
+  }
+  if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1 || set_cloexec(fd) == -1) {
+    close(fd);
+    return -1;
+  }
+  if (connect(fd, reinterpret_cast<struct sockaddr*>(&entry->addr),
+              entry->addr_len) == -1 &&
+      errno != EINPROGRESS) {
+    std::cerr << directive_ << ": connect to " << upstream << ": "
+              << std::strerror(errno) << "\n";
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+void UpstreamPool::release(const std::string& upstream, int fd) {
+  std::map<std::string, Upstream>::iterator it = upstreams_.find(upstream);
+  if (it == upstreams_.end() ||
+      it->second.idle_fds.size() >= kMaxIdlePerUpstream) {
+    close(fd);
+    return;
+  }
+  it->second.idle_fds.push_back(fd);
+}
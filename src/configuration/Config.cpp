@@ -5,9 +5,14 @@
 #include <stdexcept>
 #include <iostream>
 #include <cstdlib>
+#include <set>
+#include <utility>
 
+#include "MetaVariables.hpp"
 #include "config_utils.hpp"
 #include "parse_server_directive.hpp"
+#include "parse_upstream_block.hpp"
+#include "string_utils.hpp"
 
 std::string Config::read_file(const std::string& filepath) {
   std::ifstream ifs(filepath.c_str());
@@ -46,6 +51,14 @@ std::vector<std::string> Config::tokenize(const std::string& content) {
         current_word.clear();
       }
       tokens.push_back(std::string(1, c));
+    } else if (c == '"' || c == '\'') {
+      // Quoted values keep their spaces and ';', e.g. add_header values
+      std::size_t close_pos = content.find(c, i + 1);
+      if (close_pos == std::string::npos) {
+        error_exit("Unterminated quoted string in config");
+      }
+      current_word.append(content, i + 1, close_pos - i - 1);
+      i = close_pos;
     } else {
       current_word.append(1, c);
     }
@@ -56,6 +69,41 @@ std::vector<std::string> Config::tokenize(const std::string& content) {
   return tokens;
 }
 
+// Everything that does not depend on the request time is serialized here;
+// only the Expires of a relative duration is computed per response.
+static void compile_expires(ExpiresConfig& expires,
+                            bool overrides_cache_control) {
+  std::string cache_control;
+  std::string expires_value;
+  switch (expires.mode) {
+    case ExpiresConfig::kExpiresMax:
+      expires_value = "Thu, 31 Dec 2037 23:55:55 GMT";
+      cache_control = "max-age=315360000";
+      break;
+    case ExpiresConfig::kExpiresEpoch:
+      expires_value = "Thu, 01 Jan 1970 00:00:01 GMT";
+      cache_control = "no-cache";
+      break;
+    case ExpiresConfig::kExpiresDuration:
+      if (expires.seconds > 0) {
+        cache_control = "max-age=" + to_string_long(expires.seconds);
+      } else {
+        cache_control = "no-cache";
+      }
+      break;
+    default:
+      break;
+  }
+
+  expires.header_block.clear();
+  if (!expires_value.empty()) {
+    expires.header_block += "Expires: " + expires_value + "\r\n";
+  }
+  if (!cache_control.empty() && !overrides_cache_control) {
+    expires.header_block += "Cache-Control: " + cache_control + "\r\n";
+  }
+}
+
 static void finalize_location_context(ServerContext& sc, LocationContext& lc) {
   if (lc.root.empty()) {
     if (sc.server_root == "./html") {
@@ -81,6 +129,40 @@ static void finalize_location_context(ServerContext& sc, LocationContext& lc) {
   if (lc.client_max_body_size == -1) {
     lc.client_max_body_size = sc.client_max_body_size;
   }
+
+  if (lc.default_type.empty()) {
+    lc.default_type = sc.default_type;
+  }
+
+  for (size_t i = 0; i < lc.cgi_pools.size(); ++i) {
+    CgiPoolConfig& pool = lc.cgi_pools[i];
+    for (size_t j = 0; j < lc.cgi_handlers.size(); ++j) {
+      if (lc.cgi_handlers[j].extension == pool.extension) {
+        pool.interpreter = lc.cgi_handlers[j].binary_path;
+      }
+    }
+    if (pool.interpreter.empty()) {
+      error_exit("cgi_pool " + pool.extension + " has no matching cgi_handler");
+    }
+  }
+
+  if (lc.cgi_queue_size > 0 && lc.cgi_max_concurrent == 0) {
+    error_exit("cgi_queue needs cgi_max_concurrent in location " + lc.path);
+  }
+
+  bool overrides_cache_control = false;
+  lc.header_block.clear();
+  for (size_t i = 0; i < lc.add_headers.size(); ++i) {
+    if (to_lower(lc.add_headers[i].first) == "cache-control") {
+      overrides_cache_control = true;
+    }
+    lc.header_block += lc.add_headers[i].first + ": " +
+                       lc.add_headers[i].second + "\r\n";
+  }
+  compile_expires(lc.expires, overrides_cache_control);
+  for (size_t i = 0; i < lc.expires_matches.size(); ++i) {
+    compile_expires(lc.expires_matches[i], overrides_cache_control);
+  }
 }
 
 static void finalize_server_context(ServerContext& sc) {
@@ -121,6 +203,8 @@ void Config::parse_server(const std::vector<std::string>& tokens,
     s_parsers["index"] = parse_server_index_directive;
     s_parsers["location"] = parse_location_directive;
     s_parsers["error_page"] = parse_error_page_directive;
+    s_parsers["types"] = parse_server_types_directive;
+    s_parsers["default_type"] = parse_server_default_type_directive;
   }
   ServerContext sc;
   while (token_index < tokens.size()) {
@@ -138,32 +222,179 @@ void Config::parse_server(const std::vector<std::string>& tokens,
   error_exit("Unexpected end of file: missing '}' in server block");
 }
 
-const ServerContext& Config::get_config(int port,
-                                        const std::string& host) const {
-  std::vector<const ServerContext*> candidates;
-  for (size_t i = 0; i < servers_.size(); ++i) {
-    for (size_t j = 0; j < servers_[i].listens.size(); ++j) {
-      if (servers_[i].listens[j].port == port) {
-        candidates.push_back(&servers_[i]);
+std::string Config::normalize_host(const std::string& host) {
+  std::string name = to_lower(trim(host, " \t"));
+  if (!name.empty() && name[0] == '[') {
+    std::size_t close_pos = name.find(']');
+    if (close_pos != std::string::npos) {
+      return name.substr(0, close_pos + 1);
+    }
+    return name;
+  }
+  std::size_t colon_pos = name.find(':');
+  if (colon_pos != std::string::npos) {
+    name.erase(colon_pos);
+  }
+  if (!name.empty() && name[name.size() - 1] == '.') {
+    name.erase(name.size() - 1);
+  }
+  return name;
+}
+
+void Config::build_vhost_index_() {
+  default_servers_.clear();
+  exact_names_.clear();
+  leading_wildcards_.clear();
+  trailing_wildcards_.clear();
+
+  for (std::size_t i = 0; i < servers_.size(); ++i) {
+    const ServerContext& sc = servers_[i];
+    for (std::size_t j = 0; j < sc.listens.size(); ++j) {
+      int port = sc.listens[j].port;
+      // The first server listening on a port is its default server
+      default_servers_.insert(std::make_pair(port, i));
+      for (std::size_t k = 0; k < sc.server_names.size(); ++k) {
+        std::string name = to_lower(sc.server_names[k]);
+        if (name.size() > 2 && name.compare(0, 2, "*.") == 0) {
+          leading_wildcards_.insert(
+              std::make_pair(std::make_pair(port, name.substr(1)), i));
+        } else if (name.size() > 1 && name[0] == '.') {
+          // ".example.com" matches both example.com and *.example.com
+          exact_names_.insert(
+              std::make_pair(std::make_pair(port, name.substr(1)), i));
+          leading_wildcards_.insert(
+              std::make_pair(std::make_pair(port, name), i));
+        } else if (name.size() > 2 &&
+                   name.compare(name.size() - 2, 2, ".*") == 0) {
+          trailing_wildcards_.insert(std::make_pair(
+              std::make_pair(port, name.substr(0, name.size() - 1)), i));
+        } else {
+          exact_names_.insert(std::make_pair(std::make_pair(port, name), i));
+        }
+      }
+    }
+  }
+}
+
+// The longest wildcard wins: leading wildcards are tried from the first dot,
+// trailing wildcards from the last one.
+bool Config::find_wildcard_(int port, const std::string& host,
+                            std::size_t& server_index) const {
+  if (!leading_wildcards_.empty()) {
+    for (std::size_t dot = host.find('.'); dot != std::string::npos;
+         dot = host.find('.', dot + 1)) {
+      VhostMap::const_iterator it =
+          leading_wildcards_.find(std::make_pair(port, host.substr(dot)));
+      if (it != leading_wildcards_.end()) {
+        server_index = it->second;
+        return true;
       }
     }
   }
-  if (candidates.empty()) {
+  if (!trailing_wildcards_.empty()) {
+    for (std::size_t dot = host.rfind('.'); dot != std::string::npos && dot > 0;
+         dot = host.rfind('.', dot - 1)) {
+      VhostMap::const_iterator it = trailing_wildcards_.find(
+          std::make_pair(port, host.substr(0, dot + 1)));
+      if (it != trailing_wildcards_.end()) {
+        server_index = it->second;
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+const ServerContext& Config::get_config(int port,
+                                        const std::string& host) const {
+  std::map<int, std::size_t>::const_iterator default_it =
+      default_servers_.find(port);
+  if (default_it == default_servers_.end()) {
     throw std::runtime_error("get_config(): no matching port"); //TODO throwやめよう
   }
-  for (size_t i = 0; i < candidates.size(); ++i) {
-    for (size_t j = 0; j < candidates[i]->server_names.size(); ++j) {
-      if (candidates[i]->server_names[j] == host) {
-        return *candidates[i];
+  std::string name = normalize_host(host);
+
+  VhostMap::const_iterator exact_it =
+      exact_names_.find(std::make_pair(port, name));
+  if (exact_it != exact_names_.end()) {
+    return servers_[exact_it->second];
+  }
+  std::size_t server_index;
+  if (!name.empty() && find_wildcard_(port, name, server_index)) {
+    return servers_[server_index];
+  }
+  return servers_[default_it->second];
+}
+
+// A wildcard address already accepts every connection on its port,
+// so specific addresses on the same port are not bound again.
+std::vector<ListenConfig> Config::get_unique_listens() const {
+  std::set<std::pair<std::string, int> > seen;
+  std::set<int> wildcard_ports;
+  for (std::size_t i = 0; i < servers_.size(); ++i) {
+    for (std::size_t j = 0; j < servers_[i].listens.size(); ++j) {
+      if (servers_[i].listens[j].address == "0.0.0.0") {
+        wildcard_ports.insert(servers_[i].listens[j].port);
+      }
+    }
+  }
+
+  std::vector<ListenConfig> result;
+  for (std::size_t i = 0; i < servers_.size(); ++i) {
+    for (std::size_t j = 0; j < servers_[i].listens.size(); ++j) {
+      const ListenConfig& lc = servers_[i].listens[j];
+      if (wildcard_ports.count(lc.port) && lc.address != "0.0.0.0") {
+        continue;
+      }
+      if (seen.insert(std::make_pair(lc.address, lc.port)).second) {
+        result.push_back(lc);
       }
     }
   }
-  return *candidates[0];
+  return result;
+}
+
+static std::string directory_of(const std::string& filepath) {
+  std::size_t slash_pos = filepath.find_last_of('/');
+  if (slash_pos == std::string::npos) {
+    return ".";
+  }
+  return filepath.substr(0, slash_pos);
+}
+
+// Replaces every `include path;` with the tokens of that file.
+// Relative paths are resolved against the directory of the including file.
+void Config::expand_includes_(std::vector<std::string>& tokens,
+                              const std::string& base_dir, int depth) {
+  static const int kMaxIncludeDepth = 8;
+  std::vector<std::string> expanded;
+  for (size_t i = 0; i < tokens.size(); ++i) {
+    if (tokens[i] != "include") {
+      expanded.push_back(tokens[i]);
+      continue;
+    }
+    if (i + 2 >= tokens.size() || tokens[i + 1] == ";" || tokens[i + 2] != ";") {
+      error_exit("include needs exactly one path followed by ';'");
+    }
+    if (depth >= kMaxIncludeDepth) {
+      error_exit("include nested too deeply: " + tokens[i + 1]);
+    }
+    std::string path = tokens[i + 1];
+    if (path[0] != '/') {
+      path = base_dir + "/" + path;
+    }
+    std::vector<std::string> included = tokenize(read_file(path));
+    expand_includes_(included, directory_of(path), depth + 1);
+    expanded.insert(expanded.end(), included.begin(), included.end());
+    i += 2;
+  }
+  tokens.swap(expanded);
 }
 
 void Config::load_file(const std::string& filepath) {
   std::string content = read_file(filepath);
   std::vector<std::string> tokens = tokenize(content);
+  expand_includes_(tokens, directory_of(filepath), 0);
 
   bool server_found = false;
   for (size_t i = 0; i < tokens.size(); ++i) {
@@ -171,6 +402,40 @@ void Config::load_file(const std::string& filepath) {
       server_found = true;
       i++;
       parse_server(tokens, i);
+    } else if (tokens[i] == "types") {
+      i++;
+      parse_types_block(tokens, i, types_);
+      i--;  // Points at '}' like parse_server() leaves it
+    } else if (tokens[i] == "upstream") {
+      i++;
+      UpstreamConfig upstream;
+      parse_upstream_block(tokens, i, upstream);
+      if (find_upstream(upstream.name) != NULL) {
+        error_exit("Duplicate upstream " + upstream.name);
+      }
+      upstreams_.push_back(upstream);
+      i--;
+    } else if (tokens[i] == "cache_path") {
+      i++;
+      parse_cache_path_(tokens, i);
+      i--;
+    } else if (tokens[i] == "file_io_threads") {
+      // file_io_threads 8;
+      i++;
+      std::string value;
+      set_single_string(tokens, i, value, "file_io_threads");
+      file_io_threads_ = safe_strtol(value, 0, 256);
+      i--;
+    } else if (tokens[i] == "shutdown_timeout") {
+      // shutdown_timeout 30s;
+      i++;
+      std::string value;
+      set_single_string(tokens, i, value, "shutdown_timeout");
+      shutdown_timeout_sec_ = parse_duration_sec(value);
+      if (shutdown_timeout_sec_ < 0) {
+        error_exit("shutdown_timeout must not be negative");
+      }
+      i--;
     }
   }
 
@@ -178,4 +443,160 @@ void Config::load_file(const std::string& filepath) {
     std::cout << "No server directory found in file." << std::endl;
     std::exit(EXIT_FAILURE);
   }
+  for (size_t i = 0; i < servers_.size(); ++i) {
+    if (servers_[i].mime_types.empty()) {
+      servers_[i].mime_types = types_.empty() ? default_mime_types() : types_;
+    }
+  }
+  resolve_upstreams_();
+  check_disk_caches_();
+  build_vhost_index_();
+  prebuild_responses_();
+}
+
+const UpstreamConfig* Config::find_upstream(const std::string& name) const {
+  for (std::size_t i = 0; i < upstreams_.size(); ++i) {
+    if (upstreams_[i].name == name) {
+      return &upstreams_[i];
+    }
+  }
+  return NULL;
+}
+
+// cache_path pages /var/cache/webserv max_size=10g inactive=1d entries=1m;
+void Config::parse_cache_path_(const std::vector<std::string>& tokens,
+                               size_t& token_index) {
+  std::vector<std::string> values;
+  set_vector_string(tokens, token_index, values, "cache_path");
+  if (values.size() < 2 || values[0].find('=') != std::string::npos ||
+      values[1].find('=') != std::string::npos) {
+    error_exit("cache_path needs a name and a directory");
+  }
+  CachePathConfig cache_path;
+  cache_path.name = values[0];
+  cache_path.path = values[1];
+  for (std::size_t i = 2; i < values.size(); ++i) {
+    std::size_t eq_pos = values[i].find('=');
+    if (eq_pos == std::string::npos) {
+      error_exit("cache_path: expected key=value, got " + values[i]);
+    }
+    std::string key = values[i].substr(0, eq_pos);
+    std::string value = values[i].substr(eq_pos + 1);
+    if (key == "max_size") {
+      cache_path.max_size = parse_size_bytes(value);
+    } else if (key == "inactive") {
+      cache_path.inactive_sec = parse_duration_sec(value);
+    } else if (key == "entries") {
+      cache_path.entries = parse_size_bytes(value);
+    } else {
+      error_exit("cache_path: unknown parameter " + key);
+    }
+  }
+  if (cache_path.max_size <= 0 || cache_path.inactive_sec <= 0 ||
+      cache_path.entries <= 0 || cache_path.entries > (1L << 28)) {
+    error_exit("cache_path: max_size, inactive and entries must be positive");
+  }
+  if (find_cache_path(cache_path.name) != NULL) {
+    error_exit("Duplicate cache_path " + cache_path.name);
+  }
+  cache_paths_.push_back(cache_path);
+}
+
+const CachePathConfig* Config::find_cache_path(const std::string& name) const {
+  for (std::size_t i = 0; i < cache_paths_.size(); ++i) {
+    if (cache_paths_[i].name == name) {
+      return &cache_paths_[i];
+    }
+  }
+  return NULL;
+}
+
+void Config::check_disk_caches_() const {
+  for (std::size_t i = 0; i < servers_.size(); ++i) {
+    for (std::size_t j = 0; j < servers_[i].locations.size(); ++j) {
+      const std::string& zone = servers_[i].locations[j].disk_cache.zone;
+      if (!zone.empty() && find_cache_path(zone) == NULL) {
+        error_exit("disk_cache: no cache_path named " + zone);
+      }
+    }
+  }
+}
+
+// An upstream may be defined after the locations naming it, so a bare host
+// is only known to be an address once every block is read
+void Config::resolve_upstreams_() {
+  for (std::size_t i = 0; i < servers_.size(); ++i) {
+    for (std::size_t j = 0; j < servers_[i].locations.size(); ++j) {
+      LocationContext& lc = servers_[i].locations[j];
+      std::string host;
+      std::string port;
+      if (!lc.proxy_pass.empty() && find_upstream(lc.proxy_pass) == NULL &&
+          !split_host_port(lc.proxy_pass, host, port)) {
+        lc.proxy_pass += ":80";
+      }
+      if (!lc.fastcgi_pass.empty() &&
+          lc.fastcgi_pass.compare(0, 5, "unix:") != 0 &&
+          find_upstream(lc.fastcgi_pass) == NULL &&
+          !split_host_port(lc.fastcgi_pass, host, port)) {
+        error_exit("fastcgi_pass: no upstream named " + lc.fastcgi_pass);
+      }
+    }
+  }
+}
+
+namespace {
+const ParserStatus kPrebuiltErrorStatuses[] = {
+    kBadRequest,       kForbidden,           kNotFound,
+    kMethodNotAllowed, kContentTooLarge,     kUriTooLong,
+    kRequestHeaderFieldsTooLarge,            kInternalServerError,
+    kNotImplemented,   kBadGateway,          kGatewayTimeout,
+    kVersionNotSupported};
+}  // namespace
+
+// Redirects, error pages and the fixed part of the CGI environment depend on
+// nothing but the config, so they are rendered here once instead of on every
+// request.
+void Config::prebuild_responses_() {
+  const std::size_t num_statuses =
+      sizeof(kPrebuiltErrorStatuses) / sizeof(kPrebuiltErrorStatuses[0]);
+  for (std::size_t i = 0; i < servers_.size(); ++i) {
+    ServerContext& sc = servers_[i];
+    std::set<int> codes;
+    for (std::size_t j = 0; j < num_statuses; ++j) {
+      codes.insert(kPrebuiltErrorStatuses[j]);
+    }
+    for (std::map<int, std::string>::const_iterator it = sc.error_pages.begin();
+         it != sc.error_pages.end(); ++it) {
+      codes.insert(it->first);
+    }
+
+    sc.error_responses.clear();
+    for (std::set<int>::const_iterator it = codes.begin(); it != codes.end();
+         ++it) {
+      ParserStatus status = static_cast<ParserStatus>(*it);
+      Response response;
+      response.prepare_error_response(status, error_page_path(sc, *it));
+      sc.error_responses[*it] = PrebuiltResponse(response);
+    }
+
+    for (std::size_t j = 0; j < sc.locations.size(); ++j) {
+      LocationContext& lc = sc.locations[j];
+      if (lc.redirect_status_code == -1) {
+        continue;
+      }
+      Response response;
+      response.prepare_redirect_response(lc.redirect_status_code,
+                                         lc.redirect_url);
+      lc.redirect_response = PrebuiltResponse(response);
+    }
+
+    std::string server_name = "localhost";
+    for (std::size_t j = 0; j < sc.server_names.size(); ++j) {
+      if (!sc.server_names[j].empty()) {
+        server_name = sc.server_names[j];
+        break;
+      }
+    }
+    sc.cgi_env = MetaVariables::render_constants(server_name);
+  }
 }
@@ -4,8 +4,11 @@
 #include <sstream>
 #include <cstdlib>
 #include <algorithm>
+#include <cctype>
 #include <cerrno>
 
+#include "Config.hpp"
+
 void error_exit(const std::string& msg) {
   std::cerr << "Error: " << msg << std::endl;
   std::exit(EXIT_FAILURE);
@@ -88,4 +91,118 @@ std::string to_string_long(long v) {
   std::ostringstream oss;
   oss << v;
   return oss.str();
-}
\ No newline at end of file
+}
+
+// "90", "30s", "10m", "1h30m", "7d", "2w", "1M", "1y" -> seconds.
+// A leading '-' gives a negative duration.
+long parse_duration_sec(const std::string& str) {
+  std::size_t i = 0;
+  long sign = 1;
+  if (!str.empty() && str[0] == '-') {
+    sign = -1;
+    i = 1;
+  }
+  if (i >= str.size()) {
+    error_exit("Invalid duration: '" + str + "'");
+  }
+
+  long total = 0;
+  while (i < str.size()) {
+    std::size_t digits_end = i;
+    while (digits_end < str.size() && std::isdigit(str[digits_end])) {
+      digits_end++;
+    }
+    if (digits_end == i) {
+      error_exit("Invalid duration: '" + str + "'");
+    }
+    long value = safe_strtol(str.substr(i, digits_end - i), 0, 1000000000L);
+    long unit = 1;
+    if (digits_end < str.size()) {
+      switch (str[digits_end]) {
+        case 's': unit = 1; break;
+        case 'm': unit = 60; break;
+        case 'h': unit = 60 * 60; break;
+        case 'd': unit = 24 * 60 * 60; break;
+        case 'w': unit = 7 * 24 * 60 * 60; break;
+        case 'M': unit = 30 * 24 * 60 * 60; break;
+        case 'y': unit = 365 * 24 * 60 * 60; break;
+        default: error_exit("Invalid duration unit in '" + str + "'");
+      }
+      digits_end++;
+    } else if (total != 0) {
+      error_exit("Missing duration unit in '" + str + "'");
+    }
+    if (value > (1000000000L * 10) / unit) {
+      error_exit("Duration too large: '" + str + "'");
+    }
+    total += value * unit;
+    i = digits_end;
+  }
+  return sign * total;
+}
+
+// "512", "64k", "512m", "2g" (nginx size syntax)
+long parse_size_bytes(const std::string& str) {
+  if (str.empty()) {
+    error_exit("Invalid size: '" + str + "'");
+  }
+  std::string digits = str;
+  long unit = 1;
+  switch (str[str.size() - 1]) {
+    case 'k': case 'K': unit = 1024L; break;
+    case 'm': case 'M': unit = 1024L * 1024; break;
+    case 'g': case 'G': unit = 1024L * 1024 * 1024; break;
+    default: break;
+  }
+  if (unit != 1) {
+    digits.erase(digits.size() - 1);
+  }
+  long value = safe_strtol(digits, 0, __LONG_MAX__ / unit);
+  return value * unit;
+}
+
+// "host:port" or "[::1]:port"; the brackets stay on the host. Returns false
+// with an empty port when there is none.
+bool split_host_port(const std::string& authority, std::string& host,
+                     std::string& port) {
+  std::size_t bracket_pos = authority.find(']');
+  std::size_t colon_pos = authority.rfind(':');
+  if (colon_pos == std::string::npos ||
+      (bracket_pos != std::string::npos && colon_pos < bracket_pos) ||
+      (bracket_pos == std::string::npos &&
+       authority.find(':') != colon_pos)) {
+    host = authority;
+    port.clear();
+    return false;
+  }
+  host = authority.substr(0, colon_pos);
+  port = authority.substr(colon_pos + 1);
+  return true;
+}
+
+// The file of the error_page set for status, or "" when there is none
+std::string error_page_path(const ServerContext& target_config, int status) {
+
+  std::map<int, std::string>::const_iterator it = target_config.error_pages.find(status);
+  if (it == target_config.error_pages.end()) {
+    return "";
+  }
+
+  std::string error_uri = it->second;
+
+  const LocationContext& error_lc = target_config.get_matching_location(error_uri);
+
+  std::string root;
+
+  if (error_lc.path != "__NOT_FOUND__" && !error_lc.root.empty()) {
+    root = error_lc.root;
+  } else {
+    root = target_config.server_root;
+  }
+
+  if (!error_uri.empty() && error_uri[0] != '/') {
+    root += "/";
+  }
+
+  return root + error_uri;
+}
@@ -0,0 +1,108 @@
+#include "mime_types.hpp"
+
+#include "config_utils.hpp"
+#include "string_utils.hpp"
+
+namespace {
+struct MimeEntry {
+  const char* extension;
+  const char* type;
+};
+
+// Used when the configuration has no `types` block
+const MimeEntry kBuiltinMimeTypes[] = {
+    {"html", "text/html"},
+    {"htm", "text/html"},
+    {"css", "text/css"},
+    {"js", "text/javascript"},
+    {"mjs", "text/javascript"},
+    {"txt", "text/plain"},
+    {"py", "text/plain"},
+    {"csv", "text/csv"},
+    {"xml", "text/xml"},
+    {"json", "application/json"},
+    {"map", "application/json"},
+    {"webmanifest", "application/manifest+json"},
+    {"wasm", "application/wasm"},
+    {"pdf", "application/pdf"},
+    {"zip", "application/zip"},
+    {"gz", "application/gzip"},
+    {"tar", "application/x-tar"},
+    {"png", "image/png"},
+    {"jpg", "image/jpeg"},
+    {"jpeg", "image/jpeg"},
+    {"gif", "image/gif"},
+    {"webp", "image/webp"},
+    {"avif", "image/avif"},
+    {"svg", "image/svg+xml"},
+    {"svgz", "image/svg+xml"},
+    {"ico", "image/x-icon"},
+    {"woff", "font/woff"},
+    {"woff2", "font/woff2"},
+    {"ttf", "font/ttf"},
+    {"otf", "font/otf"},
+    {"mp3", "audio/mpeg"},
+    {"ogg", "audio/ogg"},
+    {"mp4", "video/mp4"},
+    {"webm", "video/webm"},
+};
+}  // namespace
+
+const MimeTypeMap& default_mime_types() {
+  static MimeTypeMap types;
+  if (types.empty()) {
+    const std::size_t num_entries =
+        sizeof(kBuiltinMimeTypes) / sizeof(kBuiltinMimeTypes[0]);
+    for (std::size_t i = 0; i < num_entries; ++i) {
+      types[kBuiltinMimeTypes[i].extension] = kBuiltinMimeTypes[i].type;
+    }
+  }
+  return types;
+}
+
+void parse_types_block(const std::vector<std::string>& tokens,
+                       size_t& token_index, MimeTypeMap& types) {
+  if (token_index >= tokens.size() || tokens[token_index] != "{") {
+    error_exit("Expected '{' after types");
+  }
+  token_index++;
+
+  while (token_index < tokens.size() && tokens[token_index] != "}") {
+    std::string type = tokens[token_index++];
+    if (type == ";" || type == "{") {
+      error_exit("types: unexpected '" + type + "'");
+    }
+    if (token_index >= tokens.size() || tokens[token_index] == ";") {
+      error_exit("types: " + type + " needs at least one extension");
+    }
+    while (token_index < tokens.size() && tokens[token_index] != ";") {
+      if (tokens[token_index] == "}" || tokens[token_index] == "{") {
+        error_exit("types: expected ';' after " + type);
+      }
+      types[to_lower(tokens[token_index])] = type;
+      token_index++;
+    }
+    token_index++;
+  }
+
+  if (token_index >= tokens.size()) {
+    error_exit("Unexpected end of file: missing '}' in types block");
+  }
+  token_index++;
+}
+
+std::string lookup_mime_type(const MimeTypeMap& types, const std::string& path,
+                             const std::string& default_type) {
+  std::size_t dot_pos = path.find_last_of('.');
+  std::size_t slash_pos = path.find_last_of('/');
+  if (dot_pos == std::string::npos ||
+      (slash_pos != std::string::npos && dot_pos < slash_pos)) {
+    return default_type;
+  }
+
+  MimeTypeMap::const_iterator it = types.find(to_lower(path.substr(dot_pos + 1)));
+  if (it == types.end()) {
+    return default_type;
+  }
+  return it->second;
+}
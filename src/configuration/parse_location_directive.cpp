@@ -15,6 +15,26 @@ void parse_upload_store_directive(const std::vector<std::string>& tokens,
   set_single_string(tokens, token_index, lc.upload_store, "upload_store");
 }
 
+// upload_max_parts 8;
+void parse_upload_max_parts_directive(const std::vector<std::string>& tokens,
+                                      size_t& token_index, LocationContext& lc) {
+  std::string value;
+  set_single_string(tokens, token_index, value, "upload_max_parts");
+  lc.upload_max_parts = safe_strtol(value, 1, 65535);
+}
+
+// upload_max_part_size 100m;
+void parse_upload_max_part_size_directive(
+    const std::vector<std::string>& tokens, size_t& token_index,
+    LocationContext& lc) {
+  std::string value;
+  set_single_string(tokens, token_index, value, "upload_max_part_size");
+  lc.upload_max_part_size = parse_size_bytes(value);
+  if (lc.upload_max_part_size <= 0) {
+    error_exit("upload_max_part_size must be positive");
+  }
+}
+
 void parse_location_index_directive(const std::vector<std::string>& tokens,
                                     size_t& token_index, LocationContext& lc) {
   set_vector_string(tokens, token_index, lc.index, "index");
@@ -62,6 +82,22 @@ void parse_autoindex_directive(const std::vector<std::string>& tokens,
   }
 }
 
+void parse_autoindex_details_directive(const std::vector<std::string>& tokens,
+                                       size_t& token_index, LocationContext& lc) {
+  if (token_index >= tokens.size() || tokens[token_index] == ";") {
+    error_exit("autoindex_details needs a value (on/off)");
+  }
+
+  if (tokens[token_index] != "on" && tokens[token_index] != "off") {
+    error_exit("autoindex_details must be 'on' or 'off'");
+  }
+  lc.autoindex_details = (tokens[token_index] == "on");
+  token_index++;
+  if (token_index >= tokens.size() || tokens[token_index++] != ";") {
+    error_exit("Expected ';' after autoindex_details values");
+  }
+}
+
 void parse_return_directive(const std::vector<std::string>& tokens,
                             size_t& token_index, LocationContext& lc) {
   if (token_index >= tokens.size() || tokens[token_index] == ";")
@@ -112,3 +148,372 @@ void parse_cgi_handlers_directive(const std::vector<std::string>& tokens,
   handler.binary_path = path;
   lc.cgi_handlers.push_back(handler);
 }
+
+// cgi_pool .py cgi-bin/cgi_worker.py min=1 max=8 idle=60s requests=1000;
+void parse_cgi_pool_directive(const std::vector<std::string>& tokens,
+                              size_t& token_index, LocationContext& lc) {
+  std::vector<std::string> values;
+  set_vector_string(tokens, token_index, values, "cgi_pool");
+  if (values.size() < 2) {
+    error_exit("cgi_pool needs an extension and a worker script");
+  }
+  CgiPoolConfig pool;
+  pool.extension = values[0];
+  pool.worker_script = values[1];
+  for (size_t i = 2; i < values.size(); ++i) {
+    std::size_t eq_pos = values[i].find('=');
+    if (eq_pos == std::string::npos) {
+      error_exit("cgi_pool: expected key=value, got " + values[i]);
+    }
+    std::string key = values[i].substr(0, eq_pos);
+    std::string value = values[i].substr(eq_pos + 1);
+    if (key == "min") {
+      pool.min_workers = safe_strtol(value, 0, 256);
+    } else if (key == "max") {
+      pool.max_workers = safe_strtol(value, 1, 256);
+    } else if (key == "idle") {
+      pool.idle_timeout_sec = parse_duration_sec(value);
+    } else if (key == "requests") {
+      pool.max_requests = safe_strtol(value, 1, __LONG_MAX__);
+    } else {
+      error_exit("cgi_pool: unknown parameter " + key);
+    }
+  }
+  if (pool.min_workers > pool.max_workers) {
+    error_exit("cgi_pool: min must not exceed max");
+  }
+  lc.cgi_pools.push_back(pool);
+}
+
+// cgi_max_concurrent 16;
+void parse_cgi_max_concurrent_directive(const std::vector<std::string>& tokens,
+                                        size_t& token_index, LocationContext& lc) {
+  std::string value;
+  set_single_string(tokens, token_index, value, "cgi_max_concurrent");
+  lc.cgi_max_concurrent = safe_strtol(value, 1, 65535);
+}
+
+// cgi_queue 100 timeout=10s;
+void parse_cgi_queue_directive(const std::vector<std::string>& tokens,
+                               size_t& token_index, LocationContext& lc) {
+  std::vector<std::string> values;
+  set_vector_string(tokens, token_index, values, "cgi_queue");
+  lc.cgi_queue_size = safe_strtol(values[0], 0, 65535);
+  for (size_t i = 1; i < values.size(); ++i) {
+    if (values[i].compare(0, 8, "timeout=") != 0) {
+      error_exit("cgi_queue: unknown parameter " + values[i]);
+    }
+    lc.cgi_queue_timeout_sec = parse_duration_sec(values[i].substr(8));
+    if (lc.cgi_queue_timeout_sec <= 0) {
+      error_exit("cgi_queue: timeout must be positive");
+    }
+  }
+}
+
+static long parse_positive_duration(const std::vector<std::string>& tokens,
+                                    size_t& token_index,
+                                    const std::string& directive_name) {
+  std::string value;
+  set_single_string(tokens, token_index, value, directive_name);
+  long seconds = parse_duration_sec(value);
+  if (seconds <= 0) {
+    error_exit(directive_name + " must be positive");
+  }
+  return seconds;
+}
+
+// cgi_read_timeout 60s;
+void parse_cgi_read_timeout_directive(const std::vector<std::string>& tokens,
+                                      size_t& token_index, LocationContext& lc) {
+  lc.cgi_read_timeout_sec =
+      parse_positive_duration(tokens, token_index, "cgi_read_timeout");
+}
+
+// cgi_send_timeout 60s;
+void parse_cgi_send_timeout_directive(const std::vector<std::string>& tokens,
+                                      size_t& token_index, LocationContext& lc) {
+  lc.cgi_send_timeout_sec =
+      parse_positive_duration(tokens, token_index, "cgi_send_timeout");
+}
+
+// cgi_total_timeout 5m;
+void parse_cgi_total_timeout_directive(const std::vector<std::string>& tokens,
+                                       size_t& token_index, LocationContext& lc) {
+  lc.cgi_total_timeout_sec =
+      parse_positive_duration(tokens, token_index, "cgi_total_timeout");
+}
+
+// cgi_rlimit_as 512m;
+void parse_cgi_rlimit_as_directive(const std::vector<std::string>& tokens,
+                                   size_t& token_index, LocationContext& lc) {
+  std::string value;
+  set_single_string(tokens, token_index, value, "cgi_rlimit_as");
+  lc.cgi_rlimit_as = parse_size_bytes(value);
+  if (lc.cgi_rlimit_as == 0) {
+    error_exit("cgi_rlimit_as must be positive");
+  }
+}
+
+// cgi_rlimit_cpu 30s;
+void parse_cgi_rlimit_cpu_directive(const std::vector<std::string>& tokens,
+                                    size_t& token_index, LocationContext& lc) {
+  lc.cgi_rlimit_cpu =
+      parse_positive_duration(tokens, token_index, "cgi_rlimit_cpu");
+}
+
+// cgi_rlimit_nofile 256;
+void parse_cgi_rlimit_nofile_directive(const std::vector<std::string>& tokens,
+                                       size_t& token_index, LocationContext& lc) {
+  std::string value;
+  set_single_string(tokens, token_index, value, "cgi_rlimit_nofile");
+  lc.cgi_rlimit_nofile = safe_strtol(value, 3, 1048576);
+}
+
+// cgi_cache dashboards max_size=16m ttl=1s stale=10s;
+void parse_cgi_cache_directive(const std::vector<std::string>& tokens,
+                               size_t& token_index, LocationContext& lc) {
+  std::vector<std::string> values;
+  set_vector_string(tokens, token_index, values, "cgi_cache");
+  if (values[0].find('=') != std::string::npos) {
+    error_exit("cgi_cache needs a zone name");
+  }
+  lc.cgi_cache.zone = values[0];
+  for (size_t i = 1; i < values.size(); ++i) {
+    std::size_t eq_pos = values[i].find('=');
+    if (eq_pos == std::string::npos) {
+      error_exit("cgi_cache: expected key=value, got " + values[i]);
+    }
+    std::string key = values[i].substr(0, eq_pos);
+    std::string value = values[i].substr(eq_pos + 1);
+    if (key == "max_size") {
+      lc.cgi_cache.max_size = parse_size_bytes(value);
+    } else if (key == "ttl") {
+      lc.cgi_cache.ttl_sec = parse_duration_sec(value);
+    } else if (key == "stale") {
+      lc.cgi_cache.stale_sec = parse_duration_sec(value);
+    } else {
+      error_exit("cgi_cache: unknown parameter " + key);
+    }
+  }
+  if (lc.cgi_cache.max_size <= 0 || lc.cgi_cache.ttl_sec <= 0 ||
+      lc.cgi_cache.stale_sec < 0) {
+    error_exit("cgi_cache: max_size and ttl must be positive, stale >= 0");
+  }
+}
+
+// cgi_cache_key "$host$request_uri$http_accept_language";
+void parse_cgi_cache_key_directive(const std::vector<std::string>& tokens,
+                                   size_t& token_index, LocationContext& lc) {
+  set_single_string(tokens, token_index, lc.cgi_cache.key, "cgi_cache_key");
+}
+
+// cgi_cache_lock on;
+void parse_cgi_cache_lock_directive(const std::vector<std::string>& tokens,
+                                    size_t& token_index, LocationContext& lc) {
+  std::string value;
+  set_single_string(tokens, token_index, value, "cgi_cache_lock");
+  if (value == "on") {
+    lc.cgi_cache.lock = true;
+  } else if (value == "off") {
+    lc.cgi_cache.lock = false;
+  } else {
+    error_exit("cgi_cache_lock must be on or off");
+  }
+}
+
+// cgi_cache_lock_timeout 5s;
+void parse_cgi_cache_lock_timeout_directive(
+    const std::vector<std::string>& tokens, size_t& token_index,
+    LocationContext& lc) {
+  lc.cgi_cache.lock_timeout_sec =
+      parse_positive_duration(tokens, token_index, "cgi_cache_lock_timeout");
+}
+
+// disk_cache pages ttl=10m;
+void parse_disk_cache_directive(const std::vector<std::string>& tokens,
+                                size_t& token_index, LocationContext& lc) {
+  std::vector<std::string> values;
+  set_vector_string(tokens, token_index, values, "disk_cache");
+  if (values[0].find('=') != std::string::npos) {
+    error_exit("disk_cache needs a cache_path name");
+  }
+  lc.disk_cache.zone = values[0];
+  for (size_t i = 1; i < values.size(); ++i) {
+    if (values[i].compare(0, 4, "ttl=") != 0) {
+      error_exit("disk_cache: unknown parameter " + values[i]);
+    }
+    lc.disk_cache.ttl_sec = parse_duration_sec(values[i].substr(4));
+  }
+  if (lc.disk_cache.ttl_sec <= 0) {
+    error_exit("disk_cache: ttl must be positive");
+  }
+}
+
+// disk_cache_key "$host$request_uri";
+void parse_disk_cache_key_directive(const std::vector<std::string>& tokens,
+                                    size_t& token_index, LocationContext& lc) {
+  set_single_string(tokens, token_index, lc.disk_cache.key, "disk_cache_key");
+}
+
+// stub_status;
+void parse_stub_status_directive(const std::vector<std::string>& tokens,
+                                 size_t& token_index, LocationContext& lc) {
+  if (token_index >= tokens.size() || tokens[token_index] != ";") {
+    error_exit("stub_status takes no value");
+  }
+  token_index++;
+  lc.stub_status = true;
+}
+
+// fastcgi_pass unix:/run/app.sock | 127.0.0.1:9000 | upstream_name;
+void parse_fastcgi_pass_directive(const std::vector<std::string>& tokens,
+                                  size_t& token_index, LocationContext& lc) {
+  set_single_string(tokens, token_index, lc.fastcgi_pass, "fastcgi_pass");
+  const std::string& upstream = lc.fastcgi_pass;
+  if (upstream.compare(0, 5, "unix:") == 0) {
+    if (upstream.size() == 5) {
+      error_exit("fastcgi_pass: missing socket path");
+    }
+    return;
+  }
+  // Without a port it has to name an upstream, see resolve_upstreams_()
+  std::string host;
+  std::string port;
+  if (split_host_port(upstream, host, port)) {
+    if (host.empty()) {
+      error_exit("fastcgi_pass must be unix:/path, host:port or an upstream");
+    }
+    safe_strtol(port, 1, ConfigLimits::kPortMax);
+  }
+}
+
+// proxy_pass http://127.0.0.1:8000[/uri] | http://upstream_name[/uri];
+void parse_proxy_pass_directive(const std::vector<std::string>& tokens,
+                                size_t& token_index, LocationContext& lc) {
+  std::string value;
+  set_single_string(tokens, token_index, value, "proxy_pass");
+  if (value.compare(0, 7, "http://") != 0) {
+    error_exit("proxy_pass must start with http://");
+  }
+  std::string authority = value.substr(7);
+  std::size_t slash_pos = authority.find('/');
+  if (slash_pos != std::string::npos) {
+    lc.proxy_uri = authority.substr(slash_pos);
+    lc.has_proxy_uri = true;
+    authority.erase(slash_pos);
+  }
+
+  // A host without a port may name an upstream; port 80 is added later
+  // if it does not
+  std::string host;
+  std::string port;
+  bool has_port = split_host_port(authority, host, port);
+  if (host.empty() || host == "[]") {
+    error_exit("proxy_pass: missing host");
+  }
+  if (has_port) {
+    safe_strtol(port, 1, ConfigLimits::kPortMax);
+  }
+  lc.proxy_pass = authority;
+}
+
+// proxy_connect_timeout 5s;
+void parse_proxy_connect_timeout_directive(
+    const std::vector<std::string>& tokens, size_t& token_index,
+    LocationContext& lc) {
+  lc.proxy_connect_timeout_sec =
+      parse_positive_duration(tokens, token_index, "proxy_connect_timeout");
+}
+
+// proxy_read_timeout 60s;
+void parse_proxy_read_timeout_directive(const std::vector<std::string>& tokens,
+                                        size_t& token_index,
+                                        LocationContext& lc) {
+  lc.proxy_read_timeout_sec =
+      parse_positive_duration(tokens, token_index, "proxy_read_timeout");
+}
+
+// proxy_send_timeout 60s;
+void parse_proxy_send_timeout_directive(const std::vector<std::string>& tokens,
+                                        size_t& token_index,
+                                        LocationContext& lc) {
+  lc.proxy_send_timeout_sec =
+      parse_positive_duration(tokens, token_index, "proxy_send_timeout");
+}
+
+// native_handler /usr/lib/webserv/health.so [argument];
+void parse_native_handler_directive(const std::vector<std::string>& tokens,
+                                    size_t& token_index, LocationContext& lc) {
+  std::vector<std::string> values;
+  set_vector_string(tokens, token_index, values, "native_handler");
+  if (values.size() > 2) {
+    error_exit("native_handler takes a shared object and one argument");
+  }
+  lc.native_handler = values[0];
+  lc.native_argument = values.size() == 2 ? values[1] : "";
+}
+
+void parse_location_default_type_directive(const std::vector<std::string>& tokens,
+                                           size_t& token_index, LocationContext& lc) {
+  set_single_string(tokens, token_index, lc.default_type, "default_type");
+}
+
+static void parse_expires_value(const std::string& value, ExpiresConfig& expires) {
+  if (value == "off") {
+    expires.mode = ExpiresConfig::kExpiresOff;
+  } else if (value == "max") {
+    expires.mode = ExpiresConfig::kExpiresMax;
+  } else if (value == "epoch") {
+    expires.mode = ExpiresConfig::kExpiresEpoch;
+  } else {
+    expires.mode = ExpiresConfig::kExpiresDuration;
+    expires.seconds = parse_duration_sec(value);
+  }
+}
+
+// expires 30d | -1h | max | epoch | off;
+void parse_expires_directive(const std::vector<std::string>& tokens,
+                             size_t& token_index, LocationContext& lc) {
+  std::string value;
+  set_single_string(tokens, token_index, value, "expires");
+  parse_expires_value(value, lc.expires);
+}
+
+// expires_match *.[0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f][0-9a-f].js max;
+void parse_expires_match_directive(const std::vector<std::string>& tokens,
+                                   size_t& token_index, LocationContext& lc) {
+  if (token_index + 2 >= tokens.size() || tokens[token_index] == ";" ||
+      tokens[token_index + 1] == ";") {
+    error_exit("expires_match needs a pattern and a duration");
+  }
+  ExpiresConfig expires;
+  expires.pattern = tokens[token_index++];
+  parse_expires_value(tokens[token_index++], expires);
+  if (tokens[token_index] != ";") {
+    error_exit("Expected ';' after expires_match values");
+  }
+  token_index++;
+  lc.expires_matches.push_back(expires);
+}
+
+// add_header Cache-Control "public, max-age=31536000, immutable";
+// Unquoted values spanning several tokens are joined with a space.
+void parse_add_header_directive(const std::vector<std::string>& tokens,
+                                size_t& token_index, LocationContext& lc) {
+  if (token_index >= tokens.size() || tokens[token_index] == ";") {
+    error_exit("add_header needs a name and a value");
+  }
+  std::string name = tokens[token_index++];
+  std::vector<std::string> values;
+  set_vector_string(tokens, token_index, values, "add_header");
+
+  std::string value = values[0];
+  for (size_t i = 1; i < values.size(); ++i) {
+    value += " " + values[i];
+  }
+  if (name.find_first_of(": \t\r\n") != std::string::npos ||
+      value.find_first_of("\r\n") != std::string::npos) {
+    error_exit("add_header: invalid header " + name);
+  }
+  lc.add_headers.push_back(std::make_pair(name, value));
+}
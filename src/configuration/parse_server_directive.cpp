@@ -4,6 +4,7 @@
 
 #include "Config.hpp"
 #include "config_utils.hpp"
+#include "mime_types.hpp"
 #include "parse_location_directive.hpp"
 #include "string_utils.hpp"
 
@@ -105,6 +106,17 @@ void parse_error_page_directive(const std::vector<std::string>& tokens,
   token_index++;
 }
 
+void parse_server_types_directive(const std::vector<std::string>& tokens,
+                                  size_t& token_index, ServerContext& sc) {
+  parse_types_block(tokens, token_index, sc.mime_types);
+}
+
+void parse_server_default_type_directive(
+    const std::vector<std::string>& tokens, size_t& token_index,
+    ServerContext& sc) {
+  set_single_string(tokens, token_index, sc.default_type, "default_type");
+}
+
 typedef void (*LocationParser)(const std::vector<std::string>&, size_t&,
                                LocationContext&);
 
@@ -136,13 +148,42 @@ void parse_location_directive(const std::vector<std::string>& tokens,
   if (parsers.empty()) {
     parsers["root"] = parse_location_root_directive;
     parsers["upload_store"] = parse_upload_store_directive;
+    parsers["upload_max_parts"] = parse_upload_max_parts_directive;
+    parsers["upload_max_part_size"] = parse_upload_max_part_size_directive;
     parsers["index"] = parse_location_index_directive;
 
     parsers["allow_methods"] = parse_allow_methods_directive;
     parsers["client_max_body_size"] = parse_location_client_max_body_size_directive;
     parsers["autoindex"] = parse_autoindex_directive;
+    parsers["autoindex_details"] = parse_autoindex_details_directive;
     parsers["return"] = parse_return_directive;
     parsers["cgi_handler"] = parse_cgi_handlers_directive;
+    parsers["cgi_pool"] = parse_cgi_pool_directive;
+    parsers["cgi_max_concurrent"] = parse_cgi_max_concurrent_directive;
+    parsers["cgi_queue"] = parse_cgi_queue_directive;
+    parsers["cgi_read_timeout"] = parse_cgi_read_timeout_directive;
+    parsers["cgi_send_timeout"] = parse_cgi_send_timeout_directive;
+    parsers["cgi_total_timeout"] = parse_cgi_total_timeout_directive;
+    parsers["cgi_rlimit_as"] = parse_cgi_rlimit_as_directive;
+    parsers["cgi_rlimit_cpu"] = parse_cgi_rlimit_cpu_directive;
+    parsers["cgi_rlimit_nofile"] = parse_cgi_rlimit_nofile_directive;
+    parsers["cgi_cache"] = parse_cgi_cache_directive;
+    parsers["cgi_cache_key"] = parse_cgi_cache_key_directive;
+    parsers["cgi_cache_lock"] = parse_cgi_cache_lock_directive;
+    parsers["cgi_cache_lock_timeout"] = parse_cgi_cache_lock_timeout_directive;
+    parsers["disk_cache"] = parse_disk_cache_directive;
+    parsers["disk_cache_key"] = parse_disk_cache_key_directive;
+    parsers["stub_status"] = parse_stub_status_directive;
+    parsers["fastcgi_pass"] = parse_fastcgi_pass_directive;
+    parsers["proxy_pass"] = parse_proxy_pass_directive;
+    parsers["proxy_connect_timeout"] = parse_proxy_connect_timeout_directive;
+    parsers["proxy_read_timeout"] = parse_proxy_read_timeout_directive;
+    parsers["proxy_send_timeout"] = parse_proxy_send_timeout_directive;
+    parsers["native_handler"] = parse_native_handler_directive;
+    parsers["default_type"] = parse_location_default_type_directive;
+    parsers["expires"] = parse_expires_directive;
+    parsers["expires_match"] = parse_expires_match_directive;
+    parsers["add_header"] = parse_add_header_directive;
   }
 
   while (token_index < tokens.size() && tokens[token_index] != "}") {
@@ -194,3 +235,10 @@ const LocationContext& ServerContext::get_matching_location(
   }
   return *best_match;
 }
+
+std::string ServerContext::get_mime_type(const std::string& path,
+                                         const LocationContext& lc) const {
+  const std::string& default_mime =
+      lc.default_type.empty() ? default_type : lc.default_type;
+  return lookup_mime_type(mime_types, path, default_mime);
+}
@@ -0,0 +1,159 @@
+#include "parse_upstream_block.hpp"
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "config_utils.hpp"
+
+namespace {
+typedef void (*UpstreamParser)(const std::vector<std::string>&, size_t&,
+                               UpstreamConfig&);
+
+// "weight=3" -> ("weight", "3")
+void split_parameter(const std::string& directive, const std::string& param,
+                     std::string& key, std::string& value) {
+  std::size_t eq_pos = param.find('=');
+  if (eq_pos == std::string::npos) {
+    error_exit(directive + ": expected key=value, got " + param);
+  }
+  key = param.substr(0, eq_pos);
+  value = param.substr(eq_pos + 1);
+}
+
+// server 10.0.0.1:8080 weight=3 max_fails=2 fail_timeout=30s;
+void parse_server(const std::vector<std::string>& tokens, size_t& token_index,
+                  UpstreamConfig& upstream) {
+  std::vector<std::string> values;
+  set_vector_string(tokens, token_index, values, "server");
+  UpstreamServerConfig server;
+  server.address = values[0];
+  if (server.address.compare(0, 5, "unix:") == 0) {
+    if (server.address.size() == 5) {
+      error_exit("upstream " + upstream.name + ": missing socket path");
+    }
+  } else {
+    std::string host;
+    std::string port;
+    if (!split_host_port(server.address, host, port)) {
+      server.address += ":80";
+    } else {
+      safe_strtol(port, 1, ConfigLimits::kPortMax);
+    }
+    if (host.empty()) {
+      error_exit("upstream " + upstream.name + ": missing host");
+    }
+  }
+  for (std::size_t i = 1; i < values.size(); ++i) {
+    std::string key;
+    std::string value;
+    split_parameter("server", values[i], key, value);
+    if (key == "weight") {
+      server.weight = safe_strtol(value, 1, 1000);
+    } else if (key == "max_fails") {
+      server.max_fails = safe_strtol(value, 0, 1000);
+    } else if (key == "fail_timeout") {
+      server.fail_timeout_sec = parse_duration_sec(value);
+      if (server.fail_timeout_sec < 0) {
+        error_exit("server: fail_timeout must not be negative");
+      }
+    } else {
+      error_exit("server: unknown parameter " + key);
+    }
+  }
+  upstream.servers.push_back(server);
+}
+
+// least_conn;
+void parse_least_conn(const std::vector<std::string>& tokens,
+                      size_t& token_index, UpstreamConfig& upstream) {
+  if (token_index >= tokens.size() || tokens[token_index] != ";") {
+    error_exit("least_conn takes no value");
+  }
+  token_index++;
+  upstream.balance = UpstreamConfig::kLeastConn;
+}
+
+// hash $request_uri [consistent];
+void parse_hash(const std::vector<std::string>& tokens, size_t& token_index,
+                UpstreamConfig& upstream) {
+  std::vector<std::string> values;
+  set_vector_string(tokens, token_index, values, "hash");
+  if (values.size() > 2 || (values.size() == 2 && values[1] != "consistent")) {
+    error_exit("hash takes a key and optionally consistent");
+  }
+  upstream.balance = UpstreamConfig::kHash;
+  upstream.hash_key = values[0];
+  upstream.hash_consistent = values.size() == 2;
+}
+
+// health_check interval=5s timeout=2s fails=2 passes=1 uri=/health;
+void parse_health_check(const std::vector<std::string>& tokens,
+                        size_t& token_index, UpstreamConfig& upstream) {
+  upstream.check_interval_sec = 5;
+  if (token_index < tokens.size() && tokens[token_index] == ";") {
+    token_index++;
+    return;
+  }
+  std::vector<std::string> values;
+  set_vector_string(tokens, token_index, values, "health_check");
+  for (std::size_t i = 0; i < values.size(); ++i) {
+    std::string key;
+    std::string value;
+    split_parameter("health_check", values[i], key, value);
+    if (key == "interval") {
+      upstream.check_interval_sec = parse_duration_sec(value);
+    } else if (key == "timeout") {
+      upstream.check_timeout_sec = parse_duration_sec(value);
+    } else if (key == "fails") {
+      upstream.check_fails = safe_strtol(value, 1, 1000);
+    } else if (key == "passes") {
+      upstream.check_passes = safe_strtol(value, 1, 1000);
+    } else if (key == "uri") {
+      if (value.empty() || value[0] != '/') {
+        error_exit("health_check: uri must start with '/'");
+      }
+      upstream.check_uri = value;
+    } else {
+      error_exit("health_check: unknown parameter " + key);
+    }
+  }
+  if (upstream.check_interval_sec <= 0 || upstream.check_timeout_sec <= 0) {
+    error_exit("health_check: interval and timeout must be positive");
+  }
+}
+}  // namespace
+
+void parse_upstream_block(const std::vector<std::string>& tokens,
+                          size_t& token_index, UpstreamConfig& upstream) {
+  if (token_index >= tokens.size() || tokens[token_index] == "{") {
+    error_exit("upstream needs a name");
+  }
+  upstream.name = tokens[token_index++];
+  if (token_index >= tokens.size() || tokens[token_index] != "{") {
+    error_exit("Expected '{' after upstream " + upstream.name);
+  }
+  token_index++;
+  static std::map<std::string, UpstreamParser> s_parsers;
+  if (s_parsers.empty()) {
+    s_parsers["server"] = parse_server;
+    s_parsers["least_conn"] = parse_least_conn;
+    s_parsers["hash"] = parse_hash;
+    s_parsers["health_check"] = parse_health_check;
+  }
+  while (token_index < tokens.size()) {
+    if (tokens[token_index] == "}") {
+      token_index++;
+      if (upstream.servers.empty()) {
+        error_exit("upstream " + upstream.name + " has no server");
+      }
+      return;
+    }
+    std::string key = tokens[token_index++];
+    if (s_parsers.find(key) == s_parsers.end()) {
+      error_exit("Unknown directive in upstream: " + key);
+    }
+    s_parsers[key](tokens, token_index, upstream);
+  }
+  error_exit("Unexpected end of file: missing '}' in upstream block");
+}
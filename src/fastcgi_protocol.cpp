@@ -0,0 +1,89 @@
+#include "fastcgi_protocol.hpp"
+
+namespace fastcgi {
+
+namespace {
+void append_header(std::string& out, unsigned char type,
+                   unsigned short request_id, std::size_t content_length,
+                   std::size_t padding_length) {
+  out.push_back(static_cast<char>(kVersion1));
+  out.push_back(static_cast<char>(type));
+  out.push_back(static_cast<char>((request_id >> 8) & 0xFF));
+  out.push_back(static_cast<char>(request_id & 0xFF));
+  out.push_back(static_cast<char>((content_length >> 8) & 0xFF));
+  out.push_back(static_cast<char>(content_length & 0xFF));
+  out.push_back(static_cast<char>(padding_length));
+  out.push_back(0);
+}
+
+void append_length(std::string& out, std::size_t len) {
+  if (len < 128) {
+    out.push_back(static_cast<char>(len));
+    return;
+  }
+  out.push_back(static_cast<char>(((len >> 24) & 0x7F) | 0x80));
+  out.push_back(static_cast<char>((len >> 16) & 0xFF));
+  out.push_back(static_cast<char>((len >> 8) & 0xFF));
+  out.push_back(static_cast<char>(len & 0xFF));
+}
+}  // namespace
+
+void append_begin_request(std::string& out, unsigned short request_id,
+                          bool keep_conn) {
+  append_header(out, kBeginRequest, request_id, 8, 0);
+  out.push_back(static_cast<char>((kResponder >> 8) & 0xFF));
+  out.push_back(static_cast<char>(kResponder & 0xFF));
+  out.push_back(static_cast<char>(keep_conn ? kKeepConn : 0));
+  out.append(5, '\0');
+}
+
+void append_params(std::string& out, unsigned short request_id,
+                   const Params& params) {
+  std::string encoded;
+  for (std::size_t i = 0; i < params.size(); ++i) {
+    append_length(encoded, params[i].first.size());
+    append_length(encoded, params[i].second.size());
+    encoded.append(params[i].first);
+    encoded.append(params[i].second);
+  }
+  if (!encoded.empty()) {
+    append_stream(out, kParams, request_id, encoded.data(), encoded.size());
+  }
+  append_stream(out, kParams, request_id, NULL, 0);
+}
+
+void append_stream(std::string& out, unsigned char type,
+                   unsigned short request_id, const char* data,
+                   std::size_t len) {
+  if (len == 0) {
+    append_header(out, type, request_id, 0, 0);
+    return;
+  }
+  for (std::size_t offset = 0; offset < len; offset += kMaxContentLength) {
+    std::size_t chunk = len - offset;
+    if (chunk > kMaxContentLength) {
+      chunk = kMaxContentLength;
+    }
+    // Keep records 8-byte aligned as the spec recommends
+    std::size_t padding = (8 - chunk % 8) % 8;
+    append_header(out, type, request_id, chunk, padding);
+    out.append(data + offset, chunk);
+    out.append(padding, '\0');
+  }
+}
+
+bool parse_header(const std::string& buf, std::size_t offset,
+                  RecordHeader& header) {
+  if (buf.size() < offset + kHeaderLength) {
+    return false;
+  }
+  const unsigned char* p =
+      reinterpret_cast<const unsigned char*>(buf.data() + offset);
+  header.type = p[1];
+  header.request_id = static_cast<unsigned short>((p[2] << 8) | p[3]);
+  header.content_length = (static_cast<std::size_t>(p[4]) << 8) | p[5];
+  header.padding_length = p[6];
+  return true;
+}
+
+}  // namespace fastcgi
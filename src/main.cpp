@@ -22,6 +22,7 @@ int main(int argc, char* argv[]) {
   set_signal_handler(SIGINT, turn_off_running_status);
   set_signal_handler(SIGTERM, turn_off_running_status);
   set_signal_handler(SIGTSTP, turn_off_running_status);
+  set_signal_handler(SIGQUIT, stop_immediately);
   try {
     std::vector<ListenConfig> listen_configs;
     Server server(config_path);
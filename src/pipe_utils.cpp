@@ -0,0 +1,93 @@
+#include "pipe_utils.hpp"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+
+#include <cerrno>
+#ifdef WEBSERV_HAVE_SENDFILE
+#include <sys/sendfile.h>
+#endif
+
+namespace {
+const int kPipeSize = 256 * 1024;
+}  // namespace
+
+void enlarge_pipe(int fd) {
+#ifdef WEBSERV_HAVE_SPLICE
+  fcntl(fd, F_SETPIPE_SZ, kPipeSize);
+#else
+  (void)fd;
+#endif
+}
+
+std::size_t pipe_buffered(int fd) {
+  int available = 0;
+  if (ioctl(fd, FIONREAD, &available) == -1 || available < 0) {
+    return 0;
+  }
+  return static_cast<std::size_t>(available);
+}
+
+bool pipe_hung_up(int fd) {
+  struct pollfd poll_fd;
+  poll_fd.fd = fd;
+  poll_fd.events = POLLIN;
+  poll_fd.revents = 0;
+  return poll(&poll_fd, 1, 0) == 1 && (poll_fd.revents & POLLHUP) != 0;
+}
+
+std::size_t pipe_free_space(int fd) {
+#ifdef WEBSERV_HAVE_SPLICE
+  int capacity = fcntl(fd, F_GETPIPE_SZ);
+  if (capacity <= 0) {
+    return 0;
+  }
+  std::size_t used = pipe_buffered(fd);
+  if (used >= static_cast<std::size_t>(capacity)) {
+    return 0;
+  }
+  return static_cast<std::size_t>(capacity) - used;
+#else
+  (void)fd;
+  return 0;
+#endif
+}
+
+ssize_t splice_bytes(int from_fd, int to_fd, std::size_t len) {
+#ifdef WEBSERV_HAVE_SPLICE
+  return splice(from_fd, NULL, to_fd, NULL, len,
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+#else
+  (void)from_fd;
+  (void)to_fd;
+  (void)len;
+  return -1;
+#endif
+}
+
+ssize_t send_file_bytes(int file_fd, int sock_fd, off_t& offset,
+                        std::size_t len) {
+#ifdef WEBSERV_HAVE_SENDFILE
+  return sendfile(sock_fd, file_fd, &offset, len);
+#else
+  (void)file_fd;
+  (void)sock_fd;
+  (void)offset;
+  (void)len;
+  return -1;
+#endif
+}
+
+int preallocate_file(int file_fd, off_t len) {
+#ifdef WEBSERV_HAVE_FALLOCATE
+  if (fallocate(file_fd, 0, 0, len) == -1 &&
+      (errno == ENOSPC || errno == EFBIG)) {
+    return -1;
+  }
+#else
+  (void)file_fd;
+  (void)len;
+#endif
+  return 0;
+}
@@ -6,9 +6,15 @@
 #include "config_utils.hpp"
 
 extern volatile sig_atomic_t g_running;
+extern volatile sig_atomic_t g_stop_now;
 
 void turn_off_running_status(int) { g_running = false; }
 
+void stop_immediately(int) {
+  g_running = false;
+  g_stop_now = true;
+}
+
 void set_signal_handler(int signum, void (*handler)(int)) {
   struct sigaction sa;
   sigemptyset(&sa.sa_mask);
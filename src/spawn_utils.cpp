@@ -0,0 +1,228 @@
+#include "spawn_utils.hpp"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+// posix_spawn_file_actions_addchdir_np: glibc 2.29+, macOS 10.15+
+#if (defined(__GLIBC__) &&                                            \
+     (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 29))) || \
+    defined(__APPLE__)
+#define WEBSERV_HAVE_SPAWN_CHDIR 1
+#endif
+
+int set_cloexec(int fd) {
+  int flags = fcntl(fd, F_GETFD, 0);
+  if (flags == -1) {
+    return -1;
+  }
+  return fcntl(fd, F_SETFD, flags | FD_CLOEXEC);
+}
+
+namespace {
+// Sets one limit of the calling process. A limit above the current hard
+// limit is clamped, only root could raise it.
+int set_limit(int resource, long value, long hard_extra) {
+  if (value <= 0) {
+    return 0;
+  }
+  struct rlimit current;
+  if (getrlimit(resource, &current) == -1) {
+    return -1;
+  }
+  struct rlimit limit;
+  limit.rlim_cur = static_cast<rlim_t>(value);
+  limit.rlim_max = static_cast<rlim_t>(value + hard_extra);
+  if (current.rlim_max != RLIM_INFINITY && limit.rlim_max > current.rlim_max) {
+    limit.rlim_max = current.rlim_max;
+  }
+  if (limit.rlim_cur > limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+  }
+  return setrlimit(resource, &limit);
+}
+
+int apply_limits(const ProcessLimits& limits) {
+  // The soft CPU limit sends SIGXCPU, the hard one a second later SIGKILL
+  if (set_limit(RLIMIT_AS, limits.address_space, 0) == -1 ||
+      set_limit(RLIMIT_CPU, limits.cpu_sec, 1) == -1 ||
+      set_limit(RLIMIT_NOFILE, limits.open_files, 0) == -1) {
+    return -1;
+  }
+  return 0;
+}
+
+// What a child needs between clone and exec. It shares the server's memory
+// until then, so error reports back the errno of a step that failed.
+struct ChildSetup {
+  const char* file;
+  char* const* argv;
+  char* const* envp;
+  int stdin_fd;
+  int stdout_fd;
+  const char* work_dir;  // NULL to stay
+  const ProcessLimits* limits;
+  volatile int error;
+};
+
+// Runs in the child: system calls only, no allocation and no locks. Every
+// signal the server handles or ignores is set back to the default before
+// the mask is lifted, as POSIX_SPAWN_SETSIGDEF does for posix_spawn; the
+// ones the C library keeps for itself are refused by sigaction().
+int exec_child(void* arg) {
+  ChildSetup* setup = static_cast<ChildSetup*>(arg);
+  struct sigaction default_action;
+  std::memset(&default_action, 0, sizeof(default_action));
+  default_action.sa_handler = SIG_DFL;
+  sigemptyset(&default_action.sa_mask);
+  for (int sig = 1; sig < NSIG; ++sig) {
+    if (sig != SIGKILL && sig != SIGSTOP) {
+      sigaction(sig, &default_action, NULL);
+    }
+  }
+  sigset_t none;
+  sigemptyset(&none);
+  sigprocmask(SIG_SETMASK, &none, NULL);
+  if (dup2(setup->stdin_fd, STDIN_FILENO) == -1 ||
+      dup2(setup->stdout_fd, STDOUT_FILENO) == -1 ||
+      (setup->work_dir != NULL && chdir(setup->work_dir) == -1) ||
+      apply_limits(*setup->limits) == -1) {
+    setup->error = errno;
+    _exit(127);
+  }
+  execve(setup->file, setup->argv, setup->envp);
+  setup->error = errno;
+  _exit(127);
+}
+
+#ifdef __linux__
+// What posix_spawn does, plus the limits: the child borrows the server's
+// address space on a stack of its own, and the server waits until it has
+// called exec. Nothing is copied, so the cost stays flat however large the
+// server grows. Signals stay blocked meanwhile so that no handler of the
+// server runs in the child.
+pid_t start_child(ChildSetup& setup) {
+  static const std::size_t kStackSize = 64 * 1024;
+  char* stack = static_cast<char*>(std::malloc(kStackSize));
+  if (stack == NULL) {
+    errno = ENOMEM;
+    return -1;
+  }
+  sigset_t all;
+  sigset_t saved;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &saved);
+  setup.error = 0;
+  pid_t pid = clone(exec_child, stack + kStackSize,
+                    CLONE_VM | CLONE_VFORK | SIGCHLD, &setup);
+  int err = errno;
+  pthread_sigmask(SIG_SETMASK, &saved, NULL);
+  std::free(stack);
+  if (pid == -1) {
+    errno = err;
+    return -1;
+  }
+  if (setup.error != 0) {
+    waitpid(pid, NULL, 0);
+    errno = setup.error;
+    return -1;
+  }
+  return pid;
+}
+#else
+// Where there is no clone(2) the child is a copy, which reports a failed
+// exec only by exiting with 127
+pid_t start_child(ChildSetup& setup) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    exec_child(&setup);
+  }
+  return pid;
+}
+#endif
+
+#ifdef WEBSERV_HAVE_SPAWN_CHDIR
+// glibc implements posix_spawn with clone(CLONE_VM | CLONE_VFORK), so the
+// cost no longer grows with the size of the server's address space.
+pid_t posix_spawn_process(const char* file, char* const argv[],
+                          char* const envp[], int stdin_fd, int stdout_fd,
+                          const std::string& work_dir) {
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attr;
+  if (posix_spawn_file_actions_init(&actions) != 0) {
+    return -1;
+  }
+  if (posix_spawnattr_init(&attr) != 0) {
+    posix_spawn_file_actions_destroy(&actions);
+    return -1;
+  }
+
+  // The server ignores SIGPIPE, among others it may handle; scripts get
+  // every default back and nothing blocked
+  sigset_t default_signals;
+  sigfillset(&default_signals);
+  sigset_t no_signals;
+  sigemptyset(&no_signals);
+
+  int rc = posix_spawn_file_actions_adddup2(&actions, stdin_fd, STDIN_FILENO);
+  if (rc == 0) {
+    rc = posix_spawn_file_actions_adddup2(&actions, stdout_fd, STDOUT_FILENO);
+  }
+  if (rc == 0 && !work_dir.empty()) {
+    rc = posix_spawn_file_actions_addchdir_np(&actions, work_dir.c_str());
+  }
+  if (rc == 0) {
+    rc = posix_spawnattr_setsigdefault(&attr, &default_signals);
+  }
+  if (rc == 0) {
+    rc = posix_spawnattr_setsigmask(&attr, &no_signals);
+  }
+  if (rc == 0) {
+    rc = posix_spawnattr_setflags(&attr,
+                                  POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+  }
+
+  pid_t pid = -1;
+  if (rc == 0) {
+    rc = posix_spawn(&pid, file, &actions, &attr, argv, envp);
+  }
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attr);
+  if (rc != 0) {
+    errno = rc;
+    return -1;
+  }
+  return pid;
+}
+#endif
+}  // namespace
+
+pid_t spawn_process(const char* file, char* const argv[], char* const envp[],
+                    int stdin_fd, int stdout_fd, const std::string& work_dir,
+                    const ProcessLimits& limits) {
+#ifdef WEBSERV_HAVE_SPAWN_CHDIR
+  if (limits.empty()) {
+    return posix_spawn_process(file, argv, envp, stdin_fd, stdout_fd,
+                               work_dir);
+  }
+#endif
+  ChildSetup setup;
+  setup.file = file;
+  setup.argv = argv;
+  setup.envp = envp;
+  setup.stdin_fd = stdin_fd;
+  setup.stdout_fd = stdout_fd;
+  setup.work_dir = work_dir.empty() ? NULL : work_dir.c_str();
+  setup.limits = &limits;
+  setup.error = 0;
+  return start_child(setup);
+}
@@ -4,6 +4,9 @@
 #include <string>
 #include <cstdlib>
 #include <climits>
+#include <ctime>
+#include <cstring>
+#include <time.h>
 #include "Parser.hpp"
 
 std::string to_lower(std::string s) {
@@ -76,3 +79,23 @@ bool is_digits(const std::string& str) {
   }
   return true;
 }
+
+std::string format_http_date(std::time_t t) {
+  struct tm gmt;
+  gmtime_r(&t, &gmt);
+  char buf[64];
+  std::size_t len =
+      std::strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &gmt);
+  return std::string(buf, len);
+}
+
+bool parse_http_date(const std::string& str, std::time_t& t) {
+  struct tm gmt;
+  std::memset(&gmt, 0, sizeof(gmt));
+  const char* end = strptime(str.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &gmt);
+  if (end == NULL || *end != '\0') {
+    return false;
+  }
+  t = timegm(&gmt);
+  return t != static_cast<std::time_t>(-1);
+}